@@ -0,0 +1,198 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <spawn.h>
+// Brings bash's own config.h, which ours would clash with
+#include <loadables.h>
+#include "env.h"
+#include "prompt.h"
+
+/* Bash builtin
+ *
+ * cprompt.so renders in the shell itself, saving PS1=$(cprompt) its fork
+ * and exec on every prompt:
+ *     enable -f cprompt.so cprompt
+ *     PROMPT_COMMAND=cprompt
+ * Everything but main() is the same code as the cprompt program.
+ */
+
+#define ESC '\033'
+
+// shopt promptvars, from bash's parser
+extern int promptvars;
+
+/**
+ * @brief Writes a character of a rendered prompt the way PS1 shows it as is
+ *
+ * Bash expands PS1 before showing it: backslashes, and with promptvars also
+ * $ and `, must come out as they are, since directory names end up in
+ * there, even inside escape sequences (the ST ending an OSC is ESC \).
+ *
+ * @param[out] out Where to write, room for 4 bytes
+ * @param[in] c The character
+ * @return How many bytes were written
+ */
+static size_t ps1_char(char* out, char c)
+{
+	if (c == '\\') {
+		memcpy(out, "\\\\\\\\", promptvars ? 4 : 2);
+		return promptvars ? 4 : 2;
+	}
+	if ((c == '$' || c == '`') && promptvars) {
+		out[0] = out[1] = '\\';
+		out[2] = c;
+		return 3;
+	}
+	*out = c;
+	return 1;
+}
+
+/**
+ * @brief Turns a rendered prompt into a value for PS1
+ *
+ * Escape sequences are marked as taking no room on the line.
+ *
+ * @param[in] elements The rendered prompt
+ * @param[in] len The amount of pointers
+ * @return The value, free with free, or NULL if out of memory
+ */
+static char* to_ps1(const struct prompt_string* elements, size_t len)
+{
+	size_t size = 1, used = 0, n;
+	const char* s;
+	char* ps1;
+
+	// Worst case, a lone ESC becomes five bytes
+	for (size_t i = 0; i < len; i++)
+		size += 5 * strlen(elements[i].str);
+	if (!(ps1 = malloc(size)))
+		return NULL;
+
+	for (size_t i = 0; i < len; i++) {
+		for (s = elements[i].str; *s; s++) {
+			if (*s != ESC) {
+				used += ps1_char(ps1 + used, *s);
+				continue;
+			}
+			n = escape_length(s);
+			memcpy(ps1 + used, "\\[", 2);
+			used += 2;
+			for (size_t j = 0; j < n; j++)
+				used += ps1_char(ps1 + used, s[j]);
+			memcpy(ps1 + used, "\\]", 2);
+			used += 2;
+			s += n - 1;
+		}
+	}
+	ps1[used] = 0;
+	return ps1;
+}
+
+/**
+ * @brief Hands the refresh of what was shown from the latency cache over to
+ * the cprompt program
+ *
+ * Forking the interactive shell for it would copy all of it, and the child
+ * would run on with whatever bash had locked. cprompt has to come from the
+ * same build to know the elements, or it refuses.
+ */
+static void spawn_refresh(void)
+{
+	char* argv[] = { "cprompt", "-R", NULL, NULL };
+	pid_t pid;
+
+	if (!(argv[2] = take_stale_elements_arg()))
+		return;
+	// Bash reaps it along with its other children
+	posix_spawnp(&pid, argv[0], NULL, NULL, argv, export_env);
+	free(argv[2]);
+}
+
+static int cprompt_builtin(WORD_LIST* list)
+{
+	enum prompt_side side = PromptLeft;
+	struct prompt_string* elements, *laid_out;
+	struct render_client who = {
+		.tty = isatty(STDIN_FILENO) ? ttyname(STDIN_FILENO) : NULL,
+		.shell = getpid(),
+		.uid = geteuid(),
+	};
+	struct env_index env;
+	const char* var = "PS1";
+	size_t len;
+	char* ps1;
+	int opt;
+
+	reset_internal_getopt();
+	while ((opt = internal_getopt(list, "rv:")) != -1) {
+		switch (opt) {
+		case 'r':
+			side = PromptRight;
+			break;
+		case 'v':
+			var = list_optarg;
+			break;
+		CASE_HELPOPT;
+		default:
+			builtin_usage();
+			return EX_USAGE;
+		}
+	}
+	if (loptend) {
+		builtin_usage();
+		return EX_USAGE;
+	}
+	if (!legal_identifier(var)) {
+		sh_invalidid((char*)var);
+		return EXECUTION_FAILURE;
+	}
+
+	// Exported variables only reach environ at the next exec
+	maybe_make_export_env();
+	env_index_build(&env, export_env);
+	env_use(&env);
+	render_for(&who);
+	elements = make_exploded_prompt(side, &len);
+	laid_out = layout_prompt(side, elements, len, terminal_columns());
+	ps1 = laid_out ? to_ps1(laid_out, len) : NULL;
+	if (laid_out)
+		exploded_prompt_free(laid_out, len);
+	exploded_prompt_free(elements, len);
+	spawn_refresh();
+	render_for(NULL);
+	env_use(NULL);
+
+	if (!ps1) {
+		builtin_error("out of memory");
+		return EXECUTION_FAILURE;
+	}
+	bind_variable(var, ps1, 0);
+	free(ps1);
+	return EXECUTION_SUCCESS;
+}
+
+static char* cprompt_doc[] = {
+	"Render the prompt into PS1.",
+	"",
+	"Renders the prompt configured in cprompt's user_config.h, as the",
+	"cprompt program would, without leaving the shell.",
+	"",
+	"Options:",
+	"  -r\trender the right prompt",
+	"  -v var\tassign to VAR instead of PS1",
+	NULL
+};
+
+__attribute__((visibility("default")))
+struct builtin cprompt_struct = {
+	"cprompt",
+	cprompt_builtin,
+	BUILTIN_ENABLED,
+	cprompt_doc,
+	"cprompt [-r] [-v var]",
+	0
+};
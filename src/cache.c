@@ -0,0 +1,275 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "env.h"
+
+// How far a lookup walks from the home slot before giving up
+#define CACHE_PROBE_LIMIT 8
+// How many tables cache_table_hold can keep open
+#define CACHE_HELD_MAX 8
+
+struct cache_header {
+	uint32_t magic;
+	uint32_t slots;
+	uint32_t record_size;
+	uint32_t reserved;
+};
+
+// Tables kept open by cache_table_hold
+static struct {
+	const char* name;
+	int fd;
+} held[CACHE_HELD_MAX];
+static int held_count = 0;
+
+/**
+ * @brief mkdir that is fine with the directory already existing
+ *
+ * @param[in] path The directory to create
+ * @return true if the directory exists afterwards
+ */
+static bool ensure_dir(const char* path)
+{
+	return mkdir(path, 0700) == 0 || errno == EEXIST;
+}
+
+const char* cache_dir(void)
+{
+	static char dir[PATH_MAX];
+	static int state = 0; // 0 unknown, 1 usable, -1 unusable
+	const char* base;
+	int len;
+
+	if (state)
+		return state > 0 ? dir : NULL;
+	state = -1;
+
+	base = env_get(ENV_XDG_CACHE_HOME);
+	if (base && *base == '/') {
+		len = snprintf(dir, PATH_MAX, "%s/cprompt", base);
+	} else {
+		base = env_get(ENV_HOME);
+		if (!base || *base != '/')
+			return NULL;
+		len = snprintf(dir, PATH_MAX, "%s/.cache", base);
+		if (len < 0 || len >= PATH_MAX || !ensure_dir(dir))
+			return NULL;
+		len = snprintf(dir, PATH_MAX, "%s/.cache/cprompt", base);
+	}
+	if (len < 0 || len >= PATH_MAX || !ensure_dir(dir))
+		return NULL;
+
+	state = 1;
+	return dir;
+}
+
+uint64_t cache_hash(const void* data, size_t len, uint64_t seed)
+{
+	// FNV-1a
+	const unsigned char* p = data;
+	uint64_t hash = seed ? seed : 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= p[i];
+		hash *= 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/**
+ * @brief Maps a table file if it holds the table expected
+ *
+ * @param[in,out] table The table, with its file open
+ * @param[in] magic The record layout expected
+ * @return false if the file holds something else
+ */
+static bool table_map(struct cache_table* table, uint32_t magic)
+{
+	struct cache_header* header;
+	struct stat st;
+
+	if (fstat(table->fd, &st) == -1)
+		return false;
+	// Empty as cache_table_hold creates it: growing it faults no one
+	if (!st.st_size && ftruncate(table->fd, table->map_size) == 0)
+		st.st_size = table->map_size;
+	if ((uint64_t)st.st_size != table->map_size)
+		return false;
+	table->map = mmap(NULL, table->map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, table->fd, 0);
+	if (table->map == MAP_FAILED) {
+		table->map = NULL;
+		return false;
+	}
+	header = table->map;
+	if (!header->magic && !header->slots && !header->record_size) {
+		header->slots = table->slots;
+		header->record_size = table->record_size;
+		header->magic = magic;
+	}
+	if (header->magic == magic && header->slots == table->slots
+			&& header->record_size == table->record_size)
+		return true;
+	munmap(table->map, table->map_size);
+	table->map = NULL;
+	return false;
+}
+
+/**
+ * @brief Puts an empty table in place of a table file
+ *
+ * The table is built in a file of its own and renamed over the old one:
+ * processes that have the old one mapped keep using it, where truncating it
+ * would fault them.
+ *
+ * @param[in,out] table The table, without a file
+ * @param[in] path The table file
+ * @param[in] magic The record layout
+ * @return false if the table can't be created
+ */
+static bool table_create(struct cache_table* table, const char* path,
+	uint32_t magic)
+{
+	struct cache_header* header;
+	char tmp[PATH_MAX];
+	int len;
+
+	len = snprintf(tmp, PATH_MAX, "%s.XXXXXX", path);
+	if (len < 0 || len >= PATH_MAX || (table->fd = mkstemp(tmp)) == -1)
+		return false;
+	fcntl(table->fd, F_SETFD, FD_CLOEXEC);
+	// Zero filled, so every slot starts empty
+	if (ftruncate(table->fd, table->map_size) == -1)
+		goto fail;
+	table->map = mmap(NULL, table->map_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED, table->fd, 0);
+	if (table->map == MAP_FAILED) {
+		table->map = NULL;
+		goto fail;
+	}
+	header = table->map;
+	header->slots = table->slots;
+	header->record_size = table->record_size;
+	header->magic = magic;
+	if (rename(tmp, path) == 0)
+		return true;
+
+fail:
+	if (table->map)
+		munmap(table->map, table->map_size);
+	table->map = NULL;
+	unlink(tmp);
+	close(table->fd);
+	table->fd = -1;
+	return false;
+}
+
+bool cache_table_open(struct cache_table* table, const char* name,
+	uint32_t magic, uint32_t slots, uint32_t record_size)
+{
+	char path[PATH_MAX];
+	const char* dir;
+	int len;
+
+	table->fd = -1;
+	table->map = NULL;
+	table->slots = slots;
+	table->record_size = record_size;
+	table->map_size = sizeof(struct cache_header)
+		+ (size_t)slots * record_size;
+
+	if (!(dir = cache_dir()))
+		return false;
+	len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	if (len < 0 || len >= PATH_MAX)
+		return false;
+
+	for (int i = 0; i < held_count; i++)
+		if (strcmp(held[i].name, name) == 0)
+			table->fd = fcntl(held[i].fd, F_DUPFD_CLOEXEC, 0);
+	if (table->fd == -1)
+		table->fd = open(path, O_RDWR | O_CLOEXEC);
+	if (table->fd != -1) {
+		if (table_map(table, magic))
+			return true;
+		close(table->fd);
+		table->fd = -1;
+	}
+	// Missing, or a different build wrote it: start over
+	return table_create(table, path, magic);
+}
+
+void* cache_table_find(struct cache_table* table, uint64_t key, bool create)
+{
+	char* records, *record, *empty = NULL;
+	uint32_t home;
+
+	if (!table->map)
+		return NULL;
+	records = (char*)table->map + sizeof(struct cache_header);
+	home = key % table->slots;
+
+	for (uint32_t i = 0; i < CACHE_PROBE_LIMIT && i < table->slots; i++) {
+		record = records + (size_t)((home + i) % table->slots)
+			* table->record_size;
+		if (*(uint64_t*)record == key)
+			return record;
+		if (!empty && *(uint64_t*)record == 0)
+			empty = record;
+	}
+	if (!create)
+		return NULL;
+
+	// Nothing free close by: evict whatever lives in the home slot
+	record = empty ? empty : records + (size_t)home * table->record_size;
+	memset(record, 0, table->record_size);
+	*(uint64_t*)record = key;
+	return record;
+}
+
+bool cache_table_hold(const char* name)
+{
+	char path[PATH_MAX];
+	const char* dir;
+	int len, fd;
+
+	if (held_count == CACHE_HELD_MAX || !(dir = cache_dir()))
+		return false;
+	len = snprintf(path, PATH_MAX, "%s/%s", dir, name);
+	if (len < 0 || len >= PATH_MAX)
+		return false;
+	if ((fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600)) == -1)
+		return false;
+	held[held_count].name = name;
+	held[held_count++].fd = fd;
+	return true;
+}
+
+void* cache_table_records(struct cache_table* table)
+{
+	if (!table->map)
+		return NULL;
+	return (char*)table->map + sizeof(struct cache_header);
+}
+
+void cache_table_close(struct cache_table* table)
+{
+	if (table->map)
+		munmap(table->map, table->map_size);
+	if (table->fd != -1)
+		close(table->fd);
+	table->map = NULL;
+	table->fd = -1;
+}
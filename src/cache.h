@@ -0,0 +1,109 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_CACHE_H
+#define CPROMPT_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Persistent cache
+ *
+ * Everything cprompt remembers between runs lives in one directory,
+ * $XDG_CACHE_HOME/cprompt (or ~/.cache/cprompt). Tables in there are fixed
+ * size files that get mmapped, so reading or updating a record costs no
+ * syscalls after the open.
+ */
+
+// Nanoseconds of a struct stat's mtime, for validating cached entries
+#ifdef __APPLE__
+#define ST_MTIM_NSEC(st) ((st).st_mtimespec.tv_nsec)
+#else
+#define ST_MTIM_NSEC(st) ((st).st_mtim.tv_nsec)
+#endif
+
+struct cache_table {
+	int fd;
+	void* map;
+	size_t map_size;
+	uint32_t slots;
+	uint32_t record_size;
+};
+
+/**
+ * @brief Returns the cache directory, creating it if needed
+ *
+ * @return The path, or NULL if there is no usable cache directory
+ */
+const char* cache_dir(void);
+
+/**
+ * @brief Hashes a buffer, continuing from a previous hash
+ *
+ * @param[in] data The bytes to hash
+ * @param[in] len How many bytes to hash
+ * @param[in] seed 0, or the result of a previous call to chain hashes
+ */
+uint64_t cache_hash(const void* data, size_t len, uint64_t seed);
+
+/**
+ * @brief Opens (creating or resetting if needed) a table in the cache
+ *
+ * Every record starts with a uint64_t key; a key of 0 marks an empty slot.
+ * A table of another layout is replaced by a new file, never truncated, so
+ * the processes still using it are unaffected.
+ *
+ * @param[out] table The table to populate
+ * @param[in] name The file name inside the cache directory
+ * @param[in] magic Identifies the record layout, a mismatch resets the table
+ * @param[in] slots How many records the table holds
+ * @param[in] record_size The size of one record
+ * @return true if the table is usable
+ */
+bool cache_table_open(struct cache_table* table, const char* name,
+	uint32_t magic, uint32_t slots, uint32_t record_size);
+
+/**
+ * @brief Finds the record with a key
+ *
+ * @param[in] table An open table
+ * @param[in] key The key to look up, never 0
+ * @param[in] create Whether to claim (and zero) a slot when the key is missing
+ * @return The record, or NULL if not found and create is false
+ */
+void* cache_table_find(struct cache_table* table, uint64_t key, bool create);
+
+/**
+ * @brief Keeps the file of a table open for the life of the process
+ *
+ * Later opens of the table use this file, even from a thread that has since
+ * lost the right to open it (the system daemon, rendering as its clients).
+ * Call it before starting threads.
+ *
+ * @param[in] name The file name inside the cache directory, which must
+ * outlive the process
+ * @return true if the file was opened
+ */
+bool cache_table_hold(const char* name);
+
+/**
+ * @brief Gets the first record of a table
+ *
+ * For tables that are not looked up by key, like a single record holding a
+ * structure of its own.
+ *
+ * @param[in] table An open table
+ * @return The record, or NULL if the table failed to open
+ */
+void* cache_table_records(struct cache_table* table);
+
+/**
+ * @brief Unmaps and closes a table
+ *
+ * @param[in] table The table, which may have failed to open
+ */
+void cache_table_close(struct cache_table* table);
+
+#endif
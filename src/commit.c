@@ -0,0 +1,573 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+#include "config.h"
+#include "cache.h"
+#include "commit.h"
+#include "pack.h"
+
+#define COMMIT_MAGIC 0x434d5431 // CMT1
+#define COMMIT_SLOTS 256
+// Commits kept in memory too, for the daemon and the shell modules
+#define COMMIT_RECENT 16
+// Most of a commit inflated, enough for the signature of a signed one
+#define COMMIT_READ_MAX (16 * 1024)
+// Largest object inflated whole: a tree, or a delta or base of a packed commit
+#define COMMIT_OBJECT_MAX (1024 * 1024)
+// Longest header of a loose object, "tree 1048576" and its NUL
+#define COMMIT_LOOSE_HEADER_MAX 32
+// Deltas followed down to a base, git's own limit
+#define COMMIT_DELTA_MAX 4095
+// Inflated between two looks at whether the subject is complete
+#define COMMIT_INFLATE_STEP 256
+
+// Types of the objects in a pack
+enum pack_type {
+	PackCommit = 1,
+	PackTree = 2,
+	PackOfsDelta = 6, // A delta against the object at an offset before it
+	PackRefDelta = 7, // A delta against an object by its id
+};
+
+struct commit_record {
+	uint64_t key;
+	uint8_t oid[GIT_OID_MAX];
+	struct git_commit commit;
+};
+
+// The last commits read, in front of the table and its open and mmap
+static pthread_mutex_t recent_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct commit_record recent[COMMIT_RECENT];
+static int recent_next;
+
+// Tells inflate_until whether what was inflated so far is enough
+typedef bool (*inflate_done)(const uint8_t* data, size_t len);
+
+/**
+ * @brief Whether a commit was inflated up to the end of its subject
+ *
+ * @param[in] data The commit so far
+ * @param[in] len Its length
+ */
+static bool subject_complete(const uint8_t* data, size_t len)
+{
+	const uint8_t* end = data + len;
+	const uint8_t* message = memmem(data, len, "\n\n", 2);
+
+	if (!message)
+		return false;
+	for (message += 2; message < end && *message == '\n'; message++);
+	// The subject is the first paragraph
+	return memmem(message, end - message, "\n\n", 2)
+		|| end - message >= GIT_SUBJECT_MAX;
+}
+
+/**
+ * @brief subject_complete for a loose object, which starts with a header
+ */
+static bool loose_subject_complete(const uint8_t* data, size_t len)
+{
+	const uint8_t* nul = memchr(data, 0, len);
+
+	return nul && subject_complete(nul + 1, data + len - nul - 1);
+}
+
+/**
+ * @brief Inflates a zlib stream, stopping early once done says so
+ *
+ * @param[in] in The stream
+ * @param[in] in_len How much there is to read, the stream can end before
+ * @param[out] out The data
+ * @param[in] cap The size of out
+ * @param[in] done Whether enough was inflated, NULL to inflate all of it
+ * @return How much was inflated, -1 if the stream is corrupt or, with done
+ * NULL, longer than cap
+ */
+static ssize_t inflate_until(const uint8_t* in, size_t in_len, uint8_t* out,
+	size_t cap, inflate_done done)
+{
+	z_stream z = {
+		.next_in = (Bytef*)in,
+		.avail_in = in_len > UINT_MAX ? UINT_MAX : in_len,
+		.next_out = out,
+	};
+	size_t len = 0;
+	int ret;
+
+	if (inflateInit(&z) != Z_OK)
+		return -1;
+	do {
+		z.avail_out = cap - len;
+		if (done && z.avail_out > COMMIT_INFLATE_STEP)
+			z.avail_out = COMMIT_INFLATE_STEP;
+		ret = inflate(&z, Z_NO_FLUSH);
+		len = z.next_out - out;
+	} while (ret == Z_OK && len < cap && !(done && done(out, len)));
+	inflateEnd(&z);
+	if (ret == Z_STREAM_END || (ret == Z_OK && (done || len == cap)))
+		return len;
+	return -1;
+}
+
+/**
+ * @brief Reads the size at the start of a delta
+ *
+ * @param[in] p Where it starts
+ * @param[in] end Where the delta ends
+ * @param[out] size The size
+ * @return Where it ends, NULL if it doesn't
+ */
+static const uint8_t* delta_size(const uint8_t* p, const uint8_t* end,
+	size_t* size)
+{
+	int shift = 0;
+
+	*size = 0;
+	do {
+		if (p == end || shift > 56)
+			return NULL;
+		*size |= (size_t)(*p & 127) << shift;
+		shift += 7;
+	} while (*p++ & 128);
+	return p;
+}
+
+/**
+ * @brief Applies a delta to its base
+ *
+ * Copies and inserts write the result from its start, so it can stop as soon
+ * as cap bytes are written.
+ *
+ * @param[in] base The base
+ * @param[in] base_len Its length
+ * @param[in] delta The delta
+ * @param[in] delta_len Its length
+ * @param[in] cap How much of the result to write
+ * @param[in] whole Whether all of the result is needed, failing if longer
+ * than cap
+ * @param[out] len How much was written
+ * @return The result, to free, NULL if the delta is corrupt
+ */
+static uint8_t* apply_delta(const uint8_t* base, size_t base_len,
+	const uint8_t* delta, size_t delta_len, size_t cap, bool whole,
+	size_t* len)
+{
+	const uint8_t* p = delta, *end = delta + delta_len, *from;
+	size_t src, dst, off, n;
+	uint8_t* out, op;
+
+	if (!(p = delta_size(p, end, &src)) || src != base_len
+			|| !(p = delta_size(p, end, &dst)) || (whole && dst > cap))
+		return NULL;
+	cap = dst < cap ? dst : cap;
+	if (!(out = malloc(cap + 1)))
+		return NULL;
+
+	*len = 0;
+	while (p < end && *len < cap) {
+		op = *p++;
+		if (op & 128) {
+			// Copy: which bytes of the offset and size follow
+			off = n = 0;
+			for (int i = 0; i < 7; i++) {
+				if (!(op & 1 << i))
+					continue;
+				if (p == end)
+					goto corrupt;
+				if (i < 4)
+					off |= (size_t)*p++ << 8 * i;
+				else
+					n |= (size_t)*p++ << 8 * (i - 4);
+			}
+			n = n ? n : 0x10000;
+			if (off > base_len || n > base_len - off)
+				goto corrupt;
+			from = base + off;
+		} else if (op) {
+			// Insert: the op is the size of what follows
+			n = op;
+			if (n > (size_t)(end - p))
+				goto corrupt;
+			from = p;
+			p += n;
+		} else {
+			goto corrupt;
+		}
+		if (n > dst - *len)
+			goto corrupt;
+		n = n < cap - *len ? n : cap - *len;
+		memcpy(out + *len, from, n);
+		*len += n;
+	}
+	if (*len == cap)
+		return out;
+
+corrupt:
+	free(out);
+	return NULL;
+}
+
+/**
+ * @brief Unpacks an object of a pack, following deltas down to their base
+ *
+ * @param[in] repo The repository
+ * @param[in] packs Its packs
+ * @param[in] pack The pack the object is in
+ * @param[in] offset Where it starts
+ * @param[in] depth How many deltas led to it
+ * @param[in] done Whether enough of it was unpacked, NULL for all of it
+ * @param[out] type Its type, that of the base for a delta
+ * @param[out] len How much of it was unpacked
+ * @return It, to free, NULL if it can't be read
+ */
+static uint8_t* unpack(const struct git_repo* repo, struct git_packs* packs,
+	int pack, uint64_t offset, int depth, inflate_done done, int* type,
+	size_t* len)
+{
+	const uint8_t* data, *p, *end;
+	uint8_t* base, *delta, *out = NULL;
+	uint8_t base_oid[GIT_OID_MAX];
+	uint64_t base_offset;
+	size_t size, object_size, cap, base_len;
+	int base_pack = pack, shift = 4;
+	ssize_t n;
+
+	if (depth > COMMIT_DELTA_MAX
+			|| !(data = git_pack_data(packs, pack, &size))
+			|| offset < 12 || offset >= size)
+		return NULL;
+	p = data + offset;
+	end = data + size;
+
+	// Its type, then its size in groups of 7 bits, least significant first
+	*type = *p >> 4 & 7;
+	object_size = *p & 15;
+	while (*p++ & 128) {
+		if (p == end || shift > 56)
+			return NULL;
+		object_size |= (size_t)(*p & 127) << shift;
+		shift += 7;
+	}
+	if (!done && object_size > COMMIT_OBJECT_MAX)
+		return NULL;
+
+	if (*type != PackOfsDelta && *type != PackRefDelta) {
+		cap = done && object_size > COMMIT_READ_MAX ? COMMIT_READ_MAX
+			: object_size;
+		if (!(out = malloc(cap + 1)))
+			return NULL;
+		n = inflate_until(p, end - p, out, cap, done);
+		if (n < 0 || (!done && (size_t)n != cap)) {
+			free(out);
+			return NULL;
+		}
+		*len = n;
+		return out;
+	}
+
+	if (*type == PackOfsDelta) {
+		// How far back the base is, with each extra byte adding one
+		base_offset = *p & 127;
+		while (*p++ & 128) {
+			if (p == end || base_offset >= UINT64_MAX >> 8)
+				return NULL;
+			base_offset = (base_offset + 1) << 7 | (*p & 127);
+		}
+		if (base_offset >= offset)
+			return NULL;
+		base_offset = offset - base_offset;
+	} else {
+		if (end - p < repo->oid_size)
+			return NULL;
+		memcpy(base_oid, p, repo->oid_size);
+		p += repo->oid_size;
+		if (!git_packs_find(packs, base_oid, &base_pack, &base_offset))
+			return NULL;
+	}
+
+	if (object_size > COMMIT_OBJECT_MAX
+			|| !(delta = malloc(object_size + 1)))
+		return NULL;
+	n = inflate_until(p, end - p, delta, object_size, NULL);
+	if ((size_t)n == object_size && (base = unpack(repo, packs, base_pack,
+			base_offset, depth + 1, NULL, type, &base_len))) {
+		out = apply_delta(base, base_len, delta, object_size,
+			done ? COMMIT_READ_MAX : COMMIT_OBJECT_MAX, !done, len);
+		free(base);
+	}
+	free(delta);
+	return out;
+}
+
+/**
+ * @brief Reads an object from the packs
+ *
+ * @param[in] repo The repository
+ * @param[in] oid The object
+ * @param[in] want Its type
+ * @param[in] done Whether enough of it was read, NULL for all of it
+ * @param[out] len How much was read
+ * @return The object, to free, NULL if no pack has it or it isn't a want
+ */
+static uint8_t* read_packed(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], enum pack_type want, inflate_done done,
+	size_t* len)
+{
+	struct git_packs* packs;
+	uint8_t* data = NULL;
+	uint64_t offset;
+	int pack, type;
+
+	if (!(packs = git_packs_open(repo)))
+		return NULL;
+	if (git_packs_find(packs, oid, &pack, &offset)
+			&& (data = unpack(repo, packs, pack, offset, 0, done, &type, len))
+			&& type != (int)want) {
+		free(data);
+		data = NULL;
+	}
+	git_packs_close(packs);
+	return data;
+}
+
+/**
+ * @brief Reads a loose object
+ *
+ * @param[in] repo The repository
+ * @param[in] oid The object
+ * @param[in] want Its type, "commit" or "tree"
+ * @param[in] done Whether enough of it was read, header included, NULL for
+ * all of it
+ * @param[in] cap The most to read, header included
+ * @param[out] len How much was read
+ * @return The object without its header, to free, NULL if it isn't there
+ * or isn't a want
+ */
+static uint8_t* read_loose(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], const char* want, inflate_done done,
+	size_t cap, size_t* len)
+{
+	char hex[2 * GIT_OID_MAX + 1], path[PATH_MAX];
+	size_t want_len = strlen(want);
+	uint8_t* data = NULL, *nul;
+	const uint8_t* map;
+	struct stat st;
+	ssize_t n;
+	int fd;
+
+	git_oid_hex(repo, oid, hex);
+	if (snprintf(path, PATH_MAX, "%s/objects/%.2s/%s", repo->commondir, hex,
+			hex + 2) >= PATH_MAX
+			|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	// "<type> <size>", NUL, then the object, all of it if it was asked for
+	if ((data = malloc(cap + 1))
+			&& (n = inflate_until(map, st.st_size, data, cap, done))
+				> (ssize_t)want_len
+			&& !memcmp(data, want, want_len) && data[want_len] == ' '
+			&& (nul = memchr(data, 0, n))
+			&& (done || strtoull((const char*)data + want_len + 1, NULL, 10)
+				== (unsigned long long)(data + n - nul - 1))) {
+		*len = data + n - nul - 1;
+		memmove(data, nul + 1, *len);
+	} else {
+		free(data);
+		data = NULL;
+	}
+	munmap((void*)map, st.st_size);
+	return data;
+}
+
+/**
+ * @brief Parses the time of an author or committer line
+ *
+ * @param[in] line The line, "author Name <email> 1700000000 +0100"
+ * @param[in] eol Where it ends
+ * @param[out] time The time
+ * @param[out] tz The offset in minutes, NULL if not needed
+ */
+static void parse_signature(const char* line, const char* eol, int64_t* time,
+	int* tz)
+{
+	const char* s = eol;
+	int minutes;
+
+	// After the last >, the name and email can hold anything else
+	while (s > line && s[-1] != '>')
+		s--;
+	if (s == line)
+		return;
+	while (s < eol && *s == ' ')
+		s++;
+	*time = 0;
+	for (int digits = 0; s < eol && *s >= '0' && *s <= '9' && digits < 18;
+			digits++)
+		*time = *time * 10 + *s++ - '0';
+	while (s < eol && *s == ' ')
+		s++;
+	if (!tz || eol - s < 5 || (*s != '+' && *s != '-'))
+		return;
+	for (int i = 1; i < 5; i++)
+		if (s[i] < '0' || s[i] > '9')
+			return;
+	minutes = (s[1] - '0') * 600 + (s[2] - '0') * 60 + (s[3] - '0') * 10
+		+ s[4] - '0';
+	*tz = *s == '-' ? -minutes : minutes;
+}
+
+/**
+ * @brief Gets the fields of a commit
+ *
+ * @param[in] repo The repository
+ * @param[in] data The commit, possibly cut after its subject
+ * @param[in] len Its length
+ * @param[out] commit The commit
+ * @return false if it has no tree
+ */
+static bool parse_commit(const struct git_repo* repo, const char* data,
+	size_t len, struct git_commit* commit)
+{
+	const char* p = data, *end = data + len, *eol;
+	size_t subject_len = 0, line_len;
+	bool tree = false;
+
+	memset(commit, 0, sizeof(*commit));
+	// Header lines, up to a blank line
+	while (p < end && *p != '\n') {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		if (eol - p == 5 + 2 * repo->oid_size && !memcmp(p, "tree ", 5))
+			tree = git_oid_parse(p + 5, repo->oid_size, commit->tree);
+		else if (eol - p > 7 && !memcmp(p, "author ", 7))
+			parse_signature(p, eol, &commit->author_time, NULL);
+		else if (eol - p > 10 && !memcmp(p, "committer ", 10))
+			parse_signature(p, eol, &commit->commit_time, &commit->commit_tz);
+		p = eol < end ? eol + 1 : end;
+	}
+
+	// Like git's %s, the lines of the first paragraph joined by spaces
+	while (p < end && *p == '\n')
+		p++;
+	while (p < end) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		for (line_len = eol - p; line_len && (p[line_len - 1] == ' '
+				|| p[line_len - 1] == '\t' || p[line_len - 1] == '\r');
+				line_len--);
+		if (!line_len)
+			break;
+		if (subject_len && subject_len < GIT_SUBJECT_MAX - 1)
+			commit->subject[subject_len++] = ' ';
+		if (line_len > GIT_SUBJECT_MAX - 1 - subject_len)
+			line_len = GIT_SUBJECT_MAX - 1 - subject_len;
+		memcpy(commit->subject + subject_len, p, line_len);
+		subject_len += line_len;
+		p = eol < end ? eol + 1 : end;
+	}
+	commit->subject[subject_len] = 0;
+	return tree;
+}
+
+/**
+ * @brief Keeps a commit in memory
+ *
+ * @param[in] key Its key in the table
+ * @param[in] oid Its object id
+ * @param[in] oid_size The size of the object id
+ * @param[in] commit The commit
+ */
+static void remember(uint64_t key, const uint8_t oid[GIT_OID_MAX],
+	int oid_size, const struct git_commit* commit)
+{
+	pthread_mutex_lock(&recent_lock);
+	recent[recent_next].key = key;
+	memcpy(recent[recent_next].oid, oid, oid_size);
+	recent[recent_next].commit = *commit;
+	recent_next = (recent_next + 1) % COMMIT_RECENT;
+	pthread_mutex_unlock(&recent_lock);
+}
+
+bool git_read_commit(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], struct git_commit* commit)
+{
+	struct commit_record* record;
+	struct cache_table table;
+	bool have_table, found = false;
+	uint64_t key = cache_hash(oid, repo->oid_size, 0);
+	uint8_t* data;
+	size_t len;
+
+	key = key ? key : 1;
+	pthread_mutex_lock(&recent_lock);
+	for (int i = 0; i < COMMIT_RECENT && !found; i++) {
+		if (recent[i].key == key && !memcmp(recent[i].oid, oid,
+				repo->oid_size)) {
+			*commit = recent[i].commit;
+			found = true;
+		}
+	}
+	pthread_mutex_unlock(&recent_lock);
+	if (found)
+		return true;
+
+	have_table = cache_table_open(&table, "commits", COMMIT_MAGIC,
+		COMMIT_SLOTS, sizeof(struct commit_record));
+	if (have_table && (record = cache_table_find(&table, key, false))
+			&& !memcmp(record->oid, oid, repo->oid_size)) {
+		*commit = record->commit;
+		cache_table_close(&table);
+		remember(key, oid, repo->oid_size, commit);
+		return true;
+	}
+
+	// Recent commits are the ones shown, and they are loose until a gc
+	if ((data = read_loose(repo, oid, "commit", loose_subject_complete,
+			COMMIT_READ_MAX, &len))
+			|| (data = read_packed(repo, oid, PackCommit, subject_complete,
+			&len))) {
+		found = parse_commit(repo, (const char*)data, len, commit);
+		free(data);
+	}
+	if (found)
+		remember(key, oid, repo->oid_size, commit);
+	if (found && have_table && (record = cache_table_find(&table, key,
+			true))) {
+		record->key = key;
+		memcpy(record->oid, oid, repo->oid_size);
+		record->commit = *commit;
+	}
+	if (have_table)
+		cache_table_close(&table);
+	return found;
+}
+
+uint8_t* git_read_tree(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], size_t* len)
+{
+	uint8_t* data;
+
+	if (!(data = read_loose(repo, oid, "tree", NULL,
+			COMMIT_OBJECT_MAX + COMMIT_LOOSE_HEADER_MAX, len)))
+		data = read_packed(repo, oid, PackTree, NULL, len);
+	return data;
+}
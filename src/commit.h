@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_COMMIT_H
+#define CPROMPT_COMMIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "git.h"
+
+/* Commits
+ *
+ * Reads the header and subject of a commit, loose or packed (see pack.h),
+ * following the deltas it is stored as. The object is inflated only until
+ * its subject is complete, not to its end. Trees are read whole.
+ *
+ * Commits never change, so what is read is kept in the cache by object id:
+ * the next prompt showing the same commit reads nothing from the repository,
+ * and the daemon and the shell modules keep the last ones in memory as well.
+ */
+
+// Longest subject we keep, NUL included
+#define GIT_SUBJECT_MAX 128
+
+struct git_commit {
+	uint8_t tree[GIT_OID_MAX];
+	int64_t author_time; // Seconds since the epoch
+	int64_t commit_time; // When the committer made it
+	int commit_tz; // The committer's offset from UTC, in minutes
+	char subject[GIT_SUBJECT_MAX]; // Its first paragraph on one line, like %s
+};
+
+/**
+ * @brief Reads a commit
+ *
+ * @param[in] repo The repository
+ * @param[in] oid The commit
+ * @param[out] commit The commit
+ * @return false if it isn't there or isn't a commit
+ */
+bool git_read_commit(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], struct git_commit* commit);
+
+/**
+ * @brief Reads a tree
+ *
+ * @param[in] repo The repository
+ * @param[in] oid The tree
+ * @param[out] len Its length
+ * @return Its entries, "<octal mode> <name>", NUL, then the object id of
+ * each, to free, or NULL if it isn't there, isn't a tree or is too big
+ */
+uint8_t* git_read_tree(const struct git_repo* repo,
+	const uint8_t oid[GIT_OID_MAX], size_t* len);
+
+#endif
@@ -0,0 +1,57 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "dircache.h"
+#include "env.h"
+#include "cwd.h"
+
+bool cached_realpath(const char* path, char resolved[PATH_MAX])
+{
+	struct stat st;
+	struct dircache cache;
+	bool ok;
+
+	if (stat(path, &st) == -1)
+		return false;
+	dircache_open(&cache);
+	ok = dircache_realpath(&cache, path, &st, resolved);
+	dircache_close(&cache);
+	return ok;
+}
+
+bool pwd_get(enum pwd_mode mode, char pwd[PATH_MAX], bool* physical)
+{
+	struct stat dot, logical;
+	struct dircache cache;
+	const char* env;
+	bool ok;
+
+	if (stat(".", &dot) == -1)
+		return false;
+
+	if (mode == PwdLogical) {
+		env = env_get(ENV_PWD);
+		// Only trust $PWD if it still is where we are
+		if (env && path_is_canonical(env) && strnlen(env, PATH_MAX) < PATH_MAX
+				&& stat(env, &logical) == 0
+				&& logical.st_dev == dot.st_dev
+				&& logical.st_ino == dot.st_ino) {
+			strcpy(pwd, env);
+			*physical = false;
+			return true;
+		}
+	}
+
+	*physical = true;
+	dircache_open(&cache);
+	ok = dircache_realpath(&cache, ".", &dot, pwd);
+	dircache_close(&cache);
+	return ok;
+}
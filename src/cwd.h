@@ -0,0 +1,40 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_CWD_H
+#define CPROMPT_CWD_H
+
+#include <stdbool.h>
+#include <limits.h>
+
+enum pwd_mode {
+	PwdPhysical, // The path with every symlink resolved, like pwd -P
+	PwdLogical, // $PWD, keeping the symlinks the user cd'd through, like pwd -L
+};
+
+/**
+ * @brief Gets the current working directory
+ *
+ * In logical mode $PWD is used if it really points at the current directory,
+ * otherwise (and in physical mode) the resolved path is used.
+ *
+ * @param[in] mode One of enum pwd_mode
+ * @param[out] pwd The current working directory
+ * @param[out] physical Whether pwd is the resolved path
+ * @return false on error, with errno set
+ */
+bool pwd_get(enum pwd_mode mode, char pwd[PATH_MAX], bool* physical);
+
+/**
+ * @brief realpath, with results kept in the directory cache
+ *
+ * See dircache_realpath.
+ *
+ * @param[in] path The path to resolve
+ * @param[out] resolved The resolved path
+ * @return false on error, with errno set
+ */
+bool cached_realpath(const char* path, char resolved[PATH_MAX]);
+
+#endif
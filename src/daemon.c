@@ -0,0 +1,1361 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <pwd.h>
+#include <grp.h>
+#include <sys/file.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include "config.h"
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+#ifdef HAVE_UNSHARE
+#include <sched.h>
+#endif
+#ifdef HAVE_SETFSUID
+#include <sys/fsuid.h>
+#include <sys/syscall.h>
+#endif
+#include "cache.h"
+#include "dircache.h"
+#include "env.h"
+#include "latency.h"
+#include "timefmt.h"
+#include "daemon.h"
+
+// Bigger requests and answers are dropped
+#define DAEMON_MESSAGE_MAX (64 * 1024)
+// How many sockets the event loop handles per wakeup
+#define DAEMON_EVENTS 64
+// Give up on a client that doesn't read its answer
+#define DAEMON_SEND_TIMEOUT_MS 1000
+// Clients render themselves when the daemon is slower than this to accept
+#define DAEMON_CONNECT_TIMEOUT_MS 20
+// or to answer
+#define DAEMON_ANSWER_TIMEOUT_MS 500
+// Refreshes past this many waiting are dropped, the next prompt asks again
+#define DAEMON_BACKGROUND_QUEUE_MAX 64
+// Supplementary groups of a user past these are ignored by the system daemon
+#define DAEMON_GROUPS_MAX 64
+// Where the zones clients name in TZ are looked up
+#define DAEMON_ZONEINFO "/usr/share/zoneinfo"
+// The zone of clients without TZ: the system's, not the daemon's
+#define DAEMON_DEFAULT_ZONE "/etc/localtime"
+// How many zone files the event loop keeps, and for how long
+#define DAEMON_ZONES 8
+#define DAEMON_ZONE_SECONDS 60
+// Longer TZ names are not looked up
+#define DAEMON_ZONE_NAME_MAX 64
+// Bigger zone files are not read
+#define DAEMON_ZONE_FILE_MAX (64 * 1024)
+
+// Where the system daemon (cprompt -s) listens
+#ifndef DAEMON_SYSTEM_SOCKET
+#define DAEMON_SYSTEM_SOCKET "/run/cprompt.sock"
+#endif
+
+// Cache tables the system daemon shares between its users: what they hold
+// is either true for everyone or, for the latency model, kept apart by user
+static const char* const shared_tables[] = { "dirs", "latency", "nsswitch" };
+
+struct daemon_job {
+	int fd;
+	// The request as it was read; the fields below point into it
+	char* buf;
+	size_t len;
+	size_t cap;
+	enum prompt_side side;
+	const char* dir;
+	struct render_client who;
+	gid_t gid; // Of the client, who.uid being its user
+	struct time_zone zone; // Of the client, see use_time_zone
+	struct env_index env;
+	// The render
+	struct prompt_string* values;
+	int count;
+	bool* dirty; // What is left for a worker
+	bool* cheap; // What the event loop renders
+	// Jobs whose dirty elements render the same, see job_key
+	uint64_t key;
+	// Jobs with the same key that get this one's values instead of a render
+	struct daemon_job* followers;
+	// Once answered, the elements to refresh (see take_stale_elements)
+	void* stale;
+	struct daemon_job* next;
+};
+
+// A zone file the event loop read, see use_time_zone
+struct daemon_zone {
+	char name[DAEMON_ZONE_NAME_MAX]; // Its TZ, "" for DAEMON_DEFAULT_ZONE
+	uint8_t* data; // NULL if it couldn't be read
+	size_t len;
+	time_t read_at; // 0 for an unused entry
+};
+
+// A queue and the threads taking jobs from it
+struct daemon_shard {
+	struct daemon* daemon;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct daemon_job* head;
+	struct daemon_job** tail;
+	int queued;
+	struct daemon_job* current; // Being rendered
+};
+
+struct daemon {
+	int listen_fd;
+	bool system; // Serving every user, see daemon_main
+	int workers;
+	struct daemon_shard* shards;
+	// Refreshes of the latency model, which wait for idle time
+	int background_threads;
+	struct daemon_shard background;
+	// The zones of recent clients, replaced in turn
+	struct daemon_zone zones[DAEMON_ZONES];
+	int next_zone;
+#ifdef HAVE_SYS_EPOLL_H
+	int epoll_fd;
+#else
+	// The clients whose request is being read
+	struct daemon_job** reading;
+	int reading_count;
+	int reading_cap;
+#endif
+};
+
+// Whether the calling thread can chdir without moving the others
+static _Thread_local bool own_cwd = false;
+// Held around renders by threads that can't
+static pthread_mutex_t cwd_lock = PTHREAD_MUTEX_INITIALIZER;
+#ifdef HAVE_SETFSUID
+// The groups of the daemon, which threads go back to after a client's
+static gid_t daemon_groups[DAEMON_GROUPS_MAX];
+static int daemon_group_count = 0;
+#endif
+
+const char* daemon_socket_path(void)
+{
+	static char path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+	const char* dir;
+	int len;
+
+	if ((dir = env_get(ENV_XDG_RUNTIME_DIR)) && *dir == '/')
+		len = snprintf(path, sizeof(path), "%s/cprompt.sock", dir);
+	else if ((dir = cache_dir()))
+		len = snprintf(path, sizeof(path), "%s/daemon.sock", dir);
+	else
+		return NULL;
+	return len > 0 && len < (int)sizeof(path) ? path : NULL;
+}
+
+/**
+ * @brief Writes a whole buffer to a socket
+ *
+ * @param[in] fd The socket
+ * @param[in] buf What to write
+ * @param[in] left How much to write
+ * @return false if the other end went away
+ */
+static bool write_all(int fd, const char* buf, size_t left)
+{
+	ssize_t written;
+
+	while (left) {
+		written = write(fd, buf, left);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		buf += written;
+		left -= written;
+	}
+	return true;
+}
+
+/**
+ * @brief Appends a NUL terminated field to a message
+ *
+ * @param[in,out] buf The message
+ * @param[in,out] len How much of buf is used
+ * @param[in] field What to append
+ * @return false if the message got too big
+ */
+static bool append_field(char buf[DAEMON_MESSAGE_MAX], size_t* len,
+	const char* field)
+{
+	size_t field_len = strlen(field) + 1;
+
+	if (field_len > DAEMON_MESSAGE_MAX - *len)
+		return false;
+	memcpy(buf + *len, field, field_len);
+	*len += field_len;
+	return true;
+}
+
+/**
+ * @brief Frees a job and hangs up on its client
+ *
+ * @param[in] job The job
+ */
+static void job_free(struct daemon_job* job)
+{
+	if (job->values)
+		exploded_prompt_free(job->values, job->count);
+	if (job->fd != -1)
+		close(job->fd);
+	free(job->stale);
+	free(job->dirty);
+	free(job->buf);
+	free(job);
+}
+
+/**
+ * @brief Parses the request of a job as far as it was read
+ *
+ * @param[in,out] job The job
+ * @return 1 if the request is complete, 0 if more is needed, -1 if it is
+ * not a request
+ */
+static int parse_request(struct daemon_job* job)
+{
+	char* envp[ENV_COUNT + 1], *field, *end, *nul, *pid_end;
+	int n = 0, vars = 0;
+
+	for (field = job->buf, end = job->buf + job->len; ; field = nul + 1, n++) {
+		if (!(nul = memchr(field, 0, end - field)))
+			return 0;
+		switch (n) {
+		case 0:
+			if (strcmp(field, "<") && strcmp(field, ">"))
+				return -1;
+			job->side = *field == '>' ? PromptRight : PromptLeft;
+			break;
+		case 1:
+			if (*field != '/')
+				return -1;
+			job->dir = field;
+			break;
+		case 2:
+			job->who.tty = *field ? field : NULL;
+			break;
+		case 3:
+			job->who.shell = strtol(field, &pid_end, 10);
+			if (!*field || *pid_end)
+				return -1;
+			break;
+		default:
+			if (*field && vars < ENV_COUNT) {
+				envp[vars++] = field;
+				break;
+			}
+			if (*field)
+				break; // More than we know of, they can't be ours
+			if (nul + 1 != end)
+				return -1;
+			envp[vars] = NULL;
+			env_index_build(&job->env, envp);
+			return 1;
+		}
+	}
+}
+
+/**
+ * @brief Bounds how long blocking calls on a socket wait
+ *
+ * @param[in] fd The socket
+ * @param[in] opt SO_SNDTIMEO (which also bounds connect) or SO_RCVTIMEO
+ * @param[in] ms The timeout
+ */
+static void set_timeout(int fd, int opt, int ms)
+{
+	struct timeval timeout = {
+		.tv_sec = ms / 1000,
+		.tv_usec = ms % 1000 * 1000,
+	};
+
+	setsockopt(fd, SOL_SOCKET, opt, &timeout, sizeof(timeout));
+}
+
+/**
+ * @brief Sends the rendered prompt to the client
+ *
+ * @param[in] job The job
+ */
+static void answer(struct daemon_job* job)
+{
+	char* buf, count[16];
+	size_t len = 0;
+	bool ok;
+
+	if (!(buf = malloc(DAEMON_MESSAGE_MAX)))
+		return;
+	snprintf(count, sizeof(count), "%d", job->count);
+	ok = append_field(buf, &len, count);
+	for (int i = 0; ok && i < job->count; i++)
+		ok = append_field(buf, &len, job->values[i].str);
+	if (!ok) {
+		free(buf);
+		return;
+	}
+
+	// The answer goes out in one go, however long the client takes
+	fcntl(job->fd, F_SETFL, fcntl(job->fd, F_GETFL) & ~O_NONBLOCK);
+	set_timeout(job->fd, SO_SNDTIMEO, DAEMON_SEND_TIMEOUT_MS);
+	write_all(job->fd, buf, len);
+	free(buf);
+}
+
+/**
+ * @brief Hashes what the elements left to a worker depend on
+ *
+ * Two jobs with the same key get the same values, so only one is rendered:
+ * twenty panes pressing Enter in one repository cost one render.
+ *
+ * @param[in] job The job
+ */
+static uint64_t job_key(const struct daemon_job* job)
+{
+	const PromptElement* prompt;
+	const char* value;
+	unsigned inputs = 0;
+	uint64_t key;
+	int count;
+
+	prompt = get_prompt(job->side, &count);
+	for (int i = 0; i < count; i++)
+		if (job->dirty[i])
+			inputs |= element_deps(prompt[i].type)->inputs;
+
+	key = cache_hash(&job->side, sizeof(job->side), 0);
+	key = cache_hash(&job->who.uid, sizeof(job->who.uid), key);
+	key = cache_hash(job->dir, strlen(job->dir) + 1, key);
+	// Renders use the whole environment we know of, not just the deps
+	for (int i = 0; i < ENV_COUNT; i++) {
+		value = job->env.values[i];
+		key = value ? cache_hash(value, strlen(value) + 1, key) : key + 1;
+	}
+	if (inputs & InputSession) {
+		key = cache_hash(&job->who.shell, sizeof(job->who.shell), key);
+		if (job->who.tty)
+			key = cache_hash(job->who.tty, strlen(job->who.tty) + 1, key);
+	}
+	return key;
+}
+
+/**
+ * @brief Queues a job, unless one with the same key is queued or rendering
+ *
+ * @param[in,out] shard The shard of the job
+ * @param[in] job The job, which is taken over
+ */
+static void enqueue(struct daemon_shard* shard, struct daemon_job* job)
+{
+	struct daemon_job* leader;
+
+	pthread_mutex_lock(&shard->lock);
+	leader = shard->current;
+	if (!leader || leader->key != job->key)
+		for (leader = shard->head; leader && leader->key != job->key;
+				leader = leader->next)
+			;
+	if (leader) {
+		job->next = leader->followers;
+		leader->followers = job;
+	} else {
+		job->next = NULL;
+		*shard->tail = job;
+		shard->tail = &job->next;
+		shard->queued++;
+		pthread_cond_signal(&shard->ready);
+	}
+	pthread_mutex_unlock(&shard->lock);
+}
+
+/**
+ * @brief Waits for the next job of a queue
+ *
+ * @param[in,out] shard The queue
+ * @return The job, which is current until answer_followers
+ */
+static struct daemon_job* dequeue(struct daemon_shard* shard)
+{
+	struct daemon_job* job;
+
+	pthread_mutex_lock(&shard->lock);
+	while (!shard->head)
+		pthread_cond_wait(&shard->ready, &shard->lock);
+	job = shard->head;
+	if (!(shard->head = job->next))
+		shard->tail = &shard->head;
+	shard->queued--;
+	shard->current = job;
+	pthread_mutex_unlock(&shard->lock);
+	return job;
+}
+
+/**
+ * @brief Hands the refresh of the stale elements of a job to the background
+ *
+ * @param[in,out] daemon The daemon
+ * @param[in] job The answered job, which is taken over unless this fails
+ * @return false if there is nothing to refresh or no room to wait
+ */
+static bool queue_refresh(struct daemon* daemon, struct daemon_job* job)
+{
+	struct daemon_shard* queue = &daemon->background;
+	bool queued = false;
+
+	if (!daemon->background_threads || !(job->stale = take_stale_elements()))
+		return false;
+	close(job->fd);
+	job->fd = -1;
+	job->next = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+	if (queue->queued < DAEMON_BACKGROUND_QUEUE_MAX) {
+		*queue->tail = job;
+		queue->tail = &job->next;
+		queue->queued++;
+		pthread_cond_signal(&queue->ready);
+		queued = true;
+	}
+	pthread_mutex_unlock(&queue->lock);
+	return queued;
+}
+
+/**
+ * @brief Answers the followers of a job with its values
+ *
+ * @param[in] shard The shard of the job, NULL if it has none
+ * @param[in,out] job The job
+ * @param[in] rendered Whether the job was rendered, if not the followers
+ * are hung up on
+ */
+static void answer_followers(struct daemon_shard* shard,
+	struct daemon_job* job, bool rendered)
+{
+	struct daemon_job* follower, *next;
+
+	// No one can follow it anymore once it is no longer current
+	if (shard) {
+		pthread_mutex_lock(&shard->lock);
+		shard->current = NULL;
+		follower = job->followers;
+		job->followers = NULL;
+		pthread_mutex_unlock(&shard->lock);
+	} else {
+		follower = job->followers;
+		job->followers = NULL;
+	}
+
+	for (; follower; follower = next) {
+		next = follower->next;
+		for (int i = 0; rendered && i < follower->count; i++) {
+			if (!follower->dirty[i])
+				continue;
+			if (!(follower->values[i].str = strdup(job->values[i].str))) {
+				rendered = false;
+				break;
+			}
+			follower->values[i].needs_free = true;
+		}
+		if (rendered)
+			answer(follower);
+		job_free(follower);
+	}
+}
+
+/**
+ * @brief Makes the calling thread access files as the client of a job
+ *
+ * Only the system daemon has clients other than its own user. The kernel
+ * then checks what a render reads against the client's rights, not root's.
+ *
+ * @param[in] job The job, or NULL to go back to the daemon's own user
+ * @param[in] all_groups Whether the client gets its supplementary groups,
+ * whose lookup can wait for a directory service, or just its own group
+ * @return false if the thread couldn't become the client
+ */
+static bool switch_user(const struct daemon_job* job, bool all_groups)
+{
+	static _Thread_local bool switched = false;
+
+	if (job ? job->who.uid == geteuid() : !switched)
+		return true;
+	switched = job;
+#if defined(HAVE_SETFSUID)
+	gid_t groups[DAEMON_GROUPS_MAX];
+	struct passwd pw, *found;
+	char buf[1024];
+	int count = DAEMON_GROUPS_MAX;
+
+	// The raw syscalls change this thread only, libc would change them all
+	if (!job) {
+		syscall(SYS_setgroups, daemon_group_count, daemon_groups);
+		setfsgid(getegid());
+		setfsuid(geteuid());
+		return true;
+	}
+	if (!all_groups || getpwuid_r(job->who.uid, &pw, buf, sizeof(buf),
+			&found) != 0 || !found || getgrouplist(pw.pw_name, job->gid,
+				groups, &count) == -1) {
+		groups[0] = job->gid;
+		count = 1;
+	}
+	if (syscall(SYS_setgroups, count, groups) == -1)
+		return false;
+	setfsgid(job->gid);
+	setfsuid(job->who.uid);
+	// setfsuid can't fail, it just doesn't change anything
+	if ((uid_t)setfsuid(-1) != job->who.uid
+			|| (gid_t)setfsgid(-1) != job->gid) {
+		switch_user(NULL, false);
+		return false;
+	}
+	return true;
+#elif defined(HAVE_PTHREAD_SETUGID_NP)
+	if (!job)
+		return pthread_setugid_np(KAUTH_UID_NONE, KAUTH_GID_NONE) == 0;
+	return pthread_setugid_np(job->who.uid, job->gid) == 0;
+#else
+	return !job;
+#endif
+}
+
+/**
+ * @brief Renders what the event loop left of a job, and answers it
+ *
+ * Jobs that followed it get the same values, then the latency model's
+ * refresh is queued for the background, or done here if there is none and
+ * the thread has a directory of its own.
+ *
+ * @param[in] shard The shard of the job, NULL if it has none
+ * @param[in,out] job The job
+ * @return true if the job was taken over by the background
+ */
+static bool render_rest(struct daemon_shard* shard, struct daemon_job* job)
+{
+	bool rendered, queued = false;
+
+	if (!own_cwd)
+		pthread_mutex_lock(&cwd_lock);
+	env_use(&job->env);
+	render_for(&job->who);
+	// If we can't go there, hanging up makes the client render itself
+	if ((rendered = switch_user(job, true) && chdir(job->dir) == 0)) {
+		render_prompt(job->side, job->values, job->dirty);
+		answer(job);
+	}
+	answer_followers(shard, job, rendered);
+	if (rendered && !(shard && (queued = queue_refresh(shard->daemon, job)))) {
+		// Not while the other workers wait for the directory
+		if (own_cwd)
+			refresh_stale_elements(false);
+		else
+			free(take_stale_elements());
+	}
+	switch_user(NULL, false);
+	render_for(NULL);
+	env_use(NULL);
+	if (!own_cwd)
+		pthread_mutex_unlock(&cwd_lock);
+	return queued;
+}
+
+/**
+ * @brief Refreshes the stale elements of an answered job
+ *
+ * Only from a thread with a directory of its own.
+ *
+ * @param[in,out] job The job
+ */
+static void refresh_job(struct daemon_job* job)
+{
+	env_use(&job->env);
+	render_for(&job->who);
+	if (switch_user(job, true) && chdir(job->dir) == 0) {
+		give_stale_elements(job->stale);
+		job->stale = NULL;
+		refresh_stale_elements(false);
+	}
+	switch_user(NULL, false);
+	render_for(NULL);
+	env_use(NULL);
+}
+
+/**
+ * @brief Runs a background thread
+ *
+ * Interactive renders preempt it: it only gets idle CPU time and I/O. Where
+ * it can't have a directory of its own it drops the refreshes, rather than
+ * have the workers wait on the directory for as long as one takes. (A child
+ * forked for it could deadlock instead: the threads of the daemon may hold
+ * locks of malloc or of libc.)
+ *
+ * @param[in] arg The background queue
+ */
+static void* background_main(void* arg)
+{
+	struct daemon_job* job;
+
+#ifdef HAVE_UNSHARE
+	own_cwd = unshare(CLONE_FS) == 0;
+#endif
+	if (own_cwd)
+		latency_background();
+	for (;;) {
+		job = dequeue(arg);
+		if (own_cwd)
+			refresh_job(job);
+		job_free(job);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Runs a worker
+ *
+ * @param[in] arg The shard of the worker
+ */
+static void* worker_main(void* arg)
+{
+	struct daemon_shard* shard = arg;
+	struct daemon_job* job;
+
+#ifdef HAVE_UNSHARE
+	own_cwd = unshare(CLONE_FS) == 0;
+#endif
+	for (;;) {
+		job = dequeue(shard);
+		if (!render_rest(shard, job))
+			job_free(job);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Initializes an empty queue
+ *
+ * @param[in] daemon The daemon
+ * @param[out] shard The queue
+ */
+static void shard_init(struct daemon* daemon, struct daemon_shard* shard)
+{
+	shard->daemon = daemon;
+	shard->tail = &shard->head;
+	pthread_mutex_init(&shard->lock, NULL);
+	pthread_cond_init(&shard->ready, NULL);
+}
+
+/**
+ * @brief Starts the workers and background threads
+ *
+ * @param[in,out] daemon The daemon, whose thread counts are lowered to how
+ * many could be started
+ */
+static void start_workers(struct daemon* daemon)
+{
+	pthread_t thread;
+	int started;
+
+	shard_init(daemon, &daemon->background);
+	for (started = 0; started < daemon->background_threads; started++)
+		if (pthread_create(&thread, NULL, background_main,
+				&daemon->background))
+			break;
+	daemon->background_threads = started;
+
+	if (daemon->workers <= 0 || !(daemon->shards = calloc(daemon->workers,
+			sizeof(*daemon->shards)))) {
+		daemon->workers = 0;
+		return;
+	}
+	for (started = 0; started < daemon->workers; started++) {
+		shard_init(daemon, &daemon->shards[started]);
+		if (pthread_create(&thread, NULL, worker_main,
+				&daemon->shards[started]))
+			break;
+	}
+	daemon->workers = started;
+}
+
+/**
+ * @brief Picks the worker of a job: the same one for a whole repository
+ *
+ * The event loop mustn't wait for the file system, so the repository is
+ * the one the workers' lookups left in the directory cache.
+ *
+ * @param[in] daemon The daemon
+ * @param[in] job The job
+ */
+static struct daemon_shard* shard_of(struct daemon* daemon,
+	const struct daemon_job* job)
+{
+	char root[PATH_MAX];
+	struct dircache cache;
+
+	dircache_open(&cache);
+	if (!dircache_cached_repo_root(&cache, job->dir, root))
+		*root = 0;
+	dircache_close(&cache);
+	// Outside of a known repository, the directory is as good a key as any
+	return &daemon->shards[cache_hash(*root ? root : job->dir,
+		strlen(*root ? root : job->dir), 0) % daemon->workers];
+}
+
+/**
+ * @brief Whether a TZ names a zone in DAEMON_ZONEINFO
+ *
+ * Rather than a path of its own, which would have the daemon read any file
+ * the client names, or a rule.
+ *
+ * @param[in] tz The TZ of a client
+ */
+static bool is_zone_name(const char* tz)
+{
+	size_t len = strnlen(tz, DAEMON_ZONE_NAME_MAX);
+
+	if (!len || len == DAEMON_ZONE_NAME_MAX)
+		return false;
+	for (const char* c = tz; *c; c++) {
+		// No leading /, no empty, . or .. component
+		if ((c == tz || c[-1] == '/') && (*c == '/' || *c == '.'))
+			return false;
+		if (!isalnum((unsigned char)*c) && !strchr("/_+-.", *c))
+			return false;
+	}
+	return tz[len - 1] != '/';
+}
+
+/**
+ * @brief Reads a zone file as the client of a job
+ *
+ * @param[in] job The job
+ * @param[in] path The file
+ * @param[in,out] zone Where to put the contents, which are NULL if it
+ * couldn't be read
+ */
+static void read_zone(const struct daemon_job* job, const char* path,
+	struct daemon_zone* zone)
+{
+	uint8_t* data;
+	ssize_t got;
+	size_t len = 0;
+	int fd = -1;
+
+	free(zone->data);
+	zone->data = NULL;
+	// Not all of its groups: the event loop can't wait for their lookup
+	if (switch_user(job, false)) {
+		fd = open(path, O_RDONLY | O_CLOEXEC | O_NONBLOCK);
+		switch_user(NULL, false);
+	}
+	if (fd == -1)
+		return;
+	if ((data = malloc(DAEMON_ZONE_FILE_MAX))) {
+		while (len < DAEMON_ZONE_FILE_MAX && (got = read(fd, data + len,
+				DAEMON_ZONE_FILE_MAX - len)) > 0)
+			len += got;
+		zone->data = data;
+		zone->len = len;
+	}
+	close(fd);
+}
+
+/**
+ * @brief Finds the time zone of a client, for the clock
+ *
+ * Setting TZ for one client would race with the threads rendering for the
+ * others. Instead the zone TZ names is read from DAEMON_ZONEINFO (as the
+ * client), or TZ is taken as a POSIX rule, and the render gets the result.
+ * Anything else is UTC, like localtime does with a TZ it can't use.
+ *
+ * @param[in,out] daemon The daemon
+ * @param[in,out] job The job
+ */
+static void use_time_zone(struct daemon* daemon, struct daemon_job* job)
+{
+	const char* tz = job->env.values[ENV_TZ];
+	char path[PATH_MAX];
+	struct daemon_zone* zone = NULL;
+	time_t now = time(NULL);
+
+	job->who.zone = &job->zone;
+	if (!tz || is_zone_name(tz)) {
+		for (int i = 0; i < DAEMON_ZONES && !zone; i++)
+			if (daemon->zones[i].read_at && !strcmp(daemon->zones[i].name,
+					tz ? tz : ""))
+				zone = &daemon->zones[i];
+		if (!zone) {
+			zone = &daemon->zones[daemon->next_zone];
+			daemon->next_zone = (daemon->next_zone + 1) % DAEMON_ZONES;
+			snprintf(zone->name, sizeof(zone->name), "%s", tz ? tz : "");
+			zone->read_at = 0;
+		}
+		// Zones that couldn't be read too, so they aren't tried every time
+		if (!zone->read_at || now - zone->read_at >= DAEMON_ZONE_SECONDS
+				|| now < zone->read_at) {
+			snprintf(path, PATH_MAX, "%s/%s", DAEMON_ZONEINFO, tz ? tz : "");
+			read_zone(job, tz ? path : DAEMON_DEFAULT_ZONE, zone);
+			zone->read_at = now ? now : 1;
+		}
+		if (zone->data && time_zone_file(zone->data, zone->len, now,
+				&job->zone))
+			return;
+	}
+	if (tz && time_zone_rule(tz, now, &job->zone))
+		return;
+	job->zone = (struct time_zone){ .abbr = "UTC" };
+}
+
+/**
+ * @brief Renders the cheap part of a complete request, and hands the rest
+ * to a worker
+ *
+ * @param[in] daemon The daemon
+ * @param[in] job The job, which is taken over
+ */
+static void dispatch(struct daemon* daemon, struct daemon_job* job)
+{
+	const PromptElement* prompt;
+	bool rest = false;
+
+	prompt = get_prompt(job->side, &job->count);
+	job->values = calloc(job->count + 1, sizeof(*job->values));
+	job->dirty = malloc(2 * (job->count + 1));
+	if (!job->values || !job->dirty) {
+		job_free(job);
+		return;
+	}
+	job->cheap = job->dirty + job->count + 1;
+	for (int i = 0; i < job->count; i++) {
+		job->cheap[i] = element_is_inline(prompt[i].type);
+		rest |= job->dirty[i] = !job->cheap[i];
+	}
+
+	env_use(&job->env);
+	render_for(&job->who);
+	use_time_zone(daemon, job);
+	render_prompt(job->side, job->values, job->cheap);
+	render_for(NULL);
+	env_use(NULL);
+
+	if (!rest) {
+		answer(job);
+	} else if (!daemon->workers) {
+		render_rest(NULL, job);
+	} else {
+		job->key = job_key(job);
+		enqueue(shard_of(daemon, job), job);
+		return;
+	}
+	job_free(job);
+}
+
+/**
+ * @brief Starts watching a client for its request
+ *
+ * @param[in,out] daemon The daemon
+ * @param[in] job The job of the client
+ * @return false if out of memory
+ */
+static bool watch_add(struct daemon* daemon, struct daemon_job* job)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event event = { .events = EPOLLIN, .data.ptr = job };
+
+	return epoll_ctl(daemon->epoll_fd, EPOLL_CTL_ADD, job->fd, &event) == 0;
+#else
+	struct daemon_job** reading;
+	int cap;
+
+	if (daemon->reading_count == daemon->reading_cap) {
+		cap = daemon->reading_cap ? daemon->reading_cap * 2 : 16;
+		if (!(reading = realloc(daemon->reading, cap * sizeof(*reading))))
+			return false;
+		daemon->reading = reading;
+		daemon->reading_cap = cap;
+	}
+	daemon->reading[daemon->reading_count++] = job;
+	return true;
+#endif
+}
+
+/**
+ * @brief Stops watching a client
+ *
+ * @param[in,out] daemon The daemon
+ * @param[in] job The job of the client
+ */
+static void watch_remove(struct daemon* daemon, struct daemon_job* job)
+{
+#ifdef HAVE_SYS_EPOLL_H
+	epoll_ctl(daemon->epoll_fd, EPOLL_CTL_DEL, job->fd, NULL);
+#else
+	for (int i = 0; i < daemon->reading_count; i++) {
+		if (daemon->reading[i] == job) {
+			daemon->reading[i] = daemon->reading[--daemon->reading_count];
+			return;
+		}
+	}
+#endif
+}
+
+/**
+ * @brief Waits for clients to connect or send something
+ *
+ * @param[in] daemon The daemon
+ * @param[out] ready The clients that sent something
+ * @param[out] accept Whether clients are waiting to connect
+ * @return How many clients are in ready
+ */
+static int watch_wait(struct daemon* daemon,
+	struct daemon_job* ready[DAEMON_EVENTS], bool* accept)
+{
+	int count = 0;
+#ifdef HAVE_SYS_EPOLL_H
+	struct epoll_event events[DAEMON_EVENTS];
+	int n;
+
+	*accept = false;
+	if ((n = epoll_wait(daemon->epoll_fd, events, DAEMON_EVENTS, -1)) == -1)
+		return 0;
+	for (int i = 0; i < n; i++) {
+		if (!events[i].data.ptr)
+			*accept = true;
+		else
+			ready[count++] = events[i].data.ptr;
+	}
+#else
+	struct pollfd fds[DAEMON_EVENTS + 1];
+	// Start past the clients served last time, so every one gets its turn
+	static int first = 0;
+	int watched;
+
+	*accept = false;
+	fds[0] = (struct pollfd){ .fd = daemon->listen_fd, .events = POLLIN };
+	watched = daemon->reading_count < DAEMON_EVENTS
+		? daemon->reading_count : DAEMON_EVENTS;
+	for (int i = 0; i < watched; i++)
+		fds[i + 1] = (struct pollfd){
+			.fd = daemon->reading[(first + i) % daemon->reading_count]->fd,
+			.events = POLLIN,
+		};
+	if (poll(fds, watched + 1, -1) <= 0)
+		return 0;
+	*accept = fds[0].revents != 0;
+	for (int i = 0; i < watched; i++)
+		if (fds[i + 1].revents)
+			ready[count++] = daemon->reading[(first + i)
+				% daemon->reading_count];
+	first = daemon->reading_count ? (first + watched) % daemon->reading_count
+		: 0;
+#endif
+	return count;
+}
+
+/**
+ * @brief Gets the user at the other end of a socket, as the kernel knows it
+ *
+ * @param[in] fd The socket
+ * @param[out] uid The user
+ * @param[out] gid Its group
+ * @return false on error
+ */
+static bool peer_of(int fd, uid_t* uid, gid_t* gid)
+{
+#ifdef SO_PEERCRED
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) == -1)
+		return false;
+	*uid = cred.uid;
+	*gid = cred.gid;
+	return true;
+#else
+	return getpeereid(fd, uid, gid) == 0;
+#endif
+}
+
+/**
+ * @brief Accepts every client waiting to connect
+ *
+ * Clients are rendered for as the user they connected as. A user's own
+ * daemon hangs up on everyone else.
+ *
+ * @param[in,out] daemon The daemon
+ */
+static void accept_clients(struct daemon* daemon)
+{
+	struct daemon_job* job;
+	int fd;
+
+	while ((fd = accept(daemon->listen_fd, NULL, NULL)) != -1) {
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		if (!(job = calloc(1, sizeof(*job)))) {
+			close(fd);
+			continue;
+		}
+		job->fd = fd;
+		if (!peer_of(fd, &job->who.uid, &job->gid)
+				|| (!daemon->system && job->who.uid != geteuid())
+				|| !watch_add(daemon, job))
+			job_free(job);
+	}
+}
+
+/**
+ * @brief Reads what a client sent, and dispatches its request once complete
+ *
+ * @param[in,out] daemon The daemon
+ * @param[in] job The job of the client
+ */
+static void read_request(struct daemon* daemon, struct daemon_job* job)
+{
+	ssize_t got;
+	size_t cap;
+	char* buf;
+	int parsed = 0;
+
+	for (;;) {
+		if (job->len == job->cap) {
+			cap = job->cap ? job->cap * 2 : 1024;
+			if (cap > DAEMON_MESSAGE_MAX || !(buf = realloc(job->buf, cap)))
+				break;
+			job->buf = buf;
+			job->cap = cap;
+		}
+		got = read(job->fd, job->buf + job->len, job->cap - job->len);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (got <= 0)
+			break;
+		job->len += got;
+		if ((parsed = parse_request(job)))
+			break;
+	}
+
+	watch_remove(daemon, job);
+	if (parsed == 1)
+		dispatch(daemon, job);
+	else
+		job_free(job);
+}
+
+/**
+ * @brief Makes sure this is the only daemon serving a socket
+ *
+ * Clients that find no daemon all start one, and only one of them can be
+ * allowed to replace the socket.
+ *
+ * @param[in] path The socket
+ * @return false if another daemon has it, with errno set
+ */
+static bool lock_socket(const char* path)
+{
+	char* name;
+	int fd;
+
+	if (asprintf(&name, "%s.lock", path) == -1)
+		return true;
+	fd = open(name, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(name);
+	// Held until the daemon exits, there is nothing else to do with it
+	if (fd != -1 && flock(fd, LOCK_EX | LOCK_NB) == -1) {
+		close(fd);
+		errno = EADDRINUSE;
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Creates the listening socket
+ *
+ * @param[in] path Where to put it
+ * @param[in] everyone Whether every user may connect, or only ours
+ * @return The socket, -1 on error, with errno set
+ */
+static int listen_socket(const char* path, bool everyone)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	mode_t mask;
+	int fd, err;
+
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	// Someone answering means a daemon is already running
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+		close(fd);
+		errno = EADDRINUSE;
+		return -1;
+	}
+	close(fd);
+
+	unlink(path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return -1;
+	mask = umask(everyone ? 0 : 077);
+	err = bind(fd, (struct sockaddr*)&addr, sizeof(addr));
+	umask(mask);
+	if (err == -1 || listen(fd, SOMAXCONN) == -1) {
+		err = errno;
+		close(fd);
+		errno = err;
+		return -1;
+	}
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+	return fd;
+}
+
+int daemon_main(int workers, int background, bool system)
+{
+	struct daemon daemon = {
+		.system = system,
+		.workers = workers,
+		.background_threads = background,
+	};
+	struct daemon_job* ready[DAEMON_EVENTS];
+	const char* path;
+	bool accept;
+	int count;
+
+	if (system) {
+#if !defined(HAVE_SETFSUID) && !defined(HAVE_PTHREAD_SETUGID_NP)
+		fprintf(stderr, "cprompt: no system daemon on this platform\n");
+		return 1;
+#endif
+		if (geteuid() != 0) {
+			fprintf(stderr, "cprompt: the system daemon runs as root\n");
+			return 1;
+		}
+		path = DAEMON_SYSTEM_SOCKET;
+	} else if (!(path = daemon_socket_path())) {
+		fprintf(stderr, "cprompt: nowhere to put the daemon's socket\n");
+		return 1;
+	}
+	if (!lock_socket(path)
+			|| (daemon.listen_fd = listen_socket(path, system)) == -1) {
+		fprintf(stderr, "cprompt: %s: %s\n", path, strerror(errno));
+		return 1;
+	}
+	signal(SIGPIPE, SIG_IGN);
+	// Resolve the lazy globals while there is a single thread
+	cache_dir();
+	env_get(ENV_HOME);
+	if (system) {
+		// Opened as root, while threads rendering as a user couldn't
+		for (size_t i = 0;
+				i < sizeof(shared_tables) / sizeof(*shared_tables); i++)
+			cache_table_hold(shared_tables[i]);
+#ifdef HAVE_SETFSUID
+		if ((daemon_group_count = getgroups(DAEMON_GROUPS_MAX,
+				daemon_groups)) == -1)
+			daemon_group_count = 0;
+#endif
+	}
+	// Don't keep a directory busy
+	if (chdir("/") == -1)
+		return 1;
+
+#ifdef HAVE_SYS_EPOLL_H
+	if ((daemon.epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1
+			|| epoll_ctl(daemon.epoll_fd, EPOLL_CTL_ADD, daemon.listen_fd,
+				&(struct epoll_event){ .events = EPOLLIN }) == -1) {
+		fprintf(stderr, "cprompt: epoll: %s\n", strerror(errno));
+		return 1;
+	}
+#endif
+	start_workers(&daemon);
+
+	for (;;) {
+		count = watch_wait(&daemon, ready, &accept);
+		if (accept)
+			accept_clients(&daemon);
+		for (int i = 0; i < count; i++)
+			read_request(&daemon, ready[i]);
+	}
+}
+
+/**
+ * @brief Splits the answer of a daemon into its values
+ *
+ * @param[in] buf The answer as far as it was read
+ * @param[in] used How much was read
+ * @param[out] elements Where to point at the values, NULL to only check
+ * @return How many values the answer has, -1 if it isn't whole
+ */
+static ssize_t answer_fields(char* buf, size_t used,
+	struct prompt_string* elements)
+{
+	char* field = buf, *end = buf + used, *nul, *count_end;
+	unsigned long count;
+
+	if (!(nul = memchr(field, 0, used)))
+		return -1;
+	// Every value takes a byte at least
+	count = strtoul(field, &count_end, 10);
+	if (!*field || *count_end || count > DAEMON_MESSAGE_MAX)
+		return -1;
+	for (unsigned long i = 0; i < count; i++) {
+		field = nul + 1;
+		if (!(nul = memchr(field, 0, end - field)))
+			return -1;
+		if (elements)
+			elements[i] = (struct prompt_string){ .str = field };
+	}
+	return count;
+}
+
+/**
+ * @brief Asks a daemon to render a side of the prompt for this shell
+ *
+ * @param[in] path The socket of the daemon
+ * @param[in] side One of enum prompt_side
+ * @param[out] len The amount of pointers
+ * @param[out] running false if nobody listens on the socket
+ * @return The values of the elements, NULL if it didn't answer
+ */
+static struct prompt_string* ask(const char* path, enum prompt_side side,
+	size_t* len, bool* running)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct prompt_string* elements;
+	char* buf, cwd[PATH_MAX], pid[32], *tty = NULL, *var;
+	const char* value;
+	size_t used = 0, shift;
+	ssize_t got, count;
+	bool ok;
+	int fd;
+
+	*running = true;
+	if (!path || !getcwd(cwd, PATH_MAX))
+		return NULL;
+	strcpy(addr.sun_path, path);
+	if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1)
+		return NULL;
+	// A busy daemon is no reason to make the prompt wait
+	set_timeout(fd, SO_SNDTIMEO, DAEMON_CONNECT_TIMEOUT_MS);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1
+			|| !(buf = malloc(DAEMON_MESSAGE_MAX))) {
+		*running = errno != ENOENT && errno != ECONNREFUSED;
+		close(fd);
+		return NULL;
+	}
+	set_timeout(fd, SO_SNDTIMEO, DAEMON_ANSWER_TIMEOUT_MS);
+	set_timeout(fd, SO_RCVTIMEO, DAEMON_ANSWER_TIMEOUT_MS);
+
+	if (isatty(STDOUT_FILENO))
+		tty = ttyname(STDOUT_FILENO);
+	snprintf(pid, sizeof(pid), "%ld", (long)getppid());
+	ok = append_field(buf, &used, side == PromptRight ? ">" : "<")
+		&& append_field(buf, &used, cwd)
+		&& append_field(buf, &used, tty ? tty : "")
+		&& append_field(buf, &used, pid);
+	for (int i = 0; ok && i < ENV_COUNT; i++) {
+		if (!(value = env_get(i)))
+			continue;
+		if (asprintf(&var, "%s=%s", env_name(i), value) == -1) {
+			ok = false;
+			break;
+		}
+		ok = append_field(buf, &used, var);
+		free(var);
+	}
+	ok = ok && append_field(buf, &used, "")
+		&& write_all(fd, buf, used);
+
+	// The answer is whole once it has all its fields, anything short of
+	// that is a failure
+	used = 0;
+	while (ok && (got = read(fd, buf + used, DAEMON_MESSAGE_MAX - used))) {
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1)
+			break;
+		used += got;
+		if (answer_fields(buf, used, NULL) != -1 || used == DAEMON_MESSAGE_MAX)
+			break;
+	}
+	close(fd);
+	if (!ok || (count = answer_fields(buf, used, NULL)) == -1
+			|| !(elements = malloc((count + 1) * sizeof(*elements)))) {
+		free(buf);
+		return NULL;
+	}
+	*len = count;
+	if (!count) {
+		free(buf);
+		return elements;
+	}
+	answer_fields(buf, used, elements);
+	// The first value owns the buffer the others point into
+	shift = elements[0].str - buf;
+	memmove(buf, buf + shift, used - shift);
+	for (ssize_t i = 0; i < count; i++)
+		elements[i].str -= shift;
+	elements[0].needs_free = true;
+	return elements;
+}
+
+struct prompt_string* daemon_render(enum prompt_side side, size_t* len,
+	bool* running)
+{
+	struct prompt_string* elements;
+
+	if ((elements = ask(daemon_socket_path(), side, len, running))
+			|| *running)
+		return elements;
+	// Without a daemon of our own, the system's will do
+	return ask(DAEMON_SYSTEM_SOCKET, side, len, running);
+}
+
+void daemon_start(int workers, int background)
+{
+	pid_t pid;
+	int fd;
+
+	if ((pid = fork()) == -1)
+		return;
+	if (pid) {
+		waitpid(pid, NULL, 0);
+		return;
+	}
+
+	// Out of the shell's session and its command substitution, for good
+	setsid();
+	if (fork() != 0)
+		_exit(0);
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	_exit(daemon_main(workers, background, false));
+}
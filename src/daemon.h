@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_DAEMON_H
+#define CPROMPT_DAEMON_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include "prompt.h"
+
+/* Daemon
+ *
+ * cprompt -d stays resident and renders prompts for every shell of the user,
+ * which connect to its socket with cprompt -c. A request is a list of NUL
+ * terminated fields, ended by an empty one:
+ *     <side>         < for the left prompt, > for the right one
+ *     <directory>    the directory of the shell
+ *     <tty>          its terminal, empty if it has none
+ *     <pid>          the pid of the shell
+ *     NAME=value     one per variable of ENV_VARS the shell has set
+ * and the answer is the number of elements of that side, then the value of
+ * each, all NUL terminated, so the client lays them out for its terminal
+ * like a prompt it rendered. The connection is closed without an answer if
+ * the request couldn't be rendered.
+ *
+ * Nothing has to start the daemon: a client that finds none renders the
+ * prompt itself and starts one for the next prompts.
+ *
+ * On hosts with many users, root can run a single system daemon instead
+ * (cprompt -s), which clients without a daemon of their own use. Each
+ * client is rendered for as the user the kernel says it is (SO_PEERCRED or
+ * getpeereid), never as whoever it claims to be, and worker threads switch
+ * their file system identity to that user for the render. What doesn't
+ * depend on the user (host facts, directory and nsswitch caches) is kept
+ * once for everyone.
+ *
+ * Sockets are watched by a single event loop (epoll where there is one)
+ * that answers prompts made of cheap elements (element_is_inline) on the
+ * spot, the clock in the TZ of each client. Anything else goes to a pool of
+ * worker threads, sharded by the repository the directory is in: renders in
+ * one repository queue behind each other, never behind another repository's.
+ * Each worker has a current directory of its own where the kernel allows it
+ * (Linux); elsewhere they take turns with chdir.
+ *
+ * A request that would render exactly like one already queued or being
+ * rendered (same directory, environment and, if it matters, shell) waits for
+ * that one and gets a copy of its values, so a burst of panes in a
+ * repository costs a single render.
+ *
+ * Refreshing what the latency model showed from its cache is background
+ * work: once a worker answered, the refresh goes to a bounded queue served
+ * by threads with idle CPU and I/O priority, so it never delays a prompt.
+ */
+
+/**
+ * @brief Gets the path of the daemon's socket
+ *
+ * $XDG_RUNTIME_DIR/cprompt.sock, or daemon.sock in the cache directory.
+ *
+ * @return The path, or NULL if there is nowhere to put it
+ */
+const char* daemon_socket_path(void);
+
+/**
+ * @brief Runs the daemon until it is killed
+ *
+ * @param[in] workers How many worker threads to render with, 0 to render
+ * everything in the event loop
+ * @param[in] background How many threads refresh the latency model at idle
+ * priority, 0 to refresh in the worker right after answering
+ * @param[in] system Whether to be the system daemon, serving every user
+ * @return The exit status
+ */
+int daemon_main(int workers, int background, bool system);
+
+/**
+ * @brief Asks the daemon to render a side of the prompt for this shell
+ *
+ * The user's own daemon if there is one, the system daemon otherwise.
+ * Gives up after a few milliseconds if the daemon doesn't accept, or half a
+ * second if it doesn't answer, so the caller can render itself.
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] len The amount of pointers
+ * @param[out] running false if there is no daemon at all
+ * @return The values of the elements, free with exploded_prompt_free, or
+ * NULL if the daemon didn't answer
+ */
+struct prompt_string* daemon_render(enum prompt_side side, size_t* len,
+	bool* running);
+
+/**
+ * @brief Starts a daemon in the background, detached from this process
+ *
+ * Returns right away. If several are started at once, all but one exit.
+ *
+ * @param[in] workers See daemon_main
+ * @param[in] background See daemon_main
+ */
+void daemon_start(int workers, int background);
+
+#endif
@@ -0,0 +1,619 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "config.h"
+#include "dircache.h"
+
+#define DIRCACHE_MAGIC 0x44495232 // DIR2
+#define DIRCACHE_SIZE (256 * 1024)
+#define DIRCACHE_INDEX_SLOTS 256
+// Start over once this much is used, rather than running out halfway through
+#define DIRCACHE_RESET_AT (DIRCACHE_SIZE / 4 * 3)
+// Upper bound on links followed, in case another process left a mess
+#define DIRCACHE_MAX_STEPS (DIRCACHE_SIZE / sizeof(struct dircache_node))
+// How many directories up from where it starts dircache_repo_root caches
+#define DIRCACHE_DEPTH_MAX 64
+
+enum dircache_flag {
+	DirStat = 1 << 0, // dev, ino and mtime are set
+	DirGit = 1 << 1, // Has a .git
+	DirNoGit = 1 << 2, // Has no .git
+};
+
+// The offsets are from the start of the arena, 0 means none
+struct dircache_node {
+	uint32_t parent;
+	uint32_t child; // First child
+	uint32_t sibling; // Next sibling
+	uint32_t label; // The components after the parent, without a leading /
+	uint32_t label_len;
+	uint32_t flags; // enum dircache_flag
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+// A directory of a lookup: its node, and the path up to it
+struct dircache_level {
+	uint32_t off;
+	size_t len;
+	struct dircache_node node; // A copy, looked at without the lock
+};
+
+// The only record of the table; nodes and labels are allocated after it
+struct dircache_arena {
+	uint64_t key; // Unused
+	uint32_t used;
+	uint32_t root; // The node for /
+	// Counts resets, after which offsets read before mean nothing
+	uint32_t generation;
+	// Nodes by hash of dev and ino, for realpath
+	uint32_t index[DIRCACHE_INDEX_SLOTS];
+};
+
+// flock keeps other processes out, but the threads of the daemon share the
+// file description of the held table, which flock can't tell apart
+static pthread_mutex_t dircache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+bool path_is_canonical(const char* path)
+{
+	const char* p;
+
+	if (*path != '/')
+		return false;
+	for (p = path; (p = strstr(p, "/.")); p++) {
+		if (p[2] == '/' || p[2] == 0)
+			return false;
+		if (p[2] == '.' && (p[3] == '/' || p[3] == 0))
+			return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Gets the arena of an open cache
+ *
+ * @param[in] cache The cache
+ */
+static struct dircache_arena* arena_of(struct dircache* cache)
+{
+	return cache_table_records(&cache->table);
+}
+
+/**
+ * @brief Allocates from the arena
+ *
+ * @param[in] cache An open cache
+ * @param[in] size How many bytes
+ * @return The offset of the allocation, 0 if the arena is full
+ */
+static uint32_t arena_alloc(struct dircache* cache, size_t size)
+{
+	struct dircache_arena* arena = arena_of(cache);
+	uint32_t off = arena->used;
+
+	size = (size + 7) & ~(size_t)7;
+	if (off < sizeof(*arena) || off > DIRCACHE_SIZE
+			|| size > DIRCACHE_SIZE - off)
+		return 0;
+	arena->used += size;
+	return off;
+}
+
+/**
+ * @brief Turns an offset into a node
+ *
+ * @param[in] cache An open cache
+ * @param[in] off The offset
+ * @return The node, NULL if the offset can't be one
+ */
+static struct dircache_node* node_at(struct dircache* cache, uint32_t off)
+{
+	if (off < sizeof(struct dircache_arena) || off % 8
+			|| off > DIRCACHE_SIZE - sizeof(struct dircache_node))
+		return NULL;
+	return (struct dircache_node*)((char*)arena_of(cache) + off);
+}
+
+/**
+ * @brief Gets the label of a node
+ *
+ * @param[in] cache An open cache
+ * @param[in] node The node
+ * @return The label, which is not NUL terminated, or NULL if it is corrupt
+ */
+static const char* label_of(struct dircache* cache,
+	const struct dircache_node* node)
+{
+	if (node->label > DIRCACHE_SIZE
+			|| node->label_len > DIRCACHE_SIZE - node->label)
+		return NULL;
+	return (const char*)arena_of(cache) + node->label;
+}
+
+/**
+ * @brief Allocates a node
+ *
+ * @param[in] cache An open cache
+ * @param[in] parent The parent node
+ * @param[in] label The components after the parent
+ * @param[in] len The length of label
+ * @return The offset of the node, 0 if the arena is full
+ */
+static uint32_t new_node(struct dircache* cache, uint32_t parent,
+	const char* label, size_t len)
+{
+	struct dircache_node* node;
+	uint32_t off, label_off;
+
+	if (!(off = arena_alloc(cache, sizeof(*node))))
+		return 0;
+	if (len && !(label_off = arena_alloc(cache, len)))
+		return 0;
+	node = node_at(cache, off);
+	*node = (struct dircache_node){ .parent = parent };
+	if (len) {
+		memcpy((char*)arena_of(cache) + label_off, label, len);
+		node->label = label_off;
+		node->label_len = len;
+	}
+	return off;
+}
+
+/**
+ * @brief Empties the arena
+ *
+ * @param[in] cache An open cache
+ * @return false if even the root doesn't fit
+ */
+static bool arena_reset(struct dircache* cache)
+{
+	struct dircache_arena* arena = arena_of(cache);
+	uint32_t generation = arena->generation + 1;
+
+	memset(arena, 0, sizeof(*arena));
+	arena->generation = generation;
+	arena->used = sizeof(*arena);
+	arena->root = new_node(cache, 0, NULL, 0);
+	return arena->root != 0;
+}
+
+bool dircache_open(struct dircache* cache)
+{
+	return cache_table_open(&cache->table, "dirs", DIRCACHE_MAGIC, 1,
+		DIRCACHE_SIZE);
+}
+
+/**
+ * @brief Unlocks an open cache
+ *
+ * @param[in] cache The cache
+ */
+static void unlock(struct dircache* cache)
+{
+	// A held table stays open, closing our fd wouldn't unlock it
+	flock(cache->table.fd, LOCK_UN);
+	pthread_mutex_unlock(&dircache_lock);
+}
+
+/**
+ * @brief Locks an open cache, unless another thread or process has it
+ *
+ * Never waits: whoever has it could be held up by a slow file system, and
+ * a lookup without the cache is only slower.
+ *
+ * @param[in] cache The cache, which may have failed to open
+ * @return false if the cache can't be used now
+ */
+static bool lock(struct dircache* cache)
+{
+	struct dircache_arena* arena = arena_of(cache);
+
+	if (!arena || pthread_mutex_trylock(&dircache_lock))
+		return false;
+	if (flock(cache->table.fd, LOCK_EX | LOCK_NB) == -1) {
+		pthread_mutex_unlock(&dircache_lock);
+		return false;
+	}
+	if ((!node_at(cache, arena->root) || arena->used > DIRCACHE_RESET_AT)
+			&& !arena_reset(cache)) {
+		unlock(cache);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * @brief Splits the label of a node in two at a slash
+ *
+ * A node for the first part is inserted between the node and its parent.
+ *
+ * @param[in] cache An open cache
+ * @param[in] off The node to split
+ * @param[in] at Where the slash is in the label
+ * @return The offset of the new node, 0 on error
+ */
+static uint32_t split(struct dircache* cache, uint32_t off, uint32_t at)
+{
+	struct dircache_node* node, *parent, *mid, *link;
+	uint32_t* next, mid_off;
+	size_t steps = 0;
+
+	node = node_at(cache, off);
+	if (!(parent = node_at(cache, node->parent)))
+		return 0;
+	for (next = &parent->child; *next != off; next = &link->sibling)
+		if (!(link = node_at(cache, *next)) || ++steps > DIRCACHE_MAX_STEPS)
+			return 0;
+	if (!(mid_off = new_node(cache, node->parent, NULL, 0)))
+		return 0;
+
+	// Both halves keep pointing into the old label
+	mid = node_at(cache, mid_off);
+	mid->label = node->label;
+	mid->label_len = at;
+	mid->child = off;
+	mid->sibling = node->sibling;
+	*next = mid_off;
+	node->parent = mid_off;
+	node->sibling = 0;
+	node->label += at + 1;
+	node->label_len -= at + 1;
+	return mid_off;
+}
+
+/**
+ * @brief Finds the node of a directory
+ *
+ * @param[in] cache An open cache
+ * @param[in] path A canonical path, without trailing slashes
+ * @param[in] create Whether to add the directory if it is missing
+ * @return The offset of the node, 0 if not found
+ */
+static uint32_t find(struct dircache* cache, const char* path, bool create)
+{
+	struct dircache_node* node, *child;
+	const char* label;
+	uint32_t off = arena_of(cache)->root, child_off;
+	size_t i, common, steps = 0;
+
+	for (path++; *path; ) {
+		if (!(node = node_at(cache, off)))
+			return 0;
+		for (child_off = node->child; child_off; child_off = child->sibling) {
+			if (!(child = node_at(cache, child_off))
+					|| !(label = label_of(cache, child))
+					|| ++steps > DIRCACHE_MAX_STEPS)
+				return 0;
+			for (i = 0; i < child->label_len && path[i] == label[i]; i++)
+				;
+			if (i == child->label_len && (path[i] == '/' || !path[i]))
+				break;
+			// How many whole components both start with
+			for (common = i; common > 0; common--)
+				if (common < child->label_len && label[common] == '/'
+						&& (path[common] == '/' || !path[common]))
+					break;
+			if (!common)
+				continue;
+			if (!create || !(child_off = split(cache, child_off, common)))
+				return 0;
+			child = node_at(cache, child_off);
+			i = common;
+			break;
+		}
+
+		if (!child_off) {
+			// Nothing shares the next component: the rest is one node
+			if (!create || !(child_off = new_node(cache, off, path,
+					strlen(path))))
+				return 0;
+			child = node_at(cache, child_off);
+			node = node_at(cache, off);
+			child->sibling = node->child;
+			node->child = child_off;
+			return child_off;
+		}
+		off = child_off;
+		path += path[i] ? i + 1 : i;
+	}
+	return off;
+}
+
+/**
+ * @brief Rebuilds the path of a node from its labels
+ *
+ * @param[in] cache An open cache
+ * @param[in] off The node
+ * @param[out] path The path
+ * @return false if the path doesn't fit or the cache is corrupt
+ */
+static bool node_path(struct dircache* cache, uint32_t off,
+	char path[PATH_MAX])
+{
+	struct dircache_node* node;
+	const char* label;
+	size_t len = 0, steps = 0;
+	uint32_t root = arena_of(cache)->root;
+
+	for (uint32_t at = off; at != root; at = node->parent) {
+		if (!(node = node_at(cache, at)) || ++steps > DIRCACHE_MAX_STEPS)
+			return false;
+		len += node->label_len + 1;
+	}
+	if (len >= PATH_MAX)
+		return false;
+
+	path[len] = 0;
+	for (uint32_t at = off; at != root; at = node->parent) {
+		node = node_at(cache, at);
+		if (!(label = label_of(cache, node)) || node->label_len + 1 > len)
+			return false;
+		len -= node->label_len;
+		memcpy(path + len, label, node->label_len);
+		path[--len] = '/';
+	}
+	if (!off || off == root)
+		strcpy(path, "/");
+	return true;
+}
+
+/**
+ * @brief Records the stat of the directory of a node
+ *
+ * If it changed, what was learnt about the directory is forgotten.
+ *
+ * @param[in,out] node The node
+ * @param[in] st The stat of its directory
+ */
+static void node_stat(struct dircache_node* node, const struct stat* st)
+{
+	if ((node->flags & DirStat) && node->dev == (uint64_t)st->st_dev
+			&& node->ino == (uint64_t)st->st_ino
+			&& node->mtime_sec == st->st_mtime
+			&& node->mtime_nsec == ST_MTIM_NSEC(*st))
+		return;
+	node->dev = st->st_dev;
+	node->ino = st->st_ino;
+	node->mtime_sec = st->st_mtime;
+	node->mtime_nsec = ST_MTIM_NSEC(*st);
+	node->flags = DirStat;
+}
+
+/**
+ * @brief Whether a directory has a .git
+ *
+ * @param[in] dir The directory, "" for /
+ */
+static bool has_git(const char* dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int len;
+
+	len = snprintf(path, PATH_MAX, "%s/.git", dir);
+	return len > 0 && len < PATH_MAX && stat(path, &st) == 0;
+}
+
+/**
+ * @brief Finds the repository root by looking at every parent
+ *
+ * @param[in] dir The directory to start from
+ * @param[out] root The repository root, or "" if there is none
+ */
+static void walk_repo_root(const char* dir, char root[PATH_MAX])
+{
+	char path[PATH_MAX];
+	size_t len;
+
+	*root = 0;
+	len = strnlen(dir, PATH_MAX);
+	if (len == PATH_MAX)
+		return;
+	memcpy(path, dir, len + 1);
+
+	for (;;) {
+		while (len > 1 && path[len - 1] == '/')
+			len--;
+		path[len] = 0;
+		if (has_git(len == 1 ? "" : path)) {
+			memcpy(root, path, len + 1);
+			return;
+		}
+		if (len <= 1)
+			return;
+		while (len > 0 && path[len - 1] != '/')
+			len--;
+	}
+}
+
+/**
+ * @brief Makes sure a directory and every parent of it have a node
+ *
+ * @param[in] cache A locked cache
+ * @param[in] path A canonical path, without trailing slashes
+ * @param[out] levels The node of each directory, from path up to /
+ * @return How many levels there are, 0 on error or if there are too many
+ */
+static int find_levels(struct dircache* cache, const char* path,
+	struct dircache_level levels[DIRCACHE_DEPTH_MAX])
+{
+	struct dircache_node* node;
+	const char* label;
+	uint32_t off, root_off = arena_of(cache)->root, slash;
+	size_t len = strlen(path);
+	int count = 0;
+
+	if (!(off = find(cache, path, true)))
+		return 0;
+	// Up from the directory, one component at a time
+	for (;;) {
+		if (count == DIRCACHE_DEPTH_MAX || !(node = node_at(cache, off))
+				|| !(label = label_of(cache, node)))
+			return 0;
+		// Materialize the parent directory if it shares our node
+		for (slash = node->label_len; slash > 0 && label[slash - 1] != '/';
+				slash--)
+			;
+		if (slash && !split(cache, off, slash - 1))
+			return 0;
+		node = node_at(cache, off);
+		levels[count].off = off;
+		levels[count].len = len;
+		levels[count++].node = *node;
+		if (off == root_off)
+			return count;
+		if (node->label_len + 1 > len)
+			return 0;
+		len -= node->label_len + 1;
+		off = node->parent;
+	}
+}
+
+void dircache_repo_root(struct dircache* cache, const char* dir,
+	char root[PATH_MAX])
+{
+	char path[PATH_MAX];
+	struct dircache_level levels[DIRCACHE_DEPTH_MAX];
+	struct dircache_node* node;
+	struct stat st;
+	uint32_t generation;
+	size_t len;
+	int count, looked;
+
+	len = strnlen(dir, PATH_MAX);
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len == PATH_MAX || !path_is_canonical(dir) || !lock(cache))
+		goto uncached;
+	memcpy(path, dir, len);
+	path[len] = 0;
+	generation = arena_of(cache)->generation;
+	count = find_levels(cache, path, levels);
+	unlock(cache);
+	if (!count)
+		goto uncached;
+
+	// The stats, without keeping everyone else out of the cache meanwhile
+	*root = 0;
+	for (looked = 0; looked < count; looked++) {
+		node = &levels[looked].node;
+		len = levels[looked].len;
+		path[len] = 0;
+		if (stat(len ? path : "/", &st) == -1)
+			goto uncached;
+		node_stat(node, &st);
+		if (!(node->flags & (DirGit | DirNoGit)))
+			node->flags |= has_git(path) ? DirGit : DirNoGit;
+		if (node->flags & DirGit) {
+			memcpy(root, len ? path : "/", len ? len + 1 : 2);
+			looked++;
+			break;
+		}
+	}
+
+	// Unless the nodes went away with a reset in the meantime
+	if (!lock(cache))
+		return;
+	if (arena_of(cache)->generation == generation) {
+		for (int i = 0; i < looked; i++) {
+			node = node_at(cache, levels[i].off);
+			node->flags = levels[i].node.flags;
+			node->dev = levels[i].node.dev;
+			node->ino = levels[i].node.ino;
+			node->mtime_sec = levels[i].node.mtime_sec;
+			node->mtime_nsec = levels[i].node.mtime_nsec;
+		}
+	}
+	unlock(cache);
+	return;
+
+uncached:
+	walk_repo_root(dir, root);
+}
+
+bool dircache_cached_repo_root(struct dircache* cache, const char* dir,
+	char root[PATH_MAX])
+{
+	struct dircache_node* node;
+	uint32_t off, root_off;
+	size_t len, steps = 0;
+	bool known = false;
+
+	len = strnlen(dir, PATH_MAX);
+	while (len > 1 && dir[len - 1] == '/')
+		len--;
+	if (len == PATH_MAX || !path_is_canonical(dir) || !lock(cache))
+		return false;
+	memcpy(root, dir, len);
+	root[len] = 0;
+	root_off = arena_of(cache)->root;
+	off = len > 1 ? find(cache, root, false) : root_off;
+	for (; (node = node_at(cache, off)) && ++steps <= DIRCACHE_MAX_STEPS;
+			off = node->parent) {
+		if (node->flags & DirGit) {
+			known = node_path(cache, off, root);
+			break;
+		}
+		if (!(node->flags & DirNoGit))
+			break;
+		if (off == root_off) {
+			*root = 0;
+			known = true;
+			break;
+		}
+	}
+	unlock(cache);
+	return known;
+}
+
+bool dircache_realpath(struct dircache* cache, const char* path,
+	const struct stat* st, char resolved[PATH_MAX])
+{
+	struct dircache_node* node;
+	struct stat cached;
+	uint32_t slot, off;
+	uint64_t hash;
+	bool found;
+
+	hash = cache_hash(&st->st_dev, sizeof(st->st_dev), 0);
+	hash = cache_hash(&st->st_ino, sizeof(st->st_ino), hash);
+	slot = hash % DIRCACHE_INDEX_SLOTS;
+	if (lock(cache)) {
+		off = arena_of(cache)->index[slot];
+		node = node_at(cache, off);
+		found = node && (node->flags & DirStat)
+			&& node->dev == (uint64_t)st->st_dev
+			&& node->ino == (uint64_t)st->st_ino
+			&& node_path(cache, off, resolved);
+		unlock(cache);
+		if (found && stat(resolved, &cached) == 0
+				&& cached.st_dev == st->st_dev
+				&& cached.st_ino == st->st_ino)
+			return true;
+	}
+
+	if (!realpath(path, resolved))
+		return false;
+	if (lock(cache)) {
+		if ((off = find(cache, resolved, true))) {
+			node_stat(node_at(cache, off), st);
+			arena_of(cache)->index[slot] = off;
+		}
+		unlock(cache);
+	}
+	return true;
+}
+
+void dircache_close(struct dircache* cache)
+{
+	cache_table_close(&cache->table);
+}
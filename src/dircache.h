@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_DIRCACHE_H
+#define CPROMPT_DIRCACHE_H
+
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+/* Directory cache
+ *
+ * What cprompt knows about directories (where they resolve to, whether they
+ * hold a .git) lives in one cache file, as a radix trie of path components.
+ * Runs of components nobody asked about are kept on a single node
+ * (/home/me/src is one node until something under /home is looked up), and
+ * the trie links are offsets into the file so it can be mmapped as is.
+ *
+ * Every node remembers the inode and mtime of its directory, and what was
+ * learnt about the directory only holds while a stat shows the same ones.
+ * Looking for the repository above a directory is one descent of the trie
+ * and a walk back up the parents, one stat per directory and nothing else
+ * while nothing changed.
+ *
+ * Lookups lock the cache against every other process and thread only to
+ * read or change the trie, never across a stat, and look without the cache
+ * rather than wait while someone else has it.
+ */
+
+struct dircache {
+	struct cache_table table;
+};
+
+/**
+ * @brief Whether a path is absolute and has no . or .. components
+ *
+ * @param[in] path The path to check
+ */
+bool path_is_canonical(const char* path);
+
+/**
+ * @brief Opens the directory cache
+ *
+ * The functions below work (uncached) even if this fails.
+ *
+ * @param[out] cache The cache to populate
+ * @return true if the cache is usable
+ */
+bool dircache_open(struct dircache* cache);
+
+/**
+ * @brief Finds the root of the repository containing a directory
+ *
+ * @param[in] cache The cache, which may have failed to open
+ * @param[in] dir An absolute directory
+ * @param[out] root The repository root, or "" if there is none
+ */
+void dircache_repo_root(struct dircache* cache, const char* dir,
+	char root[PATH_MAX]);
+
+/**
+ * @brief Gets what the cache knows of the repository containing a directory
+ *
+ * Nothing is looked at but the cache, for callers that can't wait for the
+ * file system and can do with a guess.
+ *
+ * @param[in] cache The cache, which may have failed to open
+ * @param[in] dir An absolute directory
+ * @param[out] root The repository root, or "" if there is none
+ * @return false if the cache doesn't know (or is busy)
+ */
+bool dircache_cached_repo_root(struct dircache* cache, const char* dir,
+	char root[PATH_MAX]);
+
+/**
+ * @brief realpath, with results cached by the inode of the directory
+ *
+ * A cached path is trusted after a single stat shows it still leads to the
+ * same inode, instead of resolving every component again.
+ *
+ * @param[in] cache The cache, which may have failed to open
+ * @param[in] path The path to resolve
+ * @param[in] st The stat of path
+ * @param[out] resolved The resolved path
+ * @return false on error, with errno set
+ */
+bool dircache_realpath(struct dircache* cache, const char* path,
+	const struct stat* st, char resolved[PATH_MAX]);
+
+/**
+ * @brief Unmaps and closes the directory cache
+ *
+ * @param[in] cache The cache, which may have failed to open
+ */
+void dircache_close(struct dircache* cache);
+
+#endif
@@ -0,0 +1,88 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "config.h"
+#include "env.h"
+
+extern char** environ;
+
+static const char* const env_names[ENV_COUNT] = {
+#define ENV_NAME(name, first, last) #name,
+	ENV_VARS(ENV_NAME)
+#undef ENV_NAME
+};
+
+// The hash is perfect if no two variables set the same bit
+#define ENV_BIT(name, first, last) \
+	(1ULL << ENV_HASH(first, last, sizeof(#name) - 1))
+#define ENV_OR(name, first, last) | ENV_BIT(name, first, last)
+#define ENV_SUM(name, first, last) + ENV_BIT(name, first, last)
+_Static_assert((0 ENV_VARS(ENV_OR)) == (0 ENV_VARS(ENV_SUM)),
+	"ENV_HASH has collisions, pick another one");
+#undef ENV_SUM
+#undef ENV_OR
+#undef ENV_BIT
+
+// Slot in the hash table to enum env_var + 1, 0 for an empty slot
+static const unsigned char env_slots[ENV_HASH_SIZE] = {
+#define ENV_SLOT(name, first, last) \
+	[ENV_HASH(first, last, sizeof(#name) - 1)] = ENV_##name + 1,
+	ENV_VARS(ENV_SLOT)
+#undef ENV_SLOT
+};
+
+void env_index_build(struct env_index* index, char* const* envp)
+{
+	const char* entry, *eq;
+	size_t len;
+	int var;
+
+	memset(index, 0, sizeof(*index));
+	for (; (entry = *envp); envp++) {
+		eq = strchr(entry, '=');
+		if (!eq || eq == entry)
+			continue;
+		len = eq - entry;
+		var = env_slots[ENV_HASH(entry[0], eq[-1], len)] - 1;
+		// getenv returns the first match, so do we
+		if (var >= 0 && !index->values[var]
+				&& !strncmp(env_names[var], entry, len)
+				&& env_names[var][len] == 0)
+			index->values[var] = eq + 1;
+	}
+}
+
+static struct env_index process_index;
+static bool process_index_built = false;
+static _Thread_local const struct env_index* thread_index = NULL;
+
+const char* env_get(enum env_var var)
+{
+	if (thread_index)
+		return thread_index->values[var];
+	if (!process_index_built) {
+		env_index_build(&process_index, environ);
+		process_index_built = true;
+	}
+	return process_index.values[var];
+}
+
+void env_reset(void)
+{
+	process_index_built = false;
+}
+
+const char* env_name(enum env_var var)
+{
+	return env_names[var];
+}
+
+void env_use(const struct env_index* index)
+{
+	thread_index = index;
+}
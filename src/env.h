@@ -0,0 +1,93 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_ENV_H
+#define CPROMPT_ENV_H
+
+/* Environment index
+ *
+ * Every variable cprompt reads is listed here. The environment is walked once
+ * and each entry is matched against this list through a perfect hash of its
+ * first character, last character and length, so looking a variable up later
+ * is an array access instead of a getenv scan.
+ *
+ * To add a variable, add it to ENV_VARS with its first and last characters,
+ * which make check checks. If it collides with another one env.c fails to
+ * build: change ENV_HASH until it doesn't.
+ */
+#define ENV_VARS(X) \
+	X(HOME, 'H', 'E') \
+	X(PWD, 'P', 'D') \
+	X(XDG_CACHE_HOME, 'X', 'E') \
+	X(CPROMPT_NAMED_DIRS, 'C', 'S') \
+	X(LANG, 'L', 'G') \
+	X(LC_ALL, 'L', 'L') \
+	X(LC_TIME, 'L', 'E') \
+	X(TERM, 'T', 'M') \
+	X(XDG_RUNTIME_DIR, 'X', 'R') \
+	X(XDG_CONFIG_HOME, 'X', 'E') \
+	X(GIT_CONFIG_GLOBAL, 'G', 'L') \
+	X(GIT_CONFIG_NOSYSTEM, 'G', 'M') \
+	X(TZ, 'T', 'Z')
+
+#define ENV_HASH_SIZE 32
+#define ENV_HASH(first, last, len) \
+	(((unsigned)(first) + (unsigned)(last) * 19 + (unsigned)(len)) \
+		% ENV_HASH_SIZE)
+
+enum env_var {
+#define ENV_ENUM(name, first, last) ENV_##name,
+	ENV_VARS(ENV_ENUM)
+#undef ENV_ENUM
+	ENV_COUNT
+};
+
+struct env_index {
+	const char* values[ENV_COUNT];
+};
+
+/**
+ * @brief Indexes an environment in a single pass
+ *
+ * The index points into envp, which must outlive it.
+ *
+ * @param[out] index The index to populate
+ * @param[in] envp A NULL terminated array of NAME=value strings
+ */
+void env_index_build(struct env_index* index, char* const* envp);
+
+/**
+ * @brief Gets a variable from the environment of the process
+ *
+ * The environment is indexed on first use. A thread rendering for someone
+ * else reads their environment instead, see env_use.
+ *
+ * @param[in] var One of enum env_var
+ * @return The value, or NULL if it is not set
+ */
+const char* env_get(enum env_var var);
+
+/**
+ * @brief Forgets the index of the process environment
+ *
+ * Call after changing the environment, the next env_get indexes it again.
+ */
+void env_reset(void);
+
+/**
+ * @brief Gets the name of a variable
+ *
+ * @param[in] var One of enum env_var
+ */
+const char* env_name(enum env_var var);
+
+/**
+ * @brief Makes env_get read from an index in the calling thread
+ *
+ * @param[in] index The index, which must outlive its use, or NULL to go back
+ * to the environment of the process
+ */
+void env_use(const struct env_index* index);
+
+#endif
@@ -0,0 +1,1144 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "commit.h"
+#include "dircache.h"
+#include "git.h"
+#include "reftable.h"
+
+// Refs that point at refs are followed this deep
+#define GIT_SYMREF_DEPTH 5
+// Files bigger than this are assumed changed rather than hashed
+#define GIT_HASH_MAX (64 * 1024 * 1024)
+// Trees of HEAD read to compare the index with, past which we don't know
+#define GIT_STAGED_TREES_MAX 1024
+
+// Modes of index entries
+#define GIT_MODE_TYPE 0170000
+#define GIT_MODE_TREE 0040000 // Only in a sparse index
+#define GIT_MODE_LINK 0120000
+#define GIT_MODE_GITLINK 0160000
+
+// Flags of index entries
+#define GIT_INDEX_ASSUME_VALID 0x8000
+#define GIT_INDEX_EXTENDED 0x4000
+#define GIT_INDEX_STAGE 0x3000
+#define GIT_INDEX_NAME 0x0fff
+#define GIT_INDEX_SKIP_WORKTREE 0x4000
+#define GIT_INDEX_INTENT_TO_ADD 0x2000
+
+struct git_index {
+	const uint8_t* data;
+	size_t size;
+	struct stat st;
+	uint32_t version;
+	uint32_t entries;
+	const uint8_t* extensions; // Where the entries end
+};
+
+struct git_entry {
+	uint32_t ctime;
+	uint32_t mtime;
+	uint32_t ino;
+	uint32_t mode;
+	uint32_t uid;
+	uint32_t gid;
+	uint32_t size;
+	const uint8_t* oid;
+	uint16_t flags;
+	uint16_t ext_flags;
+	char name[PATH_MAX];
+};
+
+/**
+ * @brief Reads a small file whole
+ *
+ * @param[in] path The file
+ * @param[out] buf Where to put its contents, NUL terminated
+ * @param[in] size The size of buf
+ * @return How many bytes were read, -1 on error
+ */
+static ssize_t read_small(const char* path, char* buf, size_t size)
+{
+	ssize_t got, len = 0;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return -1;
+	while ((size_t)len < size - 1
+			&& (got = read(fd, buf + len, size - 1 - len))) {
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1) {
+			close(fd);
+			return -1;
+		}
+		len += got;
+	}
+	close(fd);
+	buf[len] = 0;
+	return len;
+}
+
+/**
+ * @brief Removes the newlines and spaces at the end of a string
+ *
+ * @param[in,out] s The string
+ */
+static void chomp(char* s)
+{
+	size_t len = strlen(s);
+
+	while (len && (s[len - 1] == '\n' || s[len - 1] == '\r'
+			|| s[len - 1] == ' '))
+		s[--len] = 0;
+}
+
+/**
+ * @brief Makes a path absolute against a directory
+ *
+ * @param[in] dir The directory relative paths are in
+ * @param[in] path The path
+ * @param[out] out The absolute path
+ * @return false if it is too long
+ */
+static bool join(const char* dir, const char* path, char out[PATH_MAX])
+{
+	int len;
+
+	if (*path == '/')
+		len = snprintf(out, PATH_MAX, "%s", path);
+	else
+		len = snprintf(out, PATH_MAX, "%s/%s", dir, path);
+	return len > 0 && len < PATH_MAX;
+}
+
+bool git_oid_parse(const char* hex, int size, uint8_t oid[GIT_OID_MAX])
+{
+	int hi, lo;
+
+	for (int i = 0; i < size; i++) {
+		hi = hex[2 * i];
+		lo = hex[2 * i + 1];
+		hi = hi >= '0' && hi <= '9' ? hi - '0' : hi >= 'a' && hi <= 'f'
+			? hi - 'a' + 10 : -1;
+		lo = lo >= '0' && lo <= '9' ? lo - '0' : lo >= 'a' && lo <= 'f'
+			? lo - 'a' + 10 : -1;
+		if (hi < 0 || lo < 0)
+			return false;
+		oid[i] = hi << 4 | lo;
+	}
+	return true;
+}
+
+void git_oid_hex(const struct git_repo* repo, const uint8_t oid[GIT_OID_MAX],
+	char hex[2 * GIT_OID_MAX + 1])
+{
+	static const char digits[] = "0123456789abcdef";
+
+	for (int i = 0; i < repo->oid_size; i++) {
+		hex[2 * i] = digits[oid[i] >> 4];
+		hex[2 * i + 1] = digits[oid[i] & 15];
+	}
+	hex[2 * repo->oid_size] = 0;
+}
+
+/**
+ * @brief Looks a ref up in the reftable stack it belongs to
+ *
+ * HEAD and the refs of a worktree are in its own stack, the rest in the
+ * stack of the repository.
+ *
+ * @param[in] repo The repository
+ * @param[in] name The ref
+ * @param[out] oid Its object id, with ReftableOid
+ * @param[out] target The ref it points at, with ReftableSymref
+ * @return One of enum reftable_result
+ */
+static enum reftable_result reftable_ref(const struct git_repo* repo,
+	const char* name, uint8_t oid[GIT_OID_MAX], char target[GIT_REF_MAX])
+{
+	char dir[PATH_MAX];
+	bool own = strncmp(name, "refs/", 5) || !strncmp(name, "refs/bisect/", 12)
+		|| !strncmp(name, "refs/worktree/", 14)
+		|| !strncmp(name, "refs/rewritten/", 15);
+
+	if (!join(own ? repo->gitdir : repo->commondir, "reftable", dir))
+		return ReftableMissing;
+	return reftable_lookup(dir, name, repo->oid_size, oid, target);
+}
+
+bool git_open(struct git_repo* repo, const char* dir)
+{
+	char buf[PATH_MAX + 16], path[PATH_MAX];
+	uint8_t oid[GIT_OID_MAX];
+	struct dircache cache;
+	struct stat st;
+
+	dircache_open(&cache);
+	dircache_repo_root(&cache, dir, repo->root);
+	dircache_close(&cache);
+	if (!*repo->root)
+		return false;
+
+	// .git is a directory, or a file pointing at one (worktrees, submodules)
+	if (!join(repo->root, ".git", repo->gitdir) || stat(repo->gitdir, &st))
+		return false;
+	if (!S_ISDIR(st.st_mode)) {
+		if (read_small(repo->gitdir, buf, sizeof(buf)) <= 8
+				|| strncmp(buf, "gitdir: ", 8))
+			return false;
+		chomp(buf);
+		if (!join(repo->root, buf + 8, repo->gitdir))
+			return false;
+	}
+
+	// Worktrees share the refs and objects of the main repository
+	if (!join(repo->gitdir, "commondir", path)
+			|| read_small(path, buf, sizeof(buf)) <= 0) {
+		strcpy(repo->commondir, repo->gitdir);
+	} else {
+		chomp(buf);
+		if (!join(repo->gitdir, buf, repo->commondir))
+			return false;
+	}
+
+	// The config depends on the branch, for its upstream and onbranch:
+	if (!join(repo->gitdir, "HEAD", path)
+			|| read_small(path, buf, sizeof(buf)) == -1)
+		*buf = 0;
+	chomp(buf);
+	git_config_load(&repo->config, repo->gitdir, repo->commondir,
+		strncmp(buf, "ref: refs/heads/", 16) ? "" : buf + 16);
+	repo->oid_size = repo->config.oid_size;
+	if (repo->config.reftable) {
+		// Which the HEAD file doesn't say with reftable
+		if (reftable_ref(repo, "HEAD", oid, buf + 5) != ReftableSymref)
+			buf[5] = 0;
+		git_config_load(&repo->config, repo->gitdir, repo->commondir,
+			strncmp(buf + 5, "refs/heads/", 11) ? "" : buf + 16);
+	}
+	return true;
+}
+
+/**
+ * @brief Looks a ref up in packed-refs
+ *
+ * @param[in] repo The repository
+ * @param[in] ref The full ref name
+ * @param[out] oid The object id
+ * @return false if it isn't there
+ */
+static bool packed_ref(const struct git_repo* repo, const char* ref,
+	uint8_t oid[GIT_OID_MAX])
+{
+	char path[PATH_MAX];
+	const char* data, *line, *end, *nl;
+	size_t ref_len = strlen(ref), hex_len = 2 * repo->oid_size;
+	struct stat st;
+	bool found = false;
+	int fd;
+
+	if (!join(repo->commondir, "packed-refs", path)
+			|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || !st.st_size) {
+		close(fd);
+		return false;
+	}
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (data == MAP_FAILED)
+		return false;
+
+	// <hex> <ref>, with # comments and ^ peeled tags in between
+	end = data + st.st_size;
+	for (line = data; line < end && !found; line = nl + 1) {
+		if (!(nl = memchr(line, '\n', end - line)))
+			nl = end;
+		if ((size_t)(nl - line) == hex_len + 1 + ref_len
+				&& line[hex_len] == ' '
+				&& !memcmp(line + hex_len + 1, ref, ref_len))
+			found = git_oid_parse(line, repo->oid_size, oid);
+	}
+	munmap((void*)data, st.st_size);
+	return found;
+}
+
+bool git_resolve_ref(const struct git_repo* repo, const char* ref,
+	uint8_t oid[GIT_OID_MAX])
+{
+	char path[PATH_MAX], buf[GIT_REF_MAX + 16], name[GIT_REF_MAX];
+	ssize_t len;
+
+	if (strlen(ref) >= GIT_REF_MAX)
+		return false;
+	strcpy(name, ref);
+	for (int depth = 0; depth < GIT_SYMREF_DEPTH; depth++) {
+		if (repo->config.reftable) {
+			switch (reftable_ref(repo, name, oid, buf)) {
+			case ReftableOid:
+				return true;
+			case ReftableSymref:
+				strcpy(name, buf);
+				continue;
+			default:
+				return false;
+			}
+		}
+		if (!join(repo->commondir, name, path))
+			return false;
+		if ((len = read_small(path, buf, sizeof(buf))) == -1)
+			return packed_ref(repo, name, oid);
+		chomp(buf);
+		if (strncmp(buf, "ref: ", 5))
+			return len >= 2 * repo->oid_size
+				&& git_oid_parse(buf, repo->oid_size, oid);
+		if (strlen(buf + 5) >= GIT_REF_MAX)
+			return false;
+		strcpy(name, buf + 5);
+	}
+	return false;
+}
+
+bool git_read_head(const struct git_repo* repo, struct git_head* head)
+{
+	char path[PATH_MAX], buf[GIT_REF_MAX + 16];
+
+	memset(head, 0, sizeof(*head));
+	// With reftable, HEAD is only a file for older gits to see
+	if (repo->config.reftable) {
+		switch (reftable_ref(repo, "HEAD", head->oid, head->ref)) {
+		case ReftableOid:
+			return true;
+		case ReftableSymref:
+			head->unborn = !git_resolve_ref(repo, head->ref, head->oid);
+			return true;
+		default:
+			return false;
+		}
+	}
+	if (!join(repo->gitdir, "HEAD", path)
+			|| read_small(path, buf, sizeof(buf)) <= 0)
+		return false;
+	chomp(buf);
+
+	if (strncmp(buf, "ref: ", 5))
+		return git_oid_parse(buf, repo->oid_size, head->oid);
+	if (strlen(buf + 5) >= GIT_REF_MAX)
+		return false;
+	strcpy(head->ref, buf + 5);
+	head->unborn = !git_resolve_ref(repo, head->ref, head->oid);
+	return true;
+}
+
+/**
+ * @brief Whether a file exists in the git directory
+ *
+ * @param[in] repo The repository
+ * @param[in] name Its name in the git directory
+ * @param[in] dir Whether it has to be a directory
+ */
+static bool has(const struct git_repo* repo, const char* name, bool dir)
+{
+	char path[PATH_MAX];
+	struct stat st;
+
+	return join(repo->gitdir, name, path) && stat(path, &st) == 0
+		&& (!dir || S_ISDIR(st.st_mode));
+}
+
+const char* git_action(const struct git_repo* repo)
+{
+	if (has(repo, "rebase-apply", true)) {
+		if (has(repo, "rebase-apply/rebasing", false))
+			return "rebase";
+		if (has(repo, "rebase-apply/applying", false))
+			return "am";
+		return "am/rebase";
+	}
+	if (has(repo, "rebase-merge/interactive", false))
+		return "rebase-i";
+	if (has(repo, "rebase-merge", true))
+		return "rebase-m";
+	if (has(repo, "MERGE_HEAD", false))
+		return "merge";
+	if (has(repo, "BISECT_LOG", false))
+		return "bisect";
+	if (has(repo, "CHERRY_PICK_HEAD", false))
+		return has(repo, "sequencer", true) ? "cherry-seq" : "cherry";
+	if (has(repo, "REVERT_HEAD", false))
+		return has(repo, "sequencer", true) ? "revert-seq" : "revert";
+	if (has(repo, "sequencer", true))
+		return "cherry-or-revert";
+	return NULL;
+}
+
+static uint32_t be32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint16_t be16(const uint8_t* p)
+{
+	return p[0] << 8 | p[1];
+}
+
+/**
+ * @brief Maps the index of a repository
+ *
+ * @param[in] repo The repository
+ * @param[out] index The index
+ * @return false if there is no readable index
+ */
+static bool index_open(const struct git_repo* repo, struct git_index* index)
+{
+	char path[PATH_MAX];
+	int fd;
+
+	if (!join(repo->gitdir, "index", path)
+			|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &index->st) == -1
+			|| index->st.st_size < 12 + repo->oid_size) {
+		close(fd);
+		return false;
+	}
+	index->size = index->st.st_size;
+	index->data = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (index->data == MAP_FAILED)
+		return false;
+
+	index->version = be32(index->data + 4);
+	index->entries = be32(index->data + 8);
+	index->extensions = NULL;
+	if (memcmp(index->data, "DIRC", 4) || index->version < 2
+			|| index->version > 4) {
+		munmap((void*)index->data, index->size);
+		return false;
+	}
+	return true;
+}
+
+static void index_close(struct git_index* index)
+{
+	munmap((void*)index->data, index->size);
+}
+
+/**
+ * @brief Parses the index entry at a position
+ *
+ * @param[in] repo The repository
+ * @param[in] index The index
+ * @param[in] p Where the entry starts
+ * @param[in,out] entry The entry, which holds the previous one's name
+ * @return Where the next entry starts, NULL if the index is corrupt
+ */
+static const uint8_t* index_entry(const struct git_repo* repo,
+	const struct git_index* index, const uint8_t* p, struct git_entry* entry)
+{
+	const uint8_t* end = index->data + index->size - repo->oid_size;
+	const uint8_t* name, *nul;
+	size_t fixed = 40 + repo->oid_size + 2, strip = 0, keep, len;
+	uint8_t c;
+
+	// The padding of a corrupt entry can reach past end
+	if (p > end || (size_t)(end - p) < fixed)
+		return NULL;
+	entry->ctime = be32(p);
+	entry->mtime = be32(p + 8);
+	entry->ino = be32(p + 20);
+	entry->mode = be32(p + 24);
+	entry->uid = be32(p + 28);
+	entry->gid = be32(p + 32);
+	entry->size = be32(p + 36);
+	entry->oid = p + 40;
+	entry->flags = be16(p + 40 + repo->oid_size);
+	entry->ext_flags = 0;
+	if (index->version >= 3 && (entry->flags & GIT_INDEX_EXTENDED)) {
+		if ((size_t)(end - p) < fixed + 2)
+			return NULL;
+		entry->ext_flags = be16(p + fixed);
+		fixed += 2;
+	}
+	name = p + fixed;
+
+	if (index->version < 4) {
+		if (!(nul = memchr(name, 0, end - name))
+				|| nul - name >= PATH_MAX)
+			return NULL;
+		memcpy(entry->name, name, nul - name + 1);
+		// NUL padded to a multiple of 8
+		return p + ((fixed + (nul - name) + 8) & ~(size_t)7);
+	}
+
+	// Version 4: how much of the previous name to drop, then the rest
+	do {
+		if (name == end)
+			return NULL;
+		c = *name++;
+		strip = (strip << 7) | (c & 127);
+		if (c & 128)
+			strip++;
+	} while (c & 128);
+	keep = strlen(entry->name);
+	if (strip > keep || !(nul = memchr(name, 0, end - name))
+			|| (len = keep - strip) + (nul - name) >= PATH_MAX)
+		return NULL;
+	memcpy(entry->name + len, name, nul - name + 1);
+	return nul + 1;
+}
+
+/**
+ * @brief Finds where the entries of the index end
+ *
+ * @param[in] repo The repository
+ * @param[in,out] index The index, whose extensions get set
+ * @return false if the index is corrupt
+ */
+static bool index_skip_entries(const struct git_repo* repo,
+	struct git_index* index)
+{
+	struct git_entry* entry;
+	const uint8_t* p = index->data + 12;
+
+	if (!(entry = malloc(sizeof(*entry))))
+		return false;
+	*entry->name = 0;
+	for (uint32_t i = 0; p && i < index->entries; i++)
+		p = index_entry(repo, index, p, entry);
+	free(entry);
+	index->extensions = p;
+	return p;
+}
+
+/**
+ * @brief Finds an extension of the index
+ *
+ * @param[in] repo The repository
+ * @param[in] index The index, past index_skip_entries
+ * @param[in] signature The extension's signature
+ * @param[out] size Its size
+ * @return Its data, NULL if the index has none
+ */
+static const uint8_t* index_extension(const struct git_repo* repo,
+	const struct git_index* index, const char* signature, uint32_t* size)
+{
+	const uint8_t* end = index->data + index->size - repo->oid_size;
+	const uint8_t* p = index->extensions;
+
+	while (p && end - p >= 8) {
+		*size = be32(p + 4);
+		if (*size > end - p - 8)
+			return NULL;
+		if (!memcmp(p, signature, 4))
+			return p + 8;
+		p += 8 + *size;
+	}
+	return NULL;
+}
+
+/* SHA-1 and SHA-256, for comparing a file with its blob in the index. Both
+ * pad and store the same way and only differ in their state and blocks. */
+
+struct sha {
+	uint32_t h[8];
+	int words; // Of h, 5 for SHA-1 or 8 for SHA-256
+	void (*block)(struct sha* ctx, const uint8_t* p);
+	uint64_t len;
+	uint8_t block_data[64];
+};
+
+#define ROL(x, n) ((x) << (n) | (x) >> (32 - (n)))
+
+static void sha1_block(struct sha* ctx, const uint8_t* p)
+{
+	uint32_t w[80], a, b, c, d, e, f, k, t;
+
+	for (int i = 0; i < 16; i++)
+		w[i] = be32(p + 4 * i);
+	for (int i = 16; i < 80; i++)
+		w[i] = ROL(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+
+	a = ctx->h[0];
+	b = ctx->h[1];
+	c = ctx->h[2];
+	d = ctx->h[3];
+	e = ctx->h[4];
+	for (int i = 0; i < 80; i++) {
+		if (i < 20) {
+			f = (b & c) | (~b & d);
+			k = 0x5a827999;
+		} else if (i < 40) {
+			f = b ^ c ^ d;
+			k = 0x6ed9eba1;
+		} else if (i < 60) {
+			f = (b & c) | (b & d) | (c & d);
+			k = 0x8f1bbcdc;
+		} else {
+			f = b ^ c ^ d;
+			k = 0xca62c1d6;
+		}
+		t = ROL(a, 5) + f + e + k + w[i];
+		e = d;
+		d = c;
+		c = ROL(b, 30);
+		b = a;
+		a = t;
+	}
+	ctx->h[0] += a;
+	ctx->h[1] += b;
+	ctx->h[2] += c;
+	ctx->h[3] += d;
+	ctx->h[4] += e;
+}
+
+#define ROR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(struct sha* ctx, const uint8_t* p)
+{
+	static const uint32_t k[64] = {
+		0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1,
+		0x923f82a4, 0xab1c5ed5, 0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+		0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174, 0xe49b69c1, 0xefbe4786,
+		0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+		0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147,
+		0x06ca6351, 0x14292967, 0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+		0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85, 0xa2bfe8a1, 0xa81a664b,
+		0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+		0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a,
+		0x5b9cca4f, 0x682e6ff3, 0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+		0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+	};
+	uint32_t w[64], v[8], s0, s1, t1, t2;
+
+	for (int i = 0; i < 16; i++)
+		w[i] = be32(p + 4 * i);
+	for (int i = 16; i < 64; i++) {
+		s0 = ROR(w[i - 15], 7) ^ ROR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+		s1 = ROR(w[i - 2], 17) ^ ROR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+		w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+	}
+
+	memcpy(v, ctx->h, sizeof(v));
+	for (int i = 0; i < 64; i++) {
+		s1 = ROR(v[4], 6) ^ ROR(v[4], 11) ^ ROR(v[4], 25);
+		t1 = v[7] + s1 + ((v[4] & v[5]) ^ (~v[4] & v[6])) + k[i] + w[i];
+		s0 = ROR(v[0], 2) ^ ROR(v[0], 13) ^ ROR(v[0], 22);
+		t2 = s0 + ((v[0] & v[1]) ^ (v[0] & v[2]) ^ (v[1] & v[2]));
+		memmove(v + 1, v, 7 * sizeof(*v));
+		v[4] += t1;
+		v[0] = t1 + t2;
+	}
+	for (int i = 0; i < 8; i++)
+		ctx->h[i] += v[i];
+}
+
+/**
+ * @brief Starts a hash
+ *
+ * @param[out] ctx The hash
+ * @param[in] oid_size 20 for SHA-1, 32 for SHA-256
+ */
+static void sha_init(struct sha* ctx, int oid_size)
+{
+	static const uint32_t h1[5] = {
+		0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+	};
+	static const uint32_t h256[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+		0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+	};
+
+	if (oid_size == 32) {
+		memcpy(ctx->h, h256, sizeof(h256));
+		ctx->words = 8;
+		ctx->block = sha256_block;
+	} else {
+		memcpy(ctx->h, h1, sizeof(h1));
+		ctx->words = 5;
+		ctx->block = sha1_block;
+	}
+	ctx->len = 0;
+}
+
+static void sha_update(struct sha* ctx, const void* data, size_t len)
+{
+	const uint8_t* p = data;
+	size_t used = ctx->len % 64, take;
+
+	ctx->len += len;
+	while (len) {
+		take = 64 - used < len ? 64 - used : len;
+		memcpy(ctx->block_data + used, p, take);
+		used += take;
+		p += take;
+		len -= take;
+		if (used == 64) {
+			ctx->block(ctx, ctx->block_data);
+			used = 0;
+		}
+	}
+}
+
+/**
+ * @brief Finishes a hash
+ *
+ * @param[in] ctx The hash
+ * @param[out] out The digest, of the oid_size given to sha_init
+ */
+static void sha_final(struct sha* ctx, uint8_t* out)
+{
+	uint64_t bits = ctx->len * 8;
+	uint8_t pad = 0x80, length[8];
+
+	sha_update(ctx, &pad, 1);
+	pad = 0;
+	while (ctx->len % 64 != 56)
+		sha_update(ctx, &pad, 1);
+	for (int i = 0; i < 8; i++)
+		length[i] = bits >> (56 - 8 * i);
+	sha_update(ctx, length, 8);
+	for (int i = 0; i < ctx->words; i++) {
+		out[4 * i] = ctx->h[i] >> 24;
+		out[4 * i + 1] = ctx->h[i] >> 16;
+		out[4 * i + 2] = ctx->h[i] >> 8;
+		out[4 * i + 3] = ctx->h[i];
+	}
+}
+
+/**
+ * @brief Whether a file has the contents of a blob
+ *
+ * Files are hashed as they are: a repository with clean or smudge filters,
+ * or autocrlf, shows files it would convert as changed.
+ *
+ * @param[in] path The file
+ * @param[in] st Its lstat
+ * @param[in] oid The object id of the blob
+ * @param[in] oid_size Its size, which picks the hash
+ */
+static bool same_blob(const char* path, const struct stat* st,
+	const uint8_t* oid, int oid_size)
+{
+	char header[32], buf[PATH_MAX];
+	uint8_t sum[32];
+	struct sha ctx;
+	ssize_t got;
+	int fd, len;
+
+	if (st->st_size > GIT_HASH_MAX)
+		return false;
+	sha_init(&ctx, oid_size);
+	len = snprintf(header, sizeof(header), "blob %lld", (long long)st->st_size);
+	sha_update(&ctx, header, len + 1);
+
+	if (S_ISLNK(st->st_mode)) {
+		if ((got = readlink(path, buf, sizeof(buf))) != st->st_size)
+			return false;
+		sha_update(&ctx, buf, got);
+	} else {
+		if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			return false;
+		while ((got = read(fd, buf, sizeof(buf)))) {
+			if (got == -1 && errno == EINTR)
+				continue;
+			if (got == -1) {
+				close(fd);
+				return false;
+			}
+			sha_update(&ctx, buf, got);
+		}
+		close(fd);
+	}
+	sha_final(&ctx, sum);
+	return !memcmp(sum, oid, oid_size);
+}
+
+/**
+ * @brief Whether a file in the work tree differs from its index entry
+ *
+ * @param[in] repo The repository
+ * @param[in] index The index
+ * @param[in] entry The entry
+ */
+static bool entry_changed(const struct git_repo* repo,
+	const struct git_index* index, const struct git_entry* entry)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	uint32_t type = entry->mode & GIT_MODE_TYPE;
+
+	if (!join(repo->root, entry->name, path) || lstat(path, &st) == -1)
+		return true;
+	if (type == GIT_MODE_LINK ? !S_ISLNK(st.st_mode) : !S_ISREG(st.st_mode))
+		return true;
+	if (type != GIT_MODE_LINK && repo->config.filemode
+			&& !(entry->mode & 0100) != !(st.st_mode & 0100))
+		return true;
+	// A size of 0 can be git smudging an entry it wasn't sure about
+	if (entry->size != (uint32_t)st.st_size && entry->size)
+		return true;
+
+	// Like git without USE_NSEC, times are compared to the second
+	if (entry->mtime == (uint32_t)st.st_mtime
+			&& (entry->ctime == (uint32_t)st.st_ctime
+				|| !repo->config.trustctime
+				|| repo->config.checkstat_minimal)
+			&& (repo->config.checkstat_minimal
+				|| (entry->ino == (uint32_t)st.st_ino
+				&& entry->uid == (uint32_t)st.st_uid
+				&& entry->gid == (uint32_t)st.st_gid))
+			&& entry->size == (uint32_t)st.st_size
+			// Racily clean: changed in the second the index was written
+			&& entry->mtime < (uint32_t)index->st.st_mtime)
+		return false;
+	return !same_blob(path, &st, entry->oid, repo->oid_size);
+}
+
+int git_unstaged(const struct git_repo* repo)
+{
+	struct git_index index;
+	struct git_entry* entry;
+	const uint8_t* p;
+	uint32_t size;
+	int changed = 0;
+
+	if (!index_open(repo, &index))
+		return -1;
+	// A split index only has the entries that changed since its base
+	if (!index_skip_entries(repo, &index)
+			|| index_extension(repo, &index, "link", &size)
+			|| !(entry = malloc(sizeof(*entry)))) {
+		index_close(&index);
+		return -1;
+	}
+
+	*entry->name = 0;
+	p = index.data + 12;
+	for (uint32_t i = 0; !changed && i < index.entries; i++) {
+		p = index_entry(repo, &index, p, entry);
+		if ((entry->flags & GIT_INDEX_STAGE)
+				|| (entry->ext_flags & GIT_INDEX_INTENT_TO_ADD))
+			changed = 1;
+		else if (!(entry->flags & GIT_INDEX_ASSUME_VALID)
+				&& !(entry->ext_flags & GIT_INDEX_SKIP_WORKTREE)
+				&& (entry->mode & GIT_MODE_TYPE) != GIT_MODE_GITLINK)
+			changed = entry_changed(repo, &index, entry);
+	}
+	free(entry);
+	index_close(&index);
+	return changed;
+}
+
+/* Comparing the index with HEAD, for when the root of the cache tree is
+ * invalid. HEAD's trees are walked in the order of the index entries, and
+ * the directories the cache tree still knows the tree of are skipped. */
+
+struct staged_walk {
+	const struct git_repo* repo;
+	const struct git_index* index;
+	const uint8_t* p; // Where the next entry starts
+	uint32_t left; // How many entries from p on
+	struct git_entry* entry; // The current entry
+	bool have_entry; // Whether entry was read from p
+	int trees; // Read so far
+	char path[PATH_MAX]; // Of the tree walked
+};
+
+/**
+ * @brief Gets the current entry of the index, skipping intent to add ones
+ *
+ * @param[in,out] walk The walk
+ * @param[out] entry The entry, NULL past the last one
+ * @return false if the index is corrupt
+ */
+static bool walk_entry(struct staged_walk* walk, struct git_entry** entry)
+{
+	*entry = NULL;
+	while (!walk->have_entry && walk->left) {
+		if (!(walk->p = index_entry(walk->repo, walk->index, walk->p,
+				walk->entry)))
+			return false;
+		walk->left--;
+		// Not in the index yet as far as git diff --cached is concerned
+		walk->have_entry = !(walk->entry->ext_flags
+			& GIT_INDEX_INTENT_TO_ADD);
+	}
+	if (walk->have_entry)
+		*entry = walk->entry;
+	return true;
+}
+
+/**
+ * @brief Parses the node of the cache tree at a position
+ *
+ * "<name>", NUL, "<entries> <subtrees>\n", then the tree unless entries is
+ * -1, then the subtrees one after the other.
+ *
+ * @param[in] repo The repository
+ * @param[in] p Where the node starts
+ * @param[in] end Where the extension ends
+ * @param[out] entries Its entry count, -1 if invalid
+ * @param[out] subtrees How many subtrees it has
+ * @param[out] oid Its tree, NULL if invalid
+ * @return Where its first subtree starts, NULL if it is corrupt
+ */
+static const uint8_t* cache_tree_node(const struct git_repo* repo,
+	const uint8_t* p, const uint8_t* end, long* entries, long* subtrees,
+	const uint8_t** oid)
+{
+	char* num_end;
+	const uint8_t* nul, *eol;
+
+	if (!(nul = memchr(p, 0, end - p))
+			|| !(eol = memchr(nul + 1, '\n', end - nul - 1)))
+		return NULL;
+	*entries = strtol((const char*)nul + 1, &num_end, 10);
+	if (*num_end != ' ')
+		return NULL;
+	*subtrees = strtol(num_end + 1, &num_end, 10);
+	if ((const uint8_t*)num_end != eol || *subtrees < 0)
+		return NULL;
+	*oid = NULL;
+	if (*entries < 0)
+		return eol + 1;
+	if (end - eol - 1 < repo->oid_size)
+		return NULL;
+	*oid = eol + 1;
+	return eol + 1 + repo->oid_size;
+}
+
+/**
+ * @brief Skips a node of the cache tree and all of its subtrees
+ *
+ * @param[in] repo The repository
+ * @param[in] p Where the node starts
+ * @param[in] end Where the extension ends
+ * @param[in] depth How deep the node is
+ * @return Where the node after it starts, NULL if it is corrupt
+ */
+static const uint8_t* cache_tree_skip(const struct git_repo* repo,
+	const uint8_t* p, const uint8_t* end, int depth)
+{
+	const uint8_t* oid;
+	long entries, subtrees;
+
+	if (depth > PATH_MAX / 2
+			|| !(p = cache_tree_node(repo, p, end, &entries, &subtrees, &oid)))
+		return NULL;
+	for (long i = 0; p && i < subtrees; i++)
+		p = cache_tree_skip(repo, p, end, depth + 1);
+	return p;
+}
+
+/**
+ * @brief Finds the subtree of a node of the cache tree with a name
+ *
+ * @param[in] repo The repository
+ * @param[in] node The node, NULL if there is none
+ * @param[in] end Where the extension ends
+ * @param[in] name The name of the subtree
+ * @param[in] len Its length
+ * @return Where the subtree starts, NULL if there is none
+ */
+static const uint8_t* cache_tree_child(const struct git_repo* repo,
+	const uint8_t* node, const uint8_t* end, const char* name, size_t len)
+{
+	const uint8_t* oid, *p;
+	long entries, subtrees;
+
+	if (!node || !(p = cache_tree_node(repo, node, end, &entries, &subtrees,
+			&oid)))
+		return NULL;
+	for (long i = 0; p && i < subtrees; i++) {
+		if ((size_t)(end - p) > len && !memcmp(p, name, len) && !p[len])
+			return p;
+		p = cache_tree_skip(repo, p, end, 0);
+	}
+	return NULL;
+}
+
+/**
+ * @brief Compares the index entries under a directory with its tree
+ *
+ * @param[in,out] walk The walk, at the first entry under walk->path
+ * @param[in] oid The tree of the directory in HEAD
+ * @param[in] len The length of walk->path, "" or ending with a slash
+ * @param[in] node The node of the directory in the cache tree, NULL if none
+ * @param[in] end Where the cache tree ends
+ * @return 1 if they differ, 0 if not, -1 if we can't tell
+ */
+static int walk_tree(struct staged_walk* walk, const uint8_t* oid,
+	size_t len, const uint8_t* node, const uint8_t* end)
+{
+	const uint8_t* p, *next, *tree_end, *name, *nul, *child, *known;
+	uint8_t* tree;
+	struct git_entry* entry;
+	uint32_t mode;
+	long entries, subtrees;
+	size_t tree_len, name_len;
+	int result = 0;
+
+	if (++walk->trees > GIT_STAGED_TREES_MAX
+			|| !(tree = git_read_tree(walk->repo, oid, &tree_len)))
+		return -1;
+	tree_end = tree + tree_len;
+	for (p = tree; !result && p < tree_end; p = next) {
+		// "<octal mode> <name>", NUL, then its object id
+		for (mode = 0; p < tree_end && *p >= '0' && *p <= '7'; p++)
+			mode = mode << 3 | (*p - '0');
+		if (p == tree_end || *p++ != ' '
+				|| !(nul = memchr(p, 0, tree_end - p))
+				|| tree_end - nul - 1 < walk->repo->oid_size
+				|| (name_len = nul - p) + len + 2 > PATH_MAX) {
+			result = -1;
+			break;
+		}
+		name = p;
+		next = nul + 1 + walk->repo->oid_size;
+		memcpy(walk->path + len, name, name_len);
+		walk->path[len + name_len] = 0;
+		if (!walk_entry(walk, &entry)) {
+			result = -1;
+			break;
+		}
+
+		if ((mode & GIT_MODE_TYPE) != GIT_MODE_TREE) {
+			// Trees may have legacy modes, the index has the normalized one
+			if ((mode & GIT_MODE_TYPE) == 0100000)
+				mode = mode & 0100 ? 0100755 : 0100644;
+			result = !entry || strcmp(entry->name, walk->path)
+				|| (entry->flags & GIT_INDEX_STAGE) || entry->mode != mode
+				|| memcmp(entry->oid, nul + 1, walk->repo->oid_size);
+			walk->have_entry = false;
+			continue;
+		}
+
+		walk->path[len + name_len] = '/';
+		walk->path[len + name_len + 1] = 0;
+		child = cache_tree_child(walk->repo, node, end, (const char*)name,
+			name_len);
+		if (entry && (entry->mode & GIT_MODE_TYPE) == GIT_MODE_TREE
+				&& !strcmp(entry->name, walk->path)) {
+			// A directory left out of a sparse index
+			result = !!memcmp(entry->oid, nul + 1, walk->repo->oid_size);
+			walk->have_entry = false;
+		} else if (child && cache_tree_node(walk->repo, child, end, &entries,
+				&subtrees, &known) && known
+				&& !memcmp(known, nul + 1, walk->repo->oid_size)) {
+			// Still the tree of HEAD: skip everything under it
+			while (!result && entry && !strncmp(entry->name, walk->path,
+					len + name_len + 1)) {
+				result = entry->flags & GIT_INDEX_STAGE ? 1 : 0;
+				walk->have_entry = false;
+				if (!walk_entry(walk, &entry))
+					result = -1;
+			}
+		} else {
+			result = walk_tree(walk, nul + 1, len + name_len + 1, child, end);
+		}
+	}
+	free(tree);
+	return result;
+}
+
+/**
+ * @brief Compares the index with the tree of HEAD, entry by entry
+ *
+ * @param[in] repo The repository
+ * @param[in] index The index, past index_skip_entries
+ * @param[in] tree The cache tree extension, NULL if there is none
+ * @param[in] size Its size
+ * @return 1 if they differ, 0 if not, -1 if we can't tell
+ */
+static int index_differs(const struct git_repo* repo,
+	const struct git_index* index, const uint8_t* tree, uint32_t size)
+{
+	struct staged_walk walk = {
+		.repo = repo,
+		.index = index,
+		.p = index->data + 12,
+		.left = index->entries,
+	};
+	struct git_entry* entry;
+	struct git_commit commit;
+	struct git_head head;
+	uint32_t link_size;
+	int result = 0;
+
+	// A split index only has the entries that changed since its base
+	if (index_extension(repo, index, "link", &link_size)
+			|| !git_read_head(repo, &head)
+			|| !(walk.entry = malloc(sizeof(*walk.entry))))
+		return -1;
+	*walk.entry->name = 0;
+	*walk.path = 0;
+	if (!head.unborn) {
+		if (git_read_commit(repo, head.oid, &commit))
+			result = walk_tree(&walk, commit.tree, 0, tree,
+				tree ? tree + size : NULL);
+		else
+			result = -1;
+	}
+	// Anything left isn't in HEAD
+	if (!result)
+		result = !walk_entry(&walk, &entry) ? -1 : entry != NULL;
+	free(walk.entry);
+	return result;
+}
+
+int git_staged(const struct git_repo* repo)
+{
+	uint8_t root[GIT_OID_MAX];
+	struct git_commit commit;
+	struct git_index index;
+	struct git_head head;
+	const uint8_t* tree = NULL, *eol;
+	bool have_root = false, empty = false;
+	uint32_t size = 0;
+	int staged = -1;
+
+	if (!index_open(repo, &index))
+		return -1;
+	if (!index_skip_entries(repo, &index)) {
+		index_close(&index);
+		return -1;
+	}
+	// The root of the cache tree: "", NUL, its entry count, -1 once
+	// something under it was staged, its subtree count, then its tree
+	if ((tree = index_extension(repo, &index, "TREE", &size))
+			&& size >= 3 && !tree[0] && tree[1] != '-') {
+		empty = tree[1] == '0' && tree[2] == ' ';
+		if ((eol = memchr(tree, '\n', size))
+				&& tree + size - eol > repo->oid_size) {
+			memcpy(root, eol + 1, repo->oid_size);
+			have_root = true;
+		}
+	}
+	// Staging something invalidates the root, and so does unstaging it
+	if (!have_root)
+		staged = index_differs(repo, &index, tree, size);
+	index_close(&index);
+
+	// Still valid, but written for another tree than HEAD's, as after a
+	// reset --soft
+	if (have_root && git_read_head(repo, &head)) {
+		if (head.unborn)
+			staged = !empty;
+		else if (git_read_commit(repo, head.oid, &commit))
+			staged = memcmp(root, commit.tree, repo->oid_size) != 0;
+	}
+	return staged;
+}
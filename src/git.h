@@ -0,0 +1,123 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_GIT_H
+#define CPROMPT_GIT_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <limits.h>
+#include "gitconfig.h"
+
+/* Git
+ *
+ * What the prompt shows about a git repository is read from the files in
+ * .git directly, never by running git: HEAD and the refs for the branch, the
+ * marker files of a rebase or merge for the action, and the index for what
+ * changed.
+ */
+
+// Size of an object id, SHA-1 or SHA-256
+#define GIT_OID_MAX 32
+// Longest ref name we handle, refs/heads/ included
+#define GIT_REF_MAX 256
+
+struct git_repo {
+	char root[PATH_MAX]; // The work tree
+	char gitdir[PATH_MAX]; // Its .git, or the worktree's directory in there
+	char commondir[PATH_MAX]; // Where refs and objects live
+	int oid_size; // 20 for SHA-1, 32 for SHA-256
+	struct git_config config;
+};
+
+struct git_head {
+	char ref[GIT_REF_MAX]; // What HEAD points at, "" when detached
+	uint8_t oid[GIT_OID_MAX]; // The commit, all zeroes if unborn
+	bool unborn; // The branch has no commit yet
+};
+
+/**
+ * @brief Finds the repository of a directory
+ *
+ * Its config is read too, see gitconfig.h.
+ *
+ * @param[out] repo The repository to populate
+ * @param[in] dir An absolute directory
+ * @return false if the directory is not in a repository
+ */
+bool git_open(struct git_repo* repo, const char* dir);
+
+/**
+ * @brief Reads HEAD, following it to a commit
+ *
+ * @param[in] repo The repository
+ * @param[out] head What HEAD is
+ * @return false if HEAD is unreadable
+ */
+bool git_read_head(const struct git_repo* repo, struct git_head* head);
+
+/**
+ * @brief Resolves a ref to an object id, loose or packed
+ *
+ * @param[in] repo The repository
+ * @param[in] ref A full ref name, like refs/heads/main
+ * @param[out] oid The object id
+ * @return false if the ref doesn't exist
+ */
+bool git_resolve_ref(const struct git_repo* repo, const char* ref,
+	uint8_t oid[GIT_OID_MAX]);
+
+/**
+ * @brief Gets what is in progress in the repository, named like vcs_info
+ *
+ * @param[in] repo The repository
+ * @return rebase-i, merge, cherry... or NULL if nothing is
+ */
+const char* git_action(const struct git_repo* repo);
+
+/**
+ * @brief Whether the work tree differs from the index, like git diff --quiet
+ *
+ * Files are compared by stat data first, and only hashed when that can't
+ * tell (same size, different times, or modified as the index was written).
+ *
+ * @param[in] repo The repository
+ * @return 1 if it does, 0 if not, -1 if the index can't be read
+ */
+int git_unstaged(const struct git_repo* repo);
+
+/**
+ * @brief Whether the index differs from HEAD, like git diff --cached --quiet
+ *
+ * Answered from the cache tree of the index when its root is valid, by
+ * comparing it with the tree of HEAD's commit. Staging or unstaging any path
+ * invalidates the root: then the entries are compared with HEAD's trees,
+ * skipping the directories whose tree the cache tree still knows.
+ *
+ * @param[in] repo The repository
+ * @return 1 if it does, 0 if not, -1 if the index can't tell
+ */
+int git_staged(const struct git_repo* repo);
+
+/**
+ * @brief Parses hex into an object id
+ *
+ * @param[in] hex The hex, at least 2 * size digits
+ * @param[in] size The size of the object id
+ * @param[out] oid The object id
+ * @return false if it isn't hex
+ */
+bool git_oid_parse(const char* hex, int size, uint8_t oid[GIT_OID_MAX]);
+
+/**
+ * @brief Formats an object id in hex
+ *
+ * @param[in] repo The repository, for the size of its ids
+ * @param[in] oid The object id
+ * @param[out] hex The hex, NUL terminated
+ */
+void git_oid_hex(const struct git_repo* repo, const uint8_t oid[GIT_OID_MAX],
+	char hex[2 * GIT_OID_MAX + 1]);
+
+#endif
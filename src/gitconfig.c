@@ -0,0 +1,612 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+#include <errno.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "env.h"
+#include "gitconfig.h"
+
+// Where git was built to look for the system config
+#ifndef GITCONFIG_SYSTEM
+#define GITCONFIG_SYSTEM "/etc/gitconfig"
+#endif
+
+#define GITCONFIG_MAGIC 0x47434632 // GCF2
+#define GITCONFIG_SLOTS 32
+// Files a cached config can depend on, and room for their paths
+#define GITCONFIG_FILES_MAX 16
+#define GITCONFIG_PATHS_SIZE 2048
+// git's own limit on nested includes
+#define GITCONFIG_DEPTH_MAX 10
+// Bigger config files are not read
+#define GITCONFIG_FILE_MAX (1024 * 1024)
+#define GITCONFIG_KEY_MAX 64
+
+// A file as it was when the config was read, all zeroes if it didn't exist
+struct gitconfig_stamp {
+	uint64_t dev;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+};
+
+struct gitconfig_record {
+	uint64_t key;
+	uint32_t files;
+	struct gitconfig_stamp stamps[GITCONFIG_FILES_MAX];
+	char paths[GITCONFIG_PATHS_SIZE]; // One after the other, NUL terminated
+	struct git_config config;
+};
+
+// A load in progress
+struct gitconfig_load {
+	struct gitconfig_record record; // With the files looked at so far
+	size_t paths_len;
+	bool cacheable; // Every file fit in the record
+	const char* gitdir;
+	const char* branch;
+};
+
+static void stamp_of(struct gitconfig_stamp* stamp, const struct stat* st)
+{
+	memset(stamp, 0, sizeof(*stamp));
+	if (!st)
+		return;
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->size = st->st_size;
+	stamp->mtime_sec = st->st_mtime;
+	stamp->mtime_nsec = ST_MTIM_NSEC(*st);
+}
+
+/**
+ * @brief Remembers a file the config depends on
+ *
+ * @param[in,out] load The load
+ * @param[in] path The file
+ * @param[in] st Its stat, NULL if it doesn't exist
+ */
+static void depend_on(struct gitconfig_load* load, const char* path,
+	const struct stat* st)
+{
+	struct gitconfig_record* record = &load->record;
+	size_t len = strlen(path) + 1;
+
+	if (record->files == GITCONFIG_FILES_MAX
+			|| load->paths_len + len > GITCONFIG_PATHS_SIZE) {
+		load->cacheable = false;
+		return;
+	}
+	stamp_of(&record->stamps[record->files++], st);
+	memcpy(record->paths + load->paths_len, path, len);
+	load->paths_len += len;
+}
+
+/**
+ * @brief Whether none of the files a cached config depends on changed
+ *
+ * @param[in] record The cached config
+ */
+static bool still_valid(const struct gitconfig_record* record)
+{
+	struct gitconfig_stamp stamp;
+	const char* path = record->paths, *end = record->paths
+		+ GITCONFIG_PATHS_SIZE;
+	struct stat st;
+
+	if (record->files > GITCONFIG_FILES_MAX)
+		return false;
+	for (uint32_t i = 0; i < record->files; i++) {
+		if (!memchr(path, 0, end - path))
+			return false;
+		stamp_of(&stamp, stat(path, &st) == 0 ? &st : NULL);
+		if (memcmp(&stamp, &record->stamps[i], sizeof(stamp)))
+			return false;
+		path += strlen(path) + 1;
+	}
+	return true;
+}
+
+/**
+ * @brief Parses a boolean the way git does
+ *
+ * @param[in] value The value, NULL for a key without =, which means true
+ */
+static bool parse_bool(const char* value)
+{
+	if (!value)
+		return true;
+	if (!strcasecmp(value, "true") || !strcasecmp(value, "yes")
+			|| !strcasecmp(value, "on"))
+		return true;
+	if (!*value || !strcasecmp(value, "false") || !strcasecmp(value, "no")
+			|| !strcasecmp(value, "off"))
+		return false;
+	return strtol(value, NULL, 0) != 0;
+}
+
+/**
+ * @brief Matches a path against a pattern, like git's wildmatch for paths
+ *
+ * * and ? don't match a /, ** matches anything, and ** then a / matches
+ * no directory at all too.
+ *
+ * @param[in] pat The pattern
+ * @param[in] s The path
+ * @param[in] fold Whether to ignore case
+ */
+static bool glob_match(const char* pat, const char* s, bool fold)
+{
+	bool any, negate, found;
+	const char* class;
+
+	for (; *pat; pat++, s++) {
+		if (*pat == '*') {
+			any = pat[1] == '*';
+			while (*pat == '*')
+				pat++;
+			if (any && *pat == '/' && glob_match(pat + 1, s, fold))
+				return true;
+			for (;; s++) {
+				if (glob_match(pat, s, fold))
+					return true;
+				if (!*s || (!any && *s == '/'))
+					return false;
+			}
+		}
+		if (!*s)
+			return false;
+		if (*pat == '?') {
+			if (*s == '/')
+				return false;
+			continue;
+		}
+		if (*pat == '[' && (class = strchr(pat + 2, ']'))) {
+			negate = pat[1] == '!' || pat[1] == '^';
+			found = false;
+			for (pat += 1 + negate; pat < class; pat++) {
+				if (pat[1] == '-' && pat + 2 < class) {
+					found |= *s >= *pat && *s <= pat[2];
+					pat += 2;
+				} else {
+					found |= fold ? tolower((unsigned char)*pat)
+						== tolower((unsigned char)*s) : *pat == *s;
+				}
+			}
+			if (found == negate || *s == '/')
+				return false;
+			continue;
+		}
+		if (*pat == '\\' && pat[1])
+			pat++;
+		if (fold ? tolower((unsigned char)*pat) != tolower((unsigned char)*s)
+				: *pat != *s)
+			return false;
+	}
+	return !*s;
+}
+
+/**
+ * @brief Turns a path in a config file into an absolute one
+ *
+ * @param[in] from The config file it is in
+ * @param[in] path The path, relative to the file's directory or ~/
+ * @param[out] out The absolute path
+ * @return false if it can't be
+ */
+static bool config_path(const char* from, const char* path, char out[PATH_MAX])
+{
+	const char* home = env_get(ENV_HOME), *slash = strrchr(from, '/');
+	int len;
+
+	if (path[0] == '~' && path[1] == '/') {
+		if (!home)
+			return false;
+		len = snprintf(out, PATH_MAX, "%s%s", home, path + 1);
+	} else if (*path == '/') {
+		len = snprintf(out, PATH_MAX, "%s", path);
+	} else {
+		len = snprintf(out, PATH_MAX, "%.*s/%s", slash ? (int)(slash - from)
+			: 0, from, path);
+	}
+	return len > 0 && len < PATH_MAX;
+}
+
+/**
+ * @brief Evaluates the condition of an includeIf
+ *
+ * @param[in] load The load
+ * @param[in] from The config file the includeIf is in
+ * @param[in] cond The condition, the subsection of includeIf
+ */
+static bool condition_holds(const struct gitconfig_load* load,
+	const char* from, const char* cond)
+{
+	char pattern[PATH_MAX + 8], path[PATH_MAX], real[PATH_MAX];
+	bool fold = false;
+	size_t len;
+
+	if (!strncmp(cond, "onbranch:", 9)) {
+		if (!*load->branch || snprintf(pattern, sizeof(pattern), "%s%s",
+				cond + 9, *cond && cond[strlen(cond) - 1] == '/' ? "**" : "")
+				>= (int)sizeof(pattern))
+			return false;
+		return glob_match(pattern, load->branch, false);
+	}
+	if (!strncmp(cond, "gitdir/i:", 9)) {
+		fold = true;
+		cond += 9;
+	} else if (!strncmp(cond, "gitdir:", 7)) {
+		cond += 7;
+	} else {
+		return false; // hasconfig: and whatever comes next
+	}
+
+	// ~/ and ./ are expanded, anything else relative matches anywhere
+	if ((cond[0] == '~' && cond[1] == '/') || (cond[0] == '.'
+			&& cond[1] == '/')) {
+		if (!config_path(from, cond + (*cond == '.' ? 2 : 0), path))
+			return false;
+	} else if (snprintf(path, PATH_MAX, "%s%s", *cond == '/' ? "" : "**/",
+			cond) >= PATH_MAX) {
+		return false;
+	}
+	len = strlen(path);
+	snprintf(pattern, sizeof(pattern), "%s%s", path,
+		len && path[len - 1] == '/' ? "**" : "");
+	return glob_match(pattern, load->gitdir, fold)
+		|| (realpath(load->gitdir, real)
+			&& glob_match(pattern, real, fold));
+}
+
+static void parse_file(struct gitconfig_load* load, const char* path,
+	int depth);
+
+/**
+ * @brief Takes in one key of a config file
+ *
+ * @param[in,out] load The load
+ * @param[in] from The config file
+ * @param[in] depth How deep in includes the file is
+ * @param[in] section The section, lowercase
+ * @param[in] subsection The subsection, as it was written
+ * @param[in] key The key, lowercase
+ * @param[in] value Its value, NULL if it has no =
+ */
+static void apply(struct gitconfig_load* load, const char* from, int depth,
+	const char* section, const char* subsection, const char* key,
+	const char* value)
+{
+	struct git_config* config = &load->record.config;
+	char path[PATH_MAX];
+
+	if (!strcmp(section, "core") && !*subsection) {
+		if (!strcmp(key, "filemode"))
+			config->filemode = parse_bool(value);
+		else if (!strcmp(key, "trustctime"))
+			config->trustctime = parse_bool(value);
+		else if (!strcmp(key, "checkstat") && value)
+			config->checkstat_minimal = !strcmp(value, "minimal");
+		else if (!strcmp(key, "ignorecase"))
+			config->ignorecase = parse_bool(value);
+	} else if (!strcmp(section, "extensions") && !*subsection) {
+		if (!strcmp(key, "objectformat") && value)
+			config->oid_size = strcasecmp(value, "sha256") ? 20 : 32;
+		else if (!strcmp(key, "worktreeconfig"))
+			config->worktree_config = parse_bool(value);
+		else if (!strcmp(key, "refstorage") && value)
+			config->reftable = !strcmp(value, "reftable");
+	} else if (!strcmp(section, "status") && !*subsection) {
+		if (!strcmp(key, "showuntrackedfiles"))
+			config->untracked = value && !strcmp(value, "all")
+				? GitUntrackedAll : value && (!strcmp(value, "no")
+				|| !parse_bool(value)) ? GitUntrackedNo
+				: GitUntrackedNormal;
+	} else if (!strcmp(section, "branch") && *load->branch
+			&& !strcmp(subsection, load->branch) && value
+			&& strlen(value) < GITCONFIG_NAME_MAX) {
+		if (!strcmp(key, "remote"))
+			strcpy(config->remote, value);
+		else if (!strcmp(key, "merge"))
+			strcpy(config->merge, value);
+	} else if (!strcmp(key, "path") && value && *value
+			&& ((!strcmp(section, "include") && !*subsection)
+			|| (!strcmp(section, "includeif")
+			&& condition_holds(load, from, subsection)))) {
+		if (depth < GITCONFIG_DEPTH_MAX && config_path(from, value, path))
+			parse_file(load, path, depth + 1);
+	}
+}
+
+/**
+ * @brief Reads a value, up to the end of its line
+ *
+ * Quotes and escapes are undone, comments and surrounding blanks dropped,
+ * and a backslash at the end of a line continues the value on the next.
+ *
+ * @param[in] p Just after the =
+ * @param[in] end The end of the file
+ * @param[out] value The value
+ * @return Where the next line starts
+ */
+static const char* parse_value(const char* p, const char* end,
+	char value[PATH_MAX])
+{
+	size_t len = 0, kept = 0;
+	bool quoted = false;
+	char c;
+
+	while (p < end && (*p == ' ' || *p == '\t'))
+		p++;
+	while (p < end && (c = *p++) != '\n') {
+		if (!quoted && (c == '#' || c == ';')) {
+			while (p < end && *p++ != '\n');
+			break;
+		}
+		if (c == '"') {
+			quoted = !quoted;
+			kept = len;
+			continue;
+		}
+		if (c == '\\' && p < end) {
+			c = *p++;
+			if (c == '\n')
+				continue;
+			c = c == 'n' ? '\n' : c == 't' ? '\t' : c == 'b' ? '\b' : c;
+		} else if (!quoted && (c == ' ' || c == '\t' || c == '\r')) {
+			if (len < PATH_MAX - 1)
+				value[len++] = c;
+			continue;
+		}
+		if (len < PATH_MAX - 1)
+			value[len++] = c;
+		kept = len;
+	}
+	value[kept] = 0;
+	return p;
+}
+
+/**
+ * @brief Reads a section header, after its [
+ *
+ * Either [section "subsection"] or the old [section.subsection].
+ *
+ * @param[in] p Just after the [
+ * @param[in] end The end of the file
+ * @param[out] section The section, lowercase, "" if the header is invalid
+ * @param[out] subsection The subsection, "" if there is none
+ * @return Where the header ends
+ */
+static const char* parse_section(const char* p, const char* end,
+	char section[GITCONFIG_KEY_MAX], char subsection[GITCONFIG_NAME_MAX])
+{
+	size_t len = 0, sub_len = 0;
+	bool dotted = false;
+
+	*section = *subsection = 0;
+	for (; p < end && (isalnum((unsigned char)*p) || *p == '-' || *p == '.');
+			p++) {
+		if (*p == '.' && !dotted) {
+			dotted = true;
+			continue;
+		}
+		if (dotted && sub_len < GITCONFIG_NAME_MAX - 1)
+			subsection[sub_len++] = tolower((unsigned char)*p);
+		else if (!dotted && len < GITCONFIG_KEY_MAX - 1)
+			section[len++] = tolower((unsigned char)*p);
+	}
+	section[len] = 0;
+	subsection[sub_len] = 0;
+
+	if (!dotted && p < end && (*p == ' ' || *p == '\t')) {
+		while (p < end && (*p == ' ' || *p == '\t'))
+			p++;
+		if (p == end || *p++ != '"') {
+			*section = 0;
+			return p;
+		}
+		while (p < end && *p != '"' && *p != '\n') {
+			if (*p == '\\' && p + 1 < end)
+				p++;
+			if (sub_len < GITCONFIG_NAME_MAX - 1)
+				subsection[sub_len++] = *p;
+			p++;
+		}
+		subsection[sub_len] = 0;
+		if (p < end && *p == '"')
+			p++;
+	}
+	if (p == end || *p != ']')
+		*section = 0;
+	return p < end ? p + 1 : p;
+}
+
+/**
+ * @brief Reads one config file, following its includes
+ *
+ * @param[in,out] load The load
+ * @param[in] path The file, which doesn't have to exist
+ * @param[in] depth How deep in includes it is
+ */
+static void parse_file(struct gitconfig_load* load, const char* path,
+	int depth)
+{
+	char section[GITCONFIG_KEY_MAX] = "", subsection[GITCONFIG_NAME_MAX] = "";
+	char key[GITCONFIG_KEY_MAX], value[PATH_MAX];
+	const char* p, *end;
+	struct stat st;
+	ssize_t got, len = 0;
+	char* buf;
+	size_t key_len;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1 || fstat(fd, &st)) {
+		if (fd != -1)
+			close(fd);
+		depend_on(load, path, NULL);
+		return;
+	}
+	depend_on(load, path, &st);
+	if (!S_ISREG(st.st_mode) || st.st_size > GITCONFIG_FILE_MAX
+			|| !(buf = malloc(st.st_size + 1))) {
+		close(fd);
+		return;
+	}
+	while (len < st.st_size && (got = read(fd, buf + len,
+			st.st_size - len))) {
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got == -1)
+			break;
+		len += got;
+	}
+	close(fd);
+
+	for (p = buf, end = buf + len; p < end;) {
+		if (isspace((unsigned char)*p)) {
+			p++;
+		} else if (*p == '[') {
+			p = parse_section(p + 1, end, section, subsection);
+		} else if (!isalpha((unsigned char)*p) || !*section) {
+			// Comments, and whatever we can't make sense of
+			while (p < end && *p++ != '\n');
+		} else {
+			for (key_len = 0; p < end && (isalnum((unsigned char)*p)
+					|| *p == '-'); p++)
+				if (key_len < GITCONFIG_KEY_MAX - 1)
+					key[key_len++] = tolower((unsigned char)*p);
+			key[key_len] = 0;
+			while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+				p++;
+			if (p < end && *p == '=') {
+				p = parse_value(p + 1, end, value);
+				apply(load, path, depth, section, subsection, key, value);
+			} else {
+				while (p < end && *p++ != '\n');
+				apply(load, path, depth, section, subsection, key, NULL);
+			}
+		}
+	}
+	free(buf);
+}
+
+/**
+ * @brief Reads the config files, in the order git does
+ *
+ * @param[in,out] load The load
+ * @param[in] gitdir The git directory of the work tree
+ * @param[in] commondir The git directory holding the repository's config
+ */
+static void load_files(struct gitconfig_load* load, const char* gitdir,
+	const char* commondir)
+{
+	const char* home = env_get(ENV_HOME), *xdg = env_get(ENV_XDG_CONFIG_HOME);
+	const char* global = env_get(ENV_GIT_CONFIG_GLOBAL);
+	const char* nosystem = env_get(ENV_GIT_CONFIG_NOSYSTEM);
+	char path[PATH_MAX];
+
+	if (!nosystem || !parse_bool(nosystem))
+		parse_file(load, GITCONFIG_SYSTEM, 0);
+	if (global) {
+		if (*global)
+			parse_file(load, global, 0);
+	} else {
+		if (xdg && *xdg == '/') {
+			if (snprintf(path, PATH_MAX, "%s/git/config", xdg) < PATH_MAX)
+				parse_file(load, path, 0);
+		} else if (home && snprintf(path, PATH_MAX, "%s/.config/git/config",
+				home) < PATH_MAX) {
+			parse_file(load, path, 0);
+		}
+		if (home && snprintf(path, PATH_MAX, "%s/.gitconfig", home)
+				< PATH_MAX)
+			parse_file(load, path, 0);
+	}
+	if (snprintf(path, PATH_MAX, "%s/config", commondir) < PATH_MAX)
+		parse_file(load, path, 0);
+	if (load->record.config.worktree_config && snprintf(path, PATH_MAX,
+			"%s/config.worktree", gitdir) < PATH_MAX)
+		parse_file(load, path, 0);
+}
+
+/**
+ * @brief Hashes what decides which files a config is read from
+ *
+ * @param[in] gitdir The git directory of the work tree
+ * @param[in] commondir The git directory holding the repository's config
+ * @param[in] branch The checked out branch
+ */
+static uint64_t config_key(const char* gitdir, const char* commondir,
+	const char* branch)
+{
+	static const enum env_var vars[] = {
+		ENV_HOME, ENV_XDG_CONFIG_HOME, ENV_GIT_CONFIG_GLOBAL,
+		ENV_GIT_CONFIG_NOSYSTEM,
+	};
+	const char* value;
+	uint64_t key;
+
+	key = cache_hash(gitdir, strlen(gitdir) + 1, 0);
+	key = cache_hash(commondir, strlen(commondir) + 1, key);
+	key = cache_hash(branch, strlen(branch) + 1, key);
+	for (size_t i = 0; i < sizeof(vars) / sizeof(*vars); i++) {
+		value = env_get(vars[i]);
+		key = cache_hash(value ? value : "", value ? strlen(value) + 1 : 0,
+			key);
+	}
+	return key ? key : 1;
+}
+
+void git_config_load(struct git_config* config, const char* gitdir,
+	const char* commondir, const char* branch)
+{
+	struct gitconfig_record* record;
+	struct gitconfig_load* load;
+	struct cache_table table;
+	bool have_table;
+	uint64_t key = config_key(gitdir, commondir, branch);
+
+	*config = (struct git_config){
+		.oid_size = 20,
+		.filemode = true,
+		.trustctime = true,
+	};
+	have_table = cache_table_open(&table, "gitconfig", GITCONFIG_MAGIC,
+		GITCONFIG_SLOTS, sizeof(struct gitconfig_record));
+	if (have_table && (record = cache_table_find(&table, key, false))
+			&& still_valid(record)) {
+		*config = record->config;
+		cache_table_close(&table);
+		return;
+	}
+
+	if ((load = calloc(1, sizeof(*load)))) {
+		load->record.config = *config;
+		load->cacheable = true;
+		load->gitdir = gitdir;
+		load->branch = branch;
+		load_files(load, gitdir, commondir);
+		*config = load->record.config;
+		if (have_table && load->cacheable
+				&& (record = cache_table_find(&table, key, true))) {
+			load->record.key = key;
+			*record = load->record;
+		}
+		free(load);
+	}
+	if (have_table)
+		cache_table_close(&table);
+}
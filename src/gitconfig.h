@@ -0,0 +1,55 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_GITCONFIG_H
+#define CPROMPT_GITCONFIG_H
+
+#include <stdbool.h>
+
+/* Git config
+ *
+ * The few git settings cprompt needs, read from the same files as git: the
+ * system and global config, the repository's and its worktree's, and what
+ * they include (include.path, and includeIf.<condition>.path when a gitdir:
+ * or onbranch: condition holds, without reading the file otherwise). Only
+ * the keys in struct git_config are kept.
+ *
+ * The result is cached with the stat of every file that was read or looked
+ * for: as long as none of them changed, nothing is parsed again.
+ */
+
+// Longest remote name or upstream ref we keep
+#define GITCONFIG_NAME_MAX 256
+
+enum git_untracked {
+	GitUntrackedNormal,
+	GitUntrackedNo,
+	GitUntrackedAll,
+};
+
+struct git_config {
+	int oid_size; // extensions.objectformat, 20 for sha1 or 32 for sha256
+	bool worktree_config; // extensions.worktreeconfig
+	bool reftable; // extensions.refstorage = reftable
+	bool filemode; // core.filemode
+	bool trustctime; // core.trustctime
+	bool checkstat_minimal; // core.checkstat = minimal
+	bool ignorecase; // core.ignorecase
+	enum git_untracked untracked; // status.showuntrackedfiles
+	char remote[GITCONFIG_NAME_MAX]; // branch.<branch>.remote, "" if none
+	char merge[GITCONFIG_NAME_MAX]; // branch.<branch>.merge, "" if none
+};
+
+/**
+ * @brief Reads the config of a repository
+ *
+ * @param[out] config The config to populate, git's defaults where unset
+ * @param[in] gitdir The git directory of the work tree
+ * @param[in] commondir The git directory holding the repository's config
+ * @param[in] branch The checked out branch without refs/heads/, "" if none
+ */
+void git_config_load(struct git_config* config, const char* gitdir,
+	const char* commondir, const char* branch);
+
+#endif
@@ -0,0 +1,78 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "env.h"
+#include "inputs.h"
+
+uint64_t hash_inputs(const struct element_deps* deps,
+	struct input_snapshot* snap)
+{
+	char host[256];
+	struct stat st;
+	struct timespec now;
+	uint64_t hash = 1, value;
+	const char* env;
+	unsigned missing = deps->inputs & ~snap->have;
+
+	if (missing & InputCwd) {
+		if (stat(".", &st) == 0) {
+			snap->cwd = cache_hash(&st.st_dev, sizeof(st.st_dev), 0);
+			snap->cwd = cache_hash(&st.st_ino, sizeof(st.st_ino), snap->cwd);
+		}
+	}
+	if (missing & InputTime) {
+		clock_gettime(CLOCK_REALTIME, &now);
+		snap->now = now.tv_sec;
+	}
+	if (missing & InputUid) {
+		snap->uid = (uint64_t)render_uid() << 32 | geteuid();
+	}
+	if (missing & InputHost) {
+		if (gethostname(host, sizeof(host)) == 0) {
+			host[sizeof(host) - 1] = 0;
+			snap->host = cache_hash(host, strlen(host), 0);
+		}
+	}
+	if (missing & InputSession) {
+		snap->session = getppid();
+	}
+	snap->have |= missing;
+
+	if (deps->inputs & InputCwd)
+		hash = cache_hash(&snap->cwd, sizeof(snap->cwd), hash);
+	if (deps->inputs & InputTime) {
+		value = snap->now / deps->tick_seconds;
+		hash = cache_hash(&value, sizeof(value), hash);
+	}
+	if (deps->inputs & InputUid)
+		hash = cache_hash(&snap->uid, sizeof(snap->uid), hash);
+	if (deps->inputs & InputHost)
+		hash = cache_hash(&snap->host, sizeof(snap->host), hash);
+	if (deps->inputs & InputSession)
+		hash = cache_hash(&snap->session, sizeof(snap->session), hash);
+	for (int i = 0; (deps->inputs & InputEnv) && deps->env[i] != ENV_COUNT;
+			i++) {
+		// Include the terminator so unset and empty differ
+		env = env_get(deps->env[i]);
+		hash = env ? cache_hash(env, strlen(env) + 1, hash)
+			: cache_hash("", 0, hash + 1);
+	}
+	for (int i = 0; (deps->inputs & InputFiles) && deps->files[i]; i++) {
+		if (stat(deps->files[i], &st) == -1) {
+			hash = cache_hash("", 0, hash + 1);
+			continue;
+		}
+		hash = cache_hash(&st.st_ino, sizeof(st.st_ino), hash);
+		hash = cache_hash(&st.st_size, sizeof(st.st_size), hash);
+		hash = cache_hash(&st.st_mtime, sizeof(st.st_mtime), hash);
+		value = ST_MTIM_NSEC(st);
+		hash = cache_hash(&value, sizeof(value), hash);
+	}
+	return hash;
+}
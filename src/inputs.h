@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_INPUTS_H
+#define CPROMPT_INPUTS_H
+
+#include <stdint.h>
+#include <time.h>
+#include "prompt.h"
+
+/* Element inputs
+ *
+ * Hashes of what an element depends on (see element_deps), used to tell
+ * whether its last rendered value can be reused.
+ */
+
+// The inputs shared by every element, looked at once per update.
+// Zero it before each update.
+struct input_snapshot {
+	unsigned have; // enum element_input flags already looked at
+	uint64_t cwd;
+	uint64_t uid;
+	uint64_t host;
+	uint64_t session;
+	time_t now;
+};
+
+/**
+ * @brief Hashes the inputs of an element
+ *
+ * @param[in] deps What the element depends on
+ * @param[in,out] snap The inputs looked at so far during this update
+ * @return The hash, which only changes if an input changed
+ */
+uint64_t hash_inputs(const struct element_deps* deps,
+	struct input_snapshot* snap);
+
+#endif
@@ -0,0 +1,206 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+#include "config.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "dircache.h"
+#include "latency.h"
+
+#define LATENCY_MAGIC 0x4c415432 // LAT2
+#define LATENCY_SLOTS 256
+// Weight of a new sample in the moving average
+#define LATENCY_ALPHA 0.25
+// How long a refresh may take before someone else gets to start one
+#define LATENCY_CLAIM_MIN_US 1e6
+#define LATENCY_CLAIM_FACTOR 4
+
+// From linux/ioprio.h, which the C library doesn't wrap
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_IDLE 3
+#define IOPRIO_CLASS_SHIFT 13
+
+double latency_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+void latency_background(void)
+{
+#if defined(__linux__) && defined(SCHED_IDLE)
+	struct sched_param param = { 0 };
+
+	// Both only apply to the calling thread
+	sched_setscheduler(0, SCHED_IDLE, &param);
+#ifdef SYS_ioprio_set
+	syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0,
+		IOPRIO_CLASS_IDLE << IOPRIO_CLASS_SHIFT);
+#endif
+#elif defined(__APPLE__)
+	// Throttles both CPU and I/O
+	setpriority(PRIO_DARWIN_THREAD, 0, PRIO_DARWIN_BG);
+#endif
+}
+
+bool latency_fork_refresher(void)
+{
+	int fd;
+
+	fflush(stdout);
+	if (fork() != 0)
+		return false;
+
+	setsid();
+	if ((fd = open("/dev/null", O_RDWR)) != -1) {
+		dup2(fd, STDIN_FILENO);
+		dup2(fd, STDOUT_FILENO);
+		dup2(fd, STDERR_FILENO);
+		if (fd > STDERR_FILENO)
+			close(fd);
+	}
+	latency_background();
+	return true;
+}
+
+bool latency_open(struct latency_model* model,
+	const struct latency_policy* policy, const char* cwd, uid_t uid)
+{
+	char root[PATH_MAX];
+	struct dircache cache;
+	struct stat st;
+	uint64_t dev = 0;
+
+	model->policy = *policy;
+	if (!cache_table_open(&model->table, "latency", LATENCY_MAGIC,
+			LATENCY_SLOTS, sizeof(struct latency_record)))
+		return false;
+
+	// The context is the user, the filesystem and the repository we are in
+	if (stat(cwd, &st) == 0)
+		dev = st.st_dev;
+	dircache_open(&cache);
+	dircache_repo_root(&cache, cwd, root);
+	dircache_close(&cache);
+	model->context = cache_hash(&uid, sizeof(uid), 0);
+	model->context = cache_hash(&dev, sizeof(dev), model->context);
+	model->context = cache_hash(root, strlen(root), model->context);
+	return true;
+}
+
+struct latency_record* latency_lookup(struct latency_model* model, int index,
+	int type)
+{
+	struct latency_record* record;
+	uint64_t key;
+
+	key = cache_hash(&index, sizeof(index), model->context);
+	key = cache_hash(&type, sizeof(type), key);
+	if (!key)
+		key = 1;
+
+	record = cache_table_find(&model->table, key, true);
+	if (record && record->type != (uint32_t)type) {
+		memset(record, 0, sizeof(*record));
+		record->key = key;
+		record->type = type;
+	}
+	return record;
+}
+
+/**
+ * @brief Gets the wall clock, which unlike latency_now_us means the same to
+ * every process and across reboots
+ *
+ * @return Microseconds since the epoch
+ */
+static double wall_now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_REALTIME, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/**
+ * @brief Claims the refresh of an element, unless someone else has it
+ *
+ * @param[in,out] record The record of the element
+ * @return true if the caller should refresh it
+ */
+static bool claim_refresh(struct latency_record* record)
+{
+	double now = wall_now_us(), claim;
+
+	claim = record->ewma_us * LATENCY_CLAIM_FACTOR;
+	claim = claim > LATENCY_CLAIM_MIN_US ? claim : LATENCY_CLAIM_MIN_US;
+	// A claim further away than any we make is from before the clock was
+	// set back: it would hold refreshes off for that long
+	if (record->refreshing_until_us > now
+			&& record->refreshing_until_us <= now + claim)
+		return false;
+	record->refreshing_until_us = now + claim;
+	return true;
+}
+
+enum element_mode latency_mode(const struct latency_model* model,
+	struct latency_record* record, bool* refresh)
+{
+	*refresh = false;
+	if (!record || !record->value_len || record->ewma_us < model->policy.async_us)
+		return ElementSync;
+
+	record->since_probe++;
+	if (record->ewma_us < model->policy.cached_us) {
+		*refresh = claim_refresh(record);
+		return ElementAsync;
+	}
+	// Re-probe once in a while so an element that got fast again recovers
+	if (record->since_probe >= model->policy.reprobe_every)
+		*refresh = claim_refresh(record);
+	return ElementCachedOnly;
+}
+
+void latency_observe(struct latency_record* record, double us,
+	const char* value)
+{
+	size_t len;
+
+	if (record->samples++ == 0)
+		record->ewma_us = us;
+	else
+		record->ewma_us += LATENCY_ALPHA * (us - record->ewma_us);
+	record->since_probe = 0;
+	record->refreshing_until_us = 0;
+
+	if (!value) {
+		record->value_len = 0;
+		return;
+	}
+	len = strnlen(value, LATENCY_VALUE_MAX);
+	if (len == LATENCY_VALUE_MAX) {
+		// Too long to keep, always render it
+		record->value_len = 0;
+		return;
+	}
+	memcpy(record->value, value, len + 1);
+	record->value_len = len;
+}
+
+void latency_close(struct latency_model* model)
+{
+	cache_table_close(&model->table);
+}
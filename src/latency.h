@@ -0,0 +1,135 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_LATENCY_H
+#define CPROMPT_LATENCY_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "cache.h"
+
+/* Latency learning
+ *
+ * Every element that can be slow has its render time tracked as an
+ * exponentially weighted moving average, separately for every context (the
+ * filesystem and repository the prompt is rendered in). Elements that turn
+ * out to be slow stop being rendered in the foreground: their last value is
+ * shown and the real one is computed after the prompt has been printed.
+ */
+
+#define LATENCY_VALUE_MAX 256
+
+enum element_mode {
+	ElementSync, // Render it now
+	ElementAsync, // Show the last value, refresh it every time in the background
+	ElementCachedOnly, // Show the last value, refresh it once in a while
+};
+
+struct latency_policy {
+	double async_us; // Above this, go async
+	double cached_us; // Above this, only refresh every reprobe_every renders
+	uint32_t reprobe_every;
+};
+
+struct latency_record {
+	uint64_t key;
+	uint32_t type;
+	uint32_t since_probe; // Renders since the value was last refreshed
+	double ewma_us;
+	uint32_t samples;
+	uint32_t value_len; // 0 if there is no value to reuse
+	// Until when (wall clock microseconds) a refresh is under way somewhere,
+	// so other prompts don't start one of their own
+	double refreshing_until_us;
+	char value[LATENCY_VALUE_MAX];
+};
+
+struct latency_model {
+	struct cache_table table;
+	struct latency_policy policy;
+	uint64_t context;
+};
+
+/**
+ * @brief Opens the latency table for the context of a directory
+ *
+ * @param[out] model The model to populate
+ * @param[in] policy The thresholds used by latency_mode
+ * @param[in] cwd The directory the prompt is rendered in
+ * @param[in] uid The user rendered for, cached values are never shown to
+ * another one
+ * @return true if the model is usable
+ */
+bool latency_open(struct latency_model* model,
+	const struct latency_policy* policy, const char* cwd, uid_t uid);
+
+/**
+ * @brief Finds the record of one element of the prompt
+ *
+ * @param[in] model An open model
+ * @param[in] index The position of the element in the prompt
+ * @param[in] type The type of the element
+ * @return The record, created if needed, or NULL
+ */
+struct latency_record* latency_lookup(struct latency_model* model, int index,
+	int type);
+
+/**
+ * @brief Decides how an element should be rendered this time
+ *
+ * Counts the render, so call it once per element per prompt. Only one
+ * prompt at a time is asked to refresh an element: the others show the
+ * last value until the refresh is observed.
+ *
+ * @param[in] model An open model
+ * @param[in,out] record The record of the element, may be NULL
+ * @param[out] refresh Whether the value should be recomputed in the background
+ * @return One of enum element_mode
+ */
+enum element_mode latency_mode(const struct latency_model* model,
+	struct latency_record* record, bool* refresh);
+
+/**
+ * @brief Records how long rendering an element took
+ *
+ * @param[in,out] record The record of the element
+ * @param[in] us The render time in microseconds
+ * @param[in] value The rendered value, or NULL if it must not be reused
+ */
+void latency_observe(struct latency_record* record, double us,
+	const char* value);
+
+/**
+ * @brief Closes the model
+ *
+ * @param[in] model The model, which may have failed to open
+ */
+void latency_close(struct latency_model* model);
+
+/**
+ * @brief Returns the current monotonic time in microseconds
+ */
+double latency_now_us(void);
+
+/**
+ * @brief Makes the calling thread yield to everything else
+ *
+ * Idle CPU scheduling and idle I/O priority where there are such things, so
+ * a refresh never slows down the prompt someone is waiting for.
+ */
+void latency_background(void);
+
+/**
+ * @brief Forks a child to refresh cached values in the background
+ *
+ * The child lets go of the terminal and of the pipe the shell is reading, so
+ * the prompt shows without waiting for it, and runs with latency_background.
+ * It must end with _exit.
+ *
+ * @return true in the child, false in the parent or if fork failed
+ */
+bool latency_fork_refresher(void);
+
+#endif
@@ -0,0 +1,482 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <errno.h>
+#include <time.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "config.h"
+#ifdef HAVE_SYS_TIMERFD_H
+#include <sys/timerfd.h>
+#endif
+#include "cache.h"
+#include "env.h"
+#include "inputs.h"
+#include "live.h"
+#include "session.h"
+
+#define LIVE_LINE_MAX (PATH_MAX + 64)
+// The record kind and side in front of the prompt
+#define LIVE_HEADER 2
+
+// The width of the shell's terminal, from resize requests
+static int columns;
+// Reads EOF once the last background refresh exited, -1 if none is running
+static int refresh_fd = -1;
+
+struct live_render {
+	enum prompt_side side;
+	const PromptElement* prompt;
+	int count;
+	struct prompt_string* values;
+	size_t* offsets; // Where each element starts in the prompt
+	// The header comes first and the prompt is NUL terminated, so a whole
+	// record goes out in one write
+	char* buf;
+	size_t len; // Of the prompt, not counting the header and NUL
+	size_t cap;
+	bool shortened; // The layout changed a value, buf isn't just the values
+	uint64_t sent_hash; // Of the last prompt sent, valid if sent
+	bool sent;
+	// The hash of the inputs of each element when it was last rendered
+	uint64_t* input_hashes;
+	bool* dirty;
+};
+
+/**
+ * @brief Lays the element values out into the record buffer
+ *
+ * @param[in,out] render The render
+ * @return false if out of memory
+ */
+static bool assemble(struct live_render* render)
+{
+	struct prompt_string* laid_out;
+	size_t len = 0, value_len;
+	char* buf;
+
+	laid_out = layout_prompt(render->side, render->values, render->count,
+		columns);
+	if (!laid_out)
+		return false;
+	for (int i = 0; i < render->count; i++)
+		len += strlen(laid_out[i].str);
+	if (len + LIVE_HEADER + 1 > render->cap) {
+		if (!(buf = realloc(render->buf, len + LIVE_HEADER + 1))) {
+			exploded_prompt_free(laid_out, render->count);
+			return false;
+		}
+		render->buf = buf;
+		render->cap = len + LIVE_HEADER + 1;
+	}
+
+	render->len = 0;
+	render->shortened = false;
+	for (int i = 0; i < render->count; i++) {
+		value_len = strlen(laid_out[i].str);
+		render->offsets[i] = render->len;
+		memcpy(render->buf + LIVE_HEADER + render->len,
+			laid_out[i].str, value_len);
+		render->len += value_len;
+		render->shortened |= laid_out[i].needs_free;
+	}
+	render->buf[LIVE_HEADER + render->len] = 0;
+	exploded_prompt_free(laid_out, render->count);
+	return true;
+}
+
+/**
+ * @brief Re-renders the elements whose inputs changed
+ *
+ * Elements shown from the latency cache are re-rendered too when asked to,
+ * so they pick up a background refresh. If every new value has the length
+ * of the old one (the usual case for a clock) and the layout changed
+ * nothing, they are copied over the old ones in place, anything else lays
+ * the prompt out again.
+ *
+ * @param[in,out] render The render
+ * @param[in,out] snap The inputs looked at so far during this update
+ * @param[in] inputs Only look at elements depending on these inputs
+ * @param[in] recheck Whether to re-render the elements shown from the cache
+ * @return false if out of memory
+ */
+static bool update(struct live_render* render, struct input_snapshot* snap,
+	unsigned inputs, bool recheck)
+{
+	const struct element_deps* deps;
+	bool first = !render->values, any = false, stale;
+	bool reassemble = first || render->shortened;
+	size_t* old_len = NULL;
+	uint64_t hash;
+
+	if (first) {
+		render->values = calloc(render->count + 1, sizeof(*render->values));
+		if (!render->values)
+			return false;
+	}
+
+	for (int i = 0; i < render->count; i++) {
+		render->dirty[i] = false;
+		deps = element_deps(render->prompt[i].type);
+		stale = first || (recheck && render->values[i].cached);
+		if (!stale && !(deps->inputs & inputs))
+			continue;
+		hash = hash_inputs(deps, snap);
+		if (!stale && hash == render->input_hashes[i])
+			continue;
+		render->input_hashes[i] = hash;
+		render->dirty[i] = any = true;
+	}
+	if (!any)
+		return true;
+
+	if (!first && !(old_len = malloc(render->count * sizeof(*old_len))))
+		return false;
+	for (int i = 0; !first && i < render->count; i++) {
+		if (!render->dirty[i])
+			continue;
+		old_len[i] = strlen(render->values[i].str);
+		if (render->values[i].needs_free)
+			free(render->values[i].str);
+	}
+
+	render_prompt(render->side, render->values, render->dirty);
+
+	for (int i = 0; !first && i < render->count; i++)
+		if (render->dirty[i] && strlen(render->values[i].str) != old_len[i])
+			reassemble = true;
+	for (int i = 0; !reassemble && i < render->count; i++)
+		if (render->dirty[i])
+			memcpy(render->buf + LIVE_HEADER + render->offsets[i],
+				render->values[i].str, old_len[i]);
+	free(old_len);
+	return !reassemble || assemble(render);
+}
+
+/**
+ * @brief Writes a whole buffer to the shell
+ *
+ * @param[in] buf What to write
+ * @param[in] left How much to write
+ * @return false if the shell went away
+ */
+static bool write_all(const char* buf, size_t left)
+{
+	ssize_t written;
+
+	while (left) {
+		written = write(STDOUT_FILENO, buf, left);
+		if (written == -1 && errno == EINTR)
+			continue;
+		if (written <= 0)
+			return false;
+		buf += written;
+		left -= written;
+	}
+	return true;
+}
+
+/**
+ * @brief Sends the prompt to the shell, unless the shell already has it
+ *
+ * @param[in,out] render The render
+ * @param[in] kind 'R', 'T' or 'U'
+ * @return false if the shell went away
+ */
+static bool send_prompt(struct live_render* render, char kind)
+{
+	uint64_t hash;
+
+	hash = cache_hash(render->buf + LIVE_HEADER, render->len, 0);
+	if (render->sent && hash == render->sent_hash)
+		return true;
+
+	render->buf[0] = kind;
+	render->buf[1] = render->side == PromptRight ? '>' : '<';
+	if (!write_all(render->buf, render->len + LIVE_HEADER + 1))
+		return false;
+	render->sent_hash = hash;
+	render->sent = true;
+	return true;
+}
+
+/**
+ * @brief Sends the snapshot of a side before its first real render
+ *
+ * Every value is flagged cached, so the following update renders them all.
+ *
+ * @param[in,out] render The render, never rendered so far
+ * @param[out] sent Set if the snapshot was sent
+ * @return false if the shell went away or we ran out of memory
+ */
+static bool show_snapshot(struct live_render* render, bool* sent)
+{
+	size_t len;
+
+	if (!(render->values = snapshot_load(render->side, &len)))
+		return true;
+	for (int i = 0; i < render->count; i++)
+		render->values[i].cached = true;
+	if (!assemble(render) || !send_prompt(render, 'R'))
+		return false;
+	*sent = true;
+	return true;
+}
+
+/**
+ * @brief Lays the rendered prompts out again for a new terminal width
+ *
+ * Nothing is rendered, and only the prompts whose layout changed are sent.
+ *
+ * @param[in,out] renders The render of each side
+ * @param[in] width The new width
+ * @return false if the shell went away or we ran out of memory
+ */
+static bool resize(struct live_render renders[PROMPT_SIDES], const char* width)
+{
+	char* end;
+	long n = strtol(width, &end, 10);
+
+	if (!*width || *end || n < 0 || n > INT_MAX || n == columns)
+		return true;
+	columns = n;
+	for (int side = 0; side < PROMPT_SIDES; side++)
+		if (renders[side].buf && (!assemble(&renders[side])
+				|| !send_prompt(&renders[side], 'W')))
+			return false;
+	return true;
+}
+
+/**
+ * @brief Refreshes the elements shown from the latency cache in a child
+ *
+ * The child holds the write end of a pipe until it exits, so refresh_fd
+ * polls readable once the refreshed values can be shown. A refresh still
+ * running is not waited for anymore, the new one covers its elements.
+ */
+static void start_refresh(void)
+{
+	int fds[2];
+
+	if (pipe(fds) == -1) {
+		refresh_stale_elements(true);
+		return;
+	}
+	if (refresh_stale_elements(true)) {
+		if (refresh_fd != -1)
+			close(refresh_fd);
+		refresh_fd = fds[0];
+	} else {
+		close(fds[0]);
+	}
+	close(fds[1]);
+}
+
+/**
+ * @brief Handles one request from the shell
+ *
+ * @param[in,out] renders The render of each side
+ * @param[in] line The request, without the newline
+ * @param[out] ticking Whether the clock should run
+ * @return false if the shell went away or we ran out of memory
+ */
+static bool handle_request(struct live_render renders[PROMPT_SIDES],
+	char* line, bool* ticking)
+{
+	struct input_snapshot snap = { 0 };
+	bool early = false;
+	char* dir;
+
+	if (!strcmp(line, "pause")) {
+		*ticking = false;
+		return true;
+	}
+	if (!strncmp(line, "resize\t", 7))
+		return resize(renders, line + 7);
+	if (strncmp(line, "render", 6) || (line[6] && line[6] != '\t'))
+		return true; // Not ours to understand
+
+	if (line[6] && *(dir = line + 7) == '/' && chdir(dir) == 0) {
+		setenv("PWD", dir, 1);
+		env_reset();
+	}
+	for (int side = 0; side < PROMPT_SIDES; side++)
+		if (!renders[side].values && renders[side].count
+				&& !show_snapshot(&renders[side], &early))
+			return false;
+	if (early && !write_all("R=", 3))
+		return false;
+
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		if (!renders[side].count)
+			continue;
+		// Cached elements count this prompt, the latency model decides
+		// whether they are due for a refresh
+		if (!update(&renders[side], &snap, ~0u, true)
+				|| !send_prompt(&renders[side], early ? 'U' : 'R'))
+			return false;
+		snapshot_save(side, renders[side].values, renders[side].count);
+	}
+	// The latency model wants its background refresh like after any prompt
+	start_refresh();
+	*ticking = true;
+	return early || write_all("R=", 3);
+}
+
+/**
+ * @brief Milliseconds until the next multiple of a period of wall time
+ *
+ * @param[in] period The period in seconds
+ */
+static int ms_to_boundary(int period)
+{
+	struct timespec now;
+	long ms;
+
+	clock_gettime(CLOCK_REALTIME, &now);
+	ms = (period - now.tv_sec % period) * 1000L - now.tv_nsec / 1000000;
+	return ms > 0 ? ms : 1;
+}
+
+/**
+ * @brief Arms or disarms the clock
+ *
+ * @param[in] fd The timerfd, -1 if there is none
+ * @param[in] period The period in seconds, 0 to disarm
+ */
+static void set_timer(int fd, int period)
+{
+#ifdef HAVE_SYS_TIMERFD_H
+	struct itimerspec spec = { 0 };
+	struct timespec now;
+
+	if (fd == -1)
+		return;
+	if (period) {
+		// Fire on the boundaries of wall time, like a real clock
+		clock_gettime(CLOCK_REALTIME, &now);
+		spec.it_value.tv_sec = now.tv_sec - now.tv_sec % period + period;
+		spec.it_interval.tv_sec = period;
+	}
+	timerfd_settime(fd, TFD_TIMER_ABSTIME, &spec, NULL);
+#endif
+}
+
+int live_main(void)
+{
+	struct live_render renders[PROMPT_SIDES] = { 0 };
+	struct input_snapshot snap;
+	struct pollfd fds[3];
+	char line[LIVE_LINE_MAX], *eol;
+	size_t line_len = 0;
+	ssize_t got;
+	uint64_t expirations;
+	bool ticking = false, ok = true;
+	int period = 0, element_period, timer = -1, timeout, ready;
+
+	// Until the shell says, its terminal is usually our stderr
+	columns = terminal_columns();
+
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		renders[side].side = side;
+		renders[side].prompt = get_prompt(side, &renders[side].count);
+		renders[side].offsets = malloc((renders[side].count + 1)
+			* sizeof(*renders[side].offsets));
+		renders[side].input_hashes = malloc((renders[side].count + 1)
+			* sizeof(*renders[side].input_hashes));
+		renders[side].dirty = malloc(renders[side].count + 1);
+		if (!renders[side].offsets || !renders[side].input_hashes
+				|| !renders[side].dirty)
+			return 1;
+		for (int i = 0; i < renders[side].count; i++) {
+			element_period = element_deps(
+				renders[side].prompt[i].type)->tick_seconds;
+			if (element_period && (!period || element_period < period))
+				period = element_period;
+		}
+	}
+#ifdef HAVE_SYS_TIMERFD_H
+	if (period)
+		timer = timerfd_create(CLOCK_REALTIME, TFD_NONBLOCK | TFD_CLOEXEC);
+#endif
+
+	fds[0] = (struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN };
+	fds[1] = (struct pollfd){ .fd = timer, .events = POLLIN };
+	while (ok) {
+		timeout = ticking && period && timer == -1
+			? ms_to_boundary(period) : -1;
+		// poll skips the ones that are -1
+		fds[2] = (struct pollfd){ .fd = refresh_fd, .events = POLLIN };
+		ready = poll(fds, 3, timeout);
+		if (ready == -1) {
+			if (errno == EINTR)
+				continue;
+			break;
+		}
+
+		if (ready == 0 || (fds[1].revents & POLLIN)) {
+			if (timer != -1)
+				while (read(timer, &expirations, sizeof(expirations)) > 0);
+			snap.have = 0;
+			for (int side = 0; ok && ticking && side < PROMPT_SIDES;
+					side++)
+				if (renders[side].buf)
+					ok = update(&renders[side], &snap, InputTime, false)
+						&& send_prompt(&renders[side], 'T');
+		}
+
+		if (fds[2].revents & (POLLIN | POLLHUP)) {
+			close(refresh_fd);
+			refresh_fd = -1;
+			while (waitpid(-1, NULL, WNOHANG) > 0);
+			// While a command runs, the next render picks the values up
+			snap.have = 0;
+			for (int side = 0; ok && ticking && side < PROMPT_SIDES;
+					side++)
+				if (renders[side].buf)
+					ok = update(&renders[side], &snap, 0, true)
+						&& send_prompt(&renders[side], 'T');
+		}
+
+		if (!(fds[0].revents & (POLLIN | POLLHUP)))
+			continue;
+		got = read(STDIN_FILENO, line + line_len, sizeof(line) - line_len - 1);
+		if (got == -1 && errno == EINTR)
+			continue;
+		if (got <= 0)
+			break;
+		line_len += got;
+		line[line_len] = 0;
+
+		while (ok && (eol = strchr(line, '\n'))) {
+			*eol = 0;
+			ok = handle_request(renders, line, &ticking);
+			line_len -= eol + 1 - line;
+			memmove(line, eol + 1, line_len + 1);
+		}
+		// A line that doesn't fit is garbage
+		if (line_len == sizeof(line) - 1)
+			line_len = 0;
+		set_timer(timer, ticking ? period : 0);
+	}
+
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		if (renders[side].values)
+			exploded_prompt_free(renders[side].values, renders[side].count);
+		free(renders[side].offsets);
+		free(renders[side].input_hashes);
+		free(renders[side].dirty);
+		free(renders[side].buf);
+	}
+	if (timer != -1)
+		close(timer);
+	if (refresh_fd != -1)
+		close(refresh_fd);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,59 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_LIVE_H
+#define CPROMPT_LIVE_H
+
+#include "prompt.h"
+
+/* Live mode
+ *
+ * cprompt -l stays resident as a coprocess of the shell. The shell sends one
+ * request per line on stdin:
+ *     render<TAB><directory>   render the prompt for that directory
+ *     pause                    a command is running, stop the clock
+ *     resize<TAB><columns>     the terminal was resized
+ * and reads NUL terminated records from stdout. The first byte of a record
+ * says why it was sent, the second which prompt it is:
+ *     R<prompt   the left prompt, in answer to a render request
+ *     R>prompt   the right prompt, in answer to a render request
+ *     R=         the end of the answer to a render request
+ *     T<prompt   the left prompt changed on its own: the clock ticked or
+ *                a background refresh finished
+ *     T>prompt   the same for the right prompt
+ *     U<prompt   the left prompt, when it was answered from a snapshot
+ *     U>prompt   the same for the right prompt
+ *     W<prompt   the left prompt, laid out again after a resize
+ *     W>prompt   the same for the right prompt
+ * A prompt is only sent when its bytes differ from the last ones sent, so
+ * the shell only redraws what actually changed.
+ *
+ * Every element type declares what its value depends on (element_deps). An
+ * element is only re-rendered when one of those inputs changed since it was
+ * last rendered, so a render after a command that didn't cd recomputes the
+ * clock and nothing else. Between a render and a pause, time elements are
+ * refreshed on their own and patched into the last rendered prompt.
+ *
+ * Elements shown from the latency cache are rendered again on every render
+ * request, which is what counts toward their next refresh, and when the
+ * background refresh started after the last render exits. Clock ticks leave
+ * them alone.
+ *
+ * A resize only lays the last rendered values out again (see layout_prompt),
+ * it never renders an element.
+ *
+ * The first render request is answered right away from the snapshot of the
+ * directory (see session.h) when there is one, R= included, so a new shell
+ * gets a prompt without waiting for slow elements. The real values follow as
+ * U records once they are rendered.
+ */
+
+/**
+ * @brief Runs live mode until stdin is closed
+ *
+ * @return The exit status
+ */
+int live_main(void);
+
+#endif
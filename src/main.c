@@ -17,60 +17,67 @@
 #include <libgen.h>
 #include <libproc.h>
 #include <time.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
 #include "config.h"
+#include "cache.h"
+#include "latency.h"
+#include "nameddir.h"
+#include "cwd.h"
+#include "env.h"
+#include "passwd.h"
+#include "timefmt.h"
+#include "prompt.h"
+#include "live.h"
+#include "daemon.h"
+#include "session.h"
+#include "vcs.h"
 
 #define MAX_STRFTIME_SIZE 50
 
-enum PromptElementType {
-	StringLiteral, // Any string literal; arg is char*
-	Space, // Basically StringLiteral " "
-
-	Bell, // ASCII bell (07)
-
-	HostnameUpToDot, // The hostname up until the first dot
-	FullHostname, // You probably want to use HostnameUpToDot
-
-	//NumJobs, // Number of running jobs
-
-	TtyBasename, // Gets basename of tty, tty0
-
-	ShellName, // Basename of $0, zsh
-
-	WeekMonthDay, // Date, Tue May 26
-	StrftimeDate, // Date; arg is a date format string
-
-	HourMinuteSecond24, // Time, 14:32:14
-	HourMinuteSecond12, // Time, 11:34:11
-	TimeAmPm, // Time, 12:42 PM
-	HourMinute24, // Time, 21:11
-
-	Username, // Username, root
-
-	//ShellVersion, // Shell version
-	//ShellVersionPatch, // Shell version with patch number
-	PwdTrunc, // PWD truncating $HOME to ~, see next comment
-	PwdTruncBasename, // Basename of PWD truncating $HOME to ~, see next comment
-	// arg (optional) is what $HOME is truncated to instead of ~
-
-	//HistoryNum // The history number of the current command
-	//CommandNum // The command number of the current command
+#include "user_config.h"
 
-	UserPrompt, // If EUID is 0, #, instead a $
-	// arg (optional) is an array of the string wanted when [EUID == 0, Else]
-};
+/* PWD MODE
+ *
+ * PwdPhysical resolves symlinks (the default), PwdLogical shows $PWD
+ */
+#ifndef PWD_MODE
+#define PWD_MODE PwdPhysical
+#endif
 
-typedef struct {
-	const enum PromptElementType type;
-	// This should be const
-	void* arg;
-} PromptElement;
+/* NAMED DIRECTORIES
+ *
+ * user_config.h can define NAMED_DIRS as a list of { "name", "/path" },
+ * entries that are abbreviated to ~name in the PWD
+ */
+#ifndef NAMED_DIRS
+#define NAMED_DIRS
+#endif
 
-#include "user_config.h"
+/* LAYOUT
+ *
+ * Columns the left prompt leaves for typing before the PWD is shortened, 0
+ * to never shorten it
+ */
+#ifndef PROMPT_MIN_COLUMNS
+#define PROMPT_MIN_COLUMNS 0
+#endif
+// What replaces the leading directories of a shortened PWD
+#define LAYOUT_ELLIPSIS "..."
 
-struct prompt_string {
-	char* str;
-	bool needs_free;
-};
+/* LATENCY LEARNING
+ *
+ * Defaults for the thresholds user_config.h can override, in microseconds
+ */
+#ifndef LATENCY_ASYNC_US
+#define LATENCY_ASYNC_US 5000
+#endif
+#ifndef LATENCY_CACHED_US
+#define LATENCY_CACHED_US 50000
+#endif
+#ifndef LATENCY_REPROBE_EVERY
+#define LATENCY_REPROBE_EVERY 20
+#endif
 
 enum home_dir_ret {
 	// Failed to get the home directory and the error string is not allocated
@@ -83,7 +90,42 @@ enum home_dir_ret {
 	HOME_DIR_ALLOC = 1,
 };
 
+/* DAEMON
+ *
+ * Defaults for the daemon (cprompt -d), user_config.h can override
+ */
+#ifndef DAEMON_WORKERS
+#define DAEMON_WORKERS 4
+#endif
+#ifndef DAEMON_BACKGROUND
+#define DAEMON_BACKGROUND 1
+#endif
+#ifndef DAEMON_AUTOSTART
+#define DAEMON_AUTOSTART 1
+#endif
+
+/* RIGHT PROMPT
+ *
+ * user_config.h can define RPROMPT as the elements of the right prompt
+ */
+#ifndef RPROMPT
+#define RPROMPT
+#endif
+
+// The terminator keeps the array from being empty, it is not part of it
+static const PromptElement rprompt[] = { RPROMPT { StringLiteral, "" } };
+
 const static int prompt_elements = sizeof(prompt) / sizeof(prompt[0]);
+const static int rprompt_elements = sizeof(rprompt) / sizeof(rprompt[0]) - 1;
+
+// Elements that were shown from the latency cache and need a refresh, per
+// thread like everything a render keeps around
+static _Thread_local bool stale_elements[PROMPT_SIDES][(sizeof(prompt)
+	> sizeof(rprompt) ? sizeof(prompt) : sizeof(rprompt))
+	/ sizeof(PromptElement)];
+
+// Who is rendered for, see render_for
+static _Thread_local const struct render_client* client = NULL;
 
 /**
  * Allocates or puts an error into ps
@@ -134,31 +176,37 @@ char* format_error(char* err_str, int err, bool* needs_free)
 /**
  * @brief Returns the formatted time
  *
+ * Day and month names come from the LC_TIME locale, see timefmt.h.
+ *
  * @param[out] ps The prompt_string that will be populated
  * @param[in] fmt The format string used, see man page for strftime
  */
 void get_formatted_time(struct prompt_string* ps, const char* fmt)
 {
 	struct tm time_br;
-	time_t clock;
+	struct timespec clock;
 	int status;
 
 	ps->needs_free = true;
 
-	clock = time(NULL);
-	if (clock == -1)
+	// Not time(): it can lag behind the second the live clock woke up for
+	if (clock_gettime(CLOCK_REALTIME, &clock) == -1)
 	{
 		ps->str = format_error("!TIME!", errno, &ps->needs_free);
 		return;
 	}
-	localtime_r(&clock, &time_br);
+	if (client && client->zone)
+		time_zone_tm(client->zone, clock.tv_sec, &time_br);
+	else
+		localtime_r(&clock.tv_sec, &time_br);
 
 	ps->str = malloc_or_error(ps, sizeof(char) * MAX_STRFTIME_SIZE);
 	if (!ps->str) {
 		return;
 	}
-	status = strftime(ps->str, MAX_STRFTIME_SIZE, fmt, &time_br);
-	if (status == 0)
+	status = format_time(ps->str, MAX_STRFTIME_SIZE, fmt, &time_br,
+		time_names_get());
+	if (status < 0)
 	{
 		free(ps->str);
 		ps->needs_free = false;
@@ -227,16 +275,17 @@ void get_hostname(struct prompt_string* ps, bool to_dot)
 void get_tty_basename(struct prompt_string* ps)
 {
 	int status;
-	char* tty;
+	const char* tty;
 
 	ps->needs_free = false;
 
-	if (!isatty(STDOUT_FILENO))
+	if (client ? !client->tty : !isatty(STDOUT_FILENO))
 	{
-		ps->str = format_error("!ISATTY!", errno, &ps->needs_free);
+		ps->str = format_error("!ISATTY!", client ? ENOTTY : errno,
+			&ps->needs_free);
 		return;
 	}
-	tty = ttyname(STDOUT_FILENO);
+	tty = client ? client->tty : ttyname(STDOUT_FILENO);
 	if (!tty)
 	{
 		ps->str = format_error("!TTYNAME!", errno, &ps->needs_free);
@@ -272,7 +321,7 @@ void get_parent_name(struct prompt_string* ps)
 	if (!ps->str) {
 		return;
 	}
-	ppid = getppid();
+	ppid = client ? client->shell : getppid();
 	// This is super platform-specific
 #ifdef __APPLE__
 	// This was hard to find
@@ -302,8 +351,18 @@ void get_username(struct prompt_string *ps)
 	int bufsz, status;
 	char* buf, *username;
 	struct passwd pass, *result = NULL;
+	struct passwd_entry entry;
 
 	ps->needs_free = false;
+	if (passwd_files_lookup(render_uid(), &entry)) {
+		ps->needs_free = true;
+		if (!(ps->str = strndup(entry.name, sizeof(entry.name)))) {
+			ps->needs_free = false;
+			ps->str = "!STRNDUP!";
+		}
+		return;
+	}
+
 	status = errno;
 	bufsz = sysconf(_SC_GETPW_R_SIZE_MAX);
 	if (bufsz == -1)
@@ -317,7 +376,7 @@ void get_username(struct prompt_string *ps)
 	if (!buf) {
 		return;
 	}
-	status = getpwuid_r(getuid(), &pass, buf, bufsz, &result);
+	status = getpwuid_r(render_uid(), &pass, buf, bufsz, &result);
 	if (status != 0) {
 		free(buf);
 		ps->str = format_error("!GETPWUIDR!", errno, &ps->needs_free);
@@ -348,21 +407,26 @@ void get_username(struct prompt_string *ps)
  */
 int get_home_dir(char** ret)
 {
-	char* home, *pwbuf;
+	char* home, *pwbuf = NULL;
 	int status;
 	size_t pwbufsz;
 	struct passwd pw, *result;
+	struct passwd_entry entry;
 	bool err_free;
 
-	home = getenv("HOME");
+	home = (char*)env_get(ENV_HOME);
 	if (home) {
 		*ret = home;
 		return HOME_DIR_NO_ALLOC;
 	}
-	// Try to get it from the passwd database
+	// Try to get it from the passwd database, skipping NSS if we can
+	if (passwd_files_lookup(render_uid(), &entry)) {
+		home = entry.dir;
+		goto copy;
+	}
 	status = errno;
 	pwbufsz = sysconf(_SC_GETPW_R_SIZE_MAX);
-	if (pwbufsz == -1) {
+	if (pwbufsz == (size_t)-1) {
 		if (status == errno) {
 			*ret = "!NOGETPWRSIZEMAX!";
 			return HOME_DIR_NO_ALLOC;
@@ -375,15 +439,21 @@ int get_home_dir(char** ret)
 		*ret = "!MALLOC!";
 		return HOME_DIR_FAILED_MESSAGE_NO_ALLOC;
 	}
-	status = getpwuid_r(getuid(), &pw, pwbuf, pwbufsz, &result);
+	status = getpwuid_r(render_uid(), &pw, pwbuf, pwbufsz, &result);
 	if (status != 0) {
+		free(pwbuf);
 		*ret = format_error("!GETPWUIDR!", errno, &err_free);
 		return err_free - 2;
 	} else if (!result) {
+		free(pwbuf);
 		*ret = "!USERNOTFOUND!";
 		return HOME_DIR_NO_ALLOC;
 	}
-	if(!(home = strndup(pw.pw_dir, PATH_MAX + 1))) {
+	home = pw.pw_dir;
+copy:
+	home = strndup(home, PATH_MAX + 1);
+	free(pwbuf);
+	if (!home) {
 		*ret = "!STRNDUP!";
 		return HOME_DIR_FAILED_MESSAGE_NO_ALLOC;
 	}
@@ -391,131 +461,679 @@ int get_home_dir(char** ret)
 	return HOME_DIR_ALLOC;
 }
 
+/**
+ * @brief Builds the trie of named directories, once per process
+ *
+ * The trie holds $HOME (shown as ~), the NAMED_DIRS from user_config.h and
+ * whatever the shell passes in $CPROMPT_NAMED_DIRS. When the PWD is a
+ * resolved path, so is $HOME, or a symlinked $HOME would never match.
+ *
+ * @param[out] ps The prompt string to report errors to
+ * @param[in] physical Whether the PWD it is matched against is resolved
+ * @return The trie, or NULL on error
+ */
+static const struct nameddir_trie* get_named_dirs(struct prompt_string* ps,
+	bool physical)
+{
+	static _Thread_local struct nameddir_trie trie;
+	// What the trie was built from, 0 if it wasn't
+	static _Thread_local uint64_t built_for = 0;
+	static const NamedDir config_dirs[] = { NAMED_DIRS { NULL, NULL } };
+	char* home, name[PATH_MAX], resolved[PATH_MAX];
+	const char* spec, *home_env;
+	uint64_t key;
+	int status;
+	bool ok;
+
+	home_env = env_get(ENV_HOME);
+	spec = env_get(ENV_CPROMPT_NAMED_DIRS);
+	key = cache_hash(&physical, sizeof(physical), 0);
+	key = home_env ? cache_hash(home_env, strlen(home_env) + 1, key) : key + 1;
+	key = spec ? cache_hash(spec, strlen(spec) + 1, key) : key + 1;
+	key = key ? key : 1;
+	if (built_for == key)
+		return &trie;
+	if (built_for)
+		nameddir_free(&trie);
+	built_for = 0;
+
+	status = get_home_dir(&home);
+	if (status < 0) {
+		ps->needs_free = status + 2;
+		ps->str = home;
+		return NULL;
+	}
+	nameddir_init(&trie);
+	ok = nameddir_add(&trie, home, "~");
+	if (ok && physical && cached_realpath(home, resolved))
+		ok = nameddir_add(&trie, resolved, "~");
+	if (status == HOME_DIR_ALLOC)
+		free(home);
+
+	for (int i = 0; ok && config_dirs[i].name; i++) {
+		snprintf(name, PATH_MAX, "~%s", config_dirs[i].name);
+		ok = nameddir_add(&trie, config_dirs[i].path, name);
+	}
+	if (ok && spec)
+		ok = nameddir_add_spec(&trie, spec);
+
+	if (!ok) {
+		nameddir_free(&trie);
+		ps->needs_free = false;
+		ps->str = "!MALLOC!";
+		return NULL;
+	}
+	built_for = key;
+	return &trie;
+}
+
 /**
  * @brief Gets the current working directory, abreviating $HOME with a tilde
+ * and named directories with ~name
  *
  * @param[out] ps The prompt string to populate
  * @param[in] base Should we get the basename of the path
+ * @param[in] home_name What to show $HOME as instead of ~, may be NULL
  */
-void get_pwd_tilde(struct prompt_string* ps, bool base)
+void get_pwd_tilde(struct prompt_string* ps, bool base, const char* home_name)
 {
 	// See comment about MAXPATHLEN
-	char* home, *match, pwd[PATH_MAX];
-	int status, len;
+	char pwd[PATH_MAX], abbreviated[PATH_MAX];
+	const struct nameddir_trie* named_dirs;
+	const char* replacement;
+	size_t matched;
+	bool physical;
+	int len;
 
-	if (!getcwd(pwd, PATH_MAX)) {
+	ps->needs_free = false;
+	if (!pwd_get(PWD_MODE, pwd, &physical)) {
 		ps->str = format_error("!GETCWD!", errno, &ps->needs_free);
 		return;
 	}
-	status = get_home_dir(&home);
-	if (status < 0) {
-		ps->needs_free = status + 2;
-		ps->str = home;
+	if (!(named_dirs = get_named_dirs(ps, physical)))
 		return;
+
+	matched = nameddir_match(named_dirs, pwd, &replacement);
+	if (matched) {
+		if (home_name && !strcmp(replacement, "~"))
+			replacement = home_name;
+		len = snprintf(abbreviated, PATH_MAX, "%s%s", replacement,
+			pwd + matched);
+		if (len >= 0 && len < PATH_MAX)
+			strlcpy(pwd, abbreviated, PATH_MAX);
 	}
-	match = strnstr(pwd, home, PATH_MAX);
-	if (match == pwd) {
-		len = strnlen(home, PATH_MAX) - 1;
-		*pwd = '~';
-		for (match = pwd + 1; *(match + len); match++)
-			*match = *(match + len);
-		*match = 0;
-	}
-	if (status == HOME_DIR_ALLOC)
-		free(home);
-	len = strnlen(pwd, PATH_MAX) + 1;
+
+	// basename_r wants a buffer of at least MAXPATHLEN
+	len = base ? PATH_MAX : strnlen(pwd, PATH_MAX) + 1;
 	ps->needs_free = true;
 	ps->str = malloc_or_error(ps, len);
 	if (!ps->str) {
 		return;
 	}
-	if (base && !basename_r(pwd, ps->str)) {
+	if (!base) {
+		strlcpy(ps->str, pwd, len);
+	} else if (!basename_r(pwd, ps->str)) {
 		free(ps->str);
 		ps->str = format_error("!BASENAMER!", errno, &ps->needs_free);
-		return;
-	} else
-		strlcpy(ps->str, pwd, PATH_MAX);
+	}
 	return;
 }
 
+/**
+ * @brief Whether an element may be shown from the latency cache
+ *
+ * Only elements whose value depends on nothing more than the latency context
+ * can be reused, everything else is always rendered.
+ *
+ * @param[in] type The type of the element
+ */
+static bool element_is_degradable(enum PromptElementType type)
+{
+	switch (type) {
+	case HostnameUpToDot:
+	case FullHostname:
+	case Username:
+		return true;
+	default:
+		return false;
+	}
+}
+
+bool element_is_inline(enum PromptElementType type)
+{
+	return !element_is_degradable(type)
+		&& !(element_deps(type)->inputs & (InputCwd | InputFiles));
+}
+
+static const enum env_var pwd_env[] = {
+	ENV_HOME, ENV_PWD, ENV_CPROMPT_NAMED_DIRS, ENV_COUNT
+};
+static const enum env_var time_env[] = {
+	ENV_LANG, ENV_LC_ALL, ENV_LC_TIME, ENV_TZ, ENV_COUNT
+};
+static const char* const passwd_files[] = { "/etc/passwd", NULL };
+
+/**
+ * @brief What the value of an element depends on
+ *
+ * The live engine only re-renders an element when one of these changed.
+ *
+ * @param[in] type The type of the element
+ */
+const struct element_deps* element_deps(enum PromptElementType type)
+{
+	static const struct element_deps constant = { 0 };
+	// Can't change under a running shell, but differs between shells
+	static const struct element_deps shell = { .inputs = InputSession };
+	static const struct element_deps seconds = {
+		.inputs = InputTime | InputEnv, .tick_seconds = 1, .env = time_env,
+	};
+	// Days change on a minute boundary too
+	static const struct element_deps minutes = {
+		.inputs = InputTime | InputEnv, .tick_seconds = 60, .env = time_env,
+	};
+	static const struct element_deps host = { .inputs = InputHost };
+	static const struct element_deps user = {
+		.inputs = InputUid | InputFiles, .files = passwd_files,
+	};
+	static const struct element_deps euid = { .inputs = InputUid };
+	static const struct element_deps pwd = {
+		.inputs = InputCwd | InputEnv, .env = pwd_env,
+	};
+
+	switch (type) {
+	case HourMinuteSecond24:
+	case HourMinuteSecond12:
+	case StrftimeDate: // Could be anything
+		return &seconds;
+	case TimeAmPm:
+	case HourMinute24:
+	case WeekMonthDay:
+		return &minutes;
+	case HostnameUpToDot:
+	case FullHostname:
+		return &host;
+	case Username:
+		return &user;
+	case UserPrompt:
+		return &euid;
+	case PwdTrunc:
+	case PwdTruncBasename:
+		return &pwd;
+	case TtyBasename:
+	case ShellName:
+		return &shell;
+	default:
+		return &constant;
+	}
+}
+
+/**
+ * @brief Turns one element of `prompt` into a string
+ *
+ * @param[out] ps The prompt string to populate
+ * @param[in] element The element to render
+ */
+void render_element(struct prompt_string* ps, const PromptElement* element)
+{
+	switch(element->type) {
+	case StringLiteral:
+		ps->str = element->arg;
+		ps->needs_free = false;
+		break;
+	case Space:
+		ps->str = " ";
+		ps->needs_free = false;
+		break;
+	case Bell: // for bash compatability with \a
+		ps->str = "\07";
+		ps->needs_free = false;
+		break;
+	case WeekMonthDay: // bash: %a %b %d
+		get_formatted_time(ps, "%a %b %d");
+		break;
+	case StrftimeDate: // custom
+		get_formatted_time(ps, element->arg);
+		break;
+	case HourMinuteSecond24: // bash: %H:%M:%S
+		get_formatted_time(ps, "%H:%M:%S");
+		break;
+	case HourMinuteSecond12: // bash: %I:%M:%S
+		get_formatted_time(ps, "%I:%M:%S");
+		break;
+	case TimeAmPm: // bash: %I:%M %p
+		get_formatted_time(ps, "%I:%M %p");
+		break;
+	case HourMinute24: // bash: %H:%M
+		get_formatted_time(ps, "%H:%M");
+		break;
+	case HostnameUpToDot:
+		get_hostname(ps, true);
+		break;
+	case FullHostname:
+		get_hostname(ps, false);
+		break;
+	case TtyBasename:
+		get_tty_basename(ps);
+		break;
+	case ShellName:
+		get_parent_name(ps);
+		break;
+	case Username:
+		get_username(ps);
+		break;
+	case PwdTrunc:
+		get_pwd_tilde(ps, false, element->arg);
+		break;
+	case PwdTruncBasename:
+		get_pwd_tilde(ps, true, element->arg);
+		break;
+	case UserPrompt:
+		ps->str = (client ? client->uid : geteuid()) == 0 ? "#" : "$";
+		ps->needs_free = false;
+	}
+}
+
+/**
+ * @brief Renders an element and feeds its render time to the latency model
+ *
+ * @param[out] ps The prompt string to populate
+ * @param[in] element The element to render
+ * @param[in,out] record The latency record of the element
+ */
+static void render_element_timed(struct prompt_string* ps,
+	const PromptElement* element, struct latency_record* record)
+{
+	double start;
+
+	start = latency_now_us();
+	render_element(ps, element);
+	// Errors are not worth remembering
+	latency_observe(record, latency_now_us() - start,
+		*ps->str == '!' ? NULL : ps->str);
+}
+
+/**
+ * @brief Opens the latency model for the current directory
+ *
+ * @param[out] model The model to populate
+ * @return true if the model is usable
+ */
+static bool open_latency_model(struct latency_model* model)
+{
+	const struct latency_policy policy = {
+		.async_us = LATENCY_ASYNC_US,
+		.cached_us = LATENCY_CACHED_US,
+		.reprobe_every = LATENCY_REPROBE_EVERY,
+	};
+	char cwd[PATH_MAX];
+
+	if (!getcwd(cwd, PATH_MAX))
+		return false;
+	return latency_open(model, &policy, cwd, render_uid());
+}
+
+/**
+ * @brief Gets the elements of one side of the prompt
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] count How many elements there are
+ * @return The elements
+ */
+const PromptElement* get_prompt(enum prompt_side side, int* count)
+{
+	*count = side == PromptRight ? rprompt_elements : prompt_elements;
+	return side == PromptRight ? rprompt : prompt;
+}
+
+/**
+ * @brief Finds the latency record of an element of the prompt
+ *
+ * @param[in] model An open model
+ * @param[in] side The side of the prompt the element is on
+ * @param[in] index The position of the element in its side
+ * @param[in] type The type of the element
+ */
+static struct latency_record* lookup_element(struct latency_model* model,
+	enum prompt_side side, int index, enum PromptElementType type)
+{
+	// Right prompt elements get their own records
+	return latency_lookup(model, side << 16 | index, type);
+}
+
+/**
+ * @brief Renders some or all elements of one side of the prompt
+ *
+ * Elements the latency model has learned to be slow are taken from the cache,
+ * flagged as cached and marked in `stale_elements`.
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in,out] elements One prompt string per element
+ * @param[in] dirty Which elements to render, NULL for all of them
+ */
+void render_prompt(enum prompt_side side, struct prompt_string* elements,
+	const bool* dirty)
+{
+	struct latency_model model;
+	struct latency_record* record;
+	const PromptElement* elems;
+	bool have_model = false;
+	bool* stale = stale_elements[side];
+	int count;
+
+	elems = get_prompt(side, &count);
+	for (int i = 0; i < count; ++i)
+	{
+		if (dirty && !dirty[i])
+			continue;
+		elements[i].cached = false;
+		if (!element_is_degradable(elems[i].type)) {
+			render_element(&elements[i], &elems[i]);
+			continue;
+		}
+		if (!have_model && !(have_model = open_latency_model(&model))) {
+			render_element(&elements[i], &elems[i]);
+			continue;
+		}
+
+		record = lookup_element(&model, side, i, elems[i].type);
+		if (!record) {
+			render_element(&elements[i], &elems[i]);
+		} else if (latency_mode(&model, record, &stale[i]) == ElementSync) {
+			render_element_timed(&elements[i], &elems[i], record);
+		} else if ((elements[i].str = strndup(record->value,
+				LATENCY_VALUE_MAX))) {
+			elements[i].needs_free = true;
+			elements[i].cached = true;
+		} else {
+			elements[i].str = "!STRNDUP!";
+			elements[i].needs_free = false;
+		}
+	}
+
+	if (have_model)
+		latency_close(&model);
+}
+
 /**
  * @brief Makes an array of stringified prompt parts
  *
- * Walks through user-provided `prompt` and turns each part of `prompt` into a
- * corresponding string
+ * Walks through user-provided `prompt` (or `rprompt`) and turns each part
+ * into a corresponding string, see render_prompt.
  *
+ * @param[in] side One of enum prompt_side
  * @param[out] len The amount of pointers
  *
  * @return An array of pointers to strings
  */
-struct prompt_string* make_exploded_prompt(size_t* len)
+struct prompt_string* make_exploded_prompt(enum prompt_side side, size_t* len)
 {
 	struct prompt_string* elements;
+	int count;
 
-	*len = prompt_elements;
-	elements = malloc(prompt_elements * sizeof(struct prompt_string));
+	get_prompt(side, &count);
+	*len = count;
+	// One more so an empty right prompt isn't a malloc(0)
+	elements = malloc((count + 1) * sizeof(struct prompt_string));
+	if (elements)
+		render_prompt(side, elements, NULL);
+	return elements;
+}
 
-	for (int i = 0; i < prompt_elements; ++i)
-	{
-		switch(prompt[i].type) {
-		case StringLiteral:
-			elements[i].str = prompt[i].arg;
-			elements[i].needs_free = false;
-			break;
-		case Space:
-			elements[i].str = " ";
-			elements[i].needs_free = false;
-			break;
-		case Bell: // for bash compatability with \a
-			elements[i].str = "\07";
-			elements[i].needs_free = false;
-			break;
-		case WeekMonthDay: // bash: %a %b %d
-			get_formatted_time(&elements[i], "%a %b %d");
-			break;
-		case StrftimeDate: // custom
-			get_formatted_time(&elements[i], prompt[i].arg);
-			break;
-		case HourMinuteSecond24: // bash: %H:%M:%S
-			get_formatted_time(&elements[i], "%H:%M:%S");
-			break;
-		case HourMinuteSecond12: // bash: %I:%M:%S
-			get_formatted_time(&elements[i], "%I:%M:%S");
-			break;
-		case TimeAmPm: // bash: %I:%M %p
-			get_formatted_time(&elements[i], "%I:%M %p");
-			break;
-		case HourMinute24: // bash: %H:%M
-			get_formatted_time(&elements[i], "%H:%M");
-			break;
-		case HostnameUpToDot:
-			get_hostname(&elements[i], true);
-			break;
-		case FullHostname:
-			get_hostname(&elements[i], false);
-			break;
-		case TtyBasename:
-			get_tty_basename(&elements[i]);
-			break;
-		case ShellName:
-			get_parent_name(&elements[i]);
-			break;
-		case Username:
-			get_username(&elements[i]);
-			break;
-		case PwdTrunc:
-			get_pwd_tilde(&elements[i], false);
-			break;
-		case PwdTruncBasename:
-			get_pwd_tilde(&elements[i], true);
+size_t escape_length(const char* s)
+{
+	size_t len = 2;
+
+	if (!s[1])
+		return 1;
+	if (s[1] == '[') {
+		// CSI: parameters, then a final byte
+		while (s[len] && (s[len] < 0x40 || s[len] > 0x7e))
+			len++;
+		return s[len] ? len + 1 : len;
+	}
+	if (s[1] == ']') {
+		// OSC: up to BEL or ESC backslash
+		while (s[len] && s[len] != '\007'
+				&& !(s[len] == '\033' && s[len + 1] == '\\'))
+			len++;
+		return s[len] == '\007' ? len + 1 : s[len] ? len + 2 : len;
+	}
+	return len;
+}
+
+/**
+ * @brief Gets how many columns a string takes on the terminal
+ *
+ * Escape sequences take none, any other UTF-8 character one.
+ *
+ * @param[in] s The string
+ */
+static size_t visible_width(const char* s)
+{
+	size_t width = 0;
+
+	while (*s) {
+		if (*s == '\033') {
+			s += escape_length(s);
+			continue;
+		}
+		if ((*s & 0xc0) != 0x80)
+			width++;
+		s++;
+	}
+	return width;
+}
+
+/**
+ * @brief Shortens a PWD by replacing its leading directories
+ *
+ * Keeps as many trailing directories as fit, and at least the last one.
+ *
+ * @param[out] ps The prompt string to populate, untouched if nothing can go
+ * @param[in] pwd The rendered PWD
+ * @param[in] excess How many columns it should lose
+ * @return How many columns it lost
+ */
+static size_t shorten_pwd(struct prompt_string* ps, const char* pwd,
+	size_t excess)
+{
+	size_t width = visible_width(pwd), ellipsis = strlen(LAYOUT_ELLIPSIS);
+	const char* keep, *last = strrchr(pwd, '/');
+	char* str;
+
+	if (!last || last == pwd)
+		return 0;
+	for (keep = pwd + 1; (keep = strchr(keep, '/')) && keep != last; keep++)
+		if (ellipsis + visible_width(keep) + excess <= width)
 			break;
-		case UserPrompt:
-			elements[i].str = geteuid() == 0 ? "#" : "$";
-			elements[i].needs_free = false;
+	if (ellipsis + visible_width(keep) >= width
+			|| !(str = malloc(ellipsis + strlen(keep) + 1)))
+		return 0;
+	strcpy(str, LAYOUT_ELLIPSIS);
+	strcat(str, keep);
+	ps->str = str;
+	ps->needs_free = true;
+	return width - ellipsis - visible_width(keep);
+}
+
+int terminal_columns(void)
+{
+	struct winsize size;
+
+	if (!PROMPT_MIN_COLUMNS)
+		return 0;
+	// Whichever is the terminal, stdout is a pipe under $(cprompt)
+	for (int fd = STDIN_FILENO; fd <= STDERR_FILENO; fd++)
+		if (ioctl(fd, TIOCGWINSZ, &size) == 0 && size.ws_col)
+			return size.ws_col;
+	return 0;
+}
+
+struct prompt_string* layout_prompt(enum prompt_side side,
+	const struct prompt_string* elements, size_t len, int columns)
+{
+	struct prompt_string* laid_out;
+	const PromptElement* elems;
+	size_t width = 0, excess, lost;
+	int count;
+
+	if (!(laid_out = malloc((len + 1) * sizeof(*laid_out))))
+		return NULL;
+	for (size_t i = 0; i < len; i++) {
+		laid_out[i] = elements[i];
+		laid_out[i].needs_free = false;
+		if (PROMPT_MIN_COLUMNS && columns > 0)
+			width += visible_width(elements[i].str);
+	}
+	// zsh already hides a right prompt that doesn't fit
+	if (side != PromptLeft || !PROMPT_MIN_COLUMNS || columns <= 0
+			|| width + PROMPT_MIN_COLUMNS <= (size_t)columns)
+		return laid_out;
+
+	// Values from a daemon of another build may not be these elements
+	elems = get_prompt(side, &count);
+	if (len != (size_t)count)
+		return laid_out;
+	excess = width + PROMPT_MIN_COLUMNS - columns;
+	for (size_t i = 0; excess && i < len; i++) {
+		if (elems[i].type != PwdTrunc)
+			continue;
+		lost = shorten_pwd(&laid_out[i], elements[i].str, excess);
+		excess -= lost < excess ? lost : excess;
+	}
+	return laid_out;
+}
+
+/**
+ * @brief Recomputes the elements in `stale_elements`
+ *
+ * Called after the prompt has been printed: the shell gets its prompt right
+ * away and the next prompt shows the refreshed values.
+ *
+ * @param[in] detach Whether to do it in a detached child rather than here
+ * @return Whether there was anything to refresh
+ */
+bool refresh_stale_elements(bool detach)
+{
+	struct latency_model model;
+	struct latency_record* record;
+	struct prompt_string ps;
+	const PromptElement* elems;
+	bool any = false;
+	int count;
+
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		get_prompt(side, &count);
+		for (int i = 0; i < count; ++i)
+			any |= stale_elements[side][i];
+	}
+	if (!any)
+		return false;
+
+	if (detach && !latency_fork_refresher()) {
+		memset(stale_elements, 0, sizeof(stale_elements));
+		return true;
+	}
+
+	if (open_latency_model(&model)) {
+		for (int side = 0; side < PROMPT_SIDES; side++) {
+			elems = get_prompt(side, &count);
+			for (int i = 0; i < count; ++i) {
+				if (!stale_elements[side][i])
+					continue;
+				record = lookup_element(&model, side, i, elems[i].type);
+				if (!record)
+					continue;
+				render_element_timed(&ps, &elems[i], record);
+				if (ps.needs_free)
+					free(ps.str);
+			}
 		}
+		latency_close(&model);
 	}
+	memset(stale_elements, 0, sizeof(stale_elements));
+	if (detach)
+		_exit(0);
+	return true;
+}
 
-	return elements;
+void* take_stale_elements(void)
+{
+	void* taken;
+	int count;
+
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		get_prompt(side, &count);
+		for (int i = 0; i < count; ++i) {
+			if (!stale_elements[side][i])
+				continue;
+			if ((taken = malloc(sizeof(stale_elements))))
+				memcpy(taken, stale_elements, sizeof(stale_elements));
+			memset(stale_elements, 0, sizeof(stale_elements));
+			return taken;
+		}
+	}
+	return NULL;
+}
+
+void give_stale_elements(void* taken)
+{
+	memcpy(stale_elements, taken, sizeof(stale_elements));
+	free(taken);
+}
+
+char* take_stale_elements_arg(void)
+{
+	char* arg, *at;
+	bool any = false;
+	int count;
+
+	if (!(arg = malloc(prompt_elements + rprompt_elements + PROMPT_SIDES)))
+		return NULL;
+	at = arg;
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		get_prompt(side, &count);
+		for (int i = 0; i < count; ++i) {
+			*at++ = stale_elements[side][i] ? '1' : '0';
+			any |= stale_elements[side][i];
+		}
+		*at++ = side == PROMPT_SIDES - 1 ? 0 : ',';
+	}
+	memset(stale_elements, 0, sizeof(stale_elements));
+	if (!any) {
+		free(arg);
+		return NULL;
+	}
+	return arg;
+}
+
+bool give_stale_elements_arg(const char* arg)
+{
+	int count;
+
+	memset(stale_elements, 0, sizeof(stale_elements));
+	for (int side = 0; side < PROMPT_SIDES; side++) {
+		get_prompt(side, &count);
+		for (int i = 0; i < count; ++i) {
+			if (*arg != '0' && *arg != '1')
+				return false;
+			stale_elements[side][i] = *arg++ == '1';
+		}
+		if (*arg++ != (side == PROMPT_SIDES - 1 ? 0 : ','))
+			return false;
+	}
+	return true;
+}
+
+void render_for(const struct render_client* who)
+{
+	client = who;
+}
+
+uid_t render_uid(void)
+{
+	return client ? client->uid : getuid();
 }
 
 /**
@@ -526,24 +1144,86 @@ struct prompt_string* make_exploded_prompt(size_t* len)
  */
 void exploded_prompt_free(struct prompt_string exploded_prompt[], const size_t len)
 {
-	for (int i = 0; i < len; ++i)
+	for (size_t i = 0; i < len; ++i)
 		if (exploded_prompt[i].needs_free)
 			free(exploded_prompt[i].str);
 
 	free(exploded_prompt);
 }
 
-int main(void)
+// cprompt.so, the bash builtin, has its own entry point in bash.c
+#ifndef CPROMPT_BUILTIN
+int main(int argc, char* argv[])
 {
 	size_t exploded_length;
-	struct prompt_string* exploded_prompt = make_exploded_prompt(&exploded_length);
+	struct prompt_string* exploded_prompt, *laid_out;
+	enum prompt_side side = PromptLeft;
+	bool have_histno = false, use_daemon = false, running;
+	long histno = 0;
+	char* end;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "cdln:rR:sV")) != -1) {
+		switch (opt) {
+		case 'c':
+			use_daemon = true;
+			break;
+		case 'd':
+			return daemon_main(DAEMON_WORKERS, DAEMON_BACKGROUND, false);
+		case 's':
+			return daemon_main(DAEMON_WORKERS, DAEMON_BACKGROUND, true);
+		case 'l':
+			return live_main();
+		case 'V':
+			return vcs_info_main(argc, argv);
+		case 'n':
+			histno = strtol(optarg, &end, 10);
+			have_histno = *optarg && !*end;
+			break;
+		case 'r':
+			side = PromptRight;
+			break;
+		case 'R':
+			// cprompt.so hands its refreshes over, see bash.c
+			if (!give_stale_elements_arg(optarg))
+				return 1;
+			refresh_stale_elements(true);
+			return 0;
+		default:
+			fprintf(stderr, "usage: %s [-l | -d | -s | -V ... | [-c] [-r] [-n histno]]\n",
+				argv[0]);
+			return 1;
+		}
+	}
 
-	for (int i = 0; i < exploded_length; i++) {
+	// Without a daemon to answer, render here
+	exploded_prompt = NULL;
+	if (use_daemon) {
+		exploded_prompt = daemon_render(side, &exploded_length, &running);
+		if (!running && DAEMON_AUTOSTART)
+			daemon_start(DAEMON_WORKERS, DAEMON_BACKGROUND);
+	}
+	if (!exploded_prompt && have_histno)
+		exploded_prompt = session_render(side, histno, &exploded_length);
+	else if (!exploded_prompt)
+		exploded_prompt = make_exploded_prompt(side, &exploded_length);
+	if (!exploded_prompt)
+		return 1;
+	if (!(laid_out = layout_prompt(side, exploded_prompt, exploded_length,
+			terminal_columns()))) {
+		exploded_prompt_free(exploded_prompt, exploded_length);
+		return 1;
+	}
+	for (size_t i = 0; i < exploded_length; i++) {
 		if (i == exploded_length - 1)
-			printf("%s\n", exploded_prompt[i].str);
+			printf("%s\n", laid_out[i].str);
 		else
-			printf("%s", exploded_prompt[i].str);
+			printf("%s", laid_out[i].str);
 	}
 
+	exploded_prompt_free(laid_out, exploded_length);
 	exploded_prompt_free(exploded_prompt, exploded_length);
+	refresh_stale_elements(true);
+	session_refresh();
 }
+#endif
@@ -0,0 +1,188 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "config.h"
+#include "nameddir.h"
+
+void nameddir_init(struct nameddir_trie* trie)
+{
+	trie->nodes = NULL;
+	trie->node_count = trie->node_cap = 0;
+	trie->names = NULL;
+	trie->name_count = trie->name_cap = 0;
+}
+
+/**
+ * @brief Appends a node to the trie
+ *
+ * @param[in,out] trie The trie
+ * @param[in] c The byte the node matches
+ * @return The index of the node, -1 if out of memory
+ */
+static int new_node(struct nameddir_trie* trie, char c)
+{
+	struct nameddir_node* nodes;
+	int cap;
+
+	if (trie->node_count == trie->node_cap) {
+		cap = trie->node_cap ? trie->node_cap * 2 : 64;
+		nodes = realloc(trie->nodes, cap * sizeof(*nodes));
+		if (!nodes)
+			return -1;
+		trie->nodes = nodes;
+		trie->node_cap = cap;
+	}
+	trie->nodes[trie->node_count] = (struct nameddir_node){
+		.c = c, .child = -1, .sibling = -1, .name = -1,
+	};
+	return trie->node_count++;
+}
+
+/**
+ * @brief Finds the child of a node matching a byte
+ *
+ * @param[in] trie The trie
+ * @param[in] node The parent
+ * @param[in] c The byte to match
+ * @return The index of the child, -1 if there is none
+ */
+static int find_child(const struct nameddir_trie* trie, int node, char c)
+{
+	for (node = trie->nodes[node].child; node != -1;
+			node = trie->nodes[node].sibling)
+		if (trie->nodes[node].c == c)
+			return node;
+	return -1;
+}
+
+bool nameddir_add(struct nameddir_trie* trie, const char* path,
+	const char* replacement)
+{
+	char** names, *copy;
+	size_t len;
+	int node, child, cap;
+
+	len = strnlen(path, PATH_MAX);
+	while (len > 0 && path[len - 1] == '/')
+		len--;
+	// Relative and root directories are never abbreviated
+	if (len == 0 || *path != '/')
+		return true;
+
+	if (!trie->node_count && new_node(trie, 0) == -1)
+		return false;
+	node = 0;
+	for (size_t i = 0; i < len; i++) {
+		child = find_child(trie, node, path[i]);
+		if (child == -1) {
+			if ((child = new_node(trie, path[i])) == -1)
+				return false;
+			trie->nodes[child].sibling = trie->nodes[node].child;
+			trie->nodes[node].child = child;
+		}
+		node = child;
+	}
+
+	if (trie->nodes[node].name != -1 && strlen(trie->names[
+			trie->nodes[node].name]) <= strlen(replacement))
+		return true;
+
+	if (trie->name_count == trie->name_cap) {
+		cap = trie->name_cap ? trie->name_cap * 2 : 16;
+		names = realloc(trie->names, cap * sizeof(*names));
+		if (!names)
+			return false;
+		trie->names = names;
+		trie->name_cap = cap;
+	}
+	if (!(copy = strdup(replacement)))
+		return false;
+	trie->names[trie->name_count] = copy;
+	trie->nodes[node].name = trie->name_count++;
+	return true;
+}
+
+/**
+ * @brief Copies a word written the way zsh quotes it, dropping the quotes
+ *
+ * @param[out] out The unquoted word
+ * @param[in] size The size of out
+ * @param[in] in The quoted word
+ * @param[in] end Where the quoted word ends
+ * @return false if the word does not fit
+ */
+static bool unquote(char* out, size_t size, const char* in, const char* end)
+{
+	bool quoted = false;
+	size_t len = 0;
+
+	for (; in < end; in++) {
+		if (*in == '\'') {
+			quoted = !quoted;
+			continue;
+		}
+		if (*in == '\\' && !quoted && in + 1 < end)
+			in++;
+		if (len + 1 >= size)
+			return false;
+		out[len++] = *in;
+	}
+	out[len] = 0;
+	return true;
+}
+
+bool nameddir_add_spec(struct nameddir_trie* trie, const char* spec)
+{
+	char name[PATH_MAX], path[PATH_MAX];
+	const char* line, *eq, *end;
+
+	for (line = spec; *line; line = *end ? end + 1 : end) {
+		end = strchr(line, '\n');
+		if (!end)
+			end = line + strlen(line);
+		eq = memchr(line, '=', end - line);
+		if (!eq || eq == line)
+			continue;
+
+		name[0] = '~';
+		if (!unquote(name + 1, PATH_MAX - 1, line, eq)
+				|| !unquote(path, PATH_MAX, eq + 1, end))
+			continue;
+		if (!nameddir_add(trie, path, name))
+			return false;
+	}
+	return true;
+}
+
+size_t nameddir_match(const struct nameddir_trie* trie, const char* path,
+	const char** replacement)
+{
+	size_t i, matched = 0;
+	int node = 0;
+
+	if (!trie->node_count)
+		return 0;
+	for (i = 0; path[i]; i++) {
+		if ((node = find_child(trie, node, path[i])) == -1)
+			break;
+		if (trie->nodes[node].name != -1
+				&& (path[i + 1] == '/' || path[i + 1] == 0)) {
+			matched = i + 1;
+			*replacement = trie->names[trie->nodes[node].name];
+		}
+	}
+	return matched;
+}
+
+void nameddir_free(struct nameddir_trie* trie)
+{
+	for (int i = 0; i < trie->name_count; i++)
+		free(trie->names[i]);
+	free(trie->names);
+	free(trie->nodes);
+	nameddir_init(trie);
+}
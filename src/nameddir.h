@@ -0,0 +1,90 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_NAMEDDIR_H
+#define CPROMPT_NAMEDDIR_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+/* Named directories
+ *
+ * A set of directory prefixes (like zsh's `hash -d`) that get abbreviated in
+ * the PWD, compiled into a byte trie so the longest matching prefix is found
+ * in a single pass over the path.
+ */
+
+typedef struct {
+	const char* name; // Shown as ~name
+	const char* path;
+} NamedDir;
+
+struct nameddir_node {
+	char c;
+	int child; // First child, -1 if none
+	int sibling; // Next sibling, -1 if none
+	int name; // Index into names if a prefix ends here, -1 if not
+};
+
+struct nameddir_trie {
+	struct nameddir_node* nodes;
+	int node_count;
+	int node_cap;
+	char** names;
+	int name_count;
+	int name_cap;
+};
+
+/**
+ * @brief Initializes an empty trie
+ *
+ * @param[out] trie The trie to initialize
+ */
+void nameddir_init(struct nameddir_trie* trie);
+
+/**
+ * @brief Adds a prefix to the trie
+ *
+ * When the same path is added twice the shorter replacement wins, like zsh.
+ *
+ * @param[in,out] trie The trie
+ * @param[in] path The absolute directory, trailing slashes are ignored
+ * @param[in] replacement What the directory is shown as, ~name or ~
+ * @return false if out of memory
+ */
+bool nameddir_add(struct nameddir_trie* trie, const char* path,
+	const char* replacement);
+
+/**
+ * @brief Adds every directory in the output of zsh's `hash -d`
+ *
+ * Lines look like name=/path, with the path quoted if needed.
+ *
+ * @param[in,out] trie The trie
+ * @param[in] spec The list of named directories, one per line
+ * @return false if out of memory
+ */
+bool nameddir_add_spec(struct nameddir_trie* trie, const char* spec);
+
+/**
+ * @brief Finds the longest prefix of a path that is a named directory
+ *
+ * Only whole components match: /home/me does not match /home/meow.
+ *
+ * @param[in] trie The trie
+ * @param[in] path The path to match
+ * @param[out] replacement What the prefix is shown as
+ * @return The length of the matched prefix, 0 if none matched
+ */
+size_t nameddir_match(const struct nameddir_trie* trie, const char* path,
+	const char** replacement);
+
+/**
+ * @brief Frees everything the trie owns
+ *
+ * @param[in] trie The trie
+ */
+void nameddir_free(struct nameddir_trie* trie);
+
+#endif
@@ -0,0 +1,549 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "prompt.h"
+#include "pack.h"
+
+// Repositories whose packs are kept mapped
+#define PACK_DIRS_MAX 8
+// Packs of one repository we look at
+#define PACK_MAX 4096
+
+#define IDX_MAGIC "\377tOc"
+#define IDX_FANOUT 1024
+#define MIDX_MAGIC "MIDX"
+#define MIDX_HEADER 12
+// An offset with this bit is an index into the 64-bit offsets
+#define PACK_LARGE_OFFSET 0x80000000u
+
+struct git_pack {
+	char* name; // pack-<hash>, in objects/pack
+	// Its .idx, mapped when first searched; NULL when the midx covers it
+	const uint8_t* idx;
+	size_t idx_size;
+	bool idx_failed;
+	const uint8_t* data; // The .pack, mapped when first read
+	size_t size;
+	bool data_failed;
+};
+
+struct git_packs {
+	char dir[PATH_MAX]; // objects/pack
+	uid_t uid; // Whom they were opened for
+	uint64_t dev;
+	uint64_t ino;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	int oid_size;
+	int users;
+	bool registered; // In the registry, freed by it rather than its users
+	uint64_t used; // When it was last opened, to evict the oldest
+
+	// The multi-pack-index, which covers the first midx_packs packs
+	const uint8_t* midx;
+	size_t midx_size;
+	uint32_t midx_packs;
+	const uint8_t* midx_fanout;
+	const uint8_t* midx_oids;
+	const uint8_t* midx_offsets;
+	const uint8_t* midx_large;
+	size_t midx_large_count;
+
+	struct git_pack* packs;
+	int count;
+	// Where the last object was found, a hint threads race to set
+	atomic_int last;
+};
+
+static pthread_mutex_t packs_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct git_packs* registry[PACK_DIRS_MAX];
+static uint64_t packs_clock;
+
+static uint32_t be32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static uint64_t be64(const uint8_t* p)
+{
+	return (uint64_t)be32(p) << 32 | be32(p + 4);
+}
+
+/**
+ * @brief Maps a file of objects/pack
+ *
+ * @param[in] dir objects/pack
+ * @param[in] name The file
+ * @param[out] size Its size
+ * @return The mapping, NULL if it can't be read
+ */
+static const uint8_t* map_file(const char* dir, const char* name,
+	size_t* size)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	void* map;
+	int fd;
+
+	if (snprintf(path, PATH_MAX, "%s/%s", dir, name) >= PATH_MAX
+			|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return NULL;
+	if (fstat(fd, &st) == -1 || !st.st_size) {
+		close(fd);
+		return NULL;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+	*size = st.st_size;
+	return map;
+}
+
+static void packs_free(struct git_packs* packs)
+{
+	for (int i = 0; i < packs->count; i++) {
+		if (packs->packs[i].idx)
+			munmap((void*)packs->packs[i].idx, packs->packs[i].idx_size);
+		if (packs->packs[i].data)
+			munmap((void*)packs->packs[i].data, packs->packs[i].size);
+		free(packs->packs[i].name);
+	}
+	if (packs->midx)
+		munmap((void*)packs->midx, packs->midx_size);
+	free(packs->packs);
+	free(packs);
+}
+
+/**
+ * @brief Adds a pack to the list
+ *
+ * @param[in,out] packs The packs
+ * @param[in] name Its name, with or without an extension
+ * @return false if out of memory or room
+ */
+static bool add_pack(struct git_packs* packs, const char* name)
+{
+	const char* dot = strrchr(name, '.');
+	size_t len = dot ? (size_t)(dot - name) : strlen(name);
+	struct git_pack* pack;
+
+	if (packs->count == PACK_MAX)
+		return false;
+	if (packs->count % 64 == 0) {
+		pack = realloc(packs->packs, (packs->count + 64) * sizeof(*pack));
+		if (!pack)
+			return false;
+		packs->packs = pack;
+	}
+	pack = &packs->packs[packs->count];
+	memset(pack, 0, sizeof(*pack));
+	if (!(pack->name = strndup(name, len)))
+		return false;
+	packs->count++;
+	return true;
+}
+
+/**
+ * @brief Whether a fanout table can be searched: it never goes down, so it
+ * never goes past its last entry, the size of the table of ids
+ *
+ * @param[in] fanout The table
+ */
+static bool fanout_valid(const uint8_t* fanout)
+{
+	uint32_t count, prev = 0;
+
+	for (int i = 0; i < 256; i++, prev = count)
+		if ((count = be32(fanout + 4 * i)) < prev)
+			return false;
+	return true;
+}
+
+/**
+ * @brief Reads the multi-pack-index, if there is one
+ *
+ * Its packs become the first of the list, in its order.
+ *
+ * @param[in,out] packs The packs, with none listed yet
+ */
+static void load_midx(struct git_packs* packs)
+{
+	const uint8_t* m, *chunk, *names = NULL, *names_end = NULL;
+	uint64_t start, end;
+	uint32_t id, n;
+	size_t chunks;
+
+	if (!(m = map_file(packs->dir, "multi-pack-index", &packs->midx_size)))
+		return;
+	packs->midx = m;
+	chunks = packs->midx_size >= MIDX_HEADER ? m[6] : 0;
+	// Version 1 or 2, the same hash as the repository, no base midx
+	if (packs->midx_size < MIDX_HEADER + (chunks + 1) * 12
+			|| memcmp(m, MIDX_MAGIC, 4) || m[4] < 1 || m[4] > 2
+			|| (m[5] == 2) != (packs->oid_size == 32) || m[7])
+		goto invalid;
+	packs->midx_packs = be32(m + 8);
+
+	for (size_t i = 0; i < chunks; i++) {
+		chunk = m + MIDX_HEADER + i * 12;
+		id = be32(chunk);
+		start = be64(chunk + 4);
+		end = be64(chunk + 16);
+		if (start > end || end > packs->midx_size)
+			goto invalid;
+		if (id == 0x504e414d) { // PNAM
+			names = m + start;
+			names_end = m + end;
+		} else if (id == 0x4f494446 && end - start == IDX_FANOUT) { // OIDF
+			packs->midx_fanout = m + start;
+		} else if (id == 0x4f49444c) { // OIDL
+			packs->midx_oids = m + start;
+		} else if (id == 0x4f4f4646) { // OOFF
+			packs->midx_offsets = m + start;
+		} else if (id == 0x4c4f4646) { // LOFF
+			packs->midx_large = m + start;
+			packs->midx_large_count = (end - start) / 8;
+		}
+	}
+	if (!names || !packs->midx_fanout || !packs->midx_oids
+			|| !packs->midx_offsets)
+		goto invalid;
+	n = be32(packs->midx_fanout + 4 * 255);
+	if (!fanout_valid(packs->midx_fanout) || packs->midx_oids + (uint64_t)n * packs->oid_size > m + packs->midx_size
+			|| packs->midx_offsets + (uint64_t)n * 8 > m + packs->midx_size)
+		goto invalid;
+
+	// NUL terminated .idx names, padded with NULs
+	for (uint32_t i = 0; i < packs->midx_packs; i++) {
+		while (names < names_end && !*names)
+			names++;
+		if (names == names_end || !memchr(names, 0, names_end - names)
+				|| !add_pack(packs, (const char*)names))
+			goto invalid;
+		names += strlen((const char*)names) + 1;
+	}
+	return;
+
+invalid:
+	for (int i = 0; i < packs->count; i++)
+		free(packs->packs[i].name);
+	packs->count = 0;
+	packs->midx_packs = 0;
+	munmap((void*)packs->midx, packs->midx_size);
+	packs->midx = NULL;
+}
+
+/**
+ * @brief Whether a pack is one of the first count packs of the list
+ */
+static bool listed(const struct git_packs* packs, int count, const char* name)
+{
+	const char* dot = strrchr(name, '.');
+	size_t len = dot - name;
+
+	for (int i = 0; i < count; i++)
+		if (!strncmp(packs->packs[i].name, name, len)
+				&& !packs->packs[i].name[len])
+			return true;
+	return false;
+}
+
+/**
+ * @brief Lists the packs of a directory
+ *
+ * @param[in] dir objects/pack
+ * @param[in] st Its stat
+ * @param[in] oid_size The size of object ids
+ * @return The packs, or NULL if out of memory
+ */
+static struct git_packs* packs_load(const char* dir, const struct stat* st,
+	int oid_size)
+{
+	struct git_packs* packs;
+	struct dirent* entry;
+	const char* dot;
+	DIR* d;
+
+	if (!(packs = calloc(1, sizeof(*packs))))
+		return NULL;
+	strcpy(packs->dir, dir);
+	packs->uid = render_uid();
+	packs->dev = st->st_dev;
+	packs->ino = st->st_ino;
+	packs->mtime_sec = st->st_mtime;
+	packs->mtime_nsec = ST_MTIM_NSEC(*st);
+	packs->oid_size = oid_size;
+	load_midx(packs);
+
+	if (!(d = opendir(dir)))
+		return packs;
+	while ((entry = readdir(d))) {
+		dot = strrchr(entry->d_name, '.');
+		if (dot && !strcmp(dot, ".idx")
+				&& !listed(packs, packs->midx_packs, entry->d_name))
+			add_pack(packs, entry->d_name);
+	}
+	closedir(d);
+	return packs;
+}
+
+struct git_packs* git_packs_open(const struct git_repo* repo)
+{
+	struct git_packs* packs = NULL, *oldest = NULL;
+	char dir[PATH_MAX];
+	struct stat st;
+	int slot = -1;
+
+	if (snprintf(dir, PATH_MAX, "%s/objects/pack", repo->commondir)
+			>= PATH_MAX || stat(dir, &st) == -1)
+		return NULL;
+
+	pthread_mutex_lock(&packs_lock);
+	for (int i = 0; i < PACK_DIRS_MAX; i++) {
+		if (!registry[i]) {
+			slot = slot == -1 ? i : slot;
+			continue;
+		}
+		if (strcmp(registry[i]->dir, dir)
+				|| registry[i]->uid != render_uid()) {
+			if (!registry[i]->users && (!oldest
+					|| registry[i]->used < oldest->used))
+				oldest = registry[i];
+			continue;
+		}
+		if (registry[i]->dev == st.st_dev && registry[i]->ino == st.st_ino
+				&& registry[i]->mtime_sec == st.st_mtime
+				&& registry[i]->mtime_nsec == ST_MTIM_NSEC(st)
+				&& registry[i]->oid_size == repo->oid_size) {
+			packs = registry[i];
+			break;
+		}
+		// Out of date: gone when its last user is done with it
+		registry[i]->registered = false;
+		if (!registry[i]->users)
+			packs_free(registry[i]);
+		registry[i] = NULL;
+		slot = i;
+	}
+
+	if (!packs && (packs = packs_load(dir, &st, repo->oid_size))) {
+		if (slot == -1 && oldest) {
+			for (slot = 0; registry[slot] != oldest; slot++);
+			packs_free(oldest);
+		}
+		if (slot != -1) {
+			registry[slot] = packs;
+			packs->registered = true;
+		}
+	}
+	if (packs) {
+		packs->users++;
+		packs->used = ++packs_clock;
+	}
+	pthread_mutex_unlock(&packs_lock);
+	return packs;
+}
+
+void git_packs_close(struct git_packs* packs)
+{
+	if (!packs)
+		return;
+	pthread_mutex_lock(&packs_lock);
+	if (!--packs->users && !packs->registered)
+		packs_free(packs);
+	pthread_mutex_unlock(&packs_lock);
+}
+
+/**
+ * @brief Binary search of a sorted table of object ids
+ *
+ * @param[in] fanout How many ids start with each byte or less
+ * @param[in] oids The ids
+ * @param[in] oid_size Their size
+ * @param[in] oid The id to find
+ * @param[out] pos Its position
+ * @return false if it isn't there
+ */
+static bool search_oids(const uint8_t* fanout, const uint8_t* oids,
+	int oid_size, const uint8_t* oid, uint32_t* pos)
+{
+	uint32_t lo = oid[0] ? be32(fanout + 4 * (oid[0] - 1)) : 0;
+	uint32_t hi = be32(fanout + 4 * oid[0]), mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		cmp = memcmp(oids + (size_t)mid * oid_size, oid, oid_size);
+		if (!cmp) {
+			*pos = mid;
+			return true;
+		}
+		if (cmp < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return false;
+}
+
+/**
+ * @brief Maps the .idx of a pack, checking that its tables fit
+ *
+ * @param[in] packs The packs
+ * @param[in,out] pack The pack
+ * @return false if it can't be read
+ */
+static bool map_idx(struct git_packs* packs, struct git_pack* pack)
+{
+	char name[PATH_MAX];
+	const uint8_t* idx;
+	uint32_t n;
+	size_t size;
+
+	pthread_mutex_lock(&packs_lock);
+	if (!pack->idx && !pack->idx_failed) {
+		snprintf(name, PATH_MAX, "%s.idx", pack->name);
+		if ((idx = map_file(packs->dir, name, &size))) {
+			n = size >= 8 + IDX_FANOUT ? be32(idx + 8 + 4 * 255) : 0;
+			// Version 2: magic, fanout, ids, CRCs, offsets, 64-bit offsets
+			if (size >= 8 + IDX_FANOUT && !memcmp(idx, IDX_MAGIC, 4)
+					&& be32(idx + 4) == 2 && fanout_valid(idx + 8)
+					&& size >= 8 + IDX_FANOUT
+					+ (uint64_t)n * (packs->oid_size + 8)
+					+ 2 * packs->oid_size) {
+				pack->idx_size = size;
+				pack->idx = idx;
+			} else {
+				munmap((void*)idx, size);
+			}
+		}
+		pack->idx_failed = !pack->idx;
+	}
+	pthread_mutex_unlock(&packs_lock);
+	return pack->idx;
+}
+
+/**
+ * @brief Finds an object in the .idx of a pack
+ *
+ * @param[in] packs The packs
+ * @param[in] pack The pack
+ * @param[in] oid The object id
+ * @param[out] offset Where it is in the pack
+ * @return false if the pack doesn't have it
+ */
+static bool idx_find(struct git_packs* packs, struct git_pack* pack,
+	const uint8_t* oid, uint64_t* offset)
+{
+	const uint8_t* offsets, *large;
+	uint32_t n, pos, off;
+
+	if (!map_idx(packs, pack) || !search_oids(pack->idx + 8, pack->idx
+			+ 8 + IDX_FANOUT, packs->oid_size, oid, &pos))
+		return false;
+	n = be32(pack->idx + 8 + 4 * 255);
+	offsets = pack->idx + 8 + IDX_FANOUT + (size_t)n * (packs->oid_size + 4);
+	off = be32(offsets + 4 * pos);
+	if (!(off & PACK_LARGE_OFFSET)) {
+		*offset = off;
+		return true;
+	}
+	large = offsets + 4 * (size_t)n + 8 * (size_t)(off & ~PACK_LARGE_OFFSET);
+	if (large + 8 > pack->idx + pack->idx_size - 2 * packs->oid_size)
+		return false;
+	*offset = be64(large);
+	return true;
+}
+
+/**
+ * @brief Finds an object in the multi-pack-index
+ *
+ * @param[in] packs The packs
+ * @param[in] oid The object id
+ * @param[out] pack Which pack it is in
+ * @param[out] offset Where it is in the pack
+ * @return false if the multi-pack-index doesn't have it
+ */
+static bool midx_find(const struct git_packs* packs, const uint8_t* oid,
+	int* pack, uint64_t* offset)
+{
+	const uint8_t* entry;
+	uint32_t pos, off;
+
+	if (!packs->midx || !search_oids(packs->midx_fanout, packs->midx_oids,
+			packs->oid_size, oid, &pos))
+		return false;
+	entry = packs->midx_offsets + 8 * (size_t)pos;
+	if (be32(entry) >= packs->midx_packs)
+		return false;
+	*pack = be32(entry);
+	off = be32(entry + 4);
+	if (!(off & PACK_LARGE_OFFSET)) {
+		*offset = off;
+		return true;
+	}
+	if (!packs->midx_large || (off & ~PACK_LARGE_OFFSET)
+			>= packs->midx_large_count)
+		return false;
+	*offset = be64(packs->midx_large + 8 * (size_t)(off & ~PACK_LARGE_OFFSET));
+	return true;
+}
+
+bool git_packs_find(struct git_packs* packs, const uint8_t oid[GIT_OID_MAX],
+	int* pack, uint64_t* offset)
+{
+	int last = atomic_load_explicit(&packs->last, memory_order_relaxed);
+
+	if (midx_find(packs, oid, pack, offset))
+		return true;
+	// Objects of a commit tend to be in the same pack
+	if (last >= (int)packs->midx_packs && last < packs->count
+			&& idx_find(packs, &packs->packs[last], oid, offset)) {
+		*pack = last;
+		return true;
+	}
+	for (int i = packs->midx_packs; i < packs->count; i++) {
+		if (i != last && idx_find(packs, &packs->packs[i], oid, offset)) {
+			*pack = i;
+			atomic_store_explicit(&packs->last, i, memory_order_relaxed);
+			return true;
+		}
+	}
+	return false;
+}
+
+const uint8_t* git_pack_data(struct git_packs* packs, int pack, size_t* size)
+{
+	struct git_pack* p = &packs->packs[pack];
+	char name[PATH_MAX];
+
+	pthread_mutex_lock(&packs_lock);
+	if (!p->data && !p->data_failed) {
+		snprintf(name, PATH_MAX, "%s.pack", p->name);
+		p->data = map_file(packs->dir, name, &p->size);
+		// PACK, version 2 or 3, then the objects and a trailing hash
+		if (p->data && (p->size < 12 + (size_t)packs->oid_size
+				|| memcmp(p->data, "PACK", 4))) {
+			munmap((void*)p->data, p->size);
+			p->data = NULL;
+		}
+		p->data_failed = !p->data;
+	}
+	pthread_mutex_unlock(&packs_lock);
+	*size = p->size;
+	return p->data;
+}
@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_PACK_H
+#define CPROMPT_PACK_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "git.h"
+
+/* Packs
+ *
+ * Finds objects in the packs of a repository. The multi-pack-index is
+ * searched first, then the .idx of every pack it doesn't cover, each by its
+ * fanout table and a binary search, starting with the pack of the last
+ * object found. Files are mmapped the first time they are needed.
+ *
+ * Packs the multi-pack-index doesn't cover cost a search each: there is no
+ * merged table for them, which would take reading every .idx through to
+ * build on each run of cprompt. git multi-pack-index write (or git
+ * maintenance) brings them down to one search.
+ *
+ * The mappings of a repository's packs stay around for the life of the
+ * process, so the daemon and the shell modules reuse them from one prompt
+ * to the next. They are dropped when objects/pack changes (packs are never
+ * modified, only added and removed).
+ */
+
+struct git_packs;
+
+/**
+ * @brief Gets the packs of a repository
+ *
+ * @param[in] repo The repository
+ * @return The packs, to release with git_packs_close, or NULL if it has none
+ */
+struct git_packs* git_packs_open(const struct git_repo* repo);
+
+/**
+ * @brief Finds an object in the packs
+ *
+ * @param[in] packs The packs
+ * @param[in] oid The object id
+ * @param[out] pack Which pack it is in, for git_pack_data
+ * @param[out] offset Where it starts in the pack
+ * @return false if no pack has it
+ */
+bool git_packs_find(struct git_packs* packs, const uint8_t oid[GIT_OID_MAX],
+	int* pack, uint64_t* offset);
+
+/**
+ * @brief Gets the contents of a pack
+ *
+ * @param[in] packs The packs
+ * @param[in] pack The pack, from git_packs_find
+ * @param[out] size The size of the pack
+ * @return The pack, valid until git_packs_close, or NULL if it can't be read
+ */
+const uint8_t* git_pack_data(struct git_packs* packs, int pack,
+	size_t* size);
+
+/**
+ * @brief Releases packs
+ *
+ * @param[in] packs What git_packs_open returned
+ */
+void git_packs_close(struct git_packs* packs);
+
+#endif
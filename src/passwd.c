@@ -0,0 +1,288 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "passwd.h"
+
+#define NSSWITCH_PATH "/etc/nsswitch.conf"
+#define PASSWD_PATH "/etc/passwd"
+#define NSSWITCH_MAGIC 0x4e535331 // NSS1
+#define NSSWITCH_KEY 1
+
+struct nsswitch_record {
+	uint64_t key;
+	uint64_t ino;
+	int64_t size;
+	int64_t mtime_sec;
+	int64_t mtime_nsec;
+	uint32_t files_first;
+	uint32_t reserved;
+};
+
+/**
+ * @brief Parses nsswitch.conf to see if passwd is looked up in files first
+ *
+ * @param[in] conf The contents of nsswitch.conf
+ * @param[in] len The length of conf
+ */
+static bool parse_files_first(const char* conf, size_t len)
+{
+	const char* p = conf, *end = conf + len, *eol;
+
+	for (; p < end; p = eol + 1) {
+		if (!(eol = memchr(p, '\n', end - p)))
+			eol = end;
+		while (p < eol && (*p == ' ' || *p == '\t'))
+			p++;
+		if (eol - p < 7 || memcmp(p, "passwd:", 7))
+			continue;
+		for (p += 7; p < eol && (*p == ' ' || *p == '\t'); p++);
+		return eol - p >= 5 && !memcmp(p, "files", 5)
+			&& (eol - p == 5 || p[5] == ' ' || p[5] == '\t');
+	}
+	// glibc defaults to files when there is no passwd line
+	return true;
+}
+
+/**
+ * @brief Checks if NSS looks passwd up in files first
+ *
+ * The answer is cached against the inode, size and mtime of nsswitch.conf, so
+ * after the first run this costs a stat.
+ */
+static bool nsswitch_files_first(void)
+{
+	struct cache_table table;
+	struct nsswitch_record* record = NULL;
+	struct stat st;
+	char* conf;
+	bool files_first;
+	int fd;
+
+	// No nsswitch.conf (macOS for one): we can't know what is consulted
+	if (stat(NSSWITCH_PATH, &st) == -1)
+		return false;
+
+	if (cache_table_open(&table, "nsswitch", NSSWITCH_MAGIC, 1,
+			sizeof(struct nsswitch_record))) {
+		record = cache_table_find(&table, NSSWITCH_KEY, true);
+		if (record && record->ino == st.st_ino && record->size == st.st_size
+				&& record->mtime_sec == st.st_mtime
+				&& record->mtime_nsec == ST_MTIM_NSEC(st)) {
+			files_first = record->files_first;
+			cache_table_close(&table);
+			return files_first;
+		}
+	}
+
+	files_first = false;
+	if ((fd = open(NSSWITCH_PATH, O_RDONLY | O_CLOEXEC)) != -1) {
+		if (st.st_size > 0 && (conf = mmap(NULL, st.st_size, PROT_READ,
+				MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+			files_first = parse_files_first(conf, st.st_size);
+			munmap(conf, st.st_size);
+		}
+		close(fd);
+	}
+
+	if (record) {
+		record->ino = st.st_ino;
+		record->size = st.st_size;
+		record->mtime_sec = st.st_mtime;
+		record->mtime_nsec = ST_MTIM_NSEC(st);
+		record->files_first = files_first;
+	}
+	cache_table_close(&table);
+	return files_first;
+}
+
+/**
+ * @brief Finds the next ':' or '\n'
+ *
+ * Looks at eight bytes at a time, using the usual trick to find a zero byte
+ * in a word after xoring it with the delimiter repeated in every byte.
+ *
+ * @param[in] p Where to start
+ * @param[in] end The end of the buffer
+ * @return The delimiter, or end if there is none
+ */
+static const char* find_delim(const char* p, const char* end)
+{
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	const uint64_t ones = 0x0101010101010101ULL;
+	const uint64_t highs = 0x8080808080808080ULL;
+	uint64_t word, colons, newlines, found;
+
+	for (; end - p >= 8; p += 8) {
+		memcpy(&word, p, 8);
+		colons = word ^ (ones * ':');
+		newlines = word ^ (ones * '\n');
+		found = ((colons - ones) & ~colons & highs)
+			| ((newlines - ones) & ~newlines & highs);
+		if (found)
+			return p + __builtin_ctzll(found) / 8;
+	}
+#endif
+	for (; p < end; p++)
+		if (*p == ':' || *p == '\n')
+			return p;
+	return end;
+}
+
+/**
+ * @brief Copies a field of a passwd line
+ *
+ * @param[out] out The copy
+ * @param[in] size The size of out
+ * @param[in] start The start of the field
+ * @param[in] end The end of the field
+ * @return false if the field doesn't fit
+ */
+static bool copy_field(char* out, size_t size, const char* start,
+	const char* end)
+{
+	if ((size_t)(end - start) >= size)
+		return false;
+	memcpy(out, start, end - start);
+	out[end - start] = 0;
+	return true;
+}
+
+/**
+ * @brief Parses a uid field
+ *
+ * @param[in] start The start of the field
+ * @param[in] end The end of the field
+ * @param[out] uid The parsed uid
+ * @return false if the field is not a number a uid_t holds
+ */
+static bool parse_uid(const char* start, const char* end, uid_t* uid)
+{
+	unsigned digit;
+
+	*uid = 0;
+	if (start == end)
+		return false;
+	for (; start < end; start++) {
+		if (*start < '0' || *start > '9')
+			return false;
+		// Wrapping around could match another user
+		digit = *start - '0';
+		if (*uid > ((uid_t)-1 - digit) / 10)
+			return false;
+		*uid = *uid * 10 + digit;
+	}
+	return true;
+}
+
+/**
+ * @brief Whether a file is still the one stat saw
+ *
+ * @param[in] path The file
+ * @param[in] was What stat said then
+ */
+static bool unchanged(const char* path, const struct stat* was)
+{
+	struct stat st;
+
+	return stat(path, &st) == 0 && st.st_dev == was->st_dev
+		&& st.st_ino == was->st_ino && st.st_size == was->st_size
+		&& st.st_mtime == was->st_mtime
+		&& ST_MTIM_NSEC(st) == ST_MTIM_NSEC(*was);
+}
+
+/**
+ * @brief Scans the contents of /etc/passwd for a user
+ *
+ * @param[in] data The contents of /etc/passwd
+ * @param[in] len The length of data
+ * @param[in] uid The user to look for
+ * @param[out] entry The user's name and home directory
+ * @return true if found
+ */
+static bool scan_passwd(const char* data, size_t len, uid_t uid,
+	struct passwd_entry* entry)
+{
+	const char* line, *end = data + len, *field[7], *p;
+	uid_t value;
+	int n;
+
+	for (line = data; line < end; line = p + 1) {
+		// name:password:uid:gid:gecos:dir:shell
+		field[0] = p = line;
+		for (n = 1; n < 7; n++) {
+			p = find_delim(p, end);
+			if (p == end || *p == '\n')
+				break;
+			field[n] = ++p;
+		}
+		if (n == 7)
+			p = find_delim(p, end);
+		if (p < end && *p != '\n')
+			p = memchr(p, '\n', end - p);
+		if (!p)
+			p = end;
+		if (n != 7 || *line == '+' || *line == '-' || *line == '#')
+			continue;
+
+		if (!parse_uid(field[2], field[3] - 1, &value) || value != uid)
+			continue;
+
+		return copy_field(entry->name, sizeof(entry->name), field[0],
+				field[1] - 1)
+			&& copy_field(entry->dir, sizeof(entry->dir), field[5],
+				field[6] - 1);
+	}
+	return false;
+}
+
+bool passwd_files_lookup(uid_t uid, struct passwd_entry* entry)
+{
+	// Both the username and the home directory want this, until the file
+	// changes, or nsswitch.conf stops sending passwd to it first
+	static _Thread_local struct passwd_entry last;
+	static _Thread_local uid_t last_uid;
+	static _Thread_local struct stat last_st, last_nss;
+	static _Thread_local bool have_last = false;
+	struct stat st, nss;
+	char* data;
+	bool found = false;
+	int fd;
+
+	if (have_last && last_uid == uid && unchanged(PASSWD_PATH, &last_st)
+			&& unchanged(NSSWITCH_PATH, &last_nss)) {
+		*entry = last;
+		return true;
+	}
+	have_last = false;
+	// Before the answer it may be cached for: an edit after it is seen
+	if (stat(NSSWITCH_PATH, &nss) == -1 || !nsswitch_files_first())
+		return false;
+
+	if ((fd = open(PASSWD_PATH, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) == 0 && st.st_size > 0 && (data = mmap(NULL,
+			st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) != MAP_FAILED) {
+		found = scan_passwd(data, st.st_size, uid, entry);
+		munmap(data, st.st_size);
+	}
+	close(fd);
+
+	if (found) {
+		last = *entry;
+		last_uid = uid;
+		last_st = st;
+		last_nss = nss;
+		have_last = true;
+	}
+	return found;
+}
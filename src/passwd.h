@@ -0,0 +1,33 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_PASSWD_H
+#define CPROMPT_PASSWD_H
+
+#include <stdbool.h>
+#include <limits.h>
+#include <sys/types.h>
+
+/* Reading /etc/passwd directly
+ *
+ * getpwuid_r loads NSS modules and may ask a directory service about users
+ * that are in /etc/passwd anyway. When nsswitch.conf says passwd is looked up
+ * in files first, reading /etc/passwd ourselves gives the same answer.
+ */
+
+struct passwd_entry {
+	char name[256];
+	char dir[PATH_MAX];
+};
+
+/**
+ * @brief Looks a user up in /etc/passwd if NSS would look there first
+ *
+ * @param[in] uid The user to look up
+ * @param[out] entry The user's name and home directory
+ * @return true if found, false if getpwuid_r has to be asked instead
+ */
+bool passwd_files_lookup(uid_t uid, struct passwd_entry* entry);
+
+#endif
@@ -0,0 +1,250 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_PROMPT_H
+#define CPROMPT_PROMPT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/types.h>
+#include "env.h"
+
+enum PromptElementType {
+	StringLiteral, // Any string literal; arg is char*
+	Space, // Basically StringLiteral " "
+
+	Bell, // ASCII bell (07)
+
+	HostnameUpToDot, // The hostname up until the first dot
+	FullHostname, // You probably want to use HostnameUpToDot
+
+	//NumJobs, // Number of running jobs
+
+	TtyBasename, // Gets basename of tty, tty0
+
+	ShellName, // Basename of $0, zsh
+
+	WeekMonthDay, // Date, Tue May 26
+	StrftimeDate, // Date; arg is a date format string
+
+	HourMinuteSecond24, // Time, 14:32:14
+	HourMinuteSecond12, // Time, 11:34:11
+	TimeAmPm, // Time, 12:42 PM
+	HourMinute24, // Time, 21:11
+
+	Username, // Username, root
+
+	//ShellVersion, // Shell version
+	//ShellVersionPatch, // Shell version with patch number
+	PwdTrunc, // PWD truncating $HOME to ~, see next comment
+	PwdTruncBasename, // Basename of PWD truncating $HOME to ~, see next comment
+	// arg (optional) is what $HOME is truncated to instead of ~
+
+	//HistoryNum // The history number of the current command
+	//CommandNum // The command number of the current command
+
+	UserPrompt, // If EUID is 0, #, instead a $
+	// arg (optional) is an array of the string wanted when [EUID == 0, Else]
+};
+
+typedef struct {
+	const enum PromptElementType type;
+	// This should be const
+	void* arg;
+} PromptElement;
+
+struct prompt_string {
+	char* str;
+	bool needs_free;
+	bool cached; // Shown from the latency cache, see render_prompt
+};
+
+enum element_input {
+	InputCwd = 1 << 0, // The current directory
+	InputTime = 1 << 1, // The wall clock, every tick_seconds
+	InputEnv = 1 << 2, // The environment variables in env
+	InputUid = 1 << 3, // The real and effective uid
+	InputFiles = 1 << 4, // The files in files
+	InputHost = 1 << 5, // The hostname
+	InputSession = 1 << 6, // The shell cprompt runs under
+};
+
+struct element_deps {
+	unsigned inputs; // enum element_input flags
+	int tick_seconds; // With InputTime, how often the value changes
+	const enum env_var* env; // With InputEnv, terminated by ENV_COUNT
+	const char* const* files; // With InputFiles, terminated by NULL
+};
+
+enum prompt_side {
+	PromptLeft, // PROMPT, the `prompt` array of user_config.h
+	PromptRight, // RPROMPT, RPROMPT in user_config.h
+	PROMPT_SIDES
+};
+
+/**
+ * @brief Gets the elements of one side of the prompt
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] count How many elements there are
+ * @return The elements
+ */
+const PromptElement* get_prompt(enum prompt_side side, int* count);
+
+/**
+ * @brief Turns one element of `prompt` into a string
+ *
+ * @param[out] ps The prompt string to populate
+ * @param[in] element The element to render
+ */
+void render_element(struct prompt_string* ps, const PromptElement* element);
+
+/**
+ * @brief What the value of an element depends on
+ *
+ * @param[in] type The type of the element
+ */
+const struct element_deps* element_deps(enum PromptElementType type);
+
+/**
+ * @brief Whether an element is cheap to render anywhere
+ *
+ * It doesn't read the current directory or files and is never slow enough
+ * for the latency model to degrade, so the daemon renders it right away.
+ *
+ * @param[in] type The type of the element
+ */
+bool element_is_inline(enum PromptElementType type);
+
+/**
+ * @brief Renders some or all elements of one side of the prompt
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in,out] elements One prompt string per element
+ * @param[in] dirty Which elements to render, NULL for all of them
+ */
+void render_prompt(enum prompt_side side, struct prompt_string* elements,
+	const bool* dirty);
+
+/**
+ * @brief Makes an array of stringified prompt parts
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] len The amount of pointers
+ *
+ * @return An array of pointers to strings
+ */
+struct prompt_string* make_exploded_prompt(enum prompt_side side, size_t* len);
+
+/**
+ * @brief Gets how long a terminal escape sequence is
+ *
+ * @param[in] s The sequence, starting at its ESC
+ * @return How many bytes it takes
+ */
+size_t escape_length(const char* s);
+
+/**
+ * @brief Gets the width of the terminal, for layout_prompt
+ *
+ * @return Its columns, 0 if unknown or if the layout doesn't need them
+ */
+int terminal_columns(void);
+
+/**
+ * @brief Fits a rendered side of the prompt into the terminal
+ *
+ * Only looks at the values, so a resize lays out the last render again
+ * without rendering anything. With PROMPT_MIN_COLUMNS, the PWD of a left
+ * prompt that leaves fewer columns for typing loses its leading directories.
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in] elements The rendered elements, which are not changed
+ * @param[in] len How many there are
+ * @param[in] columns The width of the terminal, 0 if unknown
+ * @return The laid out elements, which borrow the strings of elements they
+ * didn't change (free with exploded_prompt_free), or NULL if out of memory
+ */
+struct prompt_string* layout_prompt(enum prompt_side side,
+	const struct prompt_string* elements, size_t len, int columns);
+
+/**
+ * @brief Recomputes elements that were shown from the latency cache
+ *
+ * @param[in] detach Whether to do it in a detached child rather than here
+ * @return Whether there was anything to refresh
+ */
+bool refresh_stale_elements(bool detach);
+
+/**
+ * @brief Takes the elements waiting for refresh_stale_elements away from the
+ * calling thread
+ *
+ * @return What to pass to give_stale_elements, NULL if there are none
+ */
+void* take_stale_elements(void);
+
+/**
+ * @brief Makes the calling thread responsible for refreshing elements
+ *
+ * @param[in] taken What take_stale_elements returned, which is freed
+ */
+void give_stale_elements(void* taken);
+
+/**
+ * @brief Takes the elements waiting for refresh_stale_elements away from the
+ * calling thread, as an argument for cprompt -R
+ *
+ * Only a cprompt built with the same user_config.h understands it.
+ *
+ * @return The argument, free with free, NULL if there are none or out of
+ * memory
+ */
+char* take_stale_elements_arg(void);
+
+/**
+ * @brief Makes the calling thread responsible for refreshing elements
+ *
+ * @param[in] arg What take_stale_elements_arg returned
+ * @return false if it wasn't written for this prompt
+ */
+bool give_stale_elements_arg(const char* arg);
+
+struct time_zone;
+
+// Who a prompt is rendered for, when it isn't the shell that ran cprompt
+struct render_client {
+	const char* tty; // Its terminal, NULL if it has none
+	pid_t shell; // Its shell
+	uid_t uid; // Its user
+	const struct time_zone* zone; // Its time zone, NULL for localtime's
+};
+
+/**
+ * @brief Renders for someone else in the calling thread
+ *
+ * The client's environment and directory are set up separately, with
+ * env_use and chdir.
+ *
+ * @param[in] who The client, which must outlive its use, or NULL to go back
+ * to rendering for the shell that ran cprompt
+ */
+void render_for(const struct render_client* who);
+
+/**
+ * @brief Gets the user the calling thread renders for
+ *
+ * @return The client's user, or getuid() when rendering for our own shell
+ */
+uid_t render_uid(void);
+
+/**
+ * @brief Frees array made by {make_exploded_prompt}
+ *
+ * @param exploded_prompt The return value of make_exploded_prompt
+ * @param len The len value of make_exploded_prompt
+ */
+void exploded_prompt_free(struct prompt_string exploded_prompt[], const size_t len);
+
+#endif
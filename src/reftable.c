@@ -0,0 +1,376 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "reftable.h"
+
+#define REFTABLE_LIST_MAX 16384
+// Levels of index blocks followed, more than any table has
+#define REFTABLE_DEPTH_MAX 8
+// A table written while we read the list can leave it out of date
+#define REFTABLE_ATTEMPTS 2
+
+// Where a search in a block stopped
+enum block_search {
+	BlockError = -1, // The block is corrupt
+	BlockPast, // At the first key after the name
+	BlockExact, // At the name
+	BlockEnd, // Every key of the block is before the name
+};
+
+struct reftable {
+	const uint8_t* data;
+	size_t size;
+	size_t header_size;
+	size_t end; // Where the footer starts
+	uint32_t block_size;
+	int oid_size;
+	uint64_t ref_index; // Where the ref index starts, 0 if there is none
+};
+
+struct reftable_block {
+	size_t start; // In the file
+	size_t len; // Up to the end of the restart table
+	uint8_t type; // 'r' for refs, 'i' for an index
+	const uint8_t* records;
+	const uint8_t* restarts;
+	uint16_t restart_count;
+};
+
+// A record, with its key rebuilt from the previous one
+struct reftable_record {
+	char key[GIT_REF_MAX];
+	size_t key_len;
+	uint8_t type; // For refs 0 deleted, 1 an oid, 2 peeled too, 3 a symref
+	const uint8_t* value;
+	uint64_t value_len; // Or for an index, the position of the block
+};
+
+static uint64_t be(const uint8_t* p, int bytes)
+{
+	uint64_t n = 0;
+
+	while (bytes--)
+		n = n << 8 | *p++;
+	return n;
+}
+
+/**
+ * @brief Reads a varint, the encoding git uses for offsets
+ *
+ * @param[in] p Where it starts
+ * @param[in] end Where the data ends
+ * @param[out] value Its value
+ * @return Where it ends, NULL if it doesn't
+ */
+static const uint8_t* get_varint(const uint8_t* p, const uint8_t* end,
+	uint64_t* value)
+{
+	uint8_t c;
+
+	if (p == end)
+		return NULL;
+	c = *p++;
+	*value = c & 127;
+	while (c & 128) {
+		if (p == end)
+			return NULL;
+		c = *p++;
+		*value = ((*value + 1) << 7) | (c & 127);
+	}
+	return p;
+}
+
+/**
+ * @brief Maps a table
+ *
+ * @param[in] path The table
+ * @param[in] oid_size The size of object ids, unless the table says
+ * @param[out] table The table
+ * @return false if it can't be read
+ */
+static bool table_open(const char* path, int oid_size, struct reftable* table)
+{
+	const uint8_t* footer;
+	struct stat st;
+	size_t footer_size;
+	int fd;
+
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+		return false;
+	if (fstat(fd, &st) == -1 || st.st_size < 24 + 68) {
+		close(fd);
+		return false;
+	}
+	table->size = st.st_size;
+	table->data = mmap(NULL, table->size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (table->data == MAP_FAILED)
+		return false;
+
+	// Version 2 adds the hash function to the header
+	table->header_size = table->data[4] == 2 ? 28 : 24;
+	footer_size = table->header_size + 44;
+	table->end = table->size - footer_size;
+	footer = table->data + table->end;
+	if (memcmp(table->data, "REFT", 4) || table->data[4] < 1
+			|| table->data[4] > 2 || table->size < table->header_size
+			+ footer_size || memcmp(footer, table->data, table->header_size)) {
+		munmap((void*)table->data, table->size);
+		return false;
+	}
+	table->block_size = be(table->data + 5, 3);
+	table->oid_size = oid_size;
+	if (table->data[4] == 2)
+		table->oid_size = memcmp(table->data + 24, "s256", 4) ? 20 : 32;
+	table->ref_index = be(footer + table->header_size, 8);
+	return true;
+}
+
+static void table_close(struct reftable* table)
+{
+	munmap((void*)table->data, table->size);
+}
+
+/**
+ * @brief Finds the parts of the block at a position
+ *
+ * @param[in] table The table
+ * @param[in] start Where the block starts, 0 for the one after the header
+ * @param[out] block The block
+ * @return false if there is no valid block there
+ */
+static bool block_at(const struct reftable* table, size_t start,
+	struct reftable_block* block)
+{
+	// The first block starts with the file header, and counts it
+	size_t head = start ? start : table->header_size;
+
+	if (head + 4 > table->end)
+		return false;
+	block->start = start;
+	block->type = table->data[head];
+	block->len = be(table->data + head + 1, 3);
+	if ((block->type != 'r' && block->type != 'i')
+			|| block->len < head - start + 6
+			|| block->len > table->end - start)
+		return false;
+	block->restart_count = be(table->data + start + block->len - 2, 2);
+	block->records = table->data + head + 4;
+	block->restarts = table->data + start + block->len - 2
+		- 3 * block->restart_count;
+	return block->restarts >= block->records;
+}
+
+/**
+ * @brief Decodes a record
+ *
+ * @param[in] table The table
+ * @param[in] block The block it is in
+ * @param[in] p Where it starts
+ * @param[in,out] record The record, holding the previous key
+ * @return Where the next record starts, NULL if it is corrupt
+ */
+static const uint8_t* decode_record(const struct reftable* table,
+	const struct reftable_block* block, const uint8_t* p,
+	struct reftable_record* record)
+{
+	const uint8_t* end = block->restarts;
+	uint64_t prefix, suffix, skip;
+
+	if (!(p = get_varint(p, end, &prefix)) || !(p = get_varint(p, end,
+			&suffix)))
+		return NULL;
+	record->type = suffix & 7;
+	suffix >>= 3;
+	if (prefix > record->key_len || suffix > (uint64_t)(end - p)
+			|| prefix + suffix >= GIT_REF_MAX)
+		return NULL;
+	memcpy(record->key + prefix, p, suffix);
+	record->key_len = prefix + suffix;
+	p += suffix;
+
+	if (block->type == 'i')
+		return get_varint(p, end, &record->value_len);
+	// The update index, then the value
+	if (!(p = get_varint(p, end, &skip)))
+		return NULL;
+	switch (record->type) {
+	case 0:
+		record->value_len = 0;
+		break;
+	case 1:
+	case 2:
+		record->value_len = record->type * table->oid_size;
+		break;
+	case 3:
+		if (!(p = get_varint(p, end, &record->value_len)))
+			return NULL;
+		break;
+	default:
+		return NULL;
+	}
+	if (record->value_len > (uint64_t)(end - p))
+		return NULL;
+	record->value = p;
+	return p + record->value_len;
+}
+
+static int compare_key(const struct reftable_record* record, const char* name,
+	size_t len)
+{
+	int cmp = memcmp(record->key, name, record->key_len < len
+		? record->key_len : len);
+
+	return cmp ? cmp : (record->key_len > len) - (record->key_len < len);
+}
+
+/**
+ * @brief Finds the first record of a block not before a name
+ *
+ * Binary search over the restart points, which have whole keys, then a
+ * scan of the few records after the last one not past the name.
+ *
+ * @param[in] table The table
+ * @param[in] block The block
+ * @param[in] name The name
+ * @param[out] record The record the search stopped at
+ * @return Where it stopped, one of enum block_search
+ */
+static enum block_search block_search(const struct reftable* table,
+	const struct reftable_block* block, const char* name,
+	struct reftable_record* record)
+{
+	const uint8_t* p = block->records, *at;
+	size_t len = strlen(name);
+	uint32_t lo = 0, hi = block->restart_count, mid;
+	int cmp;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		at = table->data + block->start + be(block->restarts + 3 * mid, 3);
+		record->key_len = 0;
+		if (at < block->records || at >= block->restarts
+				|| !decode_record(table, block, at, record))
+			return BlockError;
+		if (compare_key(record, name, len) <= 0) {
+			p = at;
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	record->key_len = 0;
+	while (p < block->restarts) {
+		if (!(p = decode_record(table, block, p, record)))
+			return BlockError;
+		if ((cmp = compare_key(record, name, len)) >= 0)
+			return cmp ? BlockPast : BlockExact;
+	}
+	return BlockEnd;
+}
+
+/**
+ * @brief Looks a ref up in one table
+ *
+ * @param[in] table The table
+ * @param[in] name The ref
+ * @param[out] record Its record, with BlockExact
+ * @return BlockExact if the table has the ref, BlockError if it is corrupt
+ */
+static enum block_search table_lookup(const struct reftable* table,
+	const char* name, struct reftable_record* record)
+{
+	struct reftable_block block;
+	enum block_search found;
+	size_t start = table->ref_index;
+
+	// Down the index to the one ref block that can have the name
+	for (int depth = 0; start && depth < REFTABLE_DEPTH_MAX; depth++) {
+		if (!block_at(table, start, &block))
+			return BlockError;
+		if (block.type == 'r')
+			break;
+		// An index record has the last key of the block it points at
+		found = block_search(table, &block, name, record);
+		if (found == BlockError || found == BlockEnd)
+			return found;
+		start = record->value_len;
+	}
+
+	// Without an index, the ref blocks one after the other
+	for (;;) {
+		if (!block_at(table, start, &block) || block.type != 'r')
+			return BlockEnd;
+		if ((found = block_search(table, &block, name, record)) != BlockEnd
+				|| table->ref_index)
+			return found;
+		start = block.start + block.len;
+		// Blocks are padded to the block size, unless written unaligned
+		if (table->block_size && start < table->end
+				&& table->data[start] != 'r')
+			start += table->block_size - start % table->block_size;
+	}
+}
+
+enum reftable_result reftable_lookup(const char* dir, const char* name,
+	int oid_size, uint8_t oid[GIT_OID_MAX], char target[GIT_REF_MAX])
+{
+	char list[REFTABLE_LIST_MAX], path[PATH_MAX];
+	struct reftable_record record;
+	struct reftable table;
+	enum block_search found;
+	ssize_t len;
+	char* line;
+	int fd;
+
+	for (int attempt = 0; attempt < REFTABLE_ATTEMPTS; attempt++) {
+		if (snprintf(path, PATH_MAX, "%s/tables.list", dir) >= PATH_MAX
+				|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			return ReftableMissing;
+		len = read(fd, list, sizeof(list) - 1);
+		close(fd);
+		if (len <= 0)
+			return ReftableMissing;
+		list[len] = 0;
+
+		// Newest table first: it overrides the others
+		found = BlockEnd;
+		while (found == BlockEnd || found == BlockPast) {
+			while (len && (list[len - 1] == '\n' || !list[len - 1]))
+				list[--len] = 0;
+			if (!len)
+				return ReftableMissing;
+			for (line = list + len; line > list && line[-1] != '\n'; line--);
+			if (snprintf(path, PATH_MAX, "%s/%s", dir, line) >= PATH_MAX
+					|| !table_open(path, oid_size, &table)) {
+				found = BlockError;
+				break;
+			}
+			found = table_lookup(&table, name, &record);
+			if (found == BlockExact && record.type == 3) {
+				if (record.value_len >= GIT_REF_MAX)
+					record.type = 0;
+				else
+					memcpy(target, record.value, record.value_len);
+				target[record.type ? record.value_len : 0] = 0;
+			} else if (found == BlockExact && record.type) {
+				memcpy(oid, record.value, table.oid_size);
+			}
+			table_close(&table);
+			len = line - list;
+		}
+		if (found == BlockExact)
+			return record.type == 3 ? ReftableSymref : record.type
+				? ReftableOid : ReftableMissing;
+	}
+	return ReftableMissing;
+}
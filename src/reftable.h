@@ -0,0 +1,39 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_REFTABLE_H
+#define CPROMPT_REFTABLE_H
+
+#include <stdint.h>
+#include "git.h"
+
+/* Reftable
+ *
+ * Repositories with extensions.refstorage = reftable keep their refs in a
+ * stack of tables in .git/reftable, listed oldest first in tables.list, the
+ * newest table overriding the older ones. A table is mmapped and a ref is
+ * found through its index blocks, then by binary search of the restart
+ * points of one ref block, without reading the rest of the table.
+ */
+
+enum reftable_result {
+	ReftableMissing, // No table has the ref, or the newest deleted it
+	ReftableOid, // The ref points at an object
+	ReftableSymref, // The ref points at another ref
+};
+
+/**
+ * @brief Looks a ref up in a stack of tables
+ *
+ * @param[in] dir The directory of the stack, like .git/reftable
+ * @param[in] name The full name of the ref, like HEAD or refs/heads/main
+ * @param[in] oid_size The size of the object ids of the repository
+ * @param[out] oid The object id, with ReftableOid
+ * @param[out] target The ref it points at, with ReftableSymref
+ * @return One of enum reftable_result
+ */
+enum reftable_result reftable_lookup(const char* dir, const char* name,
+	int oid_size, uint8_t oid[GIT_OID_MAX], char target[GIT_REF_MAX]);
+
+#endif
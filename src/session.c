@@ -0,0 +1,366 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include "config.h"
+#include "cache.h"
+#include "env.h"
+#include "inputs.h"
+#include "latency.h"
+#include "session.h"
+
+#define SESSION_MAGIC 0x53455333 // SES3
+#define SESSION_SLOTS 64
+#define SNAPSHOT_SLOTS 64
+// Prompts bigger than this are always rendered
+#define SESSION_ELEMENTS_MAX 64
+#define SESSION_BYTES_MAX 2048
+
+struct session_record {
+	uint64_t key;
+	// Odd while a shell writes the record, which readers then skip
+	atomic_uint generation;
+	int64_t histno;
+	uint32_t count;
+	uint32_t len;
+	// 0 for a value that must not be reused
+	uint64_t input_hashes[SESSION_ELEMENTS_MAX];
+	uint16_t offsets[SESSION_ELEMENTS_MAX];
+	// The values one after the other, each NUL terminated
+	char values[SESSION_BYTES_MAX];
+};
+
+// What session_refresh has to do
+static struct {
+	bool needed;
+	enum prompt_side side;
+	long histno;
+} pending;
+
+/**
+ * @brief Opens the table of sessions or snapshots
+ *
+ * @param[out] table The table to populate
+ * @param[in] snapshots Whether to open the snapshots
+ * @return true if the table is usable
+ */
+static bool open_table(struct cache_table* table, bool snapshots)
+{
+	return cache_table_open(table, snapshots ? "snapshot" : "session",
+		SESSION_MAGIC, snapshots ? SNAPSHOT_SLOTS : SESSION_SLOTS,
+		sizeof(struct session_record));
+}
+
+/**
+ * @brief The key of this shell's session
+ *
+ * @param[in] side One of enum prompt_side
+ */
+static uint64_t session_key(enum prompt_side side)
+{
+	pid_t shell = getppid();
+	uint64_t key;
+
+	key = cache_hash(&shell, sizeof(shell), 0);
+	key = cache_hash(&side, sizeof(side), key);
+	return key ? key : 1;
+}
+
+/**
+ * @brief The key of the snapshot for the current directory
+ *
+ * @param[in] side One of enum prompt_side
+ * @return The key, 0 if there is none
+ */
+static uint64_t snapshot_key(enum prompt_side side)
+{
+	char cwd[PATH_MAX];
+	const char* term;
+	uid_t uid = getuid();
+	uint64_t key;
+
+	if (!getcwd(cwd, PATH_MAX))
+		return 0;
+	term = env_get(ENV_TERM);
+	key = cache_hash(&uid, sizeof(uid), 0);
+	key = cache_hash(cwd, strlen(cwd) + 1, key);
+	key = term ? cache_hash(term, strlen(term) + 1, key) : key;
+	key = cache_hash(&side, sizeof(side), key);
+	return key ? key : 1;
+}
+
+/**
+ * @brief Stores a render in a record
+ *
+ * Another shell may be writing the same record: whoever starts last takes it
+ * over, and the record stays odd until that one is done.
+ *
+ * @param[out] record The record
+ * @param[in] histno The shell's history number
+ * @param[in] elements The rendered values
+ * @param[in] hashes The input hashes of the values
+ * @param[in] count How many elements there are
+ */
+static void store(struct session_record* record, long histno,
+	const struct prompt_string* elements, const uint64_t* hashes, int count)
+{
+	size_t len = 0, value_len;
+	unsigned generation, mine;
+
+	generation = atomic_load_explicit(&record->generation,
+		memory_order_relaxed);
+	do
+		mine = (generation | 1) + 2 * (generation & 1);
+	while (!atomic_compare_exchange_weak_explicit(&record->generation,
+		&generation, mine, memory_order_acquire, memory_order_relaxed));
+	atomic_thread_fence(memory_order_release);
+
+	if (count > SESSION_ELEMENTS_MAX)
+		count = 0;
+	for (int i = 0; i < count; i++) {
+		value_len = strlen(elements[i].str) + 1;
+		if (len + value_len > SESSION_BYTES_MAX) {
+			count = 0;
+			break;
+		}
+		memcpy(record->values + len, elements[i].str, value_len);
+		record->offsets[i] = len;
+		record->input_hashes[i] = elements[i].cached ? 0 : hashes[i];
+		len += value_len;
+	}
+	record->len = len;
+	record->histno = histno;
+	record->count = count;
+
+	// Unless another shell took the record over, which then publishes it
+	atomic_compare_exchange_strong_explicit(&record->generation, &mine,
+		mine + 1, memory_order_release, memory_order_relaxed);
+}
+
+/**
+ * @brief Copies a record that no shell is writing
+ *
+ * The file is shared with every other shell, so the copy is checked before
+ * any of its offsets is trusted.
+ *
+ * @param[in] record The record in the table, or NULL
+ * @param[out] copy The copy
+ * @return copy, or NULL if the record is missing, being written or corrupt
+ */
+static const struct session_record* load(const struct session_record* record,
+	struct session_record* copy)
+{
+	unsigned generation;
+
+	if (!record)
+		return NULL;
+	generation = atomic_load_explicit(&record->generation,
+		memory_order_acquire);
+	if (generation & 1)
+		return NULL;
+	memcpy(copy, record, sizeof(*copy));
+	atomic_thread_fence(memory_order_acquire);
+	if (atomic_load_explicit(&record->generation, memory_order_relaxed)
+			!= generation)
+		return NULL;
+
+	if (copy->count > SESSION_ELEMENTS_MAX || copy->len > SESSION_BYTES_MAX)
+		return NULL;
+	for (uint32_t i = 0; i < copy->count; i++)
+		if (copy->offsets[i] >= copy->len || !memchr(copy->values
+				+ copy->offsets[i], '\0', copy->len - copy->offsets[i]))
+			return NULL;
+	return copy;
+}
+
+/**
+ * @brief Whether an element may be shown from a snapshot it doesn't match
+ *
+ * The clock would be plain wrong and per-shell elements are cheap anyway.
+ *
+ * @param[in] deps What the element depends on
+ */
+static bool shows_stale(const struct element_deps* deps)
+{
+	return !(deps->inputs & (InputTime | InputSession));
+}
+
+/**
+ * @brief Hashes the inputs of every element
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] hashes The input hash of each element
+ */
+static void hash_elements(enum prompt_side side, uint64_t* hashes)
+{
+	struct input_snapshot snap = { 0 };
+	const PromptElement* prompt;
+	int count;
+
+	prompt = get_prompt(side, &count);
+	for (int i = 0; i < count; i++)
+		hashes[i] = hash_inputs(element_deps(prompt[i].type), &snap);
+}
+
+/**
+ * @brief Renders a side, taking what it can from a record
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in] record The record, or NULL to render everything
+ * @param[in] hashes The input hash of each element
+ * @param[in] stale_ok Whether values whose inputs changed may be shown anyway,
+ * flagged cached
+ * @param[out] elements One prompt string per element
+ * @return Whether a value was shown although its inputs changed
+ */
+static bool fill(enum prompt_side side, const struct session_record* record,
+	const uint64_t* hashes, bool stale_ok, struct prompt_string* elements)
+{
+	const PromptElement* prompt;
+	bool dirty[SESSION_ELEMENTS_MAX], any_stale = false, match;
+	int count;
+
+	prompt = get_prompt(side, &count);
+	for (int i = 0; i < count; i++) {
+		match = record && record->input_hashes[i]
+			&& hashes[i] == record->input_hashes[i];
+		dirty[i] = !match && !(record && stale_ok
+			&& shows_stale(element_deps(prompt[i].type)));
+		if (dirty[i])
+			continue;
+		elements[i].str = strdup(record->values + record->offsets[i]);
+		elements[i].needs_free = true;
+		elements[i].cached = !match;
+		dirty[i] = !elements[i].str;
+		any_stale |= !dirty[i] && !match;
+	}
+	render_prompt(side, elements, dirty);
+	return any_stale;
+}
+
+struct prompt_string* session_render(enum prompt_side side, long histno,
+	size_t* len)
+{
+	struct cache_table sessions, snapshots;
+	struct session_record* record, *snapshot = NULL, copy, snapshot_copy;
+	const struct session_record* loaded, *loaded_snapshot = NULL;
+	struct prompt_string* elements;
+	uint64_t hashes[SESSION_ELEMENTS_MAX], key;
+	bool have_snapshots;
+	int count;
+
+	get_prompt(side, &count);
+	if (count > SESSION_ELEMENTS_MAX || !open_table(&sessions, false))
+		return make_exploded_prompt(side, len);
+	if (!(elements = malloc((count + 1) * sizeof(struct prompt_string)))) {
+		cache_table_close(&sessions);
+		return make_exploded_prompt(side, len);
+	}
+	*len = count;
+	hash_elements(side, hashes);
+
+	have_snapshots = open_table(&snapshots, true);
+	if (have_snapshots && (key = snapshot_key(side)))
+		snapshot = cache_table_find(&snapshots, key, true);
+	loaded_snapshot = load(snapshot, &snapshot_copy);
+
+	record = cache_table_find(&sessions, session_key(side), false);
+	loaded = load(record, &copy);
+	if (loaded && loaded->count == (uint32_t)count) {
+		// A command ran: inputs like $PWD may have changed behind our back
+		fill(side, loaded->histno == histno ? loaded : NULL, hashes, false,
+			elements);
+	} else if (loaded_snapshot && loaded_snapshot->count == (uint32_t)count) {
+		// A new shell: show the snapshot, render the rest for real later
+		if (fill(side, loaded_snapshot, hashes, true, elements)) {
+			pending.needed = true;
+			pending.side = side;
+			pending.histno = histno;
+		}
+	} else {
+		fill(side, NULL, hashes, false, elements);
+	}
+
+	if ((record = cache_table_find(&sessions, session_key(side), true)))
+		store(record, histno, elements, hashes, count);
+	if (snapshot)
+		store(snapshot, 0, elements, hashes, count);
+	cache_table_close(&sessions);
+	if (have_snapshots)
+		cache_table_close(&snapshots);
+	return elements;
+}
+
+void session_refresh(void)
+{
+	struct cache_table sessions;
+	struct session_record* record, copy;
+	const struct session_record* loaded;
+	struct prompt_string* elements;
+	uint64_t hashes[SESSION_ELEMENTS_MAX];
+	size_t count;
+
+	if (!pending.needed || !latency_fork_refresher())
+		return;
+
+	if (!(elements = make_exploded_prompt(pending.side, &count)))
+		_exit(0);
+	hash_elements(pending.side, hashes);
+	snapshot_save(pending.side, elements, count);
+	if (open_table(&sessions, false)) {
+		record = cache_table_find(&sessions, session_key(pending.side), true);
+		loaded = load(record, &copy);
+		// Unless the shell went on to another prompt in the meantime
+		if (loaded && (loaded->count == 0
+				|| loaded->histno == pending.histno))
+			store(record, pending.histno, elements, hashes, count);
+		cache_table_close(&sessions);
+	}
+	_exit(0);
+}
+
+struct prompt_string* snapshot_load(enum prompt_side side, size_t* len)
+{
+	struct cache_table snapshots;
+	struct session_record copy;
+	const struct session_record* snapshot;
+	struct prompt_string* elements = NULL;
+	uint64_t hashes[SESSION_ELEMENTS_MAX], key;
+	int count;
+
+	get_prompt(side, &count);
+	if (count > SESSION_ELEMENTS_MAX || !(key = snapshot_key(side))
+			|| !open_table(&snapshots, true))
+		return NULL;
+	snapshot = load(cache_table_find(&snapshots, key, false), &copy);
+	if (snapshot && snapshot->count == (uint32_t)count
+			&& (elements = malloc((count + 1) * sizeof(struct prompt_string)))) {
+		hash_elements(side, hashes);
+		fill(side, snapshot, hashes, true, elements);
+		*len = count;
+	}
+	cache_table_close(&snapshots);
+	return elements;
+}
+
+void snapshot_save(enum prompt_side side, const struct prompt_string* elements,
+	int count)
+{
+	struct cache_table snapshots;
+	struct session_record* snapshot;
+	uint64_t hashes[SESSION_ELEMENTS_MAX], key;
+
+	if (count > SESSION_ELEMENTS_MAX || !(key = snapshot_key(side))
+			|| !open_table(&snapshots, true))
+		return;
+	hash_elements(side, hashes);
+	if ((snapshot = cache_table_find(&snapshots, key, true)))
+		store(snapshot, 0, elements, hashes, count);
+	cache_table_close(&snapshots);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_SESSION_H
+#define CPROMPT_SESSION_H
+
+#include <stdbool.h>
+#include "prompt.h"
+
+/* Session cache
+ *
+ * The last prompt rendered for each shell, with the values of its elements
+ * and the hashes of their inputs. When the shell says no command ran since
+ * (the history number didn't move: an empty line was entered), only the
+ * elements whose inputs changed, usually just the clock, are rendered again.
+ *
+ * Snapshots
+ *
+ * The same thing kept per (uid, directory, terminal type) instead of per
+ * shell. A new shell has no session yet, so its first prompt comes from the
+ * snapshot: values whose inputs hash the same are reused, the clock and
+ * per-shell elements are rendered, and everything else is shown as it was
+ * last time while the real values are computed in the background.
+ */
+
+/**
+ * @brief Renders a side of the prompt, reusing the last render of this shell
+ *
+ * Falls back to the snapshot for a new shell, and to rendering everything if
+ * a command ran or nothing usable is cached. Either way the result is stored
+ * for the next prompt.
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in] histno The shell's history number
+ * @param[out] len The amount of pointers
+ * @return An array of pointers to strings, free with exploded_prompt_free
+ */
+struct prompt_string* session_render(enum prompt_side side, long histno,
+	size_t* len);
+
+/**
+ * @brief Computes the values session_render showed from a snapshot
+ *
+ * Call after the prompt was printed. Forks a detached child that renders the
+ * prompt for real and stores it, so the next prompt is accurate.
+ */
+void session_refresh(void);
+
+/**
+ * @brief Gets the snapshot of a side of the prompt for the current directory
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[out] len The amount of pointers
+ * @return The values as they were, or NULL if there is no snapshot
+ */
+struct prompt_string* snapshot_load(enum prompt_side side, size_t* len);
+
+/**
+ * @brief Stores the snapshot of a side of the prompt for the current directory
+ *
+ * @param[in] side One of enum prompt_side
+ * @param[in] elements The rendered values
+ * @param[in] count How many elements there are
+ */
+void snapshot_save(enum prompt_side side, const struct prompt_string* elements,
+	int count);
+
+#endif
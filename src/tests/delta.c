@@ -0,0 +1,374 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../commit.c"
+
+uid_t render_uid(void)
+{
+	return getuid();
+}
+
+static void put_byte(struct buf* b, uint8_t c)
+{
+	put(b, &c, 1);
+}
+
+// The sizes at the start of a delta, 7 bits at a time, least significant first
+static void put_size(struct buf* b, size_t size)
+{
+	do {
+		put_byte(b, (size & 127) | (size >> 7 ? 128 : 0));
+		size >>= 7;
+	} while (size);
+}
+
+// A copy with only the non-zero bytes of its offset and size
+static void put_copy(struct buf* b, size_t off, size_t n)
+{
+	size_t op_at = b->len;
+	uint8_t op = 128;
+
+	put_byte(b, 0);
+	for (int i = 0; i < 4; i++)
+		if (off >> 8 * i & 255) {
+			op |= 1 << i;
+			put_byte(b, off >> 8 * i);
+		}
+	for (int i = 0; i < 3; i++)
+		if (n >> 8 * i & 255) {
+			op |= 1 << (4 + i);
+			put_byte(b, n >> 8 * i);
+		}
+	b->data[op_at] = op;
+}
+
+static void put_insert(struct buf* b, const char* s)
+{
+	put_byte(b, strlen(s));
+	put(b, s, strlen(s));
+}
+
+/**
+ * @brief Applies a delta to a base, wanting all of the result
+ *
+ * @return The result as a string, "" if the delta is corrupt
+ */
+static const char* apply(const char* base, const struct buf* delta)
+{
+	static char result[256];
+	uint8_t* out;
+	size_t len;
+
+	if (!(out = apply_delta((const uint8_t*)base, strlen(base), delta->data,
+			delta->len, sizeof(result) - 1, true, &len)))
+		return "";
+	memcpy(result, out, len);
+	result[len] = 0;
+	free(out);
+	return result;
+}
+
+static void test_size(void)
+{
+	const uint8_t* end;
+	struct buf b = { .len = 0 };
+	size_t size;
+
+	put_size(&b, 0);
+	put_size(&b, 300);
+	put_size(&b, (size_t)1 << 40);
+	CHECK((end = delta_size(b.data, b.data + b.len, &size)) == b.data + 1
+		&& size == 0);
+	CHECK((end = delta_size(end, b.data + b.len, &size)) == b.data + 3
+		&& size == 300);
+	CHECK((end = delta_size(end, b.data + b.len, &size)) == b.data + b.len
+		&& size == (size_t)1 << 40);
+	CHECK(!delta_size(b.data + 1, b.data + 2, &size)); // Cut off
+	// More bits than a size has
+	memset(b.data, 0xff, 9);
+	b.data[9] = 1;
+	CHECK(!delta_size(b.data, b.data + 10, &size));
+}
+
+static void test_apply(void)
+{
+	static const char base[] = "hello world";
+	static uint8_t big[0x10000 + 1];
+	struct buf d;
+	uint8_t* out;
+	size_t len;
+
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 11);
+	put_copy(&d, 6, 5);
+	put_insert(&d, " ");
+	put_copy(&d, 0, 5);
+	CHECK_STR(apply(base, &d), "world hello");
+
+	// Part of the result, stopping as soon as there is enough of it
+	out = apply_delta((const uint8_t*)base, 11, d.data, d.len, 7, false,
+		&len);
+	CHECK(out && len == 7 && !memcmp(out, "world h", 7));
+	free(out);
+	CHECK(!apply_delta((const uint8_t*)base, 11, d.data, d.len, 7, true,
+		&len));
+
+	// The base isn't the size the delta was made for
+	d.data[0] = 12;
+	CHECK_STR(apply(base, &d), "");
+
+	// A result longer or shorter than the delta says
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 4);
+	put_copy(&d, 0, 5);
+	CHECK_STR(apply(base, &d), "");
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 6);
+	put_copy(&d, 0, 5);
+	CHECK_STR(apply(base, &d), "");
+
+	// Copies out of the base
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 5);
+	put_copy(&d, 8, 5);
+	CHECK_STR(apply(base, &d), "");
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 1);
+	put_copy(&d, 0xffffffff, 1);
+	CHECK_STR(apply(base, &d), "");
+
+	// A copy whose offset is cut off, an insert past the end, op 0
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 5);
+	put_byte(&d, 0x81);
+	CHECK_STR(apply(base, &d), "");
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 5);
+	put_insert(&d, "12345");
+	d.len--;
+	CHECK_STR(apply(base, &d), "");
+	d.len = 0;
+	put_size(&d, 11);
+	put_size(&d, 5);
+	put_byte(&d, 0);
+	put_insert(&d, "12345");
+	CHECK_STR(apply(base, &d), "");
+
+	// A copy of size 0 is one of 0x10000
+	memset(big, 'x', sizeof(big));
+	d.len = 0;
+	put_size(&d, sizeof(big));
+	put_size(&d, 0x10000);
+	put_byte(&d, 0x81); // An offset byte, no size bytes
+	put_byte(&d, 1);
+	out = apply_delta(big, sizeof(big), d.data, d.len, COMMIT_OBJECT_MAX,
+		true, &len);
+	CHECK(out && len == 0x10000 && out[0xffff] == 'x');
+	free(out);
+}
+
+static const char commit_text[] = "tree "
+	"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa\n"
+	"author A <a@b> 1700000000 +0000\n"
+	"committer C <c@d> 1700000100 +0100\n"
+	"\n"
+	"First\n";
+
+// Objects in the pack, by the first byte of their ids
+enum {
+	Base = 0x10, // The commit
+	OfsDelta = 0x20, // Against it, by offset
+	RefDelta = 0x30, // Against it, by id
+	Chain = 0x40, // Against the first delta
+	Backward = 0x50, // A delta whose base is after it
+};
+
+static void put_object_header(struct buf* b, int type, size_t size)
+{
+	uint8_t c = type << 4 | (size & 15);
+
+	for (size >>= 4; size; size >>= 7) {
+		put_byte(b, c | 128);
+		c = size & 127;
+	}
+	put_byte(b, c);
+}
+
+static void put_deflated(struct buf* b, const void* data, size_t len)
+{
+	uLongf out = sizeof(b->data) - b->len;
+
+	if (compress2(b->data + b->len, &out, data, len, 9) != Z_OK)
+		exit(99);
+	b->len += out;
+}
+
+// How far back an ofs delta's base is, each extra byte adding one
+static void put_distance(struct buf* b, uint64_t v)
+{
+	uint8_t bytes[10];
+	int i = sizeof(bytes) - 1;
+
+	bytes[i] = v & 127;
+	while (v >>= 7)
+		bytes[--i] = 128 | (--v & 127);
+	put(b, bytes + i, sizeof(bytes) - i);
+}
+
+/**
+ * @brief Puts a delta object keeping the headers of the commit, with
+ * another subject
+ */
+static void put_delta(struct buf* pack, int type, uint64_t base,
+	size_t base_len, const char* subject)
+{
+	size_t headers = strlen(commit_text) - strlen("First\n");
+	uint64_t start = pack->len;
+	uint8_t oid[20];
+	struct buf d = { .len = 0 };
+
+	put_size(&d, base_len);
+	put_size(&d, headers + strlen(subject));
+	put_copy(&d, 0, headers);
+	put_insert(&d, subject);
+	put_object_header(pack, type, d.len);
+	if (type == PackRefDelta) {
+		memset(oid, Base, sizeof(oid));
+		put(pack, oid, sizeof(oid));
+	} else {
+		put_distance(pack, start - base);
+	}
+	put_deflated(pack, d.data, d.len);
+}
+
+/**
+ * @brief Writes a pack of a commit and deltas against it, and its .idx
+ *
+ * @param[out] offsets Where each object starts
+ */
+static void write_pack(uint64_t offsets[5])
+{
+	uint8_t oid[20], noise[256];
+	struct buf pack = { .len = 0 }, idx = { .len = 0 };
+	size_t len = strlen(commit_text);
+	int object = 0;
+
+	put(&pack, "PACK\0\0\0\2\0\0\0\5", 12);
+	offsets[0] = pack.len;
+	put_object_header(&pack, PackCommit, len);
+	put_deflated(&pack, commit_text, len);
+	offsets[1] = pack.len;
+	put_delta(&pack, PackOfsDelta, offsets[0], len, "Second\n");
+	offsets[2] = pack.len;
+	put_delta(&pack, PackRefDelta, 0, len, "Third\n");
+	// A blob no .idx lists, taking the next delta's base over 127 bytes back
+	for (int i = 0; i < 256; i++)
+		noise[i] = i * 167 ^ i >> 3;
+	put_object_header(&pack, 3, sizeof(noise));
+	put_deflated(&pack, noise, sizeof(noise));
+	offsets[3] = pack.len;
+	put_delta(&pack, PackOfsDelta, offsets[1], len + 1, "Fourth\n");
+	offsets[4] = pack.len;
+	put_object_header(&pack, PackOfsDelta, 4);
+	put_distance(&pack, 1000);
+	put_deflated(&pack, "\x1a\x04\x90\x04", 4);
+	put_zeros(&pack, 20);
+	test_write("repo/objects/pack/pack-a.pack", pack.data, pack.len);
+
+	put(&idx, "\377tOc\0\0\0\2", 8);
+	for (int byte = 0; byte < 256; byte++) {
+		while (object < 5 && (object + 1) * 0x10 <= byte)
+			object++;
+		put32(&idx, object);
+	}
+	for (int i = 0; i < 5; i++) {
+		memset(oid, (i + 1) * 0x10, sizeof(oid));
+		put(&idx, oid, sizeof(oid));
+	}
+	for (int i = 0; i < 5; i++)
+		put32(&idx, 0); // CRCs
+	for (int i = 0; i < 5; i++)
+		put32(&idx, offsets[i]);
+	put_zeros(&idx, 40);
+	test_write("repo/objects/pack/pack-a.idx", idx.data, idx.len);
+}
+
+/**
+ * @brief Reads the commit whose id is all made of byte
+ */
+static bool read_commit(const struct git_repo* repo, uint8_t byte,
+	struct git_commit* commit)
+{
+	uint8_t oid[GIT_OID_MAX];
+
+	memset(oid, byte, sizeof(oid));
+	return git_read_commit(repo, oid, commit);
+}
+
+static void test_pack(void)
+{
+	struct git_commit c;
+	struct git_packs* packs;
+	struct git_repo repo = { .oid_size = 20 };
+	uint64_t offsets[5];
+	uint8_t* data, tree[GIT_OID_MAX];
+	size_t len;
+	int type;
+
+	write_pack(offsets);
+	CHECK(offsets[3] - offsets[1] > 127);
+	if (snprintf(repo.commondir, sizeof(repo.commondir), "%s/repo",
+			test_root) >= (int)sizeof(repo.commondir))
+		exit(99);
+	memset(tree, 0xaa, sizeof(tree));
+
+	CHECK(read_commit(&repo, Base, &c));
+	CHECK_STR(c.subject, "First");
+	CHECK(read_commit(&repo, OfsDelta, &c));
+	CHECK_STR(c.subject, "Second");
+	CHECK(!memcmp(c.tree, tree, 20) && c.commit_time == 1700000100
+		&& c.commit_tz == 60 && c.author_time == 1700000000);
+	CHECK(read_commit(&repo, RefDelta, &c));
+	CHECK_STR(c.subject, "Third");
+	CHECK(read_commit(&repo, Chain, &c));
+	CHECK_STR(c.subject, "Fourth");
+	CHECK(!read_commit(&repo, Backward, &c));
+	CHECK(!read_commit(&repo, 0x60, &c));
+
+	// Unpacked whole, with the type of the base
+	CHECK((packs = git_packs_open(&repo)));
+	if (!packs)
+		return;
+	data = unpack(&repo, packs, 0, offsets[2], 0, NULL, &type, &len);
+	CHECK(data && type == PackCommit && len == strlen(commit_text)
+		&& !memcmp(data + len - 6, "Third\n", 6));
+	free(data);
+	// Too deep a chain, an offset in the header or past the end
+	CHECK(!unpack(&repo, packs, 0, offsets[3], COMMIT_DELTA_MAX, NULL, &type,
+		&len));
+	CHECK(!unpack(&repo, packs, 0, 4, 0, NULL, &type, &len));
+	CHECK(!unpack(&repo, packs, 0, 1 << 20, 0, NULL, &type, &len));
+	git_packs_close(packs);
+
+	// A commit isn't a tree
+	memset(tree, Base, sizeof(tree));
+	CHECK(!git_read_tree(&repo, tree, &len));
+}
+
+int main(void)
+{
+	test_dir();
+	test_size();
+	test_apply();
+	test_pack();
+	return TEST_EXIT();
+}
@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../dircache.c"
+
+/**
+ * @brief Gets the path a node of the trie stands for
+ */
+static const char* path_of(struct dircache* cache, uint32_t off)
+{
+	static char path[PATH_MAX];
+
+	if (!node_path(cache, off, path))
+		strcpy(path, "!CORRUPT!");
+	return path;
+}
+
+static void test_canonical(void)
+{
+	CHECK(path_is_canonical("/"));
+	CHECK(path_is_canonical("/a/.b/..c/c."));
+	CHECK(!path_is_canonical("a/b"));
+	CHECK(!path_is_canonical("/a/./b"));
+	CHECK(!path_is_canonical("/a/.."));
+	CHECK(!path_is_canonical("/a/../b"));
+}
+
+static void test_trie(struct dircache* cache)
+{
+	uint32_t deep, mid, other, prefix;
+
+	CHECK(lock(cache));
+	// A run of components nobody else asked about is a single node
+	CHECK((deep = find(cache, "/a/b/c/d", true)));
+	CHECK_STR(path_of(cache, deep), "/a/b/c/d");
+	CHECK(find(cache, "/a/b/c/d", false) == deep);
+	CHECK(!find(cache, "/a/b", false));
+	CHECK(node_at(cache, deep)->parent == arena_of(cache)->root);
+
+	// A sibling splits it at the last component they share
+	CHECK((other = find(cache, "/a/b/x", true)));
+	CHECK((mid = find(cache, "/a/b", false)));
+	CHECK_STR(path_of(cache, mid), "/a/b");
+	CHECK(find(cache, "/a/b/c/d", false) == deep);
+	CHECK(node_at(cache, deep)->parent == mid);
+	CHECK(node_at(cache, other)->parent == mid);
+	CHECK_STR(path_of(cache, deep), "/a/b/c/d");
+	CHECK(!find(cache, "/a", false));
+
+	// Components match whole, not by prefix
+	CHECK((prefix = find(cache, "/a/bb", true)));
+	CHECK(prefix != mid);
+	CHECK_STR(path_of(cache, prefix), "/a/bb");
+	CHECK(find(cache, "/a/b", false) == mid);
+	CHECK(!find(cache, "/a/b/c/dd", false));
+	CHECK(find(cache, "/a/b/c/d", false) == deep);
+
+	CHECK(find(cache, "/", false) == arena_of(cache)->root);
+	CHECK_STR(path_of(cache, arena_of(cache)->root), "/");
+	unlock(cache);
+}
+
+static void test_repo_root(struct dircache* cache, const char* dir)
+{
+	char path[PATH_MAX], root[PATH_MAX], want[PATH_MAX];
+
+	test_write("repo/.git", "gitdir: x\n", 10);
+	test_write("repo/sub/deeper/file", "", 0);
+	snprintf(path, sizeof(path), "%s/repo/sub/deeper", dir);
+	snprintf(want, sizeof(want), "%s/repo", dir);
+
+	// Uncached, then cached, then after the cache was closed
+	CHECK(!dircache_cached_repo_root(cache, path, root));
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+	dircache_close(cache);
+	CHECK(dircache_open(cache));
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+	CHECK(dircache_cached_repo_root(cache, path, root));
+	CHECK_STR(root, want);
+
+	// Someone else has the cache: look without it rather than wait
+	CHECK(lock(cache));
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+	CHECK(!dircache_cached_repo_root(cache, path, root));
+	unlock(cache);
+
+	// A .git appearing in between changes the mtime of its directory
+	test_write("repo/sub/.git", "gitdir: y\n", 10);
+	snprintf(want, sizeof(want), "%s/repo/sub", dir);
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+
+	snprintf(path, sizeof(path), "%s/repo/sub/.git", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/repo/.git", dir);
+	unlink(path);
+	snprintf(path, sizeof(path), "%s/repo/sub/deeper", dir);
+	dircache_repo_root(cache, path, root);
+	walk_repo_root(path, want);
+	CHECK_STR(root, want);
+
+	// Trailing slashes are the same directory
+	test_write("repo/.git", "gitdir: x\n", 10);
+	snprintf(path, sizeof(path), "%s/repo/sub/deeper//", dir);
+	snprintf(want, sizeof(want), "%s/repo", dir);
+	dircache_repo_root(cache, path, root);
+	CHECK_STR(root, want);
+}
+
+static void test_realpath(struct dircache* cache, const char* dir)
+{
+	char link[PATH_MAX], target[PATH_MAX], resolved[PATH_MAX];
+	struct stat st;
+
+	test_write("real/one/file", "", 0);
+	test_write("real/two/file", "", 0);
+	snprintf(link, sizeof(link), "%s/link", dir);
+	snprintf(target, sizeof(target), "%s/real/one", dir);
+	CHECK(symlink(target, link) == 0);
+
+	CHECK(stat(link, &st) == 0);
+	CHECK(dircache_realpath(cache, link, &st, resolved));
+	CHECK_STR(resolved, target);
+	// Now from the cache
+	CHECK(dircache_realpath(cache, link, &st, resolved));
+	CHECK_STR(resolved, target);
+
+	// The inode of the link's new target isn't the cached one's
+	unlink(link);
+	snprintf(target, sizeof(target), "%s/real/two", dir);
+	CHECK(symlink(target, link) == 0);
+	CHECK(stat(link, &st) == 0);
+	CHECK(dircache_realpath(cache, link, &st, resolved));
+	CHECK_STR(resolved, target);
+}
+
+int main(void)
+{
+	struct dircache cache;
+	const char* dir = test_dir();
+
+	test_canonical();
+	if (!dircache_open(&cache)) {
+		fprintf(stderr, "dircache: can't open the cache\n");
+		return 99;
+	}
+	test_trie(&cache);
+	test_repo_root(&cache, dir);
+	test_realpath(&cache, dir);
+	dircache_close(&cache);
+	return TEST_EXIT();
+}
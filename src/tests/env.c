@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../env.c"
+
+// The first and last characters ENV_VARS gives, which C can't check
+// against the names at build time
+static const char env_ends[ENV_COUNT][2] = {
+#define ENV_ENDS(name, first, last) { first, last },
+	ENV_VARS(ENV_ENDS)
+#undef ENV_ENDS
+};
+
+int main(void)
+{
+	char entries[ENV_COUNT][64], want[16];
+	char* envp[ENV_COUNT + 3];
+	struct env_index index;
+	size_t len;
+
+	// A wrong character leaves its variable out of every index
+	for (int var = 0; var < ENV_COUNT; var++) {
+		len = strlen(env_names[var]);
+		if (env_names[var][0] != env_ends[var][0]
+				|| env_names[var][len - 1] != env_ends[var][1]) {
+			fprintf(stderr, "ENV_VARS has the wrong first or last "
+				"character for %s\n", env_names[var]);
+			test_failures++;
+		}
+		snprintf(entries[var], sizeof(entries[var]), "%s=%d",
+			env_names[var], var);
+		envp[var + 1] = entries[var];
+	}
+	// A name that starts like one, and a second HOME getenv wouldn't see
+	envp[0] = "HOMEX=no";
+	envp[ENV_COUNT + 1] = "HOME=second";
+	envp[ENV_COUNT + 2] = NULL;
+
+	env_index_build(&index, envp);
+	for (int var = 0; var < ENV_COUNT; var++) {
+		snprintf(want, sizeof(want), "%d", var);
+		CHECK(index.values[var] && !strcmp(index.values[var], want));
+	}
+	return TEST_EXIT();
+}
@@ -0,0 +1,482 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <zlib.h>
+#include "test.h"
+#include "../git.c"
+
+uid_t render_uid(void)
+{
+	return getuid();
+}
+
+static void put16(struct buf* b, uint16_t v)
+{
+	uint8_t bytes[2] = { v >> 8, v };
+
+	put(b, bytes, 2);
+}
+
+static void put_str(struct buf* b, const char* s)
+{
+	put(b, s, strlen(s) + 1);
+}
+
+/**
+ * @brief Appends the stat part of an index entry, the oid and the flags
+ */
+static void put_entry_head(struct buf* b, uint32_t mode, uint32_t size,
+	const uint8_t* oid, int oid_size, uint16_t flags)
+{
+	for (int i = 0; i < 5; i++)
+		put32(b, i == 2 ? 1 : 0); // ctime, mtime, dev
+	put32(b, 7); // ino
+	put32(b, mode);
+	put32(b, 0); // uid
+	put32(b, 0); // gid
+	put32(b, size);
+	put(b, oid, oid_size);
+	put16(b, flags);
+}
+
+/**
+ * @brief Appends a version 2 or 3 entry, NUL padded like git does
+ */
+static void put_entry(struct buf* b, uint32_t mode, const uint8_t* oid,
+	int oid_size, const char* name, uint16_t ext_flags)
+{
+	size_t start = b->len, len = strlen(name);
+	uint16_t flags = len < 0xfff ? len : 0xfff;
+
+	put_entry_head(b, mode, 3, oid, oid_size,
+		flags | (ext_flags ? GIT_INDEX_EXTENDED : 0));
+	if (ext_flags)
+		put16(b, ext_flags);
+	put(b, name, len);
+	do
+		put(b, "", 1);
+	while ((b->len - start) % 8);
+}
+
+static void put_header(struct buf* b, uint32_t version, uint32_t entries)
+{
+	b->len = 0;
+	put(b, "DIRC", 4);
+	put32(b, version);
+	put32(b, entries);
+}
+
+static struct git_repo test_repo(int oid_size)
+{
+	struct git_repo repo = { .oid_size = oid_size };
+
+	return repo;
+}
+
+static struct git_index test_index(struct buf* b, int oid_size)
+{
+	struct git_index index = { .data = b->data };
+
+	// The trailing hash, zeroes, after the end the tests look at
+	put_zeros(b, oid_size);
+	index.size = b->len;
+	b->len -= oid_size;
+	index.version = be32(b->data + 4);
+	index.entries = be32(b->data + 8);
+	return index;
+}
+
+static void test_hashes(void)
+{
+	static const uint8_t sha1_abc[20] = {
+		0xa9, 0x99, 0x3e, 0x36, 0x47, 0x06, 0x81, 0x6a, 0xba, 0x3e,
+		0x25, 0x71, 0x78, 0x50, 0xc2, 0x6c, 0x9c, 0xd0, 0xd8, 0x9d
+	};
+	static const uint8_t sha256_abc[32] = {
+		0xba, 0x78, 0x16, 0xbf, 0x8f, 0x01, 0xcf, 0xea, 0x41, 0x41, 0x40,
+		0xde, 0x5d, 0xae, 0x22, 0x23, 0xb0, 0x03, 0x61, 0xa3, 0x96, 0x17,
+		0x7a, 0x9c, 0xb4, 0x10, 0xff, 0x61, 0xf2, 0x00, 0x15, 0xad
+	};
+	// Two blocks once padded
+	static const uint8_t sha256_long[32] = {
+		0x24, 0x8d, 0x6a, 0x61, 0xd2, 0x06, 0x38, 0xb8, 0xe5, 0xc0, 0x26,
+		0x93, 0x0c, 0x3e, 0x60, 0x39, 0xa3, 0x3c, 0xe4, 0x59, 0x64, 0xff,
+		0x21, 0x67, 0xf6, 0xec, 0xed, 0xd4, 0x19, 0xdb, 0x06, 0xc1
+	};
+	const char* lng = "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq";
+	uint8_t sum[32];
+	struct sha ctx;
+
+	sha_init(&ctx, 20);
+	sha_update(&ctx, "abc", 3);
+	sha_final(&ctx, sum);
+	CHECK(!memcmp(sum, sha1_abc, 20));
+
+	sha_init(&ctx, 32);
+	sha_update(&ctx, "a", 1);
+	sha_update(&ctx, "bc", 2);
+	sha_final(&ctx, sum);
+	CHECK(!memcmp(sum, sha256_abc, 32));
+
+	sha_init(&ctx, 32);
+	sha_update(&ctx, lng, strlen(lng));
+	sha_final(&ctx, sum);
+	CHECK(!memcmp(sum, sha256_long, 32));
+}
+
+static void test_v2_v3(int version)
+{
+	struct git_repo repo = test_repo(20);
+	struct git_entry entry = { .name = "" };
+	struct git_index index;
+	uint8_t oid[20] = { 1, 2, 3 };
+	const uint8_t* p;
+	struct buf b;
+
+	put_header(&b, version, 3);
+	put_entry(&b, 0100644, oid, 20, "a", 0);
+	put_entry(&b, 0100755, oid, 20, "dir/name", version >= 3
+		? GIT_INDEX_INTENT_TO_ADD : 0);
+	put_entry(&b, 0120000, oid, 20, "link", 0);
+	put(&b, "TREE", 4);
+	put32(&b, 0);
+	index = test_index(&b, 20);
+
+	p = index.data + 12;
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, "a");
+	CHECK(entry.mode == 0100644 && entry.size == 3 && entry.ino == 7);
+	CHECK(!memcmp(entry.oid, oid, 20));
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, "dir/name");
+	CHECK(entry.mode == 0100755);
+	CHECK(entry.ext_flags == (version >= 3 ? GIT_INDEX_INTENT_TO_ADD : 0));
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, "link");
+	CHECK(p && !memcmp(p, "TREE", 4));
+
+	CHECK(index_skip_entries(&repo, &index));
+	CHECK(index.extensions == p);
+}
+
+static void test_v4(void)
+{
+	struct git_repo repo = test_repo(20);
+	struct git_entry entry = { .name = "" };
+	struct git_index index;
+	uint8_t oid[20] = { 0 };
+	char name[256];
+	const uint8_t* p;
+	struct buf b;
+
+	memset(name, 'x', 210);
+	name[210] = 0;
+	put_header(&b, 4, 4);
+	put_entry_head(&b, 0100644, 0, oid, 20, strlen("dir/a"));
+	put(&b, "\0dir/a", 7);
+	put_entry_head(&b, 0100644, 0, oid, 20, strlen("dir/b"));
+	put(&b, "\1b", 3);
+	put_entry_head(&b, 0100644, 0, oid, 20, 0xfff);
+	put(&b, "\5", 1);
+	put_str(&b, name);
+	// 200 takes two bytes: 0x80 0x48
+	put_entry_head(&b, 0100644, 0, oid, 20, 0xfff);
+	put(&b, "\x80\x48y", 4);
+	index = test_index(&b, 20);
+
+	p = index.data + 12;
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, "dir/a");
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, "dir/b");
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	CHECK_STR(entry.name, name);
+	CHECK((p = index_entry(&repo, &index, p, &entry)));
+	name[10] = 'y';
+	name[11] = 0;
+	CHECK_STR(entry.name, name);
+	CHECK(p == b.data + b.len);
+
+	// Dropping more than the previous name has
+	put_header(&b, 4, 1);
+	put_entry_head(&b, 0100644, 0, oid, 20, 1);
+	put(&b, "\1a", 3);
+	index = test_index(&b, 20);
+	strcpy(entry.name, "");
+	CHECK(!index_entry(&repo, &index, index.data + 12, &entry));
+}
+
+static void test_corrupt(void)
+{
+	struct git_repo repo = test_repo(20);
+	struct git_entry entry = { .name = "" };
+	struct git_index index;
+	uint8_t oid[20] = { 0 };
+	const uint8_t* p;
+	struct buf b;
+
+	// A name running into the trailing hash
+	put_header(&b, 2, 1);
+	put_entry_head(&b, 0100644, 0, oid, 20, 4);
+	put(&b, "name", 4);
+	index = test_index(&b, 20);
+	CHECK(!index_entry(&repo, &index, index.data + 12, &entry));
+	CHECK(!index_skip_entries(&repo, &index));
+
+	// Fewer bytes than the fixed part
+	put_header(&b, 2, 1);
+	put(&b, oid, 20);
+	index = test_index(&b, 20);
+	CHECK(!index_entry(&repo, &index, index.data + 12, &entry));
+
+	// The padding of an entry ends past the entries, where the next one
+	// would start
+	put_header(&b, 2, 2);
+	put_entry_head(&b, 0100644, 0, oid, 20, 3);
+	put(&b, "abc", 4);
+	index = test_index(&b, 20);
+	CHECK((p = index_entry(&repo, &index, index.data + 12, &entry)));
+	CHECK(p > b.data + b.len);
+	CHECK(!index_entry(&repo, &index, p, &entry));
+	CHECK(!index_skip_entries(&repo, &index));
+}
+
+static void test_extensions(void)
+{
+	struct git_repo repo = test_repo(20);
+	struct git_index index;
+	uint32_t size;
+	struct buf b;
+
+	put_header(&b, 2, 0);
+	put(&b, "link", 4);
+	put32(&b, 3);
+	put(&b, "abc", 3);
+	put(&b, "TREE", 4);
+	put32(&b, 2);
+	put(&b, "de", 2);
+	index = test_index(&b, 20);
+	CHECK(index_skip_entries(&repo, &index));
+	CHECK(index_extension(&repo, &index, "TREE", &size));
+	CHECK(size == 2);
+	CHECK(index_extension(&repo, &index, "link", &size));
+	CHECK(size == 3);
+	CHECK(!index_extension(&repo, &index, "UNTR", &size));
+
+	// An extension claiming more than there is
+	b.data[12 + 7] = 100;
+	CHECK(!index_extension(&repo, &index, "TREE", &size));
+}
+
+static void test_cache_tree(void)
+{
+	struct git_repo repo = test_repo(20);
+	const uint8_t* end, *p, *oid, *sub;
+	uint8_t root_oid[20] = { 0xaa }, sub_oid[20] = { 0xbb };
+	long entries, subtrees;
+	struct buf b = { .len = 0 };
+
+	// Root with two subtrees, the first invalid with one of its own
+	put(&b, "\0" "5 2\n", 5);
+	put(&b, root_oid, 20);
+	put(&b, "bad\0" "-1 1\n", 9);
+	put(&b, "deep\0" "1 0\n", 9);
+	put(&b, sub_oid, 20);
+	put(&b, "good\0" "2 0\n", 9);
+	put(&b, sub_oid, 20);
+	end = b.data + b.len;
+
+	CHECK((p = cache_tree_node(&repo, b.data, end, &entries, &subtrees,
+		&oid)));
+	CHECK(entries == 5 && subtrees == 2 && oid == b.data + 5);
+	CHECK((sub = cache_tree_child(&repo, b.data, end, "bad", 3)));
+	CHECK(cache_tree_node(&repo, sub, end, &entries, &subtrees, &oid));
+	CHECK(entries == -1 && subtrees == 1 && !oid);
+	// Past "bad" and everything under it
+	CHECK((sub = cache_tree_child(&repo, b.data, end, "good", 4)));
+	CHECK(cache_tree_node(&repo, sub, end, &entries, &subtrees, &oid));
+	CHECK(entries == 2 && oid && !memcmp(oid, sub_oid, 20));
+	CHECK(!cache_tree_child(&repo, b.data, end, "deep", 4));
+	CHECK(!cache_tree_child(&repo, b.data, end, "goo", 3));
+	CHECK(cache_tree_skip(&repo, b.data, end, 0) == end);
+	// Cut short in the last oid
+	CHECK(!cache_tree_skip(&repo, b.data, end - 1, 0));
+}
+
+/**
+ * @brief Writes a loose object into the test repository
+ *
+ * @param[in] oid_size Picks the hash
+ * @param[in] type blob, tree or commit
+ * @param[in] data The object
+ * @param[in] len Its size
+ * @param[out] oid Its id
+ */
+static void put_object(int oid_size, const char* type, const void* data,
+	size_t len, uint8_t* oid)
+{
+	char path[PATH_MAX], hex[2 * GIT_OID_MAX + 1];
+	struct git_repo repo = test_repo(oid_size);
+	uLongf packed_len;
+	struct buf raw, packed;
+	struct sha ctx;
+
+	raw.len = snprintf((char*)raw.data, sizeof(raw.data), "%s %zu", type,
+		len) + 1;
+	put(&raw, data, len);
+	sha_init(&ctx, oid_size);
+	sha_update(&ctx, raw.data, raw.len);
+	sha_final(&ctx, oid);
+	packed_len = sizeof(packed.data);
+	compress2(packed.data, &packed_len, raw.data, raw.len, 1);
+
+	git_oid_hex(&repo, oid, hex);
+	snprintf(path, sizeof(path), "repo/.git/objects/%.2s/%s", hex, hex + 2);
+	test_write(path, packed.data, packed_len);
+}
+
+/**
+ * @brief Writes the index of the test repository, with a zeroed hash
+ */
+static void write_index(struct buf* b, int oid_size)
+{
+	put_zeros(b, oid_size);
+	test_write("repo/.git/index", b->data, b->len);
+}
+
+/**
+ * @brief Checks git_staged and git_unstaged on a repository of a file
+ * f and a file d/g, with the index rewritten each time
+ */
+static void test_repository(const char* dir, int oid_size)
+{
+	const char* config = oid_size == 32 ? "[core]\n"
+		"\trepositoryformatversion = 1\n[extensions]\n"
+		"\tobjectformat = sha256\n" : "[core]\n";
+	char path[PATH_MAX], hex[2 * GIT_OID_MAX + 1], commit[512];
+	uint8_t blob[GIT_OID_MAX], other[GIT_OID_MAX], sub[GIT_OID_MAX];
+	uint8_t tree[GIT_OID_MAX], head[GIT_OID_MAX];
+	struct git_repo repo;
+	struct buf b;
+	size_t tree_len;
+
+	snprintf(path, sizeof(path), "%s/repo", dir);
+	test_write("repo/.git/HEAD", "ref: refs/heads/main\n", 21);
+	test_write("repo/.git/config", config, strlen(config));
+	test_write("repo/f", "hi\n", 3);
+	test_write("repo/d/g", "hi\n", 3);
+
+	put_object(oid_size, "blob", "hi\n", 3, blob);
+	put_object(oid_size, "blob", "ho\n", 3, other);
+	b.len = 0;
+	put(&b, "100644 g", 9);
+	put(&b, blob, oid_size);
+	put_object(oid_size, "tree", b.data, b.len, sub);
+	b.len = 0;
+	put(&b, "40000 d", 8);
+	put(&b, sub, oid_size);
+	put(&b, "100644 f", 9);
+	put(&b, blob, oid_size);
+	tree_len = b.len;
+	put_object(oid_size, "tree", b.data, tree_len, tree);
+	repo = test_repo(oid_size);
+	git_oid_hex(&repo, tree, hex);
+	snprintf(commit, sizeof(commit), "tree %s\nauthor a <a> 1 +0000\n"
+		"committer a <a> 1 +0000\n\nsubject\n", hex);
+	put_object(oid_size, "commit", commit, strlen(commit), head);
+	git_oid_hex(&repo, head, hex);
+	strcat(hex, "\n");
+	test_write("repo/.git/refs/heads/main", hex, strlen(hex));
+
+	CHECK(git_open(&repo, path));
+	CHECK(repo.oid_size == oid_size);
+
+	// What HEAD has, with a valid cache tree root
+	put_header(&b, 2, 2);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100644, blob, oid_size, "f", 0);
+	put(&b, "TREE", 4);
+	put32(&b, 5 + oid_size);
+	put(&b, "\0" "2 0\n", 5);
+	put(&b, tree, oid_size);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 0);
+	// The entries say size 3 and mtime 0: the files get hashed
+	CHECK(git_unstaged(&repo) == 0);
+	test_write("repo/f", "ha\n", 3);
+	CHECK(git_unstaged(&repo) == 1);
+	test_write("repo/f", "hi\n", 3);
+
+	// The same after git add f; git reset f invalidated the root
+	put_header(&b, 2, 2);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100644, blob, oid_size, "f", 0);
+	put(&b, "TREE", 4);
+	put32(&b, 6);
+	put(&b, "\0" "-1 0\n", 6);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 0);
+
+	// Then something different staged, under a valid subtree
+	put_header(&b, 2, 2);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100644, other, oid_size, "f", 0);
+	put(&b, "TREE", 4);
+	put32(&b, 12 + oid_size);
+	put(&b, "\0" "-1 1\n", 6);
+	put(&b, "d\0" "1 0\n", 6);
+	put(&b, sub, oid_size);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 1);
+
+	// A new file, a deleted one, an intent to add and a mode change
+	put_header(&b, 3, 3);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100644, blob, oid_size, "e", 0);
+	put_entry(&b, 0100644, blob, oid_size, "f", 0);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 1);
+	put_header(&b, 3, 1);
+	put_entry(&b, 0100644, blob, oid_size, "f", 0);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 1);
+	put_header(&b, 3, 3);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100644, blob, oid_size, "e", GIT_INDEX_INTENT_TO_ADD);
+	put_entry(&b, 0100644, blob, oid_size, "f", 0);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 0);
+	put_header(&b, 2, 2);
+	put_entry(&b, 0100644, blob, oid_size, "d/g", 0);
+	put_entry(&b, 0100755, blob, oid_size, "f", 0);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == 1);
+
+	// A split index only has part of the entries
+	put_header(&b, 2, 0);
+	put(&b, "link", 4);
+	put32(&b, oid_size);
+	put(&b, tree, oid_size);
+	write_index(&b, oid_size);
+	CHECK(git_staged(&repo) == -1);
+	CHECK(git_unstaged(&repo) == -1);
+
+	nftw(path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+int main(void)
+{
+	const char* dir = test_dir();
+
+	test_hashes();
+	test_v2_v3(2);
+	test_v2_v3(3);
+	test_v4();
+	test_corrupt();
+	test_extensions();
+	test_cache_tree();
+	test_repository(dir, 20);
+	test_repository(dir, 32);
+	return TEST_EXIT();
+}
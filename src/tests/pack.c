@@ -0,0 +1,396 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../pack.c"
+
+uid_t render_uid(void)
+{
+	return getuid();
+}
+
+// An object: its id is first, then fill for the rest
+struct object {
+	uint8_t first;
+	uint8_t fill;
+	uint32_t pack; // For a multi-pack-index
+	uint64_t offset;
+};
+
+static void oid_of(const struct object* object, uint8_t* oid, int oid_size)
+{
+	memset(oid, object->fill, oid_size);
+	oid[0] = object->first;
+}
+
+static void put_oids(struct buf* b, const struct object* objects, int n,
+	int oid_size)
+{
+	uint8_t oid[GIT_OID_MAX];
+
+	for (int i = 0; i < n; i++) {
+		oid_of(objects + i, oid, oid_size);
+		put(b, oid, oid_size);
+	}
+}
+
+static void put_fanout(struct buf* b, const struct object* objects, int n)
+{
+	int count = 0;
+
+	for (int byte = 0; byte < 256; byte++) {
+		while (count < n && objects[count].first <= byte)
+			count++;
+		put32(b, count);
+	}
+}
+
+/**
+ * @brief Puts the 32-bit offsets of objects, after their packs for a
+ * multi-pack-index, pointing at the 64-bit ones of those that need them
+ */
+static void put_offsets(struct buf* b, const struct object* objects, int n,
+	bool with_pack)
+{
+	uint32_t large = 0;
+
+	for (int i = 0; i < n; i++) {
+		if (with_pack)
+			put32(b, objects[i].pack);
+		if (objects[i].offset < PACK_LARGE_OFFSET)
+			put32(b, objects[i].offset);
+		else
+			put32(b, PACK_LARGE_OFFSET | large++);
+	}
+}
+
+static void put_large_offsets(struct buf* b, const struct object* objects,
+	int n)
+{
+	for (int i = 0; i < n; i++)
+		if (objects[i].offset >= PACK_LARGE_OFFSET)
+			put64(b, objects[i].offset);
+}
+
+/**
+ * @brief Writes a version 2 .idx of objects, sorted by id
+ */
+static void write_idx(const char* path, const struct object* objects, int n,
+	int oid_size)
+{
+	struct buf b = { .len = 0 };
+
+	put(&b, IDX_MAGIC, 4);
+	put32(&b, 2);
+	put_fanout(&b, objects, n);
+	put_oids(&b, objects, n, oid_size);
+	for (int i = 0; i < n; i++)
+		put32(&b, 0); // CRCs
+	put_offsets(&b, objects, n, false);
+	put_large_offsets(&b, objects, n);
+	put_zeros(&b, 2 * oid_size); // The checksums
+	test_write(path, b.data, b.len);
+}
+
+/**
+ * @brief Writes a multi-pack-index of objects, sorted by id, in packs
+ *
+ * @param[in] path Where
+ * @param[in] names The .idx of the packs, in order
+ * @param[in] packs How many
+ * @param[in] objects The objects
+ * @param[in] n How many
+ * @param[in] oid_size The size of their ids
+ */
+static void write_midx(const char* path, const char* const* names, int packs,
+	const struct object* objects, int n, int oid_size)
+{
+	uint32_t ids[] = { 0x504e414d, 0x4f494446, 0x4f49444c, 0x4f4f4646,
+		0x4c4f4646 }; // PNAM, OIDF, OIDL, OOFF, LOFF
+	struct buf b = { .len = 0 }, chunks[5] = { { .len = 0 } };
+	uint64_t at;
+
+	for (int i = 0; i < packs; i++)
+		put(chunks, names[i], strlen(names[i]) + 1);
+	while (chunks[0].len % 4)
+		put(chunks, "", 1);
+	put_fanout(chunks + 1, objects, n);
+	put_oids(chunks + 2, objects, n, oid_size);
+	put_offsets(chunks + 3, objects, n, true);
+	put_large_offsets(chunks + 4, objects, n);
+
+	put(&b, MIDX_MAGIC, 4);
+	put(&b, (uint8_t[]){ 1, oid_size == 32 ? 2 : 1, 5, 0 }, 4);
+	put32(&b, packs);
+	at = MIDX_HEADER + 6 * 12;
+	for (int i = 0; i < 5; i++) {
+		put32(&b, ids[i]);
+		put64(&b, at);
+		at += chunks[i].len;
+	}
+	put32(&b, 0);
+	put64(&b, at);
+	for (int i = 0; i < 5; i++)
+		put(&b, chunks[i].data, chunks[i].len);
+	test_write(path, b.data, b.len);
+}
+
+/**
+ * @brief Makes a repository to write packs into
+ */
+static void test_repo(struct git_repo* repo, const char* name, int oid_size)
+{
+	if (snprintf(repo->commondir, sizeof(repo->commondir), "%s/%s",
+			test_root, name) >= (int)sizeof(repo->commondir))
+		exit(99);
+	repo->oid_size = oid_size;
+}
+
+/**
+ * @brief The path of a file in the objects/pack of a repository
+ */
+static const char* pack_path(const struct git_repo* repo, const char* name)
+{
+	static char path[2 * PATH_MAX];
+
+	snprintf(path, sizeof(path), "%s/objects/pack/%s", repo->commondir,
+		name);
+	return path;
+}
+
+/**
+ * @brief Overwrites a 32-bit number in a file of objects/pack
+ */
+static void patch32(const struct git_repo* repo, const char* name, long at,
+	uint32_t v)
+{
+	uint8_t bytes[4] = { v >> 24, v >> 16, v >> 8, v };
+	FILE* f;
+
+	if (!(f = fopen(pack_path(repo, name), "r+")) || fseek(f, at, SEEK_SET)
+			|| fwrite(bytes, 1, 4, f) != 4 || fclose(f)) {
+		perror(name);
+		exit(99);
+	}
+}
+
+static void test_search(void)
+{
+	static const struct object objects[] = {
+		{ 0x00, 1, 0, 0 },
+		{ 0x10, 1, 0, 0 },
+		{ 0x10, 2, 0, 0 },
+		{ 0x10, 3, 0, 0 },
+		{ 0xff, 9, 0, 0 },
+	};
+	struct buf fanout = { .len = 0 }, oids = { .len = 0 };
+	uint8_t oid[GIT_OID_MAX];
+	uint32_t pos;
+
+	put_fanout(&fanout, objects, 5);
+	put_oids(&oids, objects, 5, 20);
+	for (uint32_t i = 0; i < 5; i++) {
+		oid_of(objects + i, oid, 20);
+		CHECK(search_oids(fanout.data, oids.data, 20, oid, &pos) && pos == i);
+	}
+	// An empty bucket, and missing ids in full ones, on either side
+	oid_of(&(struct object){ 0x0f, 1, 0, 0 }, oid, 20);
+	CHECK(!search_oids(fanout.data, oids.data, 20, oid, &pos));
+	oid_of(&(struct object){ 0x10, 0, 0, 0 }, oid, 20);
+	CHECK(!search_oids(fanout.data, oids.data, 20, oid, &pos));
+	oid_of(&(struct object){ 0x10, 4, 0, 0 }, oid, 20);
+	CHECK(!search_oids(fanout.data, oids.data, 20, oid, &pos));
+	oid_of(&(struct object){ 0xff, 8, 0, 0 }, oid, 20);
+	CHECK(!search_oids(fanout.data, oids.data, 20, oid, &pos));
+}
+
+/**
+ * @brief Checks an object is found in a pack at an offset, or not at all
+ * with pack -1
+ */
+static void check_find(struct git_packs* packs, const struct object* object,
+	int pack, uint64_t offset, int oid_size, int line)
+{
+	uint8_t oid[GIT_OID_MAX];
+	uint64_t found_offset = 0;
+	int found_pack = -1;
+	bool found;
+
+	oid_of(object, oid, oid_size);
+	found = packs && git_packs_find(packs, oid, &found_pack, &found_offset);
+	if (pack == -1 ? found : !found || found_pack != pack
+			|| found_offset != offset) {
+		fprintf(stderr, "%s:%d: %02x%02x... found in %d at %llu\n", __FILE__,
+			line, object->first, object->fill, found ? found_pack : -1,
+			(unsigned long long)found_offset);
+		test_failures++;
+	}
+}
+
+#define CHECK_FIND(packs, object, pack, offset, oid_size) \
+	check_find(packs, object, pack, offset, oid_size, __LINE__)
+
+static void test_idx(int oid_size)
+{
+	static const struct object objects[] = {
+		{ 0x01, 1, 0, 12 },
+		{ 0x80, 1, 0, 0x123456789ull },
+		{ 0x80, 2, 0, 0x7fffffff },
+		{ 0xfe, 3, 0, 0x80000000ull },
+	};
+	struct object missing = { 0x80, 3, 0, 0 };
+	struct git_packs* packs;
+	struct git_repo repo;
+	const uint8_t* data;
+	size_t size;
+
+	test_repo(&repo, oid_size == 32 ? "idx256" : "idx", oid_size);
+	write_idx(oid_size == 32 ? "idx256/objects/pack/pack-a.idx"
+		: "idx/objects/pack/pack-a.idx", objects, 4, oid_size);
+	test_write(oid_size == 32 ? "idx256/objects/pack/pack-a.pack"
+		: "idx/objects/pack/pack-a.pack", "PACK\0\0\0\2\0\0\0\0"
+		"0123456789012345678901234567890123456789", 44);
+
+	CHECK((packs = git_packs_open(&repo)));
+	for (int i = 0; i < 4; i++)
+		CHECK_FIND(packs, objects + i, 0, objects[i].offset, oid_size);
+	CHECK_FIND(packs, &missing, -1, 0, oid_size);
+	CHECK((data = git_pack_data(packs, 0, &size)) && size == 44
+		&& !memcmp(data, "PACK", 4));
+	git_packs_close(packs);
+}
+
+static void test_midx(void)
+{
+	static const char* const names[] = { "pack-m1.idx", "pack-m2.idx" };
+	static const struct object covered[] = {
+		{ 0x10, 1, 0, 100 },
+		{ 0x20, 1, 1, 200 },
+		{ 0x20, 2, 1, 0x200000000ull },
+		{ 0x30, 1, 2, 300 }, // In a pack it doesn't list
+	}, first[] = {
+		{ 0x40, 1, 0, 400 },
+	}, second[] = {
+		{ 0x50, 1, 0, 500 },
+		{ 0x60, 1, 0, 0x300000000ull },
+	};
+	struct git_packs* packs;
+	struct git_repo repo;
+	const uint8_t* data;
+	size_t size;
+	int uncovered;
+
+	test_repo(&repo, "midx", 20);
+	write_midx("midx/objects/pack/multi-pack-index", names, 2, covered, 4,
+		20);
+	// The covered packs' .idx aren't read: these would say otherwise
+	write_idx("midx/objects/pack/pack-m1.idx", second, 2, 20);
+	write_idx("midx/objects/pack/pack-m2.idx", second, 2, 20);
+	test_write("midx/objects/pack/pack-m2.pack", "PACK\0\0\0\2\0\0\0\0"
+		"01234567890123456789", 32);
+	write_idx("midx/objects/pack/pack-u1.idx", first, 1, 20);
+	write_idx("midx/objects/pack/pack-u2.idx", second, 2, 20);
+
+	CHECK((packs = git_packs_open(&repo)));
+	if (!packs)
+		return;
+	CHECK(packs->midx_packs == 2 && packs->count == 4);
+	CHECK_FIND(packs, covered, 0, 100, 20);
+	CHECK_FIND(packs, covered + 1, 1, 200, 20);
+	CHECK_FIND(packs, covered + 2, 1, 0x200000000ull, 20);
+	CHECK_FIND(packs, covered + 3, -1, 0, 20);
+	CHECK((data = git_pack_data(packs, 1, &size)) && size == 32);
+
+	// Whichever order readdir gave the others, the hint doesn't hide any
+	uncovered = strcmp(packs->packs[2].name, "pack-u1") ? 3 : 2;
+	CHECK_FIND(packs, second + 1, 5 - uncovered, 0x300000000ull, 20);
+	CHECK_FIND(packs, first, uncovered, 400, 20);
+	CHECK_FIND(packs, second, 5 - uncovered, 500, 20);
+	CHECK_FIND(packs, &((struct object){ 0x50, 2, 0, 0 }), -1, 0, 20);
+	git_packs_close(packs);
+
+	// The same mappings until objects/pack changes
+	CHECK(git_packs_open(&repo) == packs);
+	git_packs_close(packs);
+}
+
+static void test_corrupt(void)
+{
+	static const char* const names[] = { "pack-m.idx" };
+	static const struct object objects[] = {
+		{ 0x10, 1, 0, 100 },
+		{ 0x20, 1, 0, 0x80000000ull },
+	};
+	struct git_packs* packs;
+	struct git_repo repo;
+	const char* path;
+	struct stat st;
+
+	// A SHA-256 multi-pack-index in a SHA-1 repository is ignored
+	test_repo(&repo, "corrupt-midx", 20);
+	write_midx("corrupt-midx/objects/pack/multi-pack-index", names, 1,
+		objects, 2, 32);
+	write_idx("corrupt-midx/objects/pack/pack-u.idx", objects + 1, 1, 20);
+	CHECK((packs = git_packs_open(&repo)));
+	CHECK(packs && !packs->midx && packs->count == 1);
+	CHECK_FIND(packs, objects, -1, 0, 20);
+	CHECK_FIND(packs, objects + 1, 0, 0x80000000ull, 20);
+	git_packs_close(packs);
+
+	// Chunks past its end
+	test_repo(&repo, "short-midx", 20);
+	write_midx("short-midx/objects/pack/multi-pack-index", names, 1,
+		objects, 2, 20);
+	path = pack_path(&repo, "multi-pack-index");
+	CHECK(!stat(path, &st) && !truncate(path, st.st_size - 1));
+	CHECK((packs = git_packs_open(&repo)));
+	CHECK(packs && !packs->midx && packs->count == 0);
+	git_packs_close(packs);
+
+	// An .idx of version 1, too short for its objects, or whose large
+	// offsets are cut off
+	test_repo(&repo, "corrupt-idx", 20);
+	write_idx("corrupt-idx/objects/pack/pack-v.idx", objects, 1, 20);
+	patch32(&repo, "pack-v.idx", 4, 1);
+	write_idx("corrupt-idx/objects/pack/pack-s.idx", objects, 1, 20);
+	path = pack_path(&repo, "pack-s.idx");
+	CHECK(!truncate(path, 8 + IDX_FANOUT + 28 + 39));
+	write_idx("corrupt-idx/objects/pack/pack-l.idx", objects + 1, 1, 20);
+	path = pack_path(&repo, "pack-l.idx");
+	CHECK(!truncate(path, 8 + IDX_FANOUT + 28 + 40));
+	CHECK((packs = git_packs_open(&repo)));
+	CHECK(packs && packs->count == 3);
+	CHECK_FIND(packs, objects, -1, 0, 20);
+	CHECK_FIND(packs, objects + 1, -1, 0, 20);
+	git_packs_close(packs);
+
+	// Fanouts that go down, which would send the search past the ids: the
+	// multi-pack-index's after its 12 bytes of names
+	test_repo(&repo, "fanout", 20);
+	write_midx("fanout/objects/pack/multi-pack-index", names, 1, objects, 2,
+		20);
+	patch32(&repo, "multi-pack-index", MIDX_HEADER + 6 * 12 + 12 + 4 * 0x10,
+		1000);
+	write_idx("fanout/objects/pack/pack-f.idx", objects + 1, 1, 20);
+	patch32(&repo, "pack-f.idx", 8 + 4 * 0x10, 1000);
+	CHECK((packs = git_packs_open(&repo)));
+	CHECK(packs && !packs->midx && packs->count == 1);
+	CHECK_FIND(packs, objects, -1, 0, 20);
+	CHECK_FIND(packs, objects + 1, -1, 0, 20);
+	git_packs_close(packs);
+
+	test_repo(&repo, "no-packs", 20);
+	CHECK(!git_packs_open(&repo));
+}
+
+int main(void)
+{
+	test_dir();
+	test_search();
+	test_idx(20);
+	test_idx(32);
+	test_midx();
+	test_corrupt();
+	return TEST_EXIT();
+}
@@ -0,0 +1,438 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../reftable.c"
+
+// A record: a ref, or for an index the last ref of a block
+struct ref {
+	const char* name;
+	uint8_t type; // As in a ref record
+	char fill; // The bytes of the oid, the peeled one has fill + 1
+	const char* target; // With type 3
+	uint64_t block; // For an index, where the block starts
+};
+
+static void set_be(uint8_t* p, uint64_t v, int bytes)
+{
+	while (bytes--)
+		*p++ = v >> 8 * bytes;
+}
+
+static void put_be(struct buf* b, uint64_t v, int bytes)
+{
+	uint8_t be[8];
+
+	set_be(be, v, bytes);
+	put(b, be, bytes);
+}
+
+static void put_varint(struct buf* b, uint64_t v)
+{
+	uint8_t bytes[10];
+	int i = sizeof(bytes) - 1;
+
+	bytes[i] = v & 127;
+	while (v >>= 7)
+		bytes[--i] = 128 | (--v & 127);
+	put(b, bytes + i, sizeof(bytes) - i);
+}
+
+static void put_header(struct buf* b, int version, uint32_t block_size,
+	const char* hash)
+{
+	put(b, "REFT", 4);
+	put_be(b, version, 1);
+	put_be(b, block_size, 3);
+	put_be(b, 1, 8); // Update indexes
+	put_be(b, 2, 8);
+	if (version == 2)
+		put(b, hash, 4);
+}
+
+static void put_footer(struct buf* b, uint64_t ref_index)
+{
+	size_t header_size = b->data[4] == 2 ? 28 : 24;
+
+	put(b, b->data, header_size);
+	put_be(b, ref_index, 8);
+	for (int i = 0; i < 4; i++)
+		put_be(b, 0, 8); // Object and log blocks
+	put_be(b, 0, 4); // The CRC, which isn't checked
+}
+
+static void put_record(struct buf* b, uint8_t block_type, const char* prev,
+	const struct ref* ref, int oid_size)
+{
+	size_t prefix = 0, len = strlen(ref->name);
+	uint8_t oid[2 * GIT_OID_MAX];
+
+	while (prev && prev[prefix] && prev[prefix] == ref->name[prefix])
+		prefix++;
+	put_varint(b, prefix);
+	put_varint(b, (len - prefix) << 3 | ref->type);
+	put(b, ref->name + prefix, len - prefix);
+	if (block_type == 'i') {
+		put_varint(b, ref->block);
+		return;
+	}
+	put_varint(b, 0); // Update index delta
+	if (ref->type == 3) {
+		put_varint(b, strlen(ref->target));
+		put(b, ref->target, strlen(ref->target));
+	} else if (ref->type) {
+		memset(oid, ref->fill, oid_size);
+		memset(oid + oid_size, ref->fill + 1, oid_size);
+		put(b, oid, ref->type * oid_size);
+	}
+}
+
+/**
+ * @brief Appends a block, with a restart point every few records
+ *
+ * @param[in,out] b The table
+ * @param[in] start Where the block starts, 0 for the first, after the header
+ * @param[in] type 'r' or 'i'
+ * @param[in] refs Its records, in order
+ * @param[in] n The amount of records
+ * @param[in] restart_every Records from one restart point to the next
+ * @param[in] oid_size The size of the oids
+ */
+static void put_block(struct buf* b, size_t start, uint8_t type,
+	const struct ref* refs, int n, int restart_every, int oid_size)
+{
+	uint32_t restarts[16];
+	size_t len_at;
+	int count = 0;
+
+	put(b, &type, 1);
+	len_at = b->len;
+	put_be(b, 0, 3);
+	for (int i = 0; i < n; i++) {
+		if (i % restart_every == 0)
+			restarts[count++] = b->len - start;
+		put_record(b, type, i % restart_every ? refs[i - 1].name : NULL,
+			refs + i, oid_size);
+	}
+	for (int i = 0; i < count; i++)
+		put_be(b, restarts[i], 3);
+	put_be(b, count, 2);
+	set_be(b->data + len_at, b->len - start, 3);
+}
+
+static void pad(struct buf* b, size_t to)
+{
+	put_zeros(b, to - b->len);
+}
+
+static void test_varint(void)
+{
+	uint64_t values[] = { 0, 1, 127, 128, 16511, 16512, 1 << 20, 1ull << 40 };
+	const uint8_t* end;
+	struct buf b;
+	uint64_t v;
+
+	for (size_t i = 0; i < sizeof(values) / sizeof(*values); i++) {
+		b.len = 0;
+		put_varint(&b, values[i]);
+		end = get_varint(b.data, b.data + b.len, &v);
+		CHECK(end == b.data + b.len && v == values[i]);
+		CHECK(!get_varint(b.data, b.data + b.len - 1, &v));
+	}
+	// 128 is two bytes, git's offset encoding has no redundant forms
+	b.len = 0;
+	put_varint(&b, 128);
+	CHECK(b.len == 2 && b.data[0] == 0x80 && b.data[1] == 0);
+}
+
+/**
+ * @brief Decodes a record of a block that is only that record
+ */
+static const uint8_t* decode(uint8_t type, const char* bytes, size_t len,
+	struct reftable_record* record)
+{
+	struct reftable table = { .oid_size = 20 };
+	struct reftable_block block = {
+		.type = type,
+		.records = (const uint8_t*)bytes,
+		.restarts = (const uint8_t*)bytes + len,
+	};
+
+	return decode_record(&table, &block, block.records, record);
+}
+
+static void test_records(void)
+{
+	struct reftable_record record = { .key_len = 0 };
+	char oid[] = "\0\x09" "b" "\0" "01234567890123456789";
+
+	// A symref, its value after its length
+	CHECK(decode('r', "\0\x1b" "abc" "\0" "\x01" "x", 8, &record));
+	CHECK(record.key_len == 3 && !memcmp(record.key, "abc", 3));
+	CHECK(record.type == 3 && record.value_len == 1
+		&& *record.value == 'x');
+	// Prefix compressed, deleted
+	CHECK(decode('r', "\x03\x08" "d" "\0", 4, &record));
+	CHECK(record.key_len == 4 && !memcmp(record.key, "abcd", 4));
+	CHECK(record.type == 0 && record.value_len == 0);
+	// A prefix longer than the previous key
+	CHECK(!decode('r', "\x05\x08" "d" "\0", 4, &record));
+
+	record.key_len = 0;
+	CHECK(!decode('r', "\0\x50" "ab", 4, &record)); // Suffix past the end
+	CHECK(!decode('r', "\0\x0c" "a" "\0", 4, &record)); // Type 4
+	CHECK(!decode('r', "\0\x80", 2, &record)); // Truncated varint
+	CHECK(!decode('r', "\0\x1b" "abc" "\0" "\x02" "x", 8, &record));
+	// An oid one byte short, then whole
+	CHECK(!decode('r', oid, sizeof(oid) - 2, &record));
+	CHECK(decode('r', oid, sizeof(oid) - 1, &record));
+	CHECK(record.value_len == 20 && record.value[19] == '9');
+	// Two oids for a peeled tag
+	oid[1] = 0x0a;
+	CHECK(!decode('r', oid, sizeof(oid) - 1, &record));
+	// An index record points at a block, with no update index
+	CHECK(decode('i', "\0\x08" "a" "\x80\x00", 5, &record));
+	CHECK(record.key_len == 1 && record.value_len == 128);
+	// Keys past GIT_REF_MAX
+	record.key_len = GIT_REF_MAX - 1;
+	CHECK(!decode('r', "\x80\x7f\x08" "a" "\0", 5, &record));
+}
+
+static const struct ref refs[] = {
+	{ "HEAD", 3, 0, "refs/heads/main", 0 },
+	{ "refs/heads/main", 1, 'm', NULL, 0 },
+	{ "refs/heads/peeled", 2, 'p', NULL, 0 },
+	{ "refs/tags/gone", 0, 0, NULL, 0 },
+	{ "refs/tags/v1", 1, 'v', NULL, 0 },
+};
+
+static void write_table(const char* path, const struct buf* b)
+{
+	test_write(path, b->data, b->len);
+}
+
+/**
+ * @brief Checks a ref looks up as an oid filled with fill, or as missing
+ */
+static void check_oid(const char* dir, const char* name, char fill, int line)
+{
+	uint8_t oid[GIT_OID_MAX], want[GIT_OID_MAX];
+	char target[GIT_REF_MAX];
+	enum reftable_result found;
+
+	memset(oid, 0, sizeof(oid));
+	memset(want, fill, sizeof(want));
+	found = reftable_lookup(dir, name, 20, oid, target);
+	if (fill ? found != ReftableOid || memcmp(oid, want, 20)
+			: found != ReftableMissing) {
+		fprintf(stderr, "%s:%d: %s looked up wrong\n", __FILE__, line, name);
+		test_failures++;
+	}
+}
+
+#define CHECK_OID(dir, name, fill) check_oid(dir, name, fill, __LINE__)
+
+static void test_block(const char* root)
+{
+	char dir[PATH_MAX], target[GIT_REF_MAX];
+	uint8_t oid[GIT_OID_MAX];
+	struct buf b = { .len = 0 };
+
+	snprintf(dir, sizeof(dir), "%s/block", root);
+	CHECK(reftable_lookup(dir, "HEAD", 20, oid, target) == ReftableMissing);
+	put_header(&b, 1, 0, NULL);
+	put_block(&b, 0, 'r', refs, 5, 2, 20);
+	put_footer(&b, 0);
+	write_table("block/0001.ref", &b);
+	test_write("block/tables.list", "0001.ref\n", 9);
+
+	CHECK(reftable_lookup(dir, "HEAD", 20, oid, target) == ReftableSymref);
+	CHECK_STR(target, "refs/heads/main");
+	CHECK_OID(dir, "refs/heads/main", 'm');
+	// A peeled tag is the tag, not what it peels to
+	CHECK_OID(dir, "refs/heads/peeled", 'p');
+	CHECK_OID(dir, "refs/tags/gone", 0);
+	CHECK_OID(dir, "refs/tags/v1", 'v');
+	// Before, between and after the keys, and prefixes of them
+	CHECK_OID(dir, "A", 0);
+	CHECK_OID(dir, "refs/heads/ma", 0);
+	CHECK_OID(dir, "refs/heads/mainline", 0);
+	CHECK_OID(dir, "refs/tags/v", 0);
+	CHECK_OID(dir, "zzz", 0);
+}
+
+/**
+ * @brief Writes a table of three ref blocks padded to 256 bytes, with an
+ * index block after them or not
+ */
+static void write_blocks(const char* path, bool index)
+{
+	static const struct ref blocks[][2] = {
+		{ { "refs/heads/a", 1, 'a', NULL, 0 },
+			{ "refs/heads/b", 1, 'b', NULL, 0 } },
+		{ { "refs/heads/c", 1, 'c', NULL, 0 },
+			{ "refs/heads/d", 1, 'd', NULL, 0 } },
+		{ { "refs/tags/v1", 1, 'v', NULL, 0 },
+			{ "refs/tags/v2", 1, 'w', NULL, 0 } },
+	};
+	struct ref last[3];
+	struct buf b = { .len = 0 };
+
+	put_header(&b, 1, 256, NULL);
+	for (int i = 0; i < 3; i++) {
+		put_block(&b, 256 * i, 'r', blocks[i], 2, 1, 20);
+		pad(&b, 256 * (i + 1));
+		last[i] = (struct ref){ blocks[i][1].name, 0, 0, NULL, 256 * i };
+	}
+	if (index)
+		put_block(&b, 768, 'i', last, 3, 2, 20);
+	put_footer(&b, index ? 768 : 0);
+	write_table(path, &b);
+}
+
+static void test_blocks(const char* root)
+{
+	char dir[PATH_MAX];
+
+	for (int index = 0; index < 2; index++) {
+		snprintf(dir, sizeof(dir), "%s/blocks%d", root, index);
+		write_blocks(index ? "blocks1/0001.ref" : "blocks0/0001.ref", index);
+		test_write(index ? "blocks1/tables.list" : "blocks0/tables.list",
+			"0001.ref\n", 9);
+		CHECK_OID(dir, "refs/heads/a", 'a');
+		CHECK_OID(dir, "refs/heads/b", 'b');
+		CHECK_OID(dir, "refs/heads/c", 'c');
+		CHECK_OID(dir, "refs/heads/d", 'd');
+		CHECK_OID(dir, "refs/tags/v1", 'v');
+		CHECK_OID(dir, "refs/tags/v2", 'w');
+		CHECK_OID(dir, "refs/heads/bb", 0);
+		CHECK_OID(dir, "refs/heads/e", 0);
+		CHECK_OID(dir, "refs/tags/v3", 0);
+		CHECK_OID(dir, "HEAD", 0);
+	}
+}
+
+static void test_stack(const char* root)
+{
+	static const struct ref old[] = {
+		{ "HEAD", 3, 0, "refs/heads/main", 0 },
+		{ "refs/heads/main", 1, 'a', NULL, 0 },
+		{ "refs/heads/old", 1, 'o', NULL, 0 },
+	}, new[] = {
+		{ "refs/heads/main", 1, 'b', NULL, 0 },
+		{ "refs/heads/new", 1, 'n', NULL, 0 },
+		{ "refs/heads/old", 0, 0, NULL, 0 },
+	};
+	char dir[PATH_MAX], target[GIT_REF_MAX];
+	uint8_t oid[GIT_OID_MAX];
+	struct buf b = { .len = 0 };
+
+	snprintf(dir, sizeof(dir), "%s/stack", root);
+	put_header(&b, 1, 0, NULL);
+	put_block(&b, 0, 'r', old, 3, 16, 20);
+	put_footer(&b, 0);
+	write_table("stack/0001-0001-aaaa.ref", &b);
+	b.len = 0;
+	put_header(&b, 1, 0, NULL);
+	put_block(&b, 0, 'r', new, 3, 16, 20);
+	put_footer(&b, 0);
+	write_table("stack/0002-0002-bbbb.ref", &b);
+	test_write("stack/tables.list",
+		"0001-0001-aaaa.ref\n0002-0002-bbbb.ref\n", 38);
+
+	CHECK(reftable_lookup(dir, "HEAD", 20, oid, target) == ReftableSymref);
+	CHECK_STR(target, "refs/heads/main");
+	CHECK_OID(dir, "refs/heads/main", 'b');
+	CHECK_OID(dir, "refs/heads/new", 'n');
+	CHECK_OID(dir, "refs/heads/old", 0);
+}
+
+static void test_sha256(const char* root)
+{
+	static const struct ref sha256[] = {
+		{ "refs/heads/main", 2, 'x', NULL, 0 },
+	};
+	char dir[PATH_MAX], target[GIT_REF_MAX];
+	uint8_t oid[GIT_OID_MAX], want[GIT_OID_MAX];
+	struct buf b = { .len = 0 };
+
+	snprintf(dir, sizeof(dir), "%s/sha256", root);
+	put_header(&b, 2, 0, "s256");
+	put_block(&b, 0, 'r', sha256, 1, 16, 32);
+	put_footer(&b, 0);
+	write_table("sha256/0001.ref", &b);
+	test_write("sha256/tables.list", "0001.ref", 8);
+
+	// The table's hash wins over the one the caller assumed
+	memset(want, 'x', sizeof(want));
+	CHECK(reftable_lookup(dir, "refs/heads/main", 20, oid, target)
+		== ReftableOid);
+	CHECK(!memcmp(oid, want, 32));
+}
+
+static void test_corrupt(const char* root)
+{
+	struct reftable_block block;
+	struct reftable_record record;
+	struct reftable table;
+	char path[PATH_MAX];
+	struct buf b = { .len = 0 }, bad;
+
+	put_header(&b, 1, 0, NULL);
+	put_block(&b, 0, 'r', refs, 5, 2, 20);
+	put_footer(&b, 0);
+	snprintf(path, sizeof(path), "%s/corrupt.ref", root);
+
+	write_table("corrupt.ref", &b);
+	CHECK(table_open(path, 20, &table));
+	CHECK(block_at(&table, 0, &block) && block.restart_count == 3);
+	CHECK(block_search(&table, &block, "refs/tags/v1", &record)
+		== BlockExact);
+	table_close(&table);
+
+	// The footer must repeat the header
+	bad = b;
+	bad.data[bad.len - 68 + 8] ^= 1;
+	write_table("corrupt.ref", &bad);
+	CHECK(!table_open(path, 20, &table));
+	bad = b;
+	bad.data[4] = 3;
+	write_table("corrupt.ref", &bad);
+	CHECK(!table_open(path, 20, &table));
+	test_write("corrupt.ref", b.data, 24 + 67);
+	CHECK(!table_open(path, 20, &table));
+
+	// The block's length past the footer, or its restarts before its records
+	bad = b;
+	table = (struct reftable){ .data = bad.data, .size = bad.len,
+		.header_size = 24, .end = bad.len - 68, .oid_size = 20 };
+	set_be(bad.data + 25, bad.len, 3);
+	CHECK(!block_at(&table, 0, &block));
+	bad = b;
+	set_be(bad.data + bad.len - 68 - 2, 1000, 2);
+	CHECK(!block_at(&table, 0, &block));
+	bad = b;
+	bad.data[24] = 'g';
+	CHECK(!block_at(&table, 0, &block));
+	// A restart point in the header
+	bad = b;
+	set_be(bad.data + bad.len - 68 - 2 - 9, 3, 3);
+	CHECK(block_at(&table, 0, &block));
+	CHECK(block_search(&table, &block, "refs/heads/main", &record)
+		== BlockError);
+}
+
+int main(void)
+{
+	const char* root = test_dir();
+
+	test_varint();
+	test_records();
+	test_block(root);
+	test_blocks(root);
+	test_stack(root);
+	test_sha256(root);
+	test_corrupt(root);
+	return TEST_EXIT();
+}
@@ -0,0 +1,158 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_TEST_H
+#define CPROMPT_TEST_H
+
+#include <ftw.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "env.h"
+
+/* Unit tests
+ *
+ * Each test is a program run by make check. It includes the source file it
+ * tests, to get at the static parsers, and links whatever else that needs.
+ * CHECK reports a failed condition and carries on; the program fails if any
+ * did.
+ */
+
+static int test_failures = 0;
+
+#define CHECK(cond) \
+	do { \
+		if (!(cond)) { \
+			fprintf(stderr, "%s:%d: failed: %s\n", __FILE__, __LINE__, \
+				#cond); \
+			test_failures++; \
+		} \
+	} while (0)
+
+#define CHECK_STR(got, want) \
+	do { \
+		const char* got_ = (got), *want_ = (want); \
+		if (strcmp(got_, want_)) { \
+			fprintf(stderr, "%s:%d: %s is \"%s\", not \"%s\"\n", __FILE__, \
+				__LINE__, #got, got_, want_); \
+			test_failures++; \
+		} \
+	} while (0)
+
+static char test_root[PATH_MAX];
+
+static int remove_entry(const char* path, const struct stat* st, int flag,
+	struct FTW* ftw)
+{
+	(void)st;
+	(void)flag;
+	(void)ftw;
+	remove(path);
+	return 0;
+}
+
+static void remove_test_root(void)
+{
+	nftw(test_root, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+}
+
+/**
+ * @brief Makes a scratch directory, removed at exit, which also holds the
+ * cache so tests don't touch the user's
+ *
+ * @return The directory, a canonical path
+ */
+static inline const char* test_dir(void)
+{
+	char template[PATH_MAX], cache[PATH_MAX + 8];
+
+	snprintf(template, sizeof(template), "%s/cprompt-test-XXXXXX",
+		getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp");
+	if (!mkdtemp(template) || !realpath(template, test_root)) {
+		perror("cprompt-test");
+		exit(99); // A hard error to automake
+	}
+	atexit(remove_test_root);
+	snprintf(cache, sizeof(cache), "%s/cache", test_root);
+	mkdir(cache, 0700);
+	setenv("XDG_CACHE_HOME", cache, 1);
+	env_reset();
+	return test_root;
+}
+
+/**
+ * @brief Writes a file under the scratch directory, making its parents
+ *
+ * @param[in] path The path, relative to test_dir
+ * @param[in] data What to write
+ * @param[in] len How much of it
+ */
+static inline void test_write(const char* path, const void* data, size_t len)
+{
+	char full[2 * PATH_MAX];
+	FILE* f;
+
+	snprintf(full, sizeof(full), "%s/%s", test_root, path);
+	for (char* slash = strchr(full + strlen(test_root) + 1, '/'); slash;
+			slash = strchr(slash + 1, '/')) {
+		*slash = 0;
+		mkdir(full, 0700);
+		*slash = '/';
+	}
+	if (!(f = fopen(full, "wb")) || fwrite(data, 1, len, f) != len
+			|| fclose(f)) {
+		perror(full);
+		exit(99);
+	}
+}
+
+// Files put together byte by byte: indexes, packs, tables
+struct buf {
+	uint8_t data[0x20000];
+	size_t len;
+};
+
+/**
+ * @brief Appends to a buffer, a hard error if it doesn't fit
+ */
+static inline void put(struct buf* b, const void* data, size_t len)
+{
+	if (len > sizeof(b->data) - b->len) {
+		fprintf(stderr, "cprompt-test: %zu bytes too many\n",
+			len - (sizeof(b->data) - b->len));
+		exit(99);
+	}
+	memcpy(b->data + b->len, data, len);
+	b->len += len;
+}
+
+static inline void put_zeros(struct buf* b, size_t len)
+{
+	static const uint8_t zeros[256];
+
+	for (; len > sizeof(zeros); len -= sizeof(zeros))
+		put(b, zeros, sizeof(zeros));
+	put(b, zeros, len);
+}
+
+static inline void put32(struct buf* b, uint32_t v)
+{
+	uint8_t bytes[4] = { v >> 24, v >> 16, v >> 8, v };
+
+	put(b, bytes, 4);
+}
+
+static inline void put64(struct buf* b, uint64_t v)
+{
+	put32(b, v >> 32);
+	put32(b, v);
+}
+
+#define TEST_EXIT() (test_failures ? EXIT_FAILURE : EXIT_SUCCESS)
+
+#endif
@@ -0,0 +1,161 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include "test.h"
+#include "../timefmt.c"
+
+// 2024-01-15 and 2024-07-01, at midnight UTC
+#define WINTER 1705276800
+#define SUMMER 1719792000
+
+/**
+ * @brief Checks what a rule says about a time
+ */
+static void check_rule(const char* rule, time_t when, long offset,
+	const char* abbr)
+{
+	struct time_zone zone;
+
+	CHECK(time_zone_rule(rule, when, &zone));
+	CHECK(zone.offset == offset);
+	CHECK_STR(zone.abbr, abbr);
+}
+
+static void test_rule(void)
+{
+	struct time_zone zone;
+	const char* cet = "CET-1CEST,M3.5.0,M10.5.0/3";
+	const char* aest = "AEST-10AEDT,M10.1.0,M4.1.0/3";
+
+	check_rule(cet, WINTER, 3600, "CET");
+	check_rule(cet, SUMMER, 7200, "CEST");
+	CHECK(time_zone_rule(cet, SUMMER, &zone) && zone.is_dst);
+	CHECK(time_zone_rule(cet, WINTER, &zone) && !zone.is_dst);
+	// 2024-03-31 and 2024-10-27 at 01:00 UTC, the last Sundays
+	check_rule(cet, 1711846799, 3600, "CET");
+	check_rule(cet, 1711846800, 7200, "CEST");
+	check_rule(cet, 1729990799, 7200, "CEST");
+	check_rule(cet, 1729990800, 3600, "CET");
+
+	// Daylight saving time over the new year
+	check_rule(aest, WINTER, 39600, "AEDT");
+	check_rule(aest, SUMMER, 36000, "AEST");
+
+	check_rule("UTC0", SUMMER, 0, "UTC");
+	check_rule("<+0530>-5:30", SUMMER, 19800, "+0530");
+	check_rule("EST5EDT4,J60/1:30,J300", SUMMER, -14400, "EDT");
+
+	CHECK(!time_zone_rule(":UTC", SUMMER, &zone));
+	CHECK(!time_zone_rule("EST", SUMMER, &zone));
+	CHECK(!time_zone_rule("<+03", SUMMER, &zone));
+	CHECK(!time_zone_rule("CET-1CEST,M3.5.0", SUMMER, &zone));
+	CHECK(!time_zone_rule("CET-1CEST,M13.5.0,M10.5.0", SUMMER, &zone));
+	CHECK(!time_zone_rule("CET-168", SUMMER, &zone));
+}
+
+/**
+ * @brief Puts a TZif header together
+ */
+static void put_header(struct buf* b, uint32_t times, uint32_t types,
+	uint32_t chars)
+{
+	put(b, "TZif2", 5);
+	put_zeros(b, 15);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, 0);
+	put32(b, times);
+	put32(b, types);
+	put32(b, chars);
+}
+
+/**
+ * @brief Puts a version 2 TZif file together
+ *
+ * Transitions at 1000000000 to XST (+2, daylight saving time) and at
+ * 1500000000 back to LMT (+1), which is also what it was before.
+ *
+ * @param[out] b The file
+ * @param[in] footer The TZ rule for after them
+ * @param[in] last The type of the last transition
+ */
+static void write_tzif(struct buf* b, const char* footer, uint8_t last)
+{
+	uint8_t types[] = { 0, 0, 0x0e, 0x10, 0, 0, 0, 0, 0x1c, 0x20, 1, 4 };
+
+	b->len = 0;
+	// The 32 bit block, which readers of version 2 skip
+	put_header(b, 0, 1, 4);
+	put_zeros(b, 6);
+	put(b, "UTC", 4);
+
+	put_header(b, 2, 2, 8);
+	put64(b, 1000000000);
+	put64(b, 1500000000);
+	put(b, (uint8_t[]){ 1, last }, 2);
+	put(b, types, sizeof(types));
+	put(b, "LMT\0XST", 8);
+	put(b, "\n", 1);
+	put(b, footer, strlen(footer));
+	put(b, "\n", 1);
+}
+
+static void test_file(void)
+{
+	static struct buf b;
+	struct time_zone zone;
+
+	write_tzif(&b, "CET-1CEST,M3.5.0,M10.5.0/3", 0);
+	CHECK(time_zone_file(b.data, b.len, 0, &zone));
+	CHECK(zone.offset == 3600 && !zone.is_dst);
+	CHECK_STR(zone.abbr, "LMT");
+	CHECK(time_zone_file(b.data, b.len, 1200000000, &zone));
+	CHECK(zone.offset == 7200 && zone.is_dst);
+	CHECK_STR(zone.abbr, "XST");
+	CHECK(time_zone_file(b.data, b.len, 1499999999, &zone));
+	CHECK_STR(zone.abbr, "XST");
+	// After the last transition, the footer
+	CHECK(time_zone_file(b.data, b.len, SUMMER, &zone));
+	CHECK(zone.offset == 7200);
+	CHECK_STR(zone.abbr, "CEST");
+
+	// Without one, the last transition
+	write_tzif(&b, "", 0);
+	CHECK(time_zone_file(b.data, b.len, SUMMER, &zone));
+	CHECK(zone.offset == 3600);
+	CHECK_STR(zone.abbr, "LMT");
+
+	// A type that isn't there, or a file cut short
+	write_tzif(&b, "", 2);
+	CHECK(!time_zone_file(b.data, b.len, SUMMER, &zone));
+	write_tzif(&b, "", 0);
+	CHECK(!time_zone_file(b.data, 100, SUMMER, &zone));
+	CHECK(!time_zone_file((const uint8_t*)"TZif", 4, SUMMER, &zone));
+}
+
+static void test_tm(void)
+{
+	struct time_zone zone = { .offset = -9000, .abbr = "ABC" };
+	struct tm tm;
+#if defined(HAVE_STRUCT_TM_TM_GMTOFF) && defined(HAVE_STRUCT_TM_TM_ZONE)
+	char out[64];
+#endif
+
+	time_zone_tm(&zone, SUMMER, &tm);
+	CHECK(tm.tm_year == 124 && tm.tm_mon == 5 && tm.tm_mday == 30);
+	CHECK(tm.tm_hour == 21 && tm.tm_min == 30);
+#if defined(HAVE_STRUCT_TM_TM_GMTOFF) && defined(HAVE_STRUCT_TM_TM_ZONE)
+	// strftime gets the zone too
+	CHECK(format_time(out, sizeof(out), "%H:%M %z %Z", &tm, &c_names) > 0);
+	CHECK_STR(out, "21:30 -0230 ABC");
+#endif
+}
+
+int main(void)
+{
+	test_rule();
+	test_file();
+	test_tm();
+	return TEST_EXIT();
+}
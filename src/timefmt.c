@@ -0,0 +1,672 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <ctype.h>
+#include <limits.h>
+#include <locale.h>
+#ifdef __APPLE__
+#include <xlocale.h>
+#endif
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "cache.h"
+#include "env.h"
+#include "timefmt.h"
+
+#define TIME_NAMES_MAGIC 0x544e4d32 // TNM2
+// How long a locale that couldn't be loaded is shown in C before retrying
+#define TIME_NAMES_RETRY_SECONDS 60
+// Where the C library reads LC_TIME from, %s being the locale name
+#ifdef __APPLE__
+static const char* const locale_sources[] = {
+	"/usr/share/locale/%s/LC_TIME",
+};
+#else
+static const char* const locale_sources[] = {
+	"/usr/lib/locale/locale-archive",
+	"/usr/lib/locale/%s/LC_TIME",
+};
+#endif
+
+static const struct time_names c_names = {
+	.magic = TIME_NAMES_MAGIC,
+	.localised = 0,
+	.abday = { "Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat" },
+	.day = { "Sunday", "Monday", "Tuesday", "Wednesday", "Thursday",
+		"Friday", "Saturday" },
+	.abmon = { "Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug",
+		"Sep", "Oct", "Nov", "Dec" },
+	.mon = { "January", "February", "March", "April", "May", "June",
+		"July", "August", "September", "October", "November", "December" },
+	.am_pm = { "AM", "PM" },
+};
+
+/**
+ * @brief Gets the name of the LC_TIME locale, like setlocale(LC_TIME, "")
+ * would
+ *
+ * @return The locale name, NULL for the C locale
+ */
+static const char* time_locale(void)
+{
+	const char* name;
+
+	if (!(name = env_get(ENV_LC_ALL)) || !*name)
+		if (!(name = env_get(ENV_LC_TIME)) || !*name)
+			name = env_get(ENV_LANG);
+	if (!name || !*name || !strcmp(name, "C") || !strcmp(name, "POSIX"))
+		return NULL;
+	return name;
+}
+
+/**
+ * @brief Loads the LC_TIME part of a locale, once per thread and locale
+ *
+ * This is the slow path, on its own so the locale of the process (and of
+ * its other threads) is untouched.
+ *
+ * @param[in] locale The locale name, NULL for C
+ * @return The locale, (locale_t)0 if it couldn't be loaded
+ */
+static locale_t locale_object(const char* locale)
+{
+	static _Thread_local locale_t object = (locale_t)0;
+	static _Thread_local char object_for[64];
+	// When to try a locale that couldn't be loaded again
+	static _Thread_local time_t retry_at;
+
+	locale = locale ? locale : "C";
+	if (!strcmp(object_for, locale) && (object || time(NULL) < retry_at))
+		return object;
+	if (object)
+		freelocale(object);
+	if (!(object = newlocale(LC_TIME_MASK, locale, (locale_t)0)))
+		retry_at = time(NULL) + TIME_NAMES_RETRY_SECONDS;
+	// A name too long to remember is loaded again next time
+	if (snprintf(object_for, sizeof(object_for), "%s", locale)
+			>= (int)sizeof(object_for))
+		*object_for = 0;
+	return object;
+}
+
+/**
+ * @brief Hashes the files the C library reads a locale from
+ *
+ * @param[in] locale The locale name
+ * @return The hash, which changes when one of them does
+ */
+static uint64_t locale_stamp(const char* locale)
+{
+	char path[PATH_MAX];
+	struct stat st;
+	int64_t stamp[4];
+	uint64_t hash = 0;
+
+	for (size_t i = 0; i < sizeof(locale_sources) / sizeof(*locale_sources);
+			i++) {
+		memset(stamp, 0, sizeof(stamp));
+		if (snprintf(path, PATH_MAX, locale_sources[i], locale) < PATH_MAX
+				&& stat(path, &st) == 0) {
+			stamp[0] = st.st_ino;
+			stamp[1] = st.st_size;
+			stamp[2] = st.st_mtime;
+			stamp[3] = ST_MTIM_NSEC(st);
+		}
+		hash = cache_hash(stamp, sizeof(stamp), hash);
+	}
+	return hash;
+}
+
+/**
+ * @brief Asks the C library for the names of a locale
+ *
+ * @param[in] locale The locale name
+ * @param[out] names The extracted names, the C ones on failure
+ * @return false if the locale couldn't be loaded
+ */
+static bool extract_names(const char* locale, struct time_names* names)
+{
+	struct tm tm = { .tm_year = 100, .tm_mday = 1 };
+	locale_t loc;
+
+	*names = c_names;
+	if (!(loc = locale_object(locale)))
+		return false;
+
+	for (int i = 0; i < 7; i++) {
+		tm.tm_wday = i;
+		strftime_l(names->abday[i], sizeof(names->abday[i]), "%a", &tm, loc);
+		strftime_l(names->day[i], sizeof(names->day[i]), "%A", &tm, loc);
+	}
+	for (int i = 0; i < 12; i++) {
+		tm.tm_mon = i;
+		strftime_l(names->abmon[i], sizeof(names->abmon[i]), "%b", &tm, loc);
+		strftime_l(names->mon[i], sizeof(names->mon[i]), "%B", &tm, loc);
+	}
+	for (int i = 0; i < 2; i++) {
+		tm.tm_hour = i * 12;
+		// Plenty of locales have no AM/PM: this leaves the name empty
+		if (!strftime_l(names->am_pm[i], sizeof(names->am_pm[i]), "%p", &tm,
+				loc))
+			*names->am_pm[i] = 0;
+	}
+	names->localised = 1;
+	return true;
+}
+
+/**
+ * @brief Loads the names of a locale from the cache, extracting on a miss
+ *
+ * A locale that couldn't be loaded isn't written to the cache, so it is
+ * picked up once it is installed, and the names are extracted again once
+ * the files of the locale change.
+ *
+ * @param[in] locale The locale name
+ * @param[out] names The names
+ * @return false if the locale couldn't be loaded, names are the C ones
+ */
+static bool load_names(const char* locale, struct time_names* names)
+{
+	char path[PATH_MAX], tmp[PATH_MAX];
+	const char* dir;
+	uint64_t stamp;
+	int fd, len;
+
+	if (!(dir = cache_dir()))
+		return extract_names(locale, names);
+	len = snprintf(path, PATH_MAX, "%s/locale-", dir);
+	for (const char* c = locale; *c && len < PATH_MAX - 1; c++)
+		path[len++] = *c == '/' ? '_' : *c;
+	path[len] = 0;
+
+	stamp = locale_stamp(locale);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) != -1) {
+		len = read(fd, names, sizeof(*names));
+		close(fd);
+		if (len == sizeof(*names) && names->magic == TIME_NAMES_MAGIC
+				&& names->stamp == stamp)
+			return true;
+	}
+
+	if (!extract_names(locale, names))
+		return false;
+	names->stamp = stamp;
+	// Written aside and renamed so no one ever reads half a file
+	len = snprintf(tmp, PATH_MAX, "%s.%ld", path, (long)getpid());
+	if (len < 0 || len >= PATH_MAX)
+		return true;
+	if ((fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+			== -1)
+		return true;
+	len = write(fd, names, sizeof(*names));
+	close(fd);
+	if (len != sizeof(*names) || rename(tmp, path) == -1)
+		unlink(tmp);
+	return true;
+}
+
+const struct time_names* time_names_get(void)
+{
+	// Per thread and per locale, the daemon renders for different users
+	static _Thread_local struct time_names names;
+	static _Thread_local const struct time_names* loaded = NULL;
+	static _Thread_local char loaded_for[64];
+	// When to try a locale that couldn't be loaded again, 0 if it was
+	static _Thread_local time_t retry_at;
+	const char* locale;
+
+	locale = time_locale();
+	if (loaded && !strcmp(loaded_for, locale ? locale : "")
+			&& (!retry_at || time(NULL) < retry_at))
+		return loaded;
+	retry_at = 0;
+	if (!locale) {
+		loaded = &c_names;
+	} else {
+		if (!load_names(locale, &names))
+			retry_at = time(NULL) + TIME_NAMES_RETRY_SECONDS;
+		loaded = &names;
+	}
+	// A name too long to remember is looked up again next time
+	if (snprintf(loaded_for, sizeof(loaded_for), "%s", locale ? locale : "")
+			>= (int)sizeof(loaded_for))
+		loaded = NULL;
+	return loaded ? loaded : &names;
+}
+
+static uint32_t tz_be32(const uint8_t* p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+/**
+ * @brief Counts the days from 1970-01-01 to a date
+ *
+ * @param[in] year The year
+ * @param[in] month 1 to 12, 13 being January of the next year
+ * @param[in] day 1 to 31
+ */
+static long epoch_days(long year, int month, int day)
+{
+	long era, year_of_era, day_of_year;
+
+	if (month > 12) {
+		year++;
+		month -= 12;
+	}
+	year -= month <= 2;
+	era = (year >= 0 ? year : year - 399) / 400;
+	year_of_era = year - era * 400;
+	day_of_year = (153 * (month + (month > 2 ? -3 : 9)) + 2) / 5 + day - 1;
+	return era * 146097 + year_of_era * 365 + year_of_era / 4
+		- year_of_era / 100 + day_of_year - 719468;
+}
+
+/**
+ * @brief Parses a number of a TZ rule
+ *
+ * @param[in] s Where the number starts
+ * @param[in] max The largest value allowed
+ * @param[out] value The number
+ * @return What follows it, NULL if there is no number or it is too big
+ */
+static const char* rule_number(const char* s, long max, long* value)
+{
+	if (*s < '0' || *s > '9')
+		return NULL;
+	for (*value = 0; *s >= '0' && *s <= '9'; s++)
+		if ((*value = *value * 10 + *s - '0') > max)
+			return NULL;
+	return s;
+}
+
+/**
+ * @brief Parses the name of a zone in a TZ rule, like CET or <+03>
+ *
+ * @param[in] s Where the name starts
+ * @param[out] abbr The name, without the angle brackets
+ * @return What follows it, NULL if it is malformed
+ */
+static const char* rule_name(const char* s, char abbr[16])
+{
+	const char* start;
+	size_t len;
+
+	if (*s == '<') {
+		for (start = ++s; *s && *s != '>'; s++)
+			if (!isalnum((unsigned char)*s) && *s != '+' && *s != '-')
+				return NULL;
+		if (*s != '>')
+			return NULL;
+		len = s++ - start;
+	} else {
+		for (start = s; isalpha((unsigned char)*s); s++)
+			;
+		len = s - start;
+	}
+	if (len < 3 || len >= 16)
+		return NULL;
+	memcpy(abbr, start, len);
+	abbr[len] = 0;
+	return s;
+}
+
+/**
+ * @brief Parses a [+-]hh[:mm[:ss]] time of a TZ rule
+ *
+ * @param[in] s Where the time starts
+ * @param[out] secs The time in seconds
+ * @return What follows it, NULL if it is malformed
+ */
+static const char* rule_time(const char* s, long* secs)
+{
+	long sign = 1, part;
+
+	if (*s == '+' || *s == '-')
+		sign = *s++ == '-' ? -1 : 1;
+	// Up to 167 hours, which the TZif footers of version 3 use
+	if (!(s = rule_number(s, 167, &part)))
+		return NULL;
+	*secs = part * 3600;
+	for (int i = 0; i < 2 && *s == ':'; i++) {
+		if (!(s = rule_number(s + 1, 59, &part)))
+			return NULL;
+		*secs += part * (i ? 1 : 60);
+	}
+	*secs *= sign;
+	return s;
+}
+
+// When a TZ rule starts or ends daylight saving time
+struct rule_date {
+	char kind; // 'J' (1 to 365, no February 29), 'D' (0 to 365) or 'M'
+	long day; // Day of the year, or day of the week for 'M'
+	long week; // 1 to 5, 5 being the last
+	long month;
+	long secs; // Local time of the change
+};
+
+/**
+ * @brief Parses a date of a TZ rule, like M3.5.0/3
+ *
+ * @param[in] s Where the date starts
+ * @param[out] date The date
+ * @return What follows it, NULL if it is malformed
+ */
+static const char* rule_date(const char* s, struct rule_date* date)
+{
+	date->kind = *s == 'M' || *s == 'J' ? *s++ : 'D';
+	if (date->kind == 'M') {
+		if (!(s = rule_number(s, 12, &date->month)) || !date->month
+				|| *s != '.' || !(s = rule_number(s + 1, 5, &date->week))
+				|| !date->week || *s != '.'
+				|| !(s = rule_number(s + 1, 6, &date->day)))
+			return NULL;
+	} else if (!(s = rule_number(s, 365, &date->day))
+			|| (date->kind == 'J' && !date->day)) {
+		return NULL;
+	}
+	date->secs = 2 * 3600;
+	return *s == '/' ? rule_time(s + 1, &date->secs) : s;
+}
+
+/**
+ * @brief Finds when a date of a TZ rule is in a year
+ *
+ * @param[in] date The date
+ * @param[in] year The year
+ * @param[in] offset The offset from UTC in effect until then
+ * @return The time of the change
+ */
+static time_t rule_when(const struct rule_date* date, long year, long offset)
+{
+	long day = epoch_days(year, 1, 1), first, month_days, leap;
+
+	leap = epoch_days(year, 3, 1) - epoch_days(year, 2, 1) == 29;
+	if (date->kind == 'J') {
+		day += date->day - 1 + (leap && date->day >= 60);
+	} else if (date->kind == 'D') {
+		day += date->day;
+	} else {
+		first = epoch_days(year, date->month, 1);
+		month_days = epoch_days(year, date->month + 1, 1) - first;
+		// 1970-01-01 was a Thursday
+		day = (date->day - ((first % 7 + 11) % 7) + 7) % 7
+			+ (date->week - 1) * 7;
+		while (day >= month_days)
+			day -= 7;
+		day += first;
+	}
+	return (time_t)day * 86400 + date->secs - offset;
+}
+
+bool time_zone_rule(const char* rule, time_t when, struct time_zone* zone)
+{
+	struct rule_date start, end;
+	struct time_zone dst;
+	struct tm tm;
+	time_t local, starts, ends;
+	long std_offset, dst_offset;
+
+	if (!(rule = rule_name(rule, zone->abbr))
+			|| !(rule = rule_time(rule, &std_offset)))
+		return false;
+	// POSIX offsets are west of UTC
+	zone->offset = -std_offset;
+	zone->is_dst = 0;
+	if (!*rule)
+		return true;
+
+	if (!(rule = rule_name(rule, dst.abbr)))
+		return false;
+	dst_offset = std_offset - 3600;
+	if (*rule && *rule != ',' && !(rule = rule_time(rule, &dst_offset)))
+		return false;
+	dst.offset = -dst_offset;
+	dst.is_dst = 1;
+	// Without dates, the ones of the United States, like glibc
+	if (!*rule)
+		rule = ",M3.2.0,M11.1.0";
+	if (*rule != ',' || !(rule = rule_date(rule + 1, &start))
+			|| *rule != ',' || !(rule = rule_date(rule + 1, &end)) || *rule)
+		return false;
+
+	local = when + zone->offset;
+	if (!gmtime_r(&local, &tm))
+		return false;
+	starts = rule_when(&start, tm.tm_year + 1900L, zone->offset);
+	ends = rule_when(&end, tm.tm_year + 1900L, dst.offset);
+	// Daylight saving time over the new year, in the southern hemisphere
+	if (starts < ends ? when >= starts && when < ends
+			: when >= starts || when < ends)
+		*zone = dst;
+	return true;
+}
+
+bool time_zone_file(const uint8_t* data, size_t len, time_t when,
+	struct time_zone* zone)
+{
+	const uint8_t* block = data, *end = data + len, *times, *types, *type;
+	const char* chars, *footer, *footer_end;
+	char rule[128];
+	uint64_t size, time_count, type_count, char_count;
+	size_t time_size = 4, lo, hi, mid, abbr_len;
+	int64_t at;
+	uint8_t index;
+
+	// The 64 bit block of version 2 on follows the 32 bit one
+	for (;;) {
+		if (end - block < 44 || memcmp(block, "TZif", 4))
+			return false;
+		time_count = tz_be32(block + 32);
+		type_count = tz_be32(block + 36);
+		char_count = tz_be32(block + 40);
+		size = time_count * (time_size + 1) + type_count * 6 + char_count
+			+ tz_be32(block + 28) * (time_size + 4) + tz_be32(block + 24)
+			+ tz_be32(block + 20);
+		if (!type_count || !char_count || size > (uint64_t)(end - block - 44))
+			return false;
+		if (time_size == 8 || data[4] < '2')
+			break;
+		block += 44 + size;
+		time_size = 8;
+	}
+	times = block + 44;
+	types = times + time_count * (time_size + 1);
+	chars = (const char*)types + type_count * 6;
+
+	// How many transitions happened by then
+	for (lo = 0, hi = time_count; lo < hi; ) {
+		mid = lo + (hi - lo) / 2;
+		at = time_size == 8 ? (int64_t)((uint64_t)tz_be32(times + 8 * mid)
+				<< 32 | tz_be32(times + 8 * mid + 4))
+			: (int32_t)tz_be32(times + 4 * mid);
+		if (at <= when)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	// After the last one, the rule of the footer if there is one
+	footer = (const char*)block + 44 + size;
+	if (lo == time_count && time_size == 8 && footer < (const char*)end
+			&& *footer++ == '\n'
+			&& (footer_end = memchr(footer, '\n', (const char*)end - footer))
+			&& footer_end > footer
+			&& footer_end - footer < (ptrdiff_t)sizeof(rule)) {
+		memcpy(rule, footer, footer_end - footer);
+		rule[footer_end - footer] = 0;
+		if (time_zone_rule(rule, when, zone))
+			return true;
+	}
+
+	// Before the first transition, the first type
+	index = lo ? times[time_count * time_size + lo - 1] : 0;
+	type = types + 6 * index;
+	if (index >= type_count || type[5] >= char_count)
+		return false;
+	zone->offset = (int32_t)tz_be32(type);
+	zone->is_dst = type[4];
+	abbr_len = strnlen(chars + type[5], char_count - type[5]);
+	if (abbr_len >= sizeof(zone->abbr))
+		abbr_len = sizeof(zone->abbr) - 1;
+	memcpy(zone->abbr, chars + type[5], abbr_len);
+	zone->abbr[abbr_len] = 0;
+	return true;
+}
+
+void time_zone_tm(const struct time_zone* zone, time_t when, struct tm* tm)
+{
+	time_t local = when + zone->offset;
+
+	gmtime_r(&local, tm);
+	tm->tm_isdst = zone->is_dst;
+#ifdef HAVE_STRUCT_TM_TM_GMTOFF
+	tm->tm_gmtoff = zone->offset;
+#endif
+#ifdef HAVE_STRUCT_TM_TM_ZONE
+	tm->tm_zone = (char*)zone->abbr;
+#endif
+}
+
+/**
+ * @brief Appends a string to the output of format_time
+ *
+ * @param[in,out] out The output
+ * @param[in,out] len How much of out is used
+ * @param[in] size The size of out
+ * @param[in] str What to append
+ * @param[in] str_len The length of str
+ * @return false if it did not fit
+ */
+static bool append(char* out, size_t* len, size_t size, const char* str,
+	size_t str_len)
+{
+	if (*len + str_len >= size)
+		return false;
+	memcpy(out + *len, str, str_len);
+	*len += str_len;
+	return true;
+}
+
+/**
+ * @brief Appends a zero or space padded number to the output of format_time
+ *
+ * @param[in,out] out The output
+ * @param[in,out] len How much of out is used
+ * @param[in] size The size of out
+ * @param[in] value The number
+ * @param[in] width The minimum number of digits
+ * @param[in] pad '0' or ' '
+ * @return false if it did not fit
+ */
+static bool append_number(char* out, size_t* len, size_t size, int value,
+	int width, char pad)
+{
+	char digits[16];
+	int n = 0;
+
+	do {
+		digits[sizeof(digits) - ++n] = '0' + value % 10;
+		value /= 10;
+	} while (value && n < (int)sizeof(digits));
+	while (n < width)
+		digits[sizeof(digits) - ++n] = pad;
+	return append(out, len, size, digits + sizeof(digits) - n, n);
+}
+
+ssize_t format_time(char* out, size_t size, const char* fmt,
+	const struct tm* tm, const struct time_names* names)
+{
+	char spec[8], conv[64];
+	const char* name;
+	size_t len = 0, conv_len, spec_len;
+	locale_t loc;
+	bool ok;
+
+	if (!size)
+		return -1;
+	for (; *fmt; fmt++) {
+		if (*fmt != '%' || !fmt[1]) {
+			if (!append(out, &len, size, fmt, 1))
+				return -1;
+			continue;
+		}
+
+		name = NULL;
+		switch (*++fmt) {
+		case 'a': name = names->abday[tm->tm_wday % 7]; break;
+		case 'A': name = names->day[tm->tm_wday % 7]; break;
+		case 'b':
+		case 'h': name = names->abmon[tm->tm_mon % 12]; break;
+		case 'B': name = names->mon[tm->tm_mon % 12]; break;
+		case 'p': name = names->am_pm[tm->tm_hour >= 12]; break;
+		case 'n': name = "\n"; break;
+		case 't': name = "\t"; break;
+		case '%': name = "%"; break;
+		}
+		if (name) {
+			if (!append(out, &len, size, name, strlen(name)))
+				return -1;
+			continue;
+		}
+
+		switch (*fmt) {
+		case 'd':
+			ok = append_number(out, &len, size, tm->tm_mday, 2, '0');
+			break;
+		case 'e':
+			ok = append_number(out, &len, size, tm->tm_mday, 2, ' ');
+			break;
+		case 'H':
+			ok = append_number(out, &len, size, tm->tm_hour, 2, '0');
+			break;
+		case 'I':
+			ok = append_number(out, &len, size,
+				tm->tm_hour % 12 ? tm->tm_hour % 12 : 12, 2, '0');
+			break;
+		case 'M':
+			ok = append_number(out, &len, size, tm->tm_min, 2, '0');
+			break;
+		case 'S':
+			ok = append_number(out, &len, size, tm->tm_sec, 2, '0');
+			break;
+		case 'm':
+			ok = append_number(out, &len, size, tm->tm_mon + 1, 2, '0');
+			break;
+		case 'y':
+			ok = append_number(out, &len, size, tm->tm_year % 100, 2, '0');
+			break;
+		case 'Y':
+			ok = append_number(out, &len, size, tm->tm_year + 1900, 1, '0');
+			break;
+		default:
+			// Anything else, flags and modifiers included, is strftime's
+			spec_len = 0;
+			spec[spec_len++] = '%';
+			while (strchr("_-0^#EO", *fmt) && fmt[1]
+					&& spec_len < sizeof(spec) - 2)
+				spec[spec_len++] = *fmt++;
+			spec[spec_len++] = *fmt;
+			spec[spec_len] = 0;
+			// In the locale the names came from, not the process's one
+			if ((loc = locale_object(names->localised ? time_locale()
+					: NULL)))
+				conv_len = strftime_l(conv, sizeof(conv), spec, tm, loc);
+			else
+				conv_len = strftime(conv, sizeof(conv), spec, tm);
+			ok = append(out, &len, size, conv, conv_len);
+		}
+		if (!ok)
+			return -1;
+	}
+	out[len] = 0;
+	return len;
+}
@@ -0,0 +1,98 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_TIMEFMT_H
+#define CPROMPT_TIMEFMT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+/* Localised time formatting
+ *
+ * setlocale() maps whole locale archives to give us a handful of day and
+ * month names. Instead the LC_TIME names of a locale are extracted once into
+ * a small file in the cache directory and a formatter of our own uses them.
+ */
+
+struct time_names {
+	uint32_t magic;
+	uint32_t localised; // 0 if the locale is C or couldn't be loaded
+	uint64_t stamp; // The files of the locale when it was extracted
+	char abday[7][32];
+	char day[7][64];
+	char abmon[12][32];
+	char mon[12][64];
+	char am_pm[2][32];
+};
+
+// What time it is in a zone at some point, in place of TZ and localtime
+struct time_zone {
+	long offset; // Seconds east of UTC
+	int is_dst;
+	char abbr[16]; // Like CEST, for %Z
+};
+
+/**
+ * @brief Finds what a TZif file (see tzfile(5)) says about a time
+ *
+ * Times after the last transition of the file follow the TZ rule at its end.
+ *
+ * @param[in] data The contents of the file
+ * @param[in] len The size of data
+ * @param[in] when The time
+ * @param[out] zone The zone at that time
+ * @return false if data isn't a TZif file
+ */
+bool time_zone_file(const uint8_t* data, size_t len, time_t when,
+	struct time_zone* zone);
+
+/**
+ * @brief Finds what a POSIX TZ rule says about a time
+ *
+ * @param[in] rule The rule, like CET-1CEST,M3.5.0,M10.5.0/3
+ * @param[in] when The time
+ * @param[out] zone The zone at that time
+ * @return false if the rule is malformed
+ */
+bool time_zone_rule(const char* rule, time_t when, struct time_zone* zone);
+
+/**
+ * @brief Breaks a time down in a zone, like localtime_r in the zone of TZ
+ *
+ * @param[in] zone The zone at that time, which must outlive tm (for %Z)
+ * @param[in] when The time
+ * @param[out] tm The broken down time
+ */
+void time_zone_tm(const struct time_zone* zone, time_t when, struct tm* tm);
+
+/**
+ * @brief Gets the day and month names of the LC_TIME locale
+ *
+ * Loaded from the cache directory once per thread and locale, extracted on
+ * a miss.
+ */
+const struct time_names* time_names_get(void);
+
+/**
+ * @brief strftime using names from a struct time_names
+ *
+ * Names, numbers and literal text are formatted here; every other
+ * conversion is handed to strftime_l on its own, in the LC_TIME locale the
+ * names are from.
+ *
+ * @param[out] out The formatted time
+ * @param[in] size The size of out
+ * @param[in] fmt The format, see man page for strftime
+ * @param[in] tm The time to format
+ * @param[in] names The names to use
+ * @return The length of the result, which can be 0 (%p in a locale without
+ * AM/PM), -1 if it did not fit
+ */
+ssize_t format_time(char* out, size_t size, const char* fmt,
+	const struct tm* tm, const struct time_names* names);
+
+#endif
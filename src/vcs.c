@@ -0,0 +1,261 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include "config.h"
+#include "git.h"
+#include "vcs.h"
+
+// The defaults of vcs_info's formats and actionformats
+#define VCS_FORMAT " (%s)-[%b]%u%c-"
+#define VCS_ACTION_FORMAT " (%s)-[%b|%a]%u%c-"
+
+struct vcs_state {
+	struct git_repo repo;
+	struct git_head head;
+	char branch[GIT_REF_MAX];
+	const char* action;
+	const char* cwd;
+	int unstaged;
+	int staged;
+};
+
+/**
+ * @brief Gets the branch being rebased, which HEAD no longer points at
+ *
+ * @param[in] repo The repository
+ * @param[out] ref The ref of the branch
+ * @return false if no rebase says so
+ */
+static bool rebase_head_name(const struct git_repo* repo, char ref[GIT_REF_MAX])
+{
+	static const char* const files[] = {
+		"rebase-merge/head-name",
+		"rebase-apply/head-name",
+	};
+	char path[PATH_MAX];
+	ssize_t len;
+	int fd;
+
+	for (size_t i = 0; i < sizeof(files) / sizeof(*files); i++) {
+		if (snprintf(path, PATH_MAX, "%s/%s", repo->gitdir, files[i])
+				>= PATH_MAX
+				|| (fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+			continue;
+		len = read(fd, ref, GIT_REF_MAX - 1);
+		close(fd);
+		while (len > 0 && ref[len - 1] == '\n')
+			len--;
+		if (len > 0 && strncmp(ref, "detached HEAD", len)) {
+			ref[len] = 0;
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+ * @brief Works out what %b shows
+ *
+ * @param[in,out] state The state, with the repository and HEAD read
+ */
+static void vcs_branch(struct vcs_state* state)
+{
+	char ref[GIT_REF_MAX], hex[2 * GIT_OID_MAX + 1];
+	const char* name = state->head.ref;
+
+	if (!*name && state->action && rebase_head_name(&state->repo, ref))
+		name = ref;
+	if (*name) {
+		if (strncmp(name, "refs/heads/", 11) == 0)
+			name += 11;
+		strcpy(state->branch, name);
+	} else {
+		// Detached, shown like vcs_info when no tag is exactly there
+		git_oid_hex(&state->repo, state->head.oid, hex);
+		snprintf(state->branch, GIT_REF_MAX, "%.7s...", hex);
+	}
+}
+
+/**
+ * @brief Prints a string single quoted for the shell
+ *
+ * @param[in] s The string
+ * @param[in] len How much of it
+ */
+static void put_quoted(const char* s, size_t len)
+{
+	for (size_t i = 0; i < len; i++) {
+		if (s[i] == '\'')
+			fputs("'\\''", stdout);
+		else
+			putchar(s[i]);
+	}
+}
+
+/**
+ * @brief Prints a format with its specifiers expanded
+ *
+ * @param[in] format The format
+ * @param[in] state The state
+ * @param[in] staged What %c expands to when something is staged
+ * @param[in] unstaged What %u expands to when something changed
+ */
+static void put_format(const char* format, const struct vcs_state* state,
+	const char* staged, const char* unstaged)
+{
+	char hex[2 * GIT_OID_MAX + 1];
+	const char* s, *value;
+	size_t root_len;
+
+	for (s = format; *s; s++) {
+		if (*s != '%' || !s[1]) {
+			put_quoted(s, 1);
+			continue;
+		}
+		switch (*++s) {
+		case 's':
+			value = "git";
+			break;
+		case 'b':
+			value = state->branch;
+			break;
+		case 'a':
+			value = state->action ? state->action : "";
+			break;
+		case 'u':
+			value = state->unstaged > 0 ? unstaged : "";
+			break;
+		case 'c':
+			value = state->staged > 0 ? staged : "";
+			break;
+		case 'i':
+			git_oid_hex(&state->repo, state->head.oid, hex);
+			value = state->head.unborn ? "" : hex;
+			break;
+		case 'r':
+			value = strrchr(state->repo.root, '/');
+			value = value && value[1] ? value + 1 : state->repo.root;
+			break;
+		case 'R':
+			value = state->repo.root;
+			break;
+		case 'S':
+			// The current directory, relative to the root
+			root_len = strlen(state->repo.root);
+			value = state->cwd + root_len + (root_len > 1);
+			if (strlen(state->cwd) <= root_len)
+				value = ".";
+			break;
+		case 'm':
+			value = "";
+			break;
+		case '%':
+			value = "%";
+			break;
+		default:
+			// Unknown to vcs_info too, left as it is
+			put_quoted(s - 1, 2);
+			continue;
+		}
+		put_quoted(value, strlen(value));
+	}
+}
+
+/**
+ * @brief Whether any of the formats expands a specifier
+ *
+ * @param[in] formats The formats
+ * @param[in] len How many there are
+ * @param[in] spec The specifier, without its %
+ */
+static bool formats_use(const char* formats[], int len, char spec)
+{
+	for (int i = 0; i < len; i++)
+		for (const char* s = formats[i]; (s = strchr(s, '%')) && s[1]; s += 2)
+			if (s[1] == spec)
+				return true;
+	return false;
+}
+
+void vcs_current_branch(char branch[GIT_REF_MAX])
+{
+	struct vcs_state state = { .unstaged = -1, .staged = -1 };
+	char cwd[PATH_MAX];
+
+	*branch = 0;
+	if (!getcwd(cwd, PATH_MAX) || !git_open(&state.repo, cwd)
+			|| !git_read_head(&state.repo, &state.head))
+		return;
+	state.cwd = cwd;
+	state.action = git_action(&state.repo);
+	vcs_branch(&state);
+	strcpy(branch, state.branch);
+}
+
+int vcs_info_main(int argc, char* argv[])
+{
+	const char* formats[VCS_MESSAGES_MAX], *actionformats[VCS_MESSAGES_MAX];
+	const char* staged = "S", *unstaged = "U";
+	const char** used;
+	int nformats = 0, nactions = 0, nused, count;
+	struct vcs_state state = { .unstaged = -1, .staged = -1 };
+	char cwd[PATH_MAX];
+	bool in_repo;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "a:f:s:u:")) != -1) {
+		switch (opt) {
+		case 'a':
+			if (nactions < VCS_MESSAGES_MAX)
+				actionformats[nactions++] = optarg;
+			break;
+		case 'f':
+			if (nformats < VCS_MESSAGES_MAX)
+				formats[nformats++] = optarg;
+			break;
+		case 's':
+			staged = optarg;
+			break;
+		case 'u':
+			unstaged = optarg;
+			break;
+		default:
+			fprintf(stderr, "usage: %s -V [-f format]... [-a actionformat]... "
+				"[-s stagedstr] [-u unstagedstr]\n", argv[0]);
+			return 1;
+		}
+	}
+	if (!nformats)
+		formats[nformats++] = VCS_FORMAT;
+	if (!nactions)
+		actionformats[nactions++] = VCS_ACTION_FORMAT;
+	count = nformats > nactions ? nformats : nactions;
+
+	in_repo = getcwd(cwd, PATH_MAX) && git_open(&state.repo, cwd)
+		&& git_read_head(&state.repo, &state.head);
+	if (in_repo) {
+		state.cwd = cwd;
+		state.action = git_action(&state.repo);
+		vcs_branch(&state);
+	}
+	used = state.action ? actionformats : formats;
+	nused = state.action ? nactions : nformats;
+	if (in_repo && *unstaged && formats_use(used, nused, 'u'))
+		state.unstaged = git_unstaged(&state.repo);
+	if (in_repo && *staged && formats_use(used, nused, 'c'))
+		state.staged = git_staged(&state.repo);
+
+	for (int i = 0; i < count; i++) {
+		printf("vcs_info_msg_%d_='", i);
+		if (in_repo && i < nused)
+			put_format(used[i], &state, staged, unstaged);
+		puts("'");
+	}
+	return 0;
+}
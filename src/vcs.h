@@ -0,0 +1,47 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+#ifndef CPROMPT_VCS_H
+#define CPROMPT_VCS_H
+
+#include "git.h"
+
+/* vcs_info mode
+ *
+ * cprompt -V stands in for zsh's vcs_info, which runs git several times per
+ * prompt: it reads the repository of the current directory itself (see
+ * git.h) and prints the vcs_info_msg_N_ variables as assignments to eval:
+ *     eval "$(cprompt -V -f ' (%s)-[%b]%u%c-' -a ' (%s)-[%b|%a]%u%c-')"
+ * Options, after -V:
+ *     -f format         a format, once per vcs_info_msg_N_ (zstyle formats)
+ *     -a actionformat   the same, used while an action is in progress
+ *                       (zstyle actionformats)
+ *     -s string         what %c expands to (zstyle stagedstr)
+ *     -u string         what %u expands to (zstyle unstagedstr)
+ * Formats take the vcs_info specifiers %s %b %a %u %c %i %r %R %S %m and %%.
+ * The index is only looked at when a format uses %u or %c and its string
+ * isn't empty, as vcs_info does with check-for-changes. Outside of a
+ * repository, all the variables are set empty.
+ */
+
+// How many vcs_info_msg_N_ can be set (zstyle max-exports)
+#define VCS_MESSAGES_MAX 9
+
+/**
+ * @brief Gets what %b shows for the current directory
+ *
+ * @param[out] branch The branch, "" outside of a repository
+ */
+void vcs_current_branch(char branch[GIT_REF_MAX]);
+
+/**
+ * @brief Prints the vcs_info variables of the current directory
+ *
+ * @param[in] argc The arguments of the program
+ * @param[in] argv Its arguments, getopt continues with those after -V
+ * @return The exit status
+ */
+int vcs_info_main(int argc, char* argv[]);
+
+#endif
@@ -0,0 +1,234 @@
+/* SPDX-License-Identifier: MIT
+ * Copyright (c) 2024 Terence Noone
+ */
+
+// zsh's headers, which bring zsh's own config.h (see ZSH_CPPFLAGS)
+#include "zsh.mdh"
+#include <stdint.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include "env.h"
+#include "prompt.h"
+#include "inputs.h"
+#include "dircache.h"
+#include "vcs.h"
+
+/* zsh module
+ *
+ * zcprompt.so gives zsh one read-only parameter per fact cprompt knows, for
+ * prompts and widgets that want just one of them:
+ *     zmodload zcprompt
+ *     print $cprompt_repo_root
+ * A fact is only computed when its parameter is read, and not again while
+ * what it depends on (its element_deps) didn't change. Everything but the
+ * parameters is the same code as the cprompt program.
+ */
+
+extern char** environ;
+
+#ifndef PM_READONLY_SPECIAL
+#define PM_READONLY_SPECIAL PM_READONLY
+#endif
+
+struct fact {
+	const char* name;
+	// Renders the fact, like render_element
+	void (*render)(struct prompt_string* ps, const struct fact* fact);
+	PromptElement element;
+	// What the value depends on, NULL to compute it every time
+	const struct element_deps* deps;
+	// The last value, and what it was computed from
+	struct prompt_string value;
+	uint64_t inputs;
+};
+
+/**
+ * @brief Renders a fact that is an element of the prompt
+ *
+ * @param[out] ps The prompt string to populate
+ * @param[in] fact The fact
+ */
+static void render_fact_element(struct prompt_string* ps,
+	const struct fact* fact)
+{
+	render_element(ps, &fact->element);
+}
+
+/**
+ * @brief Renders the root of the repository of the current directory
+ *
+ * A .git can appear in any parent, so this is done for every prompt: with
+ * the directory cache, it costs a stat per parent.
+ *
+ * @param[out] ps The prompt string to populate, "" outside of repositories
+ * @param[in] fact The fact
+ */
+static void render_repo_root(struct prompt_string* ps,
+	const struct fact* fact)
+{
+	char cwd[PATH_MAX], root[PATH_MAX];
+	struct dircache cache;
+
+	*root = 0;
+	if (getcwd(cwd, PATH_MAX)) {
+		dircache_open(&cache);
+		dircache_repo_root(&cache, cwd, root);
+		dircache_close(&cache);
+	}
+	ps->needs_free = true;
+	if (!(ps->str = strdup(root))) {
+		ps->needs_free = false;
+		ps->str = "!STRDUP!";
+	}
+}
+
+/**
+ * @brief Renders the branch of the repository of the current directory
+ *
+ * Like %b of vcs_info, see vcs.h. HEAD moves without the directory changing,
+ * so this is done for every prompt.
+ *
+ * @param[out] ps The prompt string to populate, "" outside of repositories
+ * @param[in] fact The fact
+ */
+static void render_git_branch(struct prompt_string* ps,
+	const struct fact* fact)
+{
+	char branch[GIT_REF_MAX];
+
+	vcs_current_branch(branch);
+	ps->needs_free = true;
+	if (!(ps->str = strdup(branch))) {
+		ps->needs_free = false;
+		ps->str = "!STRDUP!";
+	}
+}
+
+#define ELEMENT_FACT(name, type) \
+	{ name, render_fact_element, { type, NULL }, NULL, { 0 }, 0 }
+
+static struct fact facts[] = {
+	ELEMENT_FACT("cprompt_host", HostnameUpToDot),
+	ELEMENT_FACT("cprompt_hostname", FullHostname),
+	ELEMENT_FACT("cprompt_tty", TtyBasename),
+	ELEMENT_FACT("cprompt_shell", ShellName),
+	ELEMENT_FACT("cprompt_user", Username),
+	ELEMENT_FACT("cprompt_pwd", PwdTrunc),
+	ELEMENT_FACT("cprompt_pwd_base", PwdTruncBasename),
+	ELEMENT_FACT("cprompt_prompt_char", UserPrompt),
+	{ "cprompt_repo_root", render_repo_root, { StringLiteral, NULL },
+		NULL, { 0 }, 0 },
+	{ "cprompt_git_branch", render_git_branch, { StringLiteral, NULL },
+		NULL, { 0 }, 0 },
+};
+
+/**
+ * @brief Gets the value of a fact's parameter
+ *
+ * @param[in] pm The parameter
+ * @return The value, on the heap
+ */
+static char* get_fact(Param pm)
+{
+	struct render_client who = {
+		.tty = isatty(STDIN_FILENO) ? ttyname(STDIN_FILENO) : NULL,
+		.shell = getpid(),
+		.uid = geteuid(),
+	};
+	struct fact* fact = NULL;
+	struct input_snapshot snap = { 0 };
+	struct env_index env;
+	uint64_t inputs;
+
+	for (size_t i = 0; i < sizeof(facts) / sizeof(*facts); i++)
+		if (strcmp(facts[i].name, pm->node.nam) == 0)
+			fact = &facts[i];
+	if (!fact)
+		return dupstring("");
+	// Not once per prompt: a widget or hook may cd or change a variable
+	// before the prompt looks at the fact again
+	if (!fact->deps && fact->render == render_fact_element)
+		fact->deps = element_deps(fact->element.type);
+	// zsh frees the strings of environ as soon as a variable changes, even
+	// within a prompt: only point into it for this fetch
+	env_index_build(&env, environ);
+	env_use(&env);
+	render_for(&who);
+	inputs = fact->deps ? hash_inputs(fact->deps, &snap) : 0;
+	if (!fact->value.str || !fact->deps || inputs != fact->inputs) {
+		if (fact->value.needs_free)
+			free(fact->value.str);
+		fact->render(&fact->value, fact);
+		fact->inputs = inputs;
+	}
+	render_for(NULL);
+	env_use(NULL);
+	return metafy(fact->value.str, -1, META_HEAPDUP);
+}
+
+static const struct gsu_scalar fact_gsu = {
+	get_fact, nullstrsetfn, stdunsetfn
+};
+
+static struct paramdef partab[] = {
+	SPECIALPMDEF("cprompt_host", PM_READONLY_SPECIAL, &fact_gsu, NULL, NULL),
+	SPECIALPMDEF("cprompt_hostname", PM_READONLY_SPECIAL, &fact_gsu, NULL,
+		NULL),
+	SPECIALPMDEF("cprompt_tty", PM_READONLY_SPECIAL, &fact_gsu, NULL, NULL),
+	SPECIALPMDEF("cprompt_shell", PM_READONLY_SPECIAL, &fact_gsu, NULL, NULL),
+	SPECIALPMDEF("cprompt_user", PM_READONLY_SPECIAL, &fact_gsu, NULL, NULL),
+	SPECIALPMDEF("cprompt_pwd", PM_READONLY_SPECIAL, &fact_gsu, NULL, NULL),
+	SPECIALPMDEF("cprompt_pwd_base", PM_READONLY_SPECIAL, &fact_gsu, NULL,
+		NULL),
+	SPECIALPMDEF("cprompt_prompt_char", PM_READONLY_SPECIAL, &fact_gsu, NULL,
+		NULL),
+	SPECIALPMDEF("cprompt_repo_root", PM_READONLY_SPECIAL, &fact_gsu, NULL,
+		NULL),
+	SPECIALPMDEF("cprompt_git_branch", PM_READONLY_SPECIAL, &fact_gsu, NULL,
+		NULL),
+};
+
+static struct features module_features = {
+	NULL, 0,
+	NULL, 0,
+	NULL, 0,
+	partab, sizeof(partab) / sizeof(*partab),
+	0
+};
+
+int setup_(UNUSED(Module m))
+{
+	return 0;
+}
+
+int features_(Module m, char*** features)
+{
+	*features = featuresarray(m, &module_features);
+	return 0;
+}
+
+int enables_(Module m, int** enables)
+{
+	return handlefeatures(m, &module_features, enables);
+}
+
+int boot_(UNUSED(Module m))
+{
+	return 0;
+}
+
+int cleanup_(Module m)
+{
+	return setfeatureenables(m, &module_features, NULL);
+}
+
+int finish_(UNUSED(Module m))
+{
+	for (size_t i = 0; i < sizeof(facts) / sizeof(*facts); i++) {
+		if (facts[i].value.needs_free)
+			free(facts[i].value.str);
+		facts[i].value = (struct prompt_string){ 0 };
+	}
+	return 0;
+}
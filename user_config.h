@@ -32,3 +32,59 @@ static const PromptElement prompt[] = {
 	{ Space, NULL },
 };
 
+
+/* RIGHT PROMPT
+ *
+ * Elements of the right prompt (RPROMPT), in the same format as `prompt`.
+ * `cprompt -r` prints it; live mode sends it along with the left one.
+ */
+//#define RPROMPT { HourMinuteSecond24, NULL },
+
+/* PWD MODE
+ *
+ * PwdPhysical shows the current directory with symlinks resolved (like
+ * `pwd -P`), PwdLogical shows the path you cd'd through (like `pwd -L`).
+ */
+//#define PWD_MODE PwdLogical
+
+/* NAMED DIRECTORIES
+ *
+ * Directories abbreviated to ~name in PwdTrunc and PwdTruncBasename, like
+ * zsh's `hash -d`. The longest matching directory wins. The shell can add more
+ * at runtime through $CPROMPT_NAMED_DIRS, in the format `hash -d` prints:
+ *     export CPROMPT_NAMED_DIRS="$(hash -d)"
+ */
+//#define NAMED_DIRS { "src", "/home/me/src" }, { "logs", "/var/log" },
+
+/* LAYOUT
+ *
+ * When the left prompt leaves fewer than PROMPT_MIN_COLUMNS columns of the
+ * terminal for typing, the leading directories of PwdTrunc are replaced by
+ * "..." to make room, down to the last directory. Uncomment to enable.
+ */
+//#define PROMPT_MIN_COLUMNS 40
+
+/* LATENCY LEARNING
+ *
+ * cprompt learns how long slow elements (hostname, username) take to render
+ * in every filesystem and repository. Once an element takes longer
+ * than LATENCY_ASYNC_US microseconds its last value is shown and refreshed in
+ * the background; past LATENCY_CACHED_US it is only refreshed every
+ * LATENCY_REPROBE_EVERY prompts. Uncomment to change the defaults.
+ */
+//#define LATENCY_ASYNC_US 5000
+//#define LATENCY_CACHED_US 50000
+//#define LATENCY_REPROBE_EVERY 20
+
+/* DAEMON
+ *
+ * cprompt -d renders for all your shells (cprompt -c) with DAEMON_WORKERS
+ * threads for the elements that read the current directory, 0 to render
+ * everything in its event loop. DAEMON_BACKGROUND threads refresh slow
+ * elements at idle priority, 0 to refresh them right after answering.
+ * With DAEMON_AUTOSTART, cprompt -c starts the daemon when it finds none.
+ * Uncomment to change the defaults.
+ */
+//#define DAEMON_WORKERS 4
+//#define DAEMON_BACKGROUND 1
+//#define DAEMON_AUTOSTART 1